@@ -0,0 +1,28 @@
+#offset 0x00
+
+; --- ALU Benchmark ---
+; Integer and floating point arithmetic, logic and shifts in a counted loop.
+
+MOV R0, 0           ; Loop counter
+MOV R1, 1
+MOV R2, 3
+MOV R3, 0           ; Accumulator
+MOV R6, 255
+
+alu_loop:
+    ADD R3, R2
+    SUB R3, R1
+    MUL R3, 1.0001
+    MOV R4, R3
+    DIV R4, R2
+    MOV R5, R0
+    SHL R5, 2
+    XOR R5, R0
+    AND R5, R6
+    OR R5, R1
+    ADD R3, R5
+    INC R0
+    CMP R0, 500000
+    JL alu_loop
+
+HLT
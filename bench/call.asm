@@ -0,0 +1,24 @@
+#offset 0x00
+
+; --- CALL/RET Benchmark ---
+; A loop of subroutine calls, two levels deep.
+
+MOV R0, 0           ; Loop counter
+MOV R1, 0           ; Work counter
+
+call_loop:
+    CALL outer
+    INC R0
+    CMP R0, 200000
+    JL call_loop
+
+HLT
+
+outer:
+    INC R1
+    CALL inner
+    RET
+
+inner:
+    ADD R1, 2
+    RET
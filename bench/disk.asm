@@ -0,0 +1,22 @@
+#offset 0x00
+
+; --- Disk I/O Benchmark ---
+; Reads 8 sectors at a time from the virtual drive and writes the same data back, so the
+; drive contents are unchanged. Needs img/drive.img; the benchmark runner creates it if missing.
+
+
+MOV R0, 0           ; Loop counter
+MOV R1, 0           ; Sector number
+MOV R2, 8           ; Sectors per transfer
+MOV R3, 1023        ; Sector mask, stays within the first 512KB
+
+disk_loop:
+    disk.read_sector R1, R2, [1048576]
+    disk.write_sector R1, R2, [1048576]
+    ADD R1, 8
+    AND R1, R3
+    INC R0
+    CMP R0, 2000
+    JL disk_loop
+
+HLT
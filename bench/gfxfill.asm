@@ -0,0 +1,42 @@
+#offset 0x00
+
+; --- Graphics Fill Benchmark ---
+; A pixel-by-pixel fill of the 128x128 screen followed by full-screen clears.
+; Meant to run headless; on a window the refresh rate limits how often frames are shown.
+
+gfx.init
+MOV R4, 31          ; Palette mask
+MOV R3, 0           ; Frame counter
+
+fill_frame:
+    MOV R1, 0       ; Y
+fill_row:
+    MOV R0, 0       ; X
+fill_col:
+    MOV R2, R0
+    ADD R2, R1
+    ADD R2, R3
+    AND R2, R4
+    gfx.pixel R0, R1, R2
+    INC R0
+    CMP R0, 128
+    JL fill_col
+    INC R1
+    CMP R1, 128
+    JL fill_row
+    INC R3
+    CMP R3, 8
+    JL fill_frame
+
+MOV R0, 0           ; Frame counter
+clear_loop:
+    MOV R1, R0
+    AND R1, R4
+    gfx.clear R1
+    INC R0
+    CMP R0, 2000
+    JL clear_loop
+
+gfx.present
+gfx.close
+HLT
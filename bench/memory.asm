@@ -0,0 +1,21 @@
+#offset 0x00
+
+; --- Memory Library Benchmark ---
+; mem.set and mem.cpy on two 4KB blocks at 1MB, well above the program.
+
+MOV R0, 0           ; Loop counter
+MOV R1, 4096        ; Block size
+MOV R2, 170         ; Fill byte
+MOV R3, 0           ; Clear byte
+
+memory_loop:
+    mem.set [1048576], R2, 4096
+    mem.set [1052672], R3, R1
+    mem.cpy [1052672], [1048576], R1
+    mem.cpy [1048576], [1052672], R1
+    mem.set [1048576], R3, R1
+    INC R0
+    CMP R0, 20000
+    JL memory_loop
+
+HLT
@@ -0,0 +1,24 @@
+#offset 0x00
+
+; --- Stack Benchmark ---
+; Single register pushes plus PUSHA/POPA and PUSHFD/POPFD.
+
+MOV R0, 0           ; Loop counter
+MOV R1, 11
+MOV R2, 22
+MOV R3, 33
+
+stack_loop:
+    PUSH R1
+    PUSH R2
+    PUSH R3
+    ADD SP, 24      ; Drop the three values
+    PUSHFD
+    POPFD
+    PUSHA
+    POPA
+    INC R0
+    CMP R0, 100000
+    JL stack_loop
+
+HLT
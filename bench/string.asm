@@ -0,0 +1,31 @@
+#offset 0x00
+
+; --- String Library Benchmark ---
+; str.* operations on short strings in memory. work is declared last so its copies can grow into
+; the free memory after the data section.
+
+.STRING source 'The quick brown fox jumps over the lazy dog'
+.STRING word 'lazy'
+.STRING suffix ' again'
+.STRING number '123456'
+.STRING work '................................................................................'
+
+MOV R0, 0           ; Loop counter
+MOV R7, 10
+
+string_loop:
+    str.cpy work, source
+    str.cat work, suffix
+    str.len R1, work
+    str.cmp R2, work, source
+    str.str R3, work, word
+    str.chr R4, work, 122
+    str.toupper work
+    str.tolower work
+    str.atoi R5, number
+    str.ncpy work, source, R7
+    INC R0
+    CMP R0, 50000
+    JL string_loop
+
+HLT
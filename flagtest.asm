@@ -0,0 +1,111 @@
+#offset 0x00
+
+; str.cmp, str.chr, str.str and str.atoi set only ZF and SF. CF and OF must keep their values,
+; whichever interpreter core runs the program and whether the JIT is on. Every line should print 1.
+
+.STRING first 'apple'
+.STRING second 'apple'
+.STRING number '42'
+.STRING msg_cmp 'str.cmp keeps CF and OF: '
+.STRING msg_chr 'str.chr keeps CF and OF: '
+.STRING msg_str 'str.str keeps CF and OF: '
+.STRING msg_atoi 'str.atoi keeps CF and OF: '
+.STRING msg_clear 'str.cmp after ADD leaves CF and OF clear: '
+.STRING msg_loop 'str.chr keeps CF in a hot loop: '
+
+; --- Main Program ---
+start:
+    MOV R0, msg_cmp
+    sys.print_string R0
+    MOV R0, 1
+    MOV CF, R0              ; Set CF and OF by hand
+    MOV OF, R0
+    str.cmp R2, first, second ; Equal strings: ZF = 1
+    MOV R3, 0
+    JNZ cmp_done
+    JNC cmp_done
+    JNO cmp_done
+    MOV R3, 1
+cmp_done:
+    sys.print_number_dec R3
+    sys.newline
+
+    MOV R0, msg_chr
+    sys.print_string R0
+    MOV R0, 1
+    MOV CF, R0
+    MOV OF, R0
+    str.chr R2, first, 112  ; 'p' is found: ZF = 0
+    MOV R3, 0
+    JZ chr_done
+    JNC chr_done
+    JNO chr_done
+    MOV R3, 1
+chr_done:
+    sys.print_number_dec R3
+    sys.newline
+
+    MOV R0, msg_str
+    sys.print_string R0
+    MOV R0, 1
+    MOV CF, R0
+    MOV OF, R0
+    str.str R2, first, second
+    MOV R3, 0
+    JNC str_done
+    JNO str_done
+    MOV R3, 1
+str_done:
+    sys.print_number_dec R3
+    sys.newline
+
+    MOV R0, msg_atoi
+    sys.print_string R0
+    MOV R0, 1
+    MOV CF, R0
+    MOV OF, R0
+    str.atoi R2, number     ; 42: ZF = 0, SF = 0
+    MOV R3, 0
+    JZ atoi_done
+    JS atoi_done
+    JNC atoi_done
+    JNO atoi_done
+    CMP R2, 42
+    JNZ atoi_done
+    MOV R3, 1
+atoi_done:
+    sys.print_number_dec R3
+    sys.newline
+
+    MOV R0, msg_clear
+    sys.print_string R0
+    MOV R0, 1
+    MOV CF, R0
+    MOV OF, R0
+    ADD R0, 1               ; Arithmetic clears CF and OF
+    str.cmp R2, first, second
+    MOV R3, 0
+    JC clear_done
+    JO clear_done
+    MOV R3, 1
+clear_done:
+    sys.print_number_dec R3
+    sys.newline
+
+    MOV R0, msg_loop
+    sys.print_string R0
+    MOV R0, 1
+    MOV R3, 1
+    MOV R6, 0
+loop:
+    MOV CF, R0              ; INC below clears CF, so set it again every iteration
+    str.chr R2, first, 112
+    JC loop_next
+    MOV R3, 0
+loop_next:
+    INC R6
+    CMP R6, 200
+    JL loop
+    sys.print_number_dec R3
+    sys.newline
+    HLT                     ; Halt CPU
@@ -16,16 +16,22 @@
 #include <sys/select.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
 #endif
 #include <time.h>
 #include <SDL.h>
 
-#define MEMORY_SIZE (16384 * 1024) // 16MB Memory
+#define MEMORY_SIZE (16384 * 1024) // 16MB Memory, the default and largest guest memory size
+#define MEMORY_MIN_SIZE (256 * 1024) // Smallest guest memory size, VRAM plus room for code and stack
+#define MEMORY_SIZE_ALIGNMENT (64 * 1024) // Guest memory sizes are a multiple of this
 #define VRAM_SIZE (64 * 1024) //64 KB VRAM
-#define VRAM_START_ADDRESS (MEMORY_SIZE - VRAM_SIZE)
+#define VRAM_START_ADDRESS(vm) ((vm)->memory_size - VRAM_SIZE) // VRAM is the top of guest memory
 #define NUM_GENERAL_REGISTERS 32
 #define CPU_VER 7
-#define GPU_VER 1
+#define GPU_VER 2
 #define AUDIO_VER 1
 #define AUDIO_SAMPLE_RATE 44100 // Standard sample rate
 #define AUDIO_FREQUENCY_BASE 440.0 // Base frequency for pitch calculations (A4)
@@ -33,6 +39,23 @@
 
 #define SCREEN_WIDTH  128  
 #define SCREEN_HEIGHT 128 
+#define GFX_DEFAULT_REFRESH_HZ 60
+
+#if defined(_MSC_VER)
+#define VM_ALWAYS_INLINE __forceinline
+#elif defined(__GNUC__) || defined(__clang__)
+#define VM_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define VM_ALWAYS_INLINE inline
+#endif
+
+#if defined(_MSC_VER)
+#define VM_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+#define VM_THREAD_LOCAL __thread
+#else
+#define VM_THREAD_LOCAL _Thread_local
+#endif
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -154,6 +177,24 @@ typedef enum {
     OP_AUDIO_SET_PITCH_REG,
     OP_AUDIO_GET_AUDIO_VER_REG,
 
+    OP_GFX_PRESENT,
+
+    OP_VM_SNAPSHOT,
+
+    // Compact Immediates: the *_REG_VAL instructions with the value stored as a signed 8, 16 or 32-bit
+    // integer, one triple per instruction in the order of compact_immediate_opcodes
+    OP_MOV_REG_VAL8, OP_MOV_REG_VAL16, OP_MOV_REG_VAL32,
+    OP_ADD_REG_VAL8, OP_ADD_REG_VAL16, OP_ADD_REG_VAL32,
+    OP_SUB_REG_VAL8, OP_SUB_REG_VAL16, OP_SUB_REG_VAL32,
+    OP_MUL_REG_VAL8, OP_MUL_REG_VAL16, OP_MUL_REG_VAL32,
+    OP_DIV_REG_VAL8, OP_DIV_REG_VAL16, OP_DIV_REG_VAL32,
+    OP_MOD_REG_VAL8, OP_MOD_REG_VAL16, OP_MOD_REG_VAL32,
+    OP_CMP_REG_VAL8, OP_CMP_REG_VAL16, OP_CMP_REG_VAL32,
+
+    // Constant Pool: the same instructions with the value read from the pool by a 16-bit index
+    OP_MOV_REG_CONST, OP_ADD_REG_CONST, OP_SUB_REG_CONST, OP_MUL_REG_CONST,
+    OP_DIV_REG_CONST, OP_MOD_REG_CONST, OP_CMP_REG_CONST,
+
     OP_INVALID
 } Opcode;
 
@@ -169,7 +210,7 @@ typedef enum {
 } RegisterIndex;
 
 #define NUM_FLAG_REGISTERS 4
-#define NUM_TOTAL_REGISTERS (NUM_GENERAL_REGISTERS + NUM_FLAG_REGISTERS)
+#define NUM_TOTAL_REGISTERS (NUM_GENERAL_REGISTERS + 1 + NUM_FLAG_REGISTERS) // + SP
 
 typedef struct {
     char name[32];
@@ -228,15 +269,263 @@ uint32_t palette[32] = {
     0xE0FFFF    // 31: PaleCyan    
 };
 
-uint8_t memory[MEMORY_SIZE];
-uint8_t backup_memory[MEMORY_SIZE];
-double registers[NUM_TOTAL_REGISTERS];
-uint32_t program_counter = 0;
-bool running = true;
-bool zero_flag = false;
-bool sign_flag = false;
-bool carry_flag = false;
-bool overflow_flag = false;
+// Virtual Machine State
+
+#define MAX_DECODED_OPERANDS 4
+#define DECODE_MAX_INSTRUCTION_LENGTH 16 // Longest encoding is 11 bytes (str.fmt), rounded up
+#define DECODE_MAX_SPAN_LENGTH (3 * DECODE_MAX_INSTRUCTION_LENGTH) // A fused entry covers up to three instructions
+#define DECODE_PAGE_SHIFT 12
+#define DECODE_PAGE_SIZE (1u << DECODE_PAGE_SHIFT)
+#define DECODE_PAGE_COUNT (MEMORY_SIZE >> DECODE_PAGE_SHIFT)
+#define CODE_MAP_SHIFT 4 // 16-byte chunks
+#define CODE_MAP_DECODED 1
+#define CODE_MAP_COMPILED 2
+#define DIRTY_PAGE_SHIFT 12 // Written pages are tracked per 4KB, see Fast Reset
+#define DIRTY_PAGE_COUNT (MEMORY_SIZE >> DIRTY_PAGE_SHIFT)
+
+typedef enum {
+    OPERAND_NONE,
+    OPERAND_REG,
+    OPERAND_F64,
+    OPERAND_U32,
+    OPERAND_I8,  // Signed integer immediates, widened to double when decoded
+    OPERAND_I16,
+    OPERAND_I32,
+    OPERAND_K16  // Index into the constant pool
+} OperandKind;
+
+typedef union {
+    RegisterIndex reg;
+    double f64;
+    uint32_t u32;
+    struct { uint32_t target; uint32_t fallthrough; } branch; // Both exits of a fused compare-and-branch
+    struct { uint8_t taken_mask; uint8_t retired; } fusion;   // See predecode_fuse
+} DecodedOperand;
+
+// Superinstructions. These are handler numbers for the threaded release core, never ROM opcodes: the
+// entry keeps its real opcode for the other cores and its own operands in the first slots.
+typedef enum {
+    FUSED_INC_CMP_VAL_JCC = OP_INVALID + 1,
+    FUSED_INC_CMP_REG_JCC,
+    FUSED_DEC_CMP_VAL_JCC,
+    FUSED_DEC_CMP_REG_JCC,
+    FUSED_CMP_VAL_JCC,
+    FUSED_CMP_REG_JCC,
+    FUSED_END
+} FusedOpcode;
+
+#define FUSED_PATTERN_COUNT (FUSED_END - FUSED_INC_CMP_VAL_JCC)
+#define FUSED_INDEX(fused) ((fused) - FUSED_INC_CMP_VAL_JCC)
+
+// Profiler slots: one per dispatch index (opcodes and superinstructions), plus one for JIT-compiled code
+#define PROFILE_SLOT_COMPILED 256
+#define PROFILE_SLOTS (PROFILE_SLOT_COMPILED + 1)
+
+
+// One predecoded instruction. Operands are stored in the order execute_instruction decodes them.
+// NOP padding that directly follows an instruction is folded into it: next_pc skips the NOPs and
+// folded_nops keeps the executed instruction count exact. dispatch is the threaded release handler,
+// either the opcode itself or a FusedOpcode when the entry starts a fused sequence.
+typedef struct {
+    DecodedOperand operands[MAX_DECODED_OPERANDS];
+    uint32_t next_pc;
+    uint8_t opcode;
+    uint8_t dispatch;
+    uint8_t folded_nops;
+    bool valid;
+} DecodedInstruction;
+
+// Call stack sampling, see Call Stack Sampling
+#define STACK_SAMPLE_MAX_DEPTH 128 // Deeper frames are folded into the frame at this depth
+
+// One distinct sampled stack: the entry addresses of the active subroutines, outermost first
+typedef struct {
+    uint64_t hash;
+    uint32_t depth;
+    uint32_t* frames; // NULL marks an unused table slot
+    uint64_t count;
+} StackSample;
+
+#define SNAPSHOT_MAGIC "VCPUSNAP"
+#define SNAPSHOT_VERSION 2
+// R0 after vm.snapshot
+#define SNAPSHOT_WRITTEN 0.0
+#define SNAPSHOT_RESUMED 1.0
+#define SNAPSHOT_FAILED 2.0
+
+// Snapshot file header, see Snapshots. Followed by page_count uint32_t page numbers, padding up to
+// GUEST_PAGE_SIZE, then the pages themselves so each one sits at a page-aligned file offset.
+typedef struct {
+    char magic[8];                           // SNAPSHOT_MAGIC
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t memory_size;
+    uint32_t page_count;
+    uint32_t program_counter;
+    int32_t cursor_x;
+    int32_t cursor_y;
+    int32_t text_color;
+    uint8_t gfx_initialized;
+    uint8_t audio_initialized;
+    uint8_t speaker_enabled;
+    uint8_t reserved;
+    double current_pitch;
+    double registers[NUM_TOTAL_REGISTERS];  // Flags materialized
+    char rom_filename[256];                  // ROM the snapshot was taken from, for listings
+    uint32_t constant_pool_address;          // Reloaded from the restored memory, see Constant Pool
+    uint32_t constant_pool_count;
+} SnapshotHeader;
+
+#define OBJECT_MAGIC "VCPU_OBJ"
+#define OBJECT_VERSION 2
+#define OBJECT_SECTION_CODE 0
+#define OBJECT_SECTION_DATA 1
+#define OBJECT_SECTION_EXTERN 2 // Relocations only: the target is the name of an imported symbol
+#define OBJECT_SECTION_NONE 3   // Fixups only: a constant, nothing to relocate
+#define OBJECT_SECTION_POOL 4   // Relocations only: the target is an entry of the module's constant pool
+
+#define CONSTANT_POOL_MAGIC "VCPUPOOL"
+#define CONSTANT_POOL_MAX_ENTRIES 65536 // Indexed by a 16-bit operand
+
+// Last bytes of a ROM whose code reads the constant pool, see Constant Pool. ROMs without pooled
+// constants have no trailer.
+typedef struct {
+    uint32_t address;          // Of the first entry, right after the strings and buffers
+    uint32_t count;
+    char magic[8];             // CONSTANT_POOL_MAGIC
+} ConstantPoolTrailer;
+
+// Object file header, see Object Files. Followed by the code, the data, pool_count doubles of constant pool,
+// symbol_count ObjectSymbol records, relocation_count ObjectRelocation records and names_size bytes of
+// NUL-terminated names.
+typedef struct {
+    char magic[8];             // OBJECT_MAGIC
+    uint32_t version;
+    uint32_t code_size;        // Assembled as if loaded at address 0
+    uint32_t data_size;        // Strings and buffers, placed after all code by the linker
+    uint32_t symbol_count;
+    uint32_t relocation_count;
+    uint32_t names_size;
+    uint32_t pool_count;       // Merged into one pool by the linker
+    uint32_t reserved;
+    uint64_t source_hash;      // Build cache key, see Project Builds
+} ObjectHeader;
+
+// A label, string or buffer the module defines. Only exported ones can be imported by other modules; the
+// rest are kept for the link map, mem.clear and the call stack sampler.
+typedef struct {
+    uint32_t name;             // Offset in the names
+    uint32_t value;            // Offset in its section
+    uint32_t size;             // Buffer size, 0 for labels and strings
+    uint8_t section;           // OBJECT_SECTION_CODE or OBJECT_SECTION_DATA
+    uint8_t kind;              // SYMBOL_LABEL, SYMBOL_STRING or SYMBOL_BUFFER
+    uint8_t exported;
+    uint8_t reserved;
+} ObjectSymbol;
+
+// An operand in the code that holds an address. The linker adds the final base of the section, or
+// writes the address of the imported symbol. Pool operands get the index of the entry in the merged pool.
+typedef struct {
+    uint32_t offset;           // Of the operand in the code
+    uint32_t target;           // Offset in the section, the name of the imported symbol or the pool entry
+    uint8_t section;           // OBJECT_SECTION_CODE, DATA, EXTERN or POOL
+    uint8_t kind;              // OPERAND_F64 or OPERAND_U32, OPERAND_K16 for the pool
+    uint8_t reserved[2];
+} ObjectRelocation;
+
+// Everything one guest owns. Several VMs can run side by side on different threads; settings such as
+// debug mode, the interpreter core, the JIT switch and the refresh rate stay global and apply to all of them.
+typedef struct {
+    uint8_t* memory;                            // memory_size bytes, see Guest Memory
+    uint32_t memory_size;                       // Set by vm_create and vm_set_memory_size, at most MEMORY_SIZE
+    bool memory_file_backed;                    // Some pages are private mappings of a snapshot file
+    double registers[NUM_TOTAL_REGISTERS];
+    uint32_t program_counter;
+    bool running;
+
+    // Lazy flags, see Flag Setting
+    bool flags_pending;  // registers[REG_ZF..REG_OF] are stale, the flags follow from flags_result
+    double flags_result; // Result of the last flag-producing instruction, bitwise results as signed 32-bit
+    bool flags_eager;    // The current instruction has a flag register operand, write flags immediately
+
+    int cursor_x;
+    int cursor_y;
+    int text_color;
+
+    SDL_Window* gfx_window;
+    SDL_Renderer* gfx_renderer;
+    SDL_Texture* gfx_texture;
+    uint32_t* gfx_pixels;            // Points into memory at VRAM_START_ADDRESS
+    bool gfx_initialized;
+    bool needs_gfx_update;           // VRAM changed since the last present
+    uint32_t gfx_last_present_ticks;
+
+    bool audio_initialized;
+    bool speaker_enabled;
+    double current_pitch;            // Speaker frequency in Hz
+    double audio_phase;              // Square wave phase, advanced by audio_callback
+    SDL_AudioSpec audio_spec;
+    SDL_AudioDeviceID audio_device;
+
+    // Headless backend, see Headless Output. Set up by headless_open for one run.
+    bool headless;                   // gfx and audio opcodes bypass SDL entirely
+    FILE* frame_file;                // Frames written by gfx_update_screen, NULL to drop them
+    bool frame_ppm;                  // frame_file is a stream of binary PPM images, otherwise raw ARGB8888
+    uint32_t frame_count;
+    FILE* audio_file;                // Float WAV the speaker is rendered into, NULL to discard audio
+    uint64_t audio_sample_count;     // Samples rendered so far
+    double audio_start_time;         // Wall clock time of sample 0
+    bool console_capture;            // Guest console output goes to console_buffer instead of stdout
+    char* console_buffer;
+    size_t console_length;
+    size_t console_capacity;
+
+    DecodedInstruction* decode_cache_pages[DECODE_PAGE_COUNT]; // Side table indexed by PC, allocated per 4KB page of code
+    DecodedInstruction decode_scratch;                        // Used when a cache page cannot be allocated
+    const DecodedOperand* current_decoded;                    // Operand cursor while executing a predecoded instruction
+    uint8_t* code_map;                                        // Per 16-byte chunk: holds bytes of predecoded or compiled instructions. Guest Memory pages, like memory
+
+    // Written pages, see Fast Reset
+    uint8_t dirty_pages[DIRTY_PAGE_COUNT];                    // 1 if the page was written since memory was last cleared or reset
+    uint16_t dirty_list[DIRTY_PAGE_COUNT];                    // The pages set in dirty_pages, in the order they were first written
+    uint32_t dirty_count;
+    const uint8_t* image;                                     // Program set by vm_load_image that vm_reset_image restores, owned by the caller
+    size_t image_size;
+    double* constant_pool;                                    // Copy of the program's constant pool, see Constant Pool
+    uint32_t constant_pool_count;
+    uint32_t constant_pool_address;                           // Where the program keeps it, for snapshots
+
+    uint64_t fused_pattern_counts[FUSED_PATTERN_COUNT];       // Times each superinstruction ran during the last run
+    uint64_t instruction_count;                               // Instructions retired by the last run
+
+    // Opcode profiler, see Profiler
+    bool profiling;                                           // vm_execute runs the counting core
+    volatile uint16_t profile_current;                        // Slot being executed, read by the sampler thread
+    uint64_t profile_counts[PROFILE_SLOTS];                   // Executions per slot
+    uint64_t profile_samples[PROFILE_SLOTS];                  // Sampler ticks that found the slot running
+
+    // Source hotspot counters, see Hotspot Listing
+    bool hotspot_counting;                                    // vm_execute counts every instruction at its PC
+    uint64_t* hotspot_pages[DECODE_PAGE_COUNT];               // Executions per PC, allocated per 4KB page on first hit
+
+    // Shadow call stack and its samples, see Call Stack Sampling
+    bool stack_sampling;                                      // vm_execute tracks CALL/RET and samples the stack
+    uint32_t stack_sample_interval;                           // Instructions between samples
+    int64_t stack_sample_countdown;
+    uint32_t shadow_depth;                                    // Active frames, may exceed STACK_SAMPLE_MAX_DEPTH
+    uint32_t shadow_frames[STACK_SAMPLE_MAX_DEPTH];           // Entry address of each active subroutine
+    uint64_t shadow_hashes[STACK_SAMPLE_MAX_DEPTH];           // Hash of frames[0..i], so a sample is hashed in O(1)
+    StackSample* stack_samples;                               // Open addressing table of distinct stacks
+    uint32_t stack_sample_capacity;
+    uint32_t stack_sample_used;
+    uint64_t stack_sample_total;
+
+    // Snapshots
+    char snapshot_path[256];                                  // Written by vm.snapshot, empty to refuse
+    bool resume_pending;                                      // The next vm_execute continues from resume
+    SnapshotHeader resume;                                    // CPU and device state of the loaded snapshot
+} VM;
+
 MacroDefinition macros[MAX_MACROS];
 int macro_count = 0;
 LabelDefinition labels[MAX_LABELS];
@@ -247,23 +536,11 @@ BufferDefinition buffers[MAX_BUFFERS];
 int buffer_count = 0;
 uint32_t data_section_start = 0;
 
-int cursor_x = 0;
-int cursor_y = 0;
-int text_color = 7;
 extern bool debug_mode;
-
-SDL_Window* gfx_window = NULL;      
-SDL_Renderer* gfx_renderer = NULL;   
-SDL_Texture* gfx_texture = NULL;     
-uint32_t* gfx_pixels = NULL;       //Pixel buffer in memory
-bool          gfx_initialized = false; //Flag to track gfx init
-bool needs_gfx_update = false;
-
-bool          audio_initialized = false; // Flag to track audio init
-bool          speaker_enabled = false;    // Speaker on/off state
-double        current_pitch = 440.0;      // Current pitch (frequency)
-SDL_AudioSpec audio_spec;               // SDL Audio specification
-SDL_AudioDeviceID audio_device;         // SDL Audio device ID
+int gfx_refresh_hz = GFX_DEFAULT_REFRESH_HZ; // Automatic presents per second, 0 = only gfx.present
+bool headless_mode = false;       // Run without SDL, see Headless Output
+char headless_frame_path[256];    // Frame dump for headless runs, empty to drop frames
+char headless_audio_path[256];    // WAV file for headless runs, empty to discard audio
 
 #ifndef _WIN32
 struct termios original_termios;
@@ -317,17 +594,145 @@ typedef struct {
 #define DISK_MAGIC_NUMBER 0x12345678
 #define DISK_VERSION 1
 
-DiskResultCode disk_get_size(uint32_t* size_bytes);
-DiskResultCode disk_read_sector(uint32_t sector_number, uint32_t address_mem, uint32_t count);
-DiskResultCode disk_write_sector(uint32_t sector_number, uint32_t address_mem, uint32_t count);
-DiskResultCode disk_get_volume_label(uint32_t address_mem);
-DiskResultCode disk_set_volume_label(uint32_t address_mem);
-DiskResultCode create_disk_image();
-DiskResultCode format_disk();
+DiskResultCode disk_get_size(VM* vm, uint32_t* size_bytes);
+DiskResultCode disk_read_sector(VM* vm, uint32_t sector_number, uint32_t address_mem, uint32_t count);
+DiskResultCode disk_write_sector(VM* vm, uint32_t sector_number, uint32_t address_mem, uint32_t count);
+DiskResultCode disk_get_volume_label(VM* vm, uint32_t address_mem);
+DiskResultCode disk_set_volume_label(VM* vm, uint32_t address_mem);
+DiskResultCode create_disk_image(VM* vm);
+DiskResultCode format_disk(VM* vm);
+
+RegisterIndex register_from_string(const char* reg_str);
+uint32_t get_label_address(const char* label_name);
+bool is_symbol_reference(const char* operand);
+void decode_cache_invalidate(VM* vm, uint32_t address, uint32_t length);
+void jit_flush(VM* vm);
+void materialize_flags_for_operand(VM* vm);
+void headless_write_frame(VM* vm);
+void headless_render_audio(VM* vm);
+bool snapshot_write(VM* vm);
+void snapshot_resume(VM* vm);
+int strcasecmp_portable(const char* s1, const char* s2);
+int host_cpu_count();
+
+// Guest Memory
+// Guest memory and the code map live in anonymous mappings that the host only backs with pages once the
+// guest touches them, so a small ROM costs a few pages no matter how large its memory is. Resetting
+// drops the pages instead of writing zeros over them.
+
+#define GUEST_PAGE_SIZE 4096 // Unit of MEM_TEST and snapshots, and the host page size on common systems
+
+uint32_t guest_memory_size = MEMORY_SIZE; // Memory size for VMs created from here on
+
+bool memory_size_valid(uint32_t memory_size) {
+    return memory_size >= MEMORY_MIN_SIZE && memory_size <= MEMORY_SIZE && memory_size % MEMORY_SIZE_ALIGNMENT == 0;
+}
+
+// Returns zero-filled, demand-committed memory or NULL
+uint8_t* guest_pages_map(size_t size) {
+#ifdef _WIN32
+    return (uint8_t*)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* pages = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return pages == MAP_FAILED ? NULL : (uint8_t*)pages;
+#endif
+}
+
+void guest_pages_unmap(uint8_t* pages, size_t size) {
+    if (pages == NULL) return;
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(pages, 0, MEM_RELEASE);
+#else
+    munmap(pages, size);
+#endif
+}
+
+// OR of every 64-bit word in a page, zero if the page is clear. Four independent accumulators keep
+// several loads in flight; at -O3 compilers turn the loop into SIMD ORs.
+uint64_t guest_page_bits(const uint8_t* page) {
+    const uint64_t* words = (const uint64_t*)page;
+    uint64_t bits0 = 0, bits1 = 0, bits2 = 0, bits3 = 0;
+    for (uint32_t i = 0; i < GUEST_PAGE_SIZE / sizeof(uint64_t); i += 4) {
+        bits0 |= words[i];
+        bits1 |= words[i + 1];
+        bits2 |= words[i + 2];
+        bits3 |= words[i + 3];
+    }
+    return bits0 | bits1 | bits2 | bits3;
+}
+
+// Zeroes the whole mapping by handing its pages back to the host
+void guest_pages_discard(uint8_t* pages, size_t size) {
+#ifdef _WIN32
+    if (!VirtualFree(pages, size, MEM_DECOMMIT)) {
+        memset(pages, 0, size);
+    }
+    else if (VirtualAlloc(pages, size, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+        fprintf(stderr, "Fatal Error: Could not recommit guest memory.\n");
+        exit(1);
+    }
+#elif defined(__linux__)
+    // Private anonymous pages read back as zeros after MADV_DONTNEED
+    if (madvise(pages, size, MADV_DONTNEED) != 0) memset(pages, 0, size);
+#else
+    // Other systems only guarantee zeros from a fresh mapping placed over the old one
+    if (mmap(pages, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        memset(pages, 0, size);
+    }
+#endif
+}
+
+// Clears a VM's guest memory. Pages mapped from a snapshot file would come back with the file's contents
+// if they were only dropped, so then fresh pages are mapped over the whole range instead.
+void guest_memory_discard(VM* vm) {
+#ifndef _WIN32
+    if (vm->memory_file_backed) {
+        if (mmap(vm->memory, vm->memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            fprintf(stderr, "Fatal Error: Could not release snapshot pages.\n");
+            exit(1);
+        }
+        vm->memory_file_backed = false;
+        return;
+    }
+#endif
+    guest_pages_discard(vm->memory, vm->memory_size);
+}
 
 // System Library Functions
 
-char sys_read_char() {
+double wall_clock_seconds() {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+
+// Guest console output. Goes to stdout, or into the VM's capture buffer during headless runs.
+void console_write(VM* vm, const char* text, size_t length) {
+    if (!vm->console_capture) {
+        fwrite(text, 1, length, stdout);
+        return;
+    }
+    if (vm->console_length + length > vm->console_capacity) {
+        size_t capacity = vm->console_capacity ? vm->console_capacity : 4096;
+        while (capacity < vm->console_length + length) capacity *= 2;
+        char* buffer = (char*)realloc(vm->console_buffer, capacity);
+        if (buffer == NULL) return; // Drop the output rather than stop the guest
+        vm->console_buffer = buffer;
+        vm->console_capacity = capacity;
+    }
+    memcpy(vm->console_buffer + vm->console_length, text, length);
+    vm->console_length += length;
+}
+
+char sys_read_char(VM* vm) {
 #ifdef _WIN32
     return _getch();
 #else
@@ -338,7 +743,7 @@ char sys_read_char() {
 #endif
 }
 
-char sys_get_key_press() {
+char sys_get_key_press(VM* vm) {
 #ifdef _WIN32
     if (_kbhit()) {
         return _getch();
@@ -367,41 +772,45 @@ char sys_get_key_press() {
 #endif
 }
 
-void sys_print_char(char character) {
-    printf("%c", character);
+void sys_print_char(VM* vm, char character) {
+    console_write(vm, &character, 1);
 }
 
-void sys_print_newline() {
-    sys_print_char('\n');
-    cursor_y++;
-    cursor_x = 0;
+void sys_print_newline(VM* vm) {
+    sys_print_char(vm, '\n');
+    vm->cursor_y++;
+    vm->cursor_x = 0;
 }
 
-void sys_read_string(uint32_t address, uint32_t max_len) {
-    if (address >= MEMORY_SIZE) {
+void sys_read_string(VM* vm, uint32_t address, uint32_t max_len) {
+    if (address >= vm->memory_size) {
         printf("Error: READ_STRING address out of bounds.\n");
         return;
     }
-    char* str_ptr = (char*)&memory[address];
+    if (max_len == 0) return;
+    if (max_len > vm->memory_size - address) max_len = vm->memory_size - address;
+    char* str_ptr = (char*)&vm->memory[address];
     uint32_t i = 0;
+    uint32_t written = 0; // Backspace can leave bytes past the final length already written
     char c;
     while (i < max_len - 1) {
-        c = sys_read_char();
+        c = sys_read_char(vm);
         if (c == '\r' || c == '\n') {
             str_ptr[i] = '\0';
-            sys_print_newline();
+            sys_print_newline(vm);
             break;
         }
         else if (c == 127) {
             if (i > 0) {
                 i--;
                 str_ptr[i] = '\0';
-                printf("\b \b");
+                console_write(vm, "\b \b", 3);
             }
         }
         else if (c >= 32 && c <= 126) {
             str_ptr[i++] = c;
-            sys_print_char(c);
+            if (i > written) written = i;
+            sys_print_char(vm, c);
         }
         else if (c == 27) {
             continue;
@@ -410,28 +819,36 @@ void sys_read_string(uint32_t address, uint32_t max_len) {
     if (i == max_len - 1) {
         str_ptr[i] = '\0';
     }
+    if (i + 1 > written) written = i + 1;
+    decode_cache_invalidate(vm, address, written);
 }
 
-void sys_print_number_dec(double number) {
-    printf("%f", number);
+void sys_print_number_dec(VM* vm, double number) {
+    char text[512]; // Large enough for %f of any double
+    int length = snprintf(text, sizeof(text), "%f", number);
+    console_write(vm, text, length < (int)sizeof(text) ? length : sizeof(text) - 1);
 }
 
-void sys_print_number_hex(uint32_t number) {
-    printf("0x%X", number);
+void sys_print_number_hex(VM* vm, uint32_t number) {
+    char text[16];
+    int length = snprintf(text, sizeof(text), "0x%X", number);
+    console_write(vm, text, length);
 }
 
-void sys_number_to_string(uint32_t number, uint32_t address, uint32_t buffer_size) {
-    if (address >= MEMORY_SIZE || address + buffer_size > MEMORY_SIZE) {
+void sys_number_to_string(VM* vm, uint32_t number, uint32_t address, uint32_t buffer_size) {
+    if (address >= vm->memory_size || address + buffer_size > vm->memory_size) {
         printf("Error: NUMBER_TO_STRING buffer out of bounds.\n");
         return;
     }
-    char* str_ptr = (char*)&memory[address];
+    char* str_ptr = (char*)&vm->memory[address];
     snprintf(str_ptr, buffer_size, "%u", number);
+    decode_cache_invalidate(vm, address, buffer_size);
 }
 
-void sys_set_cursor_pos(uint32_t x, uint32_t y) {
-    cursor_x = x;
-    cursor_y = y;
+void sys_set_cursor_pos(VM* vm, uint32_t x, uint32_t y) {
+    vm->cursor_x = x;
+    vm->cursor_y = y;
+    if (vm->console_capture) return; // No terminal to move
 #ifdef _WIN32
     HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
     COORD pos = { (SHORT)x, (SHORT)y };
@@ -441,13 +858,14 @@ void sys_set_cursor_pos(uint32_t x, uint32_t y) {
 #endif
 }
 
-void sys_get_cursor_pos(uint32_t* x, uint32_t* y) {
-    *x = cursor_x;
-    *y = cursor_y;
+void sys_get_cursor_pos(VM* vm, uint32_t* x, uint32_t* y) {
+    *x = vm->cursor_x;
+    *y = vm->cursor_y;
 }
 
-void sys_set_text_color(uint32_t color_code) {
-    text_color = color_code;
+void sys_set_text_color(VM* vm, uint32_t color_code) {
+    vm->text_color = color_code;
+    if (vm->console_capture) return;
 #ifdef _WIN32
     SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), (WORD)(color_code % 16));
 #else
@@ -460,43 +878,45 @@ void sys_set_text_color(uint32_t color_code) {
 #endif
 }
 
-void sys_reset_text_color() {
+void sys_reset_text_color(VM* vm) {
+    vm->text_color = 7;
+    if (vm->console_capture) return;
 #ifdef _WIN32
     SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), 7);
 #else
     printf("\033[0m");
 #endif
-    text_color = 7;
 }
 
-void sys_print_string(uint32_t address) {
-    if (address >= MEMORY_SIZE) {
+void sys_print_string(VM* vm, uint32_t address) {
+    if (address >= vm->memory_size) {
         printf("Error: PRINT_STRING address out of bounds.\n");
         return;
     }
-    char* str = (char*)&memory[address];
+    char* str = (char*)&vm->memory[address];
     while (*str != '\0') {
-        sys_print_char(*str);
+        sys_print_char(vm, *str);
         str++;
-        if ((uint32_t)(str - (char*)memory) >= MEMORY_SIZE) {
+        if ((uint32_t)(str - (char*)vm->memory) >= vm->memory_size) {
             printf("Error: PRINT_STRING string exceeds memory bounds.\n");
             return;
         }
     }
 }
 
-void sys_clear_screen() {
+void sys_clear_screen(VM* vm) {
+    vm->cursor_x = 0;
+    vm->cursor_y = 0;
+    if (vm->console_capture) return;
 #ifdef _WIN32
     system("cls");
 #else
     system("clear");
     printf("\033[H");
 #endif
-    cursor_x = 0;
-    cursor_y = 0;
 }
 
-void sys_wait(uint32_t milliseconds) {
+void sys_wait(VM* vm, uint32_t milliseconds) {
 #ifdef _WIN32
     Sleep(milliseconds);
 #else
@@ -504,15 +924,40 @@ void sys_wait(uint32_t milliseconds) {
 #endif
 }
 
-uint32_t sys_get_cpu_ver() {
+uint32_t sys_get_cpu_ver(VM* vm) {
     return CPU_VER;
 }
 
-double sys_time() {
+double sys_time(VM* vm) {
     return (double)time(NULL);
 }
 
-DiskResultCode disk_get_size(uint32_t* size_bytes) {
+// Clears memory, checks that it reads back as zero and puts the old contents back, one page at a time.
+// A page that is already clear passes by being read once; only pages holding data are saved, cleared,
+// verified and restored. Memory never changes from the guest's point of view, so cached decodes stay
+// valid. Returns false if any byte failed to clear.
+bool sys_mem_test(VM* vm) {
+    uint64_t saved_words[GUEST_PAGE_SIZE / sizeof(uint64_t)];
+    uint8_t* saved = (uint8_t*)saved_words;
+    bool test_passed = true;
+    for (uint32_t base = 0; base < vm->memory_size; base += GUEST_PAGE_SIZE) {
+        uint8_t* page = &vm->memory[base];
+        if (guest_page_bits(page) == 0) continue;
+
+        memcpy(saved, page, GUEST_PAGE_SIZE);
+        memset(page, 0x00, GUEST_PAGE_SIZE);
+        if (guest_page_bits(page) != 0) {
+            for (uint32_t i = 0; i < GUEST_PAGE_SIZE; i++) {
+                if (page[i] != 0x00) printf("Error at address 0x%08X: Expected 0x00, but got 0x%02X\n", base + i, page[i]);
+            }
+            test_passed = false;
+        }
+        memcpy(page, saved, GUEST_PAGE_SIZE);
+    }
+    return test_passed;
+}
+
+DiskResultCode disk_get_size(VM* vm, uint32_t* size_bytes) {
     FILE* disk_image_file = fopen(DISK_IMAGE_FILENAME, "rb");
     if (!disk_image_file) {
         return DISK_NOT_FOUND;
@@ -532,11 +977,11 @@ DiskResultCode disk_get_size(uint32_t* size_bytes) {
     return DISK_OK;
 }
 
-DiskResultCode disk_read_sector(uint32_t sector_number, uint32_t address_mem, uint32_t count) {
+DiskResultCode disk_read_sector(VM* vm, uint32_t sector_number, uint32_t address_mem, uint32_t count) {
     if (sector_number >= DISK_NUM_SECTORS) {
         return DISK_INVALID_SECTOR;
     }
-    if (address_mem >= MEMORY_SIZE || (address_mem + (count * DISK_SECTOR_SIZE)) > MEMORY_SIZE) {
+    if (address_mem >= vm->memory_size || (address_mem + (count * DISK_SECTOR_SIZE)) > vm->memory_size) {
         return DISK_INVALID_OFFSET;
     }
     if (count == 0) return DISK_PARAM_ERROR;
@@ -553,8 +998,9 @@ DiskResultCode disk_read_sector(uint32_t sector_number, uint32_t address_mem, ui
     }
 
     size_t bytes_to_read = count * DISK_SECTOR_SIZE;
-    size_t bytes_read = fread(&memory[address_mem], 1, bytes_to_read, disk_image_file);
+    size_t bytes_read = fread(&vm->memory[address_mem], 1, bytes_to_read, disk_image_file);
     fclose(disk_image_file);
+    decode_cache_invalidate(vm, address_mem, (uint32_t)bytes_read);
 
     if (bytes_read != bytes_to_read) {
         return DISK_READ_ERROR;
@@ -563,11 +1009,11 @@ DiskResultCode disk_read_sector(uint32_t sector_number, uint32_t address_mem, ui
     return DISK_OK;
 }
 
-DiskResultCode disk_write_sector(uint32_t sector_number, uint32_t address_mem, uint32_t count) {
+DiskResultCode disk_write_sector(VM* vm, uint32_t sector_number, uint32_t address_mem, uint32_t count) {
     if (sector_number >= DISK_NUM_SECTORS) {
         return DISK_INVALID_SECTOR;
     }
-    if (address_mem >= MEMORY_SIZE || (address_mem + (count * DISK_SECTOR_SIZE)) > MEMORY_SIZE) {
+    if (address_mem >= vm->memory_size || (address_mem + (count * DISK_SECTOR_SIZE)) > vm->memory_size) {
         return DISK_INVALID_OFFSET;
     }
     if (count == 0) return DISK_PARAM_ERROR;
@@ -584,7 +1030,7 @@ DiskResultCode disk_write_sector(uint32_t sector_number, uint32_t address_mem, u
     }
 
     size_t bytes_to_write = count * DISK_SECTOR_SIZE;
-    size_t bytes_written = fwrite(&memory[address_mem], 1, bytes_to_write, disk_image_file);
+    size_t bytes_written = fwrite(&vm->memory[address_mem], 1, bytes_to_write, disk_image_file);
     fclose(disk_image_file);
 
     if (bytes_written != bytes_to_write) {
@@ -594,8 +1040,8 @@ DiskResultCode disk_write_sector(uint32_t sector_number, uint32_t address_mem, u
     return DISK_OK;
 }
 
-DiskResultCode disk_get_volume_label(uint32_t address_mem) {
-    if (address_mem >= MEMORY_SIZE || (address_mem + 32) > MEMORY_SIZE) {
+DiskResultCode disk_get_volume_label(VM* vm, uint32_t address_mem) {
+    if (address_mem >= vm->memory_size || (address_mem + 32) > vm->memory_size) {
         return DISK_INVALID_OFFSET;
     }
 
@@ -613,14 +1059,15 @@ DiskResultCode disk_get_volume_label(uint32_t address_mem) {
         return DISK_HEADER_ERROR;
     }
 
-    strncpy((char*)&memory[address_mem], header.volume_label, 32);
-    ((char*)&memory[address_mem])[31] = '\0';
+    strncpy((char*)&vm->memory[address_mem], header.volume_label, 32);
+    ((char*)&vm->memory[address_mem])[31] = '\0';
+    decode_cache_invalidate(vm, address_mem, 32);
 
     return DISK_OK;
 }
 
-DiskResultCode disk_set_volume_label(uint32_t address_mem) {
-    if (address_mem >= MEMORY_SIZE || (address_mem + 32) > MEMORY_SIZE) {
+DiskResultCode disk_set_volume_label(VM* vm, uint32_t address_mem) {
+    if (address_mem >= vm->memory_size || (address_mem + 32) > vm->memory_size) {
         return DISK_INVALID_OFFSET;
     }
 
@@ -638,7 +1085,7 @@ DiskResultCode disk_set_volume_label(uint32_t address_mem) {
         return DISK_HEADER_ERROR;
     }
 
-    strncpy(header.volume_label, (char*)&memory[address_mem], 32);
+    strncpy(header.volume_label, (char*)&vm->memory[address_mem], 32);
     header.volume_label[31] = '\0';
 
     if (fseek(disk_image_file, 0, SEEK_SET) != 0) {
@@ -654,7 +1101,7 @@ DiskResultCode disk_set_volume_label(uint32_t address_mem) {
     return DISK_OK;
 }
 
-DiskResultCode create_disk_image() {
+DiskResultCode create_disk_image(VM* vm) {
     FILE* disk_image_file = fopen(DISK_IMAGE_FILENAME, "wb+");
     if (!disk_image_file) {
         perror("Error creating disk image file");
@@ -705,7 +1152,7 @@ DiskResultCode create_disk_image() {
     return DISK_OK;
 }
 
-DiskResultCode format_disk() {
+DiskResultCode format_disk(VM* vm) {
     FILE* disk_image_file = fopen(DISK_IMAGE_FILENAME, "wb+"); 
     if (!disk_image_file) {
         perror("Error opening disk image file for formatting");
@@ -752,13 +1199,22 @@ DiskResultCode format_disk() {
     return DISK_OK;
 }
 
-bool gfx_init() {
+bool gfx_init(VM* vm) {
+    if (vm->headless) {
+        // No window: the gfx opcodes draw into VRAM and gfx_update_screen dumps frames from there
+        vm->gfx_pixels = (uint32_t*)&vm->memory[VRAM_START_ADDRESS(vm)];
+        memset(vm->gfx_pixels, 0, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+        decode_cache_invalidate(vm, VRAM_START_ADDRESS(vm), SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+        vm->gfx_initialized = true;
+        return true;
+    }
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         fprintf(stderr, "SDL_Init Error: %s\n", SDL_GetError());
         return false;
     }
 
-    gfx_window = SDL_CreateWindow(
+    vm->gfx_window = SDL_CreateWindow(
         "Virtual CPU Graphics",
         SDL_WINDOWPOS_UNDEFINED,
         SDL_WINDOWPOS_UNDEFINED,
@@ -766,87 +1222,113 @@ bool gfx_init() {
         SCREEN_HEIGHT * 4,
         SDL_WINDOW_SHOWN
     );
-    if (gfx_window == NULL) {
+    if (vm->gfx_window == NULL) {
         fprintf(stderr, "SDL_CreateWindow Error: %s\n", SDL_GetError());
         SDL_Quit();
         return false;
     }
 
-    gfx_renderer = SDL_CreateRenderer(gfx_window, -1, SDL_RENDERER_ACCELERATED);
-    if (gfx_renderer == NULL) {
+    vm->gfx_renderer = SDL_CreateRenderer(vm->gfx_window, -1, SDL_RENDERER_ACCELERATED);
+    if (vm->gfx_renderer == NULL) {
         fprintf(stderr, "SDL_CreateRenderer Error: %s\n", SDL_GetError());
-        SDL_DestroyWindow(gfx_window);
+        SDL_DestroyWindow(vm->gfx_window);
         SDL_Quit();
         return false;
     }
 
-    gfx_texture = SDL_CreateTexture(
-        gfx_renderer,
+    vm->gfx_texture = SDL_CreateTexture(
+        vm->gfx_renderer,
         SDL_PIXELFORMAT_ARGB8888,
         SDL_TEXTUREACCESS_STREAMING,
         SCREEN_WIDTH,
         SCREEN_HEIGHT
     );
-    if (gfx_texture == NULL) {
+    if (vm->gfx_texture == NULL) {
         fprintf(stderr, "SDL_CreateTexture Error: %s\n", SDL_GetError());
-        SDL_DestroyRenderer(gfx_renderer);
-        SDL_DestroyWindow(gfx_window);
+        SDL_DestroyRenderer(vm->gfx_renderer);
+        SDL_DestroyWindow(vm->gfx_window);
         SDL_Quit();
         return false;
     }
 
-    gfx_pixels = (uint32_t*)&memory[VRAM_START_ADDRESS];
-    if (gfx_pixels == NULL) {
+    vm->gfx_pixels = (uint32_t*)&vm->memory[VRAM_START_ADDRESS(vm)];
+    if (vm->gfx_pixels == NULL) {
         fprintf(stderr, "Failed to allocate pixel buffer.\n");
-        SDL_DestroyTexture(gfx_texture);
-        SDL_DestroyRenderer(gfx_renderer);
-        SDL_DestroyWindow(gfx_window);
+        SDL_DestroyTexture(vm->gfx_texture);
+        SDL_DestroyRenderer(vm->gfx_renderer);
+        SDL_DestroyWindow(vm->gfx_window);
         SDL_Quit();
         return false;
     }
-    memset(gfx_pixels, 0, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t)); // Initialize to black
+    memset(vm->gfx_pixels, 0, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t)); // Initialize to black
+    decode_cache_invalidate(vm, VRAM_START_ADDRESS(vm), SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
 
-    gfx_initialized = true;
+    vm->gfx_initialized = true;
     return true;
 }
 
-void gfx_close() {
-    if (gfx_initialized) {
-        SDL_DestroyTexture(gfx_texture);
-        SDL_DestroyRenderer(gfx_renderer);
-        SDL_DestroyWindow(gfx_window);
+void gfx_close(VM* vm) {
+    if (vm->gfx_initialized && !vm->headless) {
+        SDL_DestroyTexture(vm->gfx_texture);
+        SDL_DestroyRenderer(vm->gfx_renderer);
+        SDL_DestroyWindow(vm->gfx_window);
         SDL_Quit();
-        gfx_initialized = false;
     }
+    vm->gfx_initialized = false;
 }
 
-void gfx_update_screen() {
-    if (gfx_initialized) {
-        SDL_UpdateTexture(gfx_texture, NULL, gfx_pixels, SCREEN_WIDTH * sizeof(uint32_t));
-        SDL_RenderClear(gfx_renderer);
-        SDL_RenderCopy(gfx_renderer, gfx_texture, NULL, NULL);
+void gfx_update_screen(VM* vm) {
+    if (vm->gfx_initialized && vm->headless) {
+        headless_write_frame(vm);
+    }
+    else if (vm->gfx_initialized) {
+        SDL_UpdateTexture(vm->gfx_texture, NULL, vm->gfx_pixels, SCREEN_WIDTH * sizeof(uint32_t));
+        SDL_RenderClear(vm->gfx_renderer);
+        SDL_RenderCopy(vm->gfx_renderer, vm->gfx_texture, NULL, NULL);
 
         SDL_Rect destRect = { 0, 0, SCREEN_WIDTH * 4, SCREEN_HEIGHT * 4 };
-        SDL_RenderCopy(gfx_renderer, gfx_texture, NULL, &destRect);
+        SDL_RenderCopy(vm->gfx_renderer, vm->gfx_texture, NULL, &destRect);
+
+        SDL_RenderPresent(vm->gfx_renderer);
+        vm->gfx_last_present_ticks = SDL_GetTicks();
+    }
+    vm->needs_gfx_update = false;
+}
 
-        SDL_RenderPresent(gfx_renderer);
+// Called by the cores after instructions that touch the screen. Drawing only marks the frame dirty;
+// it is uploaded and presented at most gfx_refresh_hz times per second, so a full redraw costs one present.
+void gfx_present_if_due(VM* vm) {
+    if (!vm->gfx_initialized) {
+        vm->needs_gfx_update = false;
+        return;
     }
+    if (vm->headless) return; // Headless frames are dumped on gfx.present, sys.wait and at the end of the run
+    if (gfx_refresh_hz <= 0) return;
+    if (SDL_GetTicks() - vm->gfx_last_present_ticks < (uint32_t)(1000 / gfx_refresh_hz)) return;
+    gfx_update_screen(vm);
+}
+
+// True while a drawn frame still waits for its paced present. The threaded core does not enter compiled
+// code then, so a program that draws and then spins keeps passing backward branches that re-check the deadline.
+static inline bool gfx_present_pending(VM* vm) {
+    return vm->needs_gfx_update && vm->gfx_initialized && !vm->headless && gfx_refresh_hz > 0;
 }
 
-void gfx_draw_pixel(int x, int y, uint32_t palette_index) {
-    if (gfx_initialized && x >= 0 && x < SCREEN_WIDTH && y >= 0 && y < SCREEN_HEIGHT) {
+void gfx_draw_pixel(VM* vm, int x, int y, uint32_t palette_index) {
+    if (vm->gfx_initialized && x >= 0 && x < SCREEN_WIDTH && y >= 0 && y < SCREEN_HEIGHT) {
         if (palette_index < 32) { 
-            gfx_pixels[y * SCREEN_WIDTH + x] = palette[palette_index];
+            vm->gfx_pixels[y * SCREEN_WIDTH + x] = palette[palette_index];
         }
         else {
-            gfx_pixels[y * SCREEN_WIDTH + x] = palette[0];
+            vm->gfx_pixels[y * SCREEN_WIDTH + x] = palette[0];
             fprintf(stderr, "Warning: Palette index out of bounds: %u\n", palette_index);
         }
+        decode_cache_invalidate(vm, VRAM_START_ADDRESS(vm) + (y * SCREEN_WIDTH + x) * sizeof(uint32_t), sizeof(uint32_t));
     }
 }
 
-void gfx_clear_screen(uint32_t palette_index) { 
-    if (gfx_initialized) {
+void gfx_clear_screen(VM* vm, uint32_t palette_index) { 
+    if (vm->gfx_initialized) {
         uint32_t clear_color;
         if (palette_index < 32) {
             clear_color = palette[palette_index]; 
@@ -856,193 +1338,932 @@ void gfx_clear_screen(uint32_t palette_index) {
             fprintf(stderr, "Warning: Palette index out of bounds for clear: %u\n", palette_index);
         }
         for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; ++i) {
-            gfx_pixels[i] = clear_color; 
+            vm->gfx_pixels[i] = clear_color; 
         }
+        decode_cache_invalidate(vm, VRAM_START_ADDRESS(vm), SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
     }
 }
 
 
-uint32_t gfx_get_screen_width() {
+uint32_t gfx_get_screen_width(VM* vm) {
     return SCREEN_WIDTH;
 }
 
-uint32_t gfx_get_screen_height() {
+uint32_t gfx_get_screen_height(VM* vm) {
     return SCREEN_HEIGHT;
 }
 
-uint32_t gfx_get_vram_size() {
+uint32_t gfx_get_vram_size(VM* vm) {
     return VRAM_SIZE;
 }
 
-uint32_t gfx_get_gpu_ver() {
+uint32_t gfx_get_gpu_ver(VM* vm) {
     return GPU_VER;
 }
 
+// Next speaker sample, shared by the SDL callback and the headless renderer
+float audio_next_sample(VM* vm) {
+    if (!vm->speaker_enabled) return 0.0f; // Silence if speaker is off, the phase holds
+    // Simple Square Wave (PC Speaker like)
+    float sample_value = sin(2.0 * M_PI * vm->current_pitch * vm->audio_phase) >= 0 ? 1.0f : -1.0f;
+    vm->audio_phase += 1.0 / AUDIO_SAMPLE_RATE;
+    if (vm->audio_phase > 1.0) vm->audio_phase -= 1.0; // Wrap phase
+    return sample_value * 0.2f; // Reduce volume to prevent clipping
+}
+
 void audio_callback(void* userdata, Uint8* stream, int len) {
-    static double phase = 0.0; // Keep track of phase for continuous wave
+    VM* vm = (VM*)userdata; // The VM that opened the device, see sys_audio_init
     float* fstream = (float*)stream;
     int nframes = len / sizeof(float);
 
-    if (!speaker_enabled) {
+    if (!vm->speaker_enabled) {
         memset(stream, 0, len); // Silence if speaker is off
         return;
     }
 
     for (int i = 0; i < nframes; i++) {
-        float sample_value = 0.0f;
-        if (speaker_enabled) {
-            // Simple Square Wave (PC Speaker like)
-            sample_value = sin(2.0 * M_PI * current_pitch * phase) >= 0 ? 1.0f : -1.0f;
-        }
-        fstream[i] = sample_value * 0.2f; // Reduce volume to prevent clipping
-        phase += 1.0 / AUDIO_SAMPLE_RATE;
-        if (phase > 1.0) phase -= 1.0; // Wrap phase
+        fstream[i] = audio_next_sample(vm);
     }
 }
 
 
-bool sys_audio_init() {
+bool sys_audio_init(VM* vm) {
+    if (vm->headless) {
+        // No device: headless_render_audio writes the speaker to audio_file in wall clock time.
+        // Reopening continues the stream where it stopped instead of inserting the closed period.
+        vm->audio_start_time = wall_clock_seconds() - (double)vm->audio_sample_count / AUDIO_SAMPLE_RATE;
+        vm->audio_initialized = true;
+        return true;
+    }
+
     if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
         fprintf(stderr, "SDL_Init Audio Error: %s\n", SDL_GetError());
         return false;
     }
 
-    SDL_zero(audio_spec);
-    audio_spec.freq = AUDIO_SAMPLE_RATE;
-    audio_spec.format = AUDIO_F32; // 32-bit floating point audio
-    audio_spec.channels = 1;          // Mono audio
-    audio_spec.samples = 4096;        // Buffer size
-    audio_spec.callback = audio_callback;
-    audio_spec.userdata = NULL;
+    SDL_zero(vm->audio_spec);
+    vm->audio_spec.freq = AUDIO_SAMPLE_RATE;
+    vm->audio_spec.format = AUDIO_F32; // 32-bit floating point audio
+    vm->audio_spec.channels = 1;          // Mono audio
+    vm->audio_spec.samples = 4096;        // Buffer size
+    vm->audio_spec.callback = audio_callback;
+    vm->audio_spec.userdata = vm;
 
-    audio_device = SDL_OpenAudioDevice(NULL, 0, &audio_spec, NULL, 0);
-    if (audio_device == 0) {
+    vm->audio_device = SDL_OpenAudioDevice(NULL, 0, &vm->audio_spec, NULL, 0);
+    if (vm->audio_device == 0) {
         fprintf(stderr, "SDL_OpenAudioDevice Error: %s\n", SDL_GetError());
         SDL_QuitSubSystem(SDL_INIT_AUDIO);
         return false;
     }
 
-    SDL_PauseAudioDevice(audio_device, 0); // Unpause audio to start callback
-    audio_initialized = true;
+    SDL_PauseAudioDevice(vm->audio_device, 0); // Unpause audio to start callback
+    vm->audio_initialized = true;
     return true;
 }
 
-void sys_audio_close() {
-    if (audio_initialized) {
-        SDL_CloseAudioDevice(audio_device);
+void sys_audio_close(VM* vm) {
+    if (vm->audio_initialized && vm->headless) {
+        headless_render_audio(vm);
+    }
+    else if (vm->audio_initialized) {
+        SDL_CloseAudioDevice(vm->audio_device);
         SDL_QuitSubSystem(SDL_INIT_AUDIO);
-        audio_initialized = false;
     }
+    vm->audio_initialized = false;
 }
 
-void sys_audio_speaker_on() {
-    speaker_enabled = true;
+void sys_audio_speaker_on(VM* vm) {
+    if (vm->headless) headless_render_audio(vm); // Everything up to now still used the old state
+    vm->speaker_enabled = true;
 }
 
-void sys_audio_speaker_off() {
-    speaker_enabled = false;
+void sys_audio_speaker_off(VM* vm) {
+    if (vm->headless) headless_render_audio(vm);
+    vm->speaker_enabled = false;
 }
 
-void sys_audio_set_pitch(double pitch) {
-    current_pitch = pitch;
-    if (current_pitch < 0) current_pitch = 0; // Prevent negative frequencies
-    if (current_pitch > AUDIO_SAMPLE_RATE / 2.0) current_pitch = AUDIO_SAMPLE_RATE / 2.0; // Nyquist limit
+void sys_audio_set_pitch(VM* vm, double pitch) {
+    if (vm->headless) headless_render_audio(vm);
+    vm->current_pitch = pitch;
+    if (vm->current_pitch < 0) vm->current_pitch = 0; // Prevent negative frequencies
+    if (vm->current_pitch > AUDIO_SAMPLE_RATE / 2.0) vm->current_pitch = AUDIO_SAMPLE_RATE / 2.0; // Nyquist limit
 }
 
-uint32_t sys_get_audio_ver() {
+uint32_t sys_get_audio_ver(VM* vm) {
     return AUDIO_VER;
 }
 
+// Headless Output
+//
+// With headless_mode set, runs never touch SDL. gfx.init only prepares VRAM, frames are written to a
+// dump file when the screen is presented (gfx.present, sys.wait after drawing, end of run), the speaker
+// is rendered into a float WAV file instead of a device, and console output is captured in the VM.
+
+static void wav_write_u16(FILE* file, uint16_t value) {
+    uint8_t bytes[2] = { (uint8_t)value, (uint8_t)(value >> 8) };
+    fwrite(bytes, 1, 2, file);
+}
+
+static void wav_write_u32(FILE* file, uint32_t value) {
+    uint8_t bytes[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+    fwrite(bytes, 1, 4, file);
+}
+
+// Mono 32-bit float WAV header, written once up front and again with the final size on close
+static void wav_write_header(FILE* file, uint64_t sample_count) {
+    uint32_t data_bytes = (uint32_t)(sample_count * sizeof(float));
+    fwrite("RIFF", 1, 4, file);
+    wav_write_u32(file, 36 + data_bytes);
+    fwrite("WAVEfmt ", 1, 8, file);
+    wav_write_u32(file, 16);
+    wav_write_u16(file, 3); // IEEE float
+    wav_write_u16(file, 1); // Mono
+    wav_write_u32(file, AUDIO_SAMPLE_RATE);
+    wav_write_u32(file, AUDIO_SAMPLE_RATE * sizeof(float));
+    wav_write_u16(file, sizeof(float));
+    wav_write_u16(file, 32);
+    fwrite("data", 1, 4, file);
+    wav_write_u32(file, data_bytes);
+}
+
+void headless_write_frame(VM* vm) {
+    if (vm->frame_file == NULL) return;
+    if (vm->frame_ppm) {
+        uint8_t row[SCREEN_WIDTH * 3];
+        fprintf(vm->frame_file, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+        for (int y = 0; y < SCREEN_HEIGHT; y++) {
+            for (int x = 0; x < SCREEN_WIDTH; x++) {
+                uint32_t pixel = vm->gfx_pixels[y * SCREEN_WIDTH + x];
+                row[x * 3] = (uint8_t)(pixel >> 16);
+                row[x * 3 + 1] = (uint8_t)(pixel >> 8);
+                row[x * 3 + 2] = (uint8_t)pixel;
+            }
+            fwrite(row, 1, sizeof(row), vm->frame_file);
+        }
+    }
+    else {
+        fwrite(vm->gfx_pixels, sizeof(uint32_t), SCREEN_WIDTH * SCREEN_HEIGHT, vm->frame_file);
+    }
+    vm->frame_count++;
+}
+
+// Renders the speaker from the last rendered sample up to now, using the state it had in between
+void headless_render_audio(VM* vm) {
+    if (vm->audio_file == NULL || !vm->audio_initialized) return;
+    uint64_t target = (uint64_t)((wall_clock_seconds() - vm->audio_start_time) * AUDIO_SAMPLE_RATE);
+    float block[1024];
+    while (vm->audio_sample_count < target) {
+        uint64_t count = target - vm->audio_sample_count;
+        if (count > 1024) count = 1024;
+        for (uint64_t i = 0; i < count; i++) block[i] = audio_next_sample(vm);
+        fwrite(block, sizeof(float), (size_t)count, vm->audio_file);
+        vm->audio_sample_count += count;
+    }
+}
+
+// Switches the VM to the headless backend for the next run. Empty paths drop frames and discard audio.
+bool headless_open(VM* vm, const char* frame_path, const char* audio_path) {
+    gfx_close(vm); // A window or device left open by an earlier windowed run
+    sys_audio_close(vm);
+    vm->headless = true;
+    vm->frame_count = 0;
+    vm->audio_sample_count = 0;
+    vm->console_length = 0;
+    vm->console_capture = true;
+
+    if (frame_path[0] != '\0') {
+        size_t length = strlen(frame_path);
+        vm->frame_ppm = length >= 4 && strcasecmp_portable(frame_path + length - 4, ".ppm") == 0;
+        vm->frame_file = fopen(frame_path, "wb");
+        if (vm->frame_file == NULL) {
+            perror("Error opening frame dump file");
+            return false;
+        }
+    }
+    if (audio_path[0] != '\0') {
+        vm->audio_file = fopen(audio_path, "wb");
+        if (vm->audio_file == NULL) {
+            perror("Error opening audio output file");
+            return false;
+        }
+        wav_write_header(vm->audio_file, 0);
+    }
+    return true;
+}
+
+// Ends a headless run: closes the guest's devices, finishes the output files and leaves the captured
+// console output in console_buffer.
+void headless_close(VM* vm) {
+    gfx_close(vm);
+    sys_audio_close(vm);
+    if (vm->frame_file != NULL) {
+        fclose(vm->frame_file);
+        vm->frame_file = NULL;
+    }
+    if (vm->audio_file != NULL) {
+        fseek(vm->audio_file, 0, SEEK_SET);
+        wav_write_header(vm->audio_file, vm->audio_sample_count);
+        fclose(vm->audio_file);
+        vm->audio_file = NULL;
+    }
+    vm->console_capture = false;
+    vm->headless = false;
+}
+
 // Instruction Decoding
 
-Opcode decode_opcode() {
-    if (program_counter >= MEMORY_SIZE) return OP_INVALID;
-    return (Opcode)memory[program_counter++];
+const char* fused_pattern_names[FUSED_PATTERN_COUNT] = {
+    "INC r; CMP r, imm; Jcc",
+    "INC r; CMP r, reg; Jcc",
+    "DEC r; CMP r, imm; Jcc",
+    "DEC r; CMP r, reg; Jcc",
+    "CMP r, imm; Jcc",
+    "CMP r, reg; Jcc"
+};
+
+bool predecode_enabled = true;
+
+Opcode decode_opcode(VM* vm) {
+    if (vm->program_counter >= vm->memory_size) return OP_INVALID;
+    return (Opcode)vm->memory[vm->program_counter++];
+}
+
+RegisterIndex decode_register(VM* vm) {
+    RegisterIndex reg;
+    if (vm->current_decoded) {
+        reg = (vm->current_decoded++)->reg;
+    }
+    else {
+        if (vm->program_counter >= vm->memory_size) return REG_INVALID;
+        uint8_t reg_index = vm->memory[vm->program_counter++];
+        if (reg_index >= NUM_TOTAL_REGISTERS) return REG_INVALID;
+        reg = (RegisterIndex)reg_index;
+    }
+    if (reg >= REG_ZF && reg <= REG_OF) materialize_flags_for_operand(vm);
+    return reg;
 }
 
-RegisterIndex decode_register() {
-    if (program_counter >= MEMORY_SIZE) return REG_INVALID;
-    uint8_t reg_index = memory[program_counter++];
-    if (reg_index >= NUM_TOTAL_REGISTERS) return REG_INVALID;
-    return (RegisterIndex)reg_index;
+double decode_value_double(VM* vm) {
+    if (vm->current_decoded) return (vm->current_decoded++)->f64;
+    if (vm->program_counter + 8 > vm->memory_size) return 0.0;
+    double value = *(double*)&vm->memory[vm->program_counter];
+    vm->program_counter += 8;
+    return value;
 }
 
-double decode_value_double() {
-    if (program_counter + 8 > MEMORY_SIZE) return 0.0;
-    double value = *(double*)&memory[program_counter];
-    program_counter += 8;
+uint32_t decode_value_uint32(VM* vm) {
+    if (vm->current_decoded) return (vm->current_decoded++)->u32;
+    if (vm->program_counter + 4 > vm->memory_size) return 0;
+    uint32_t value = *(uint32_t*)&vm->memory[vm->program_counter];
+    vm->program_counter += 4;
     return value;
 }
 
-uint32_t decode_value_uint32() {
-    if (program_counter + 4 > MEMORY_SIZE) return 0;
-    uint32_t value = *(uint32_t*)&memory[program_counter];
-    program_counter += 4;
+uint32_t decode_address(VM* vm) {
+    return decode_value_uint32(vm);
+}
+
+// Instruction Set
+// One row per opcode: the name used by the profiler, the assembler mnemonic, the operands in the order
+// execute_instruction decodes them, the encoded length and the flags it writes. The predecoder, both
+// assembler passes, the listing and the disassembler all read this table, so an opcode's encoding is
+// defined once. Lengths are computed by the compiler from the operand kinds.
+
+#define FLAG_EFFECT_ZF 1
+#define FLAG_EFFECT_SF 2
+#define FLAG_EFFECT_CF 4
+#define FLAG_EFFECT_OF 8
+#define FLAG_EFFECT_ZS (FLAG_EFFECT_ZF | FLAG_EFFECT_SF)
+#define FLAG_EFFECT_ALL (FLAG_EFFECT_ZF | FLAG_EFFECT_SF | FLAG_EFFECT_CF | FLAG_EFFECT_OF)
+
+typedef struct {
+    const char* name;     // Opcode name without OP_
+    const char* mnemonic; // How the disassembler spells it, see disassemble_instruction
+    OperandKind operands[MAX_DECODED_OPERANDS];
+    uint8_t operand_count;
+    uint8_t length;       // In bytes, opcode included
+    uint8_t flag_effects; // FLAG_EFFECT_* written by the instruction itself, not by a MOV into a flag register
+} OpcodeInfo;
+
+#define OPERAND_SIZE(kind) ((kind) == OPERAND_REG || (kind) == OPERAND_I8 ? 1 : (kind) == OPERAND_I16 || (kind) == OPERAND_K16 ? 2 : \
+    (kind) == OPERAND_U32 || (kind) == OPERAND_I32 ? 4 : (kind) == OPERAND_F64 ? 8 : 0)
+#define ISA(op, mnemonic, flags, a, b, c, d) [OP_##op] = { #op, mnemonic, { OPERAND_##a, OPERAND_##b, OPERAND_##c, OPERAND_##d }, \
+    (OPERAND_##a != OPERAND_NONE) + (OPERAND_##b != OPERAND_NONE) + (OPERAND_##c != OPERAND_NONE) + (OPERAND_##d != OPERAND_NONE), \
+    1 + OPERAND_SIZE(OPERAND_##a) + OPERAND_SIZE(OPERAND_##b) + OPERAND_SIZE(OPERAND_##c) + OPERAND_SIZE(OPERAND_##d), flags }
+#define ISA0(op, mnemonic, flags) ISA(op, mnemonic, flags, NONE, NONE, NONE, NONE)
+#define ISA1(op, mnemonic, flags, a) ISA(op, mnemonic, flags, a, NONE, NONE, NONE)
+#define ISA2(op, mnemonic, flags, a, b) ISA(op, mnemonic, flags, a, b, NONE, NONE)
+#define ISA3(op, mnemonic, flags, a, b, c) ISA(op, mnemonic, flags, a, b, c, NONE)
+#define ISA4(op, mnemonic, flags, a, b, c, d) ISA(op, mnemonic, flags, a, b, c, d)
+
+const OpcodeInfo opcode_info[OP_INVALID] = {
+    ISA0(NOP, "NOP", 0),
+    ISA2(MOV_REG_VAL, "MOV", 0, REG, F64),
+    ISA2(MOV_REG_REG, "MOV", 0, REG, REG),
+    ISA2(MOV_REG_MEM, "MOV", 0, REG, U32),
+    ISA2(MOV_MEM_REG, "MOV", 0, U32, REG),
+    ISA2(ADD_REG_REG, "ADD", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(ADD_REG_VAL, "ADD", FLAG_EFFECT_ALL, REG, F64),
+    ISA2(SUB_REG_REG, "SUB", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(SUB_REG_VAL, "SUB", FLAG_EFFECT_ALL, REG, F64),
+    ISA2(MUL_REG_REG, "MUL", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(MUL_REG_VAL, "MUL", FLAG_EFFECT_ALL, REG, F64),
+    ISA2(DIV_REG_REG, "DIV", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(DIV_REG_VAL, "DIV", FLAG_EFFECT_ALL, REG, F64),
+    ISA2(MOD_REG_REG, "MOD", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(MOD_REG_VAL, "MOD", FLAG_EFFECT_ALL, REG, F64),
+    ISA2(AND_REG_REG, "AND", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(AND_REG_VAL, "AND", FLAG_EFFECT_ALL, REG, U32),
+    ISA2(OR_REG_REG, "OR", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(OR_REG_VAL, "OR", FLAG_EFFECT_ALL, REG, U32),
+    ISA2(XOR_REG_REG, "XOR", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(XOR_REG_VAL, "XOR", FLAG_EFFECT_ALL, REG, U32),
+    ISA1(NOT_REG, "NOT", FLAG_EFFECT_ALL, REG),
+    ISA1(NEG_REG, "NEG", FLAG_EFFECT_ALL, REG),
+    ISA2(CMP_REG_REG, "CMP", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(CMP_REG_VAL, "CMP", FLAG_EFFECT_ALL, REG, F64),
+    ISA2(TEST_REG_REG, "TEST", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(TEST_REG_VAL, "TEST", FLAG_EFFECT_ALL, REG, U32),
+    ISA2(IMUL_REG_REG, "IMUL", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(IDIV_REG_REG, "IDIV", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(MOVZX_REG_REG, "MOVZX", 0, REG, REG),
+    ISA2(MOVZX_REG_MEM, "MOVZX", 0, REG, U32),
+    ISA2(MOVSX_REG_REG, "MOVSX", 0, REG, REG),
+    ISA2(MOVSX_REG_MEM, "MOVSX", 0, REG, U32),
+    ISA2(LEA_REG_MEM, "LEA", 0, REG, U32),
+    ISA1(JMP, "JMP", 0, U32),
+    ISA1(JMP_NZ, "JNZ", 0, U32),
+    ISA1(JMP_Z, "JZ", 0, U32),
+    ISA1(JMP_S, "JS", 0, U32),
+    ISA1(JMP_NS, "JNS", 0, U32),
+    ISA1(JMP_C, "JC", 0, U32),
+    ISA1(JMP_NC, "JNC", 0, U32),
+    ISA1(JMP_O, "JO", 0, U32),
+    ISA1(JMP_NO, "JNO", 0, U32),
+    ISA1(JMP_GE, "JGE", 0, U32),
+    ISA1(JMP_LE, "JLE", 0, U32),
+    ISA1(JMP_G, "JG", 0, U32),
+    ISA1(JMP_L, "JL", 0, U32),
+    ISA0(HLT, "HLT", 0),
+    ISA1(INC_REG, "INC", FLAG_EFFECT_ALL, REG),
+    ISA1(DEC_REG, "DEC", FLAG_EFFECT_ALL, REG),
+    ISA1(INC_MEM, "INC", 0, U32),
+    ISA1(DEC_MEM, "DEC", 0, U32),
+    ISA2(SHL_REG_REG, "SHL", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(SHL_REG_VAL, "SHL", FLAG_EFFECT_ALL, REG, U32),
+    ISA2(SHR_REG_REG, "SHR", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(SHR_REG_VAL, "SHR", FLAG_EFFECT_ALL, REG, U32),
+    ISA2(SAR_REG_REG, "SAR", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(SAR_REG_VAL, "SAR", FLAG_EFFECT_ALL, REG, U32),
+    ISA2(ROL_REG_REG, "ROL", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(ROL_REG_VAL, "ROL", FLAG_EFFECT_ALL, REG, U32),
+    ISA2(ROR_REG_REG, "ROR", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(ROR_REG_VAL, "ROR", FLAG_EFFECT_ALL, REG, U32),
+    ISA1(RND_REG, "RND", 0, REG),
+    ISA1(PUSH_REG, "PUSH", 0, REG),
+    ISA1(POP_REG, "POP", 0, REG),
+    ISA1(CALL_ADDR, "CALL", 0, U32),
+    ISA0(RET, "RET", 0),
+    ISA2(XCHG_REG_REG, "XCHG", 0, REG, REG),
+    ISA1(BSWAP_REG, "BSWAP", 0, REG),
+    ISA1(SETZ_REG, "SETZ", 0, REG),
+    ISA1(SETNZ_REG, "SETNZ", 0, REG),
+    ISA0(PUSHA, "PUSHA", 0),
+    ISA0(POPA, "POPA", 0),
+    ISA0(PUSHFD, "PUSHFD", 0),
+    ISA0(POPFD, "POPFD", FLAG_EFFECT_ALL),
+
+    ISA2(MATH_ADD, "math.add", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(MATH_SUB, "math.sub", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(MATH_MUL, "math.mul", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(MATH_DIV, "math.div", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(MATH_MOD, "math.mod", FLAG_EFFECT_ALL, REG, REG),
+    ISA1(MATH_ABS, "math.abs", FLAG_EFFECT_ALL, REG),
+    ISA1(MATH_SIN, "math.sin", FLAG_EFFECT_ALL, REG),
+    ISA1(MATH_COS, "math.cos", FLAG_EFFECT_ALL, REG),
+    ISA1(MATH_TAN, "math.tan", FLAG_EFFECT_ALL, REG),
+    ISA1(MATH_ASIN, "math.asin", FLAG_EFFECT_ALL, REG),
+    ISA1(MATH_ACOS, "math.acos", FLAG_EFFECT_ALL, REG),
+    ISA1(MATH_ATAN, "math.atan", FLAG_EFFECT_ALL, REG),
+    ISA2(MATH_POW, "math.pow", FLAG_EFFECT_ALL, REG, REG),
+    ISA1(MATH_SQRT, "math.sqrt", FLAG_EFFECT_ALL, REG),
+    ISA1(MATH_LOG, "math.log", FLAG_EFFECT_ALL, REG),
+    ISA1(MATH_EXP, "math.exp", FLAG_EFFECT_ALL, REG),
+    ISA1(MATH_FLOOR, "math.floor", FLAG_EFFECT_ALL, REG),
+    ISA1(MATH_CEIL, "math.ceil", FLAG_EFFECT_ALL, REG),
+    ISA1(MATH_ROUND, "math.round", FLAG_EFFECT_ALL, REG),
+    ISA2(MATH_MIN, "math.min", FLAG_EFFECT_ALL, REG, REG),
+    ISA2(MATH_MAX, "math.max", FLAG_EFFECT_ALL, REG, REG),
+    ISA1(MATH_NEG, "math.neg", FLAG_EFFECT_ALL, REG),
+    ISA2(MATH_ATAN2, "math.atan2", FLAG_EFFECT_ALL, REG, REG),
+    ISA1(MATH_LOG10, "math.log10", FLAG_EFFECT_ALL, REG),
+    ISA3(MATH_CLAMP, "math.clamp", FLAG_EFFECT_ALL, REG, REG, REG),
+    ISA4(MATH_LERP, "math.lerp", FLAG_EFFECT_ALL, REG, REG, REG, REG),
+
+    ISA2(STR_LEN_REG_MEM, "str.len", 0, REG, U32),
+    ISA2(STR_CPY_MEM_MEM, "str.cpy", 0, U32, U32),
+    ISA2(STR_CAT_MEM_MEM, "str.cat", 0, U32, U32),
+    ISA3(STR_CMP_REG_MEM_MEM, "str.cmp", FLAG_EFFECT_ZS, REG, U32, U32),
+    ISA3(STR_NCPY_MEM_MEM_REG, "str.ncpy", 0, U32, U32, REG),
+    ISA3(STR_NCAT_MEM_MEM_REG, "str.ncat", 0, U32, U32, REG),
+    ISA1(STR_TOUPPER_MEM, "str.toupper", 0, U32),
+    ISA1(STR_TOLOWER_MEM, "str.tolower", 0, U32),
+    ISA3(STR_CHR_REG_MEM_VAL, "str.chr", FLAG_EFFECT_ZS, REG, U32, U32),
+    ISA3(STR_STR_REG_MEM_MEM, "str.str", FLAG_EFFECT_ZS, REG, U32, U32),
+    ISA2(STR_ATOI_REG_MEM, "str.atoi", FLAG_EFFECT_ZS, REG, U32),
+    ISA3(STR_ITOA_MEM_REG_REG, "str.itoa", 0, U32, REG, REG),
+    ISA4(STR_SUBSTR_MEM_MEM_REG_REG, "str.substr", 0, U32, U32, REG, REG),
+    ISA4(STR_FMT_MEM_MEM_REG_REG, "str.fmt", 0, U32, U32, REG, REG),
+
+    ISA3(MEM_CPY_MEM_MEM_REG, "mem.cpy", 0, U32, U32, REG),
+    ISA3(MEM_SET_MEM_REG_VAL, "mem.set", 0, U32, REG, U32),
+    ISA3(MEM_SET_MEM_REG_REG, "mem.set", 0, U32, REG, REG),
+    ISA1(MEM_FREE_MEM, "mem.clear", 0, U32),
+
+    ISA1(SYS_PRINT_CHAR, "sys.print_char", 0, REG),
+    ISA0(SYS_CLEAR_SCREEN, "sys.clear_screen", 0),
+    ISA1(SYS_PRINT_STRING, "sys.print_string", 0, REG),
+    ISA0(SYS_PRINT_NEWLINE, "sys.newline", 0),
+    ISA2(SYS_SET_CURSOR_POS, "sys.set_cursor_pos", 0, REG, REG),
+    ISA2(SYS_GET_CURSOR_POS, "sys.get_cursor_pos", 0, REG, REG),
+    ISA1(SYS_SET_TEXT_COLOR, "sys.set_text_color", 0, REG),
+    ISA0(SYS_RESET_TEXT_COLOR, "sys.reset_text_color", 0),
+    ISA1(SYS_PRINT_NUMBER_DEC, "sys.print_number_dec", 0, REG),
+    ISA1(SYS_PRINT_NUMBER_HEX, "sys.print_number_hex", 0, REG),
+    ISA3(SYS_NUMBER_TO_STRING, "sys.number_to_string", 0, REG, REG, REG),
+    ISA1(SYS_READ_CHAR, "sys.read_char", 0, REG),
+    ISA2(SYS_READ_STRING, "sys.read_string", 0, REG, REG),
+    ISA1(SYS_GET_KEY_PRESS, "sys.get_key_press", 0, REG),
+    ISA1(SYS_GET_CPU_VER, "sys.cpu_ver", 0, REG),
+    ISA1(SYS_WAIT, "sys.wait", 0, REG),
+    ISA1(SYS_TIME_REG, "sys.time", 0, REG),
+    ISA0(MEM_TEST, "MEM_TEST", 0),
+
+    ISA1(DISK_GET_SIZE_REG, "disk.get_size", 0, REG),
+    ISA3(DISK_READ_SECTOR_MEM_REG_REG, "disk.read_sector", 0, REG, REG, U32),
+    ISA3(DISK_WRITE_SECTOR_MEM_REG_REG, "disk.write_sector", 0, REG, REG, U32),
+    ISA0(DISK_CREATE_IMAGE, "disk.create_image", 0),
+    ISA0(DISK_FORMAT_DISK, "disk.format_disk", 0),
+    ISA1(DISK_GET_VOLUME_LABEL_MEM, "disk.get_volume_label", 0, U32),
+    ISA1(DISK_SET_VOLUME_LABEL_MEM, "disk.set_volume_label", 0, U32),
+
+    ISA0(GFX_INIT, "gfx.init", 0),
+    ISA0(GFX_CLOSE, "gfx.close", 0),
+    ISA3(GFX_DRAW_PIXEL, "gfx.pixel", 0, REG, REG, REG),
+    ISA1(GFX_CLEAR, "gfx.clear", 0, REG),
+    ISA1(GFX_GET_SCREEN_WIDTH_REG, "gfx.get_screen_width", 0, REG),
+    ISA1(GFX_GET_SCREEN_HEIGHT_REG, "gfx.get_screen_height", 0, REG),
+    ISA1(GFX_GET_VRAM_SIZE_REG, "gfx.get_vram_size", 0, REG),
+    ISA1(GFX_GET_GPU_VER_REG, "gfx.get_gpu_ver", 0, REG),
+
+    ISA0(AUDIO_INIT, "audio.init", 0),
+    ISA0(AUDIO_CLOSE, "audio.close", 0),
+    ISA0(AUDIO_SPEAKER_ON, "audio.speaker_on", 0),
+    ISA0(AUDIO_SPEAKER_OFF, "audio.speaker_off", 0),
+    ISA1(AUDIO_SET_PITCH_REG, "audio.set_pitch", 0, REG),
+    ISA1(AUDIO_GET_AUDIO_VER_REG, "audio.get_ver", 0, REG),
+
+    ISA0(GFX_PRESENT, "gfx.present", 0),
+
+    ISA0(VM_SNAPSHOT, "vm.snapshot", 0),
+
+    ISA2(MOV_REG_VAL8, "MOV", 0, REG, I8),
+    ISA2(MOV_REG_VAL16, "MOV", 0, REG, I16),
+    ISA2(MOV_REG_VAL32, "MOV", 0, REG, I32),
+    ISA2(ADD_REG_VAL8, "ADD", FLAG_EFFECT_ALL, REG, I8),
+    ISA2(ADD_REG_VAL16, "ADD", FLAG_EFFECT_ALL, REG, I16),
+    ISA2(ADD_REG_VAL32, "ADD", FLAG_EFFECT_ALL, REG, I32),
+    ISA2(SUB_REG_VAL8, "SUB", FLAG_EFFECT_ALL, REG, I8),
+    ISA2(SUB_REG_VAL16, "SUB", FLAG_EFFECT_ALL, REG, I16),
+    ISA2(SUB_REG_VAL32, "SUB", FLAG_EFFECT_ALL, REG, I32),
+    ISA2(MUL_REG_VAL8, "MUL", FLAG_EFFECT_ALL, REG, I8),
+    ISA2(MUL_REG_VAL16, "MUL", FLAG_EFFECT_ALL, REG, I16),
+    ISA2(MUL_REG_VAL32, "MUL", FLAG_EFFECT_ALL, REG, I32),
+    ISA2(DIV_REG_VAL8, "DIV", FLAG_EFFECT_ALL, REG, I8),
+    ISA2(DIV_REG_VAL16, "DIV", FLAG_EFFECT_ALL, REG, I16),
+    ISA2(DIV_REG_VAL32, "DIV", FLAG_EFFECT_ALL, REG, I32),
+    ISA2(MOD_REG_VAL8, "MOD", FLAG_EFFECT_ALL, REG, I8),
+    ISA2(MOD_REG_VAL16, "MOD", FLAG_EFFECT_ALL, REG, I16),
+    ISA2(MOD_REG_VAL32, "MOD", FLAG_EFFECT_ALL, REG, I32),
+    ISA2(CMP_REG_VAL8, "CMP", FLAG_EFFECT_ALL, REG, I8),
+    ISA2(CMP_REG_VAL16, "CMP", FLAG_EFFECT_ALL, REG, I16),
+    ISA2(CMP_REG_VAL32, "CMP", FLAG_EFFECT_ALL, REG, I32),
+    ISA2(MOV_REG_CONST, "MOV", 0, REG, K16),
+    ISA2(ADD_REG_CONST, "ADD", FLAG_EFFECT_ALL, REG, K16),
+    ISA2(SUB_REG_CONST, "SUB", FLAG_EFFECT_ALL, REG, K16),
+    ISA2(MUL_REG_CONST, "MUL", FLAG_EFFECT_ALL, REG, K16),
+    ISA2(DIV_REG_CONST, "DIV", FLAG_EFFECT_ALL, REG, K16),
+    ISA2(MOD_REG_CONST, "MOD", FLAG_EFFECT_ALL, REG, K16),
+    ISA2(CMP_REG_CONST, "CMP", FLAG_EFFECT_ALL, REG, K16),
+};
+
+// Operand layout of each opcode, in the order execute_instruction decodes them.
+int opcode_operand_layout(Opcode opcode, OperandKind kinds[MAX_DECODED_OPERANDS]) {
+    if (opcode >= OP_INVALID) {
+        for (int i = 0; i < MAX_DECODED_OPERANDS; i++) kinds[i] = OPERAND_NONE;
+        return 0;
+    }
+    memcpy(kinds, opcode_info[opcode].operands, sizeof(opcode_info[opcode].operands));
+    return opcode_info[opcode].operand_count;
+}
+
+// Compact Immediates
+// Most immediates are small integers, which take 1, 2 or 4 bytes instead of a full double: MOV R0, 0 is
+// 3 bytes instead of 10. The assembler picks the shortest form that holds the value exactly, and decoding
+// widens the value back to double. The predecoder hands the full-width opcode to the cores, so only
+// execute_instruction without the predecode cache and the tools that read ROM bytes see compact opcodes.
+
+// The instructions with compact forms, in the order of their OP_*_VAL8/16/32 triples and OP_*_CONST opcodes
+static const Opcode compact_immediate_opcodes[] = { OP_MOV_REG_VAL, OP_ADD_REG_VAL, OP_SUB_REG_VAL, OP_MUL_REG_VAL, OP_DIV_REG_VAL, OP_MOD_REG_VAL, OP_CMP_REG_VAL };
+
+// The full-width opcode of a compact or pooled one, or opcode itself
+static inline Opcode opcode_widened(Opcode opcode) {
+    if (opcode < OP_MOV_REG_VAL8 || opcode >= OP_INVALID) return opcode;
+    if (opcode >= OP_MOV_REG_CONST) return compact_immediate_opcodes[opcode - OP_MOV_REG_CONST];
+    return compact_immediate_opcodes[(opcode - OP_MOV_REG_VAL8) / 3];
+}
+
+// The shortest form of a full-width opcode that holds value exactly, or opcode itself. -0 has no
+// integer form.
+Opcode opcode_compact_immediate(Opcode opcode, double value) {
+    for (int i = 0; i < (int)(sizeof(compact_immediate_opcodes) / sizeof(compact_immediate_opcodes[0])); i++) {
+        if (compact_immediate_opcodes[i] != opcode) continue;
+        if (value != floor(value) || (value == 0.0 && signbit(value))) return opcode;
+        Opcode compact = (Opcode)(OP_MOV_REG_VAL8 + i * 3);
+        if (value >= INT8_MIN && value <= INT8_MAX) return compact;
+        if (value >= INT16_MIN && value <= INT16_MAX) return (Opcode)(compact + 1);
+        if (value >= INT32_MIN && value <= INT32_MAX) return (Opcode)(compact + 2);
+        return opcode;
+    }
+    return opcode;
+}
+
+// The form of a full-width opcode that reads its value from the constant pool, or opcode itself
+Opcode opcode_pooled(Opcode opcode) {
+    for (int i = 0; i < (int)(sizeof(compact_immediate_opcodes) / sizeof(compact_immediate_opcodes[0])); i++) {
+        if (compact_immediate_opcodes[i] == opcode) return (Opcode)(OP_MOV_REG_CONST + i);
+    }
+    return opcode;
+}
+
+// Reads an immediate of the given kind from encoded bytes as a double. Pool indices are looked up in
+// pool; an index past its end reads as 0.
+double immediate_widen(const uint8_t* bytes, OperandKind kind, const double* pool, uint32_t pool_count) {
+    uint16_t index;
+    int16_t value16;
+    int32_t value32;
+    double value;
+    switch (kind) {
+    case OPERAND_K16:
+        memcpy(&index, bytes, sizeof(index));
+        return index < pool_count ? pool[index] : 0.0;
+    case OPERAND_I8:
+        return (double)(int8_t)bytes[0];
+    case OPERAND_I16:
+        memcpy(&value16, bytes, sizeof(value16));
+        return (double)value16;
+    case OPERAND_I32:
+        memcpy(&value32, bytes, sizeof(value32));
+        return (double)value32;
+    default:
+        memcpy(&value, bytes, sizeof(value));
+        return value;
+    }
+}
+
+// decode_value_double for an immediate of any width. Predecoded operands are widened already.
+double decode_value_immediate(VM* vm, OperandKind kind) {
+    if (vm->current_decoded || kind == OPERAND_F64) return decode_value_double(vm);
+    uint32_t size = OPERAND_SIZE(kind);
+    if (vm->program_counter + size > vm->memory_size) return 0.0;
+    double value = immediate_widen(&vm->memory[vm->program_counter], kind, vm->constant_pool, vm->constant_pool_count);
+    vm->program_counter += size;
     return value;
 }
 
-uint32_t decode_address() {
-    return decode_value_uint32();
+// Constant Pool
+// Non-integer constants such as M_PI are stored once, in a pool the assembler places after the strings
+// and buffers, and the *_REG_CONST instructions refer to an entry by a 16-bit index: 4 bytes instead of
+// 10 per use. A ConstantPoolTrailer at the end of the ROM says where the pool is. Loading the program
+// copies the entries into vm->constant_pool, a small array that stays in the cache while the program runs.
+// The pool in guest memory is not read again, so a program that writes over it keeps its constants.
+
+// Copies count entries at address into vm->constant_pool. Returns false and leaves the pool empty if they
+// are not in memory or cannot be copied.
+bool vm_constant_pool_attach(VM* vm, uint32_t address, uint32_t count) {
+    vm->constant_pool_count = 0;
+    vm->constant_pool_address = 0;
+    if (count == 0) return true;
+    if (count > CONSTANT_POOL_MAX_ENTRIES || address > vm->memory_size || (uint64_t)count * sizeof(double) > vm->memory_size - address) return false;
+    double* pool = (double*)realloc(vm->constant_pool, count * sizeof(double));
+    if (pool == NULL) return false;
+    memcpy(pool, &vm->memory[address], count * sizeof(double));
+    vm->constant_pool = pool;
+    vm->constant_pool_count = count;
+    vm->constant_pool_address = address;
+    return true;
+}
+
+// Picks up the constant pool of a program of rom_size bytes loaded at address 0, if it has one
+void vm_constant_pool_load(VM* vm, size_t rom_size) {
+    ConstantPoolTrailer trailer;
+    vm->constant_pool_count = 0;
+    vm->constant_pool_address = 0;
+    if (rom_size < sizeof(trailer) || rom_size > vm->memory_size) return;
+    memcpy(&trailer, &vm->memory[rom_size - sizeof(trailer)], sizeof(trailer));
+    if (memcmp(trailer.magic, CONSTANT_POOL_MAGIC, sizeof(trailer.magic)) != 0) return;
+    size_t pool_end = rom_size - sizeof(trailer);
+    if (trailer.address > pool_end || (uint64_t)trailer.count * sizeof(double) > pool_end - trailer.address ||
+        !vm_constant_pool_attach(vm, trailer.address, trailer.count)) {
+        fprintf(stderr, "Warning: The constant pool of the program is damaged; pooled constants read as 0.\n");
+    }
+}
+
+// Predecoded Instruction Cache
+
+static void predecode_single(VM* vm, uint32_t pc, DecodedInstruction* entry) {
+    uint32_t saved_pc = vm->program_counter;
+    const DecodedOperand* saved_decoded = vm->current_decoded;
+    vm->current_decoded = NULL;
+    vm->program_counter = pc;
+
+    Opcode opcode = decode_opcode(vm);
+    OperandKind kinds[MAX_DECODED_OPERANDS];
+    int count = opcode_operand_layout(opcode, kinds);
+    bool reads_flag_register = false;
+    memset(entry->operands, 0, sizeof(entry->operands));
+    for (int i = 0; i < count; i++) {
+        switch (kinds[i]) {
+        case OPERAND_REG:
+            entry->operands[i].reg = decode_register(vm);
+            if (entry->operands[i].reg >= REG_ZF && entry->operands[i].reg <= REG_OF) reads_flag_register = true;
+            break;
+        case OPERAND_F64: entry->operands[i].f64 = decode_value_double(vm); break;
+        case OPERAND_U32: entry->operands[i].u32 = decode_value_uint32(vm); break;
+        case OPERAND_I8: case OPERAND_I16: case OPERAND_I32: case OPERAND_K16: entry->operands[i].f64 = decode_value_immediate(vm, kinds[i]); break;
+        default: break;
+        }
+    }
+    opcode = opcode_widened(opcode);
+    entry->opcode = (uint8_t)opcode;
+    entry->dispatch = (uint8_t)(reads_flag_register ? OP_INVALID : opcode); // Generic handler, see materialize_flags_for_operand
+    entry->folded_nops = 0;
+    bool transfers_control = (opcode >= OP_JMP && opcode <= OP_HLT) || opcode == OP_CALL_ADDR || opcode == OP_RET || opcode >= OP_INVALID;
+    if (opcode != OP_NOP && !transfers_control && !debug_mode) {
+        while (vm->program_counter - pc < DECODE_MAX_INSTRUCTION_LENGTH && vm->program_counter < vm->memory_size && vm->memory[vm->program_counter] == OP_NOP) {
+            vm->program_counter++;
+            entry->folded_nops++;
+        }
+    }
+    entry->next_pc = vm->program_counter;
+    entry->valid = true;
+    if (pc < vm->memory_size) {
+        uint32_t last = (vm->program_counter > pc ? vm->program_counter - 1 : pc);
+        if (last >= vm->memory_size) last = vm->memory_size - 1;
+        for (uint32_t chunk = pc >> CODE_MAP_SHIFT; chunk <= last >> CODE_MAP_SHIFT; chunk++) vm->code_map[chunk] |= CODE_MAP_DECODED;
+    }
+
+    vm->program_counter = saved_pc;
+    vm->current_decoded = saved_decoded;
+}
+
+// Bit (ZF | SF << 1) is set when the jump is taken. A fused sequence always ends in CMP, which clears
+// CF and OF, so those two flags need no bits.
+static uint8_t fused_branch_mask(Opcode jump) {
+    uint8_t mask = 0;
+    for (int flags = 0; flags < 4; flags++) {
+        bool zf = flags & 1, sf = (flags >> 1) & 1, taken = false;
+        switch (jump) {
+        case OP_JMP: case OP_JMP_NC: case OP_JMP_NO: taken = true; break;
+        case OP_JMP_C: case OP_JMP_O: taken = false; break;
+        case OP_JMP_NZ: taken = !zf; break;
+        case OP_JMP_Z: taken = zf; break;
+        case OP_JMP_S: taken = sf; break;
+        case OP_JMP_NS: case OP_JMP_GE: taken = !sf; break;
+        case OP_JMP_LE: taken = zf || sf; break;
+        case OP_JMP_G: taken = !zf && !sf; break;
+        case OP_JMP_L: taken = !zf && sf; break;
+        default: break;
+        }
+        if (taken) mask |= (uint8_t)(1 << flags);
+    }
+    return mask;
+}
+
+// Turns `INC/DEC r; CMP r, x; Jcc` and `CMP r, x; Jcc` starting at pc into one superinstruction.
+// The head entry keeps its own operands in slot 0 (and 1 for CMP); slot 1 gets the CMP operand,
+// slot 2 both branch exits, slot 3 the branch condition and the instruction count the sequence stands for.
+// Registers are limited to R0-R31/SP so the INC cannot change a flag the CMP then reads.
+static void predecode_fuse(VM* vm, uint32_t pc, DecodedInstruction* entry) {
+    DecodedInstruction cmp, jump;
+    uint32_t retired = 0;
+    bool is_step = (entry->opcode == OP_INC_REG || entry->opcode == OP_DEC_REG);
+    if (is_step) {
+        predecode_single(vm, entry->next_pc, &cmp);
+        if (cmp.operands[0].reg != entry->operands[0].reg) return;
+        retired = 1 + entry->folded_nops;
+    }
+    else {
+        cmp = *entry;
+    }
+    if (cmp.opcode != OP_CMP_REG_VAL && cmp.opcode != OP_CMP_REG_REG) return;
+    if (cmp.operands[0].reg >= REG_ZF || (cmp.opcode == OP_CMP_REG_REG && cmp.operands[1].reg >= REG_ZF)) return;
+    predecode_single(vm, cmp.next_pc, &jump);
+    if (jump.opcode < OP_JMP || jump.opcode > OP_JMP_L) return;
+
+    bool by_value = (cmp.opcode == OP_CMP_REG_VAL);
+    if (entry->opcode == OP_INC_REG) entry->dispatch = by_value ? FUSED_INC_CMP_VAL_JCC : FUSED_INC_CMP_REG_JCC;
+    else if (entry->opcode == OP_DEC_REG) entry->dispatch = by_value ? FUSED_DEC_CMP_VAL_JCC : FUSED_DEC_CMP_REG_JCC;
+    else entry->dispatch = by_value ? FUSED_CMP_VAL_JCC : FUSED_CMP_REG_JCC;
+    entry->operands[1] = cmp.operands[1];
+    entry->operands[2].branch.target = jump.operands[0].u32;
+    entry->operands[2].branch.fallthrough = jump.next_pc;
+    entry->operands[3].fusion.taken_mask = fused_branch_mask((Opcode)jump.opcode);
+    entry->operands[3].fusion.retired = (uint8_t)(retired + 1 + cmp.folded_nops + 1 + jump.folded_nops);
+}
+
+void predecode_instruction(VM* vm, uint32_t pc, DecodedInstruction* entry) {
+    predecode_single(vm, pc, entry);
+    if (!debug_mode) predecode_fuse(vm, pc, entry);
+}
+
+const DecodedInstruction* decode_cache_fetch(VM* vm, uint32_t pc) {
+    if (pc >= vm->memory_size) {
+        predecode_instruction(vm, pc, &vm->decode_scratch);
+        return &vm->decode_scratch;
+    }
+    DecodedInstruction* page = vm->decode_cache_pages[pc >> DECODE_PAGE_SHIFT];
+    if (page == NULL) {
+        page = (DecodedInstruction*)calloc(DECODE_PAGE_SIZE, sizeof(DecodedInstruction));
+        if (page == NULL) {
+            predecode_instruction(vm, pc, &vm->decode_scratch);
+            return &vm->decode_scratch;
+        }
+        vm->decode_cache_pages[pc >> DECODE_PAGE_SHIFT] = page;
+    }
+    DecodedInstruction* entry = &page[pc & (DECODE_PAGE_SIZE - 1)];
+    if (!entry->valid) predecode_instruction(vm, pc, entry);
+    return entry;
+}
+
+// Records the pages of [address, end) as written for vm_reset_image.
+static inline void dirty_mark(VM* vm, uint32_t address, uint32_t end) {
+    for (uint32_t page = address >> DIRTY_PAGE_SHIFT; page <= (end - 1) >> DIRTY_PAGE_SHIFT; page++) {
+        if (vm->dirty_pages[page]) continue;
+        vm->dirty_pages[page] = 1;
+        vm->dirty_list[vm->dirty_count++] = (uint16_t)page;
+    }
+}
+
+// Called for every guest write to memory. Marks the pages written and drops cached decodes and compiled code
+// of any instruction overlapping the range.
+void decode_cache_invalidate(VM* vm, uint32_t address, uint32_t length) {
+    if (length == 0 || address >= vm->memory_size) return;
+    uint32_t start = (address >= DECODE_MAX_SPAN_LENGTH - 1) ? address - (DECODE_MAX_SPAN_LENGTH - 1) : 0;
+    uint32_t end = (length > vm->memory_size - address) ? vm->memory_size : address + length;
+    dirty_mark(vm, address, end);
+
+    uint8_t marks = 0;
+    for (uint32_t chunk = address >> CODE_MAP_SHIFT; chunk <= (end - 1) >> CODE_MAP_SHIFT; chunk++) marks |= vm->code_map[chunk];
+    if (marks == 0) return; // Plain data write, no instruction bytes were touched
+    if (marks & CODE_MAP_COMPILED) jit_flush(vm);
+
+    for (uint32_t page_index = start >> DECODE_PAGE_SHIFT; page_index <= (end - 1) >> DECODE_PAGE_SHIFT; page_index++) {
+        DecodedInstruction* page = vm->decode_cache_pages[page_index];
+        if (page == NULL) continue;
+        uint32_t page_start = page_index << DECODE_PAGE_SHIFT;
+        uint32_t first = (start > page_start) ? start - page_start : 0;
+        uint32_t last = (end - page_start < DECODE_PAGE_SIZE) ? end - page_start : DECODE_PAGE_SIZE;
+        for (uint32_t i = first; i < last; i++) {
+            page[i].valid = false;
+        }
+    }
+}
+
+void decode_cache_reset(VM* vm) {
+    for (uint32_t i = 0; i < DECODE_PAGE_COUNT; i++) {
+        free(vm->decode_cache_pages[i]);
+        vm->decode_cache_pages[i] = NULL;
+    }
+    jit_flush(vm);
+    guest_pages_discard(vm->code_map, vm->memory_size >> CODE_MAP_SHIFT);
 }
 
 // Flag Setting
+//
+// Flags are evaluated lazily. A flag-producing instruction only records its result; ZF and SF follow
+// from it and CF and OF are always 0 (no float or bitwise result sets them). Instructions that leave CF
+// and OF alone write ZF and SF directly instead, see set_zero_sign_flags_float. registers[REG_ZF..REG_OF]
+// are brought up to date only when something reads them as registers: see materialize_flags_for_operand.
+// Jumps, SETZ/SETNZ and PUSHFD test the recorded result directly through flag_zero(vm) and friends.
+
+static inline void record_flags(VM* vm, double result) {
+    vm->flags_result = result;
+    vm->flags_pending = true;
+}
+
+void materialize_flags(VM* vm) {
+    if (!vm->flags_pending) return;
+    vm->registers[REG_ZF] = (fabs(vm->flags_result) < 1e-9);
+    vm->registers[REG_SF] = (vm->flags_result < 0.0);
+    vm->registers[REG_CF] = 0;
+    vm->registers[REG_OF] = 0;
+    vm->flags_pending = false;
+}
+
+// An instruction is about to read or write ZF/SF/CF/OF as a register. Its own flag updates are then
+// done eagerly in the original order, so e.g. `ADD ZF, R1` leaves exactly the same flags as before.
+void materialize_flags_for_operand(VM* vm) {
+    materialize_flags(vm);
+    vm->flags_eager = true;
+}
+
+static inline bool flag_zero(VM* vm) { return vm->flags_pending ? fabs(vm->flags_result) < 1e-9 : vm->registers[REG_ZF] != 0; }
+static inline bool flag_sign(VM* vm) { return vm->flags_pending ? vm->flags_result < 0.0 : vm->registers[REG_SF] != 0; }
+static inline bool flag_carry(VM* vm) { return vm->flags_pending ? false : vm->registers[REG_CF] != 0; }
+static inline bool flag_overflow(VM* vm) { return vm->flags_pending ? false : vm->registers[REG_OF] != 0; }
+
+void set_zero_flag_float(VM* vm, double result) {
+    if (!vm->flags_eager) { record_flags(vm, result); return; }
+    vm->registers[REG_ZF] = (fabs(result) < 1e-9);
+    vm->flags_pending = false;
+}
 
-void set_zero_flag_float(double result) {
-    registers[REG_ZF] = (fabs(result) < 1e-9);
+void set_sign_flag_float(VM* vm, double result) {
+    if (!vm->flags_eager) { record_flags(vm, result); return; }
+    vm->registers[REG_SF] = (result < 0.0);
+    vm->flags_pending = false;
 }
 
-void set_sign_flag_float(double result) {
-    registers[REG_SF] = (result < 0.0);
+// For instructions that set only ZF and SF (str.cmp, str.chr, str.str, str.atoi). A pending result would
+// read CF and OF as 0, so it is written out first and these two flags are updated in place.
+void set_zero_sign_flags_float(VM* vm, double result) {
+    materialize_flags(vm);
+    vm->registers[REG_ZF] = (fabs(result) < 1e-9);
+    vm->registers[REG_SF] = (result < 0.0);
 }
 
-void set_carry_flag_float(double result, double operand1, double operand2, Opcode opcode) {
+void set_carry_flag_float(VM* vm, double result, double operand1, double operand2, Opcode opcode) {
+    if (!vm->flags_eager) return;
+    vm->flags_pending = false;
     if (opcode == OP_ADD_REG_REG || opcode == OP_ADD_REG_VAL || opcode == OP_MATH_ADD) {
-        registers[REG_CF] = (result > HUGE_VAL || result < -HUGE_VAL);
+        vm->registers[REG_CF] = (result > HUGE_VAL || result < -HUGE_VAL);
     }
     else if (opcode == OP_SUB_REG_REG || opcode == OP_SUB_REG_VAL || opcode == OP_MATH_SUB) {
-        registers[REG_CF] = (result > HUGE_VAL || result < -HUGE_VAL);
+        vm->registers[REG_CF] = (result > HUGE_VAL || result < -HUGE_VAL);
     }
     else {
-        registers[REG_CF] = 0;
+        vm->registers[REG_CF] = 0;
     }
 }
 
-void set_overflow_flag_float(double result, double operand1, double operand2, Opcode opcode) {
-    registers[REG_OF] = 0;
+void set_overflow_flag_float(VM* vm, double result, double operand1, double operand2, Opcode opcode) {
+    if (!vm->flags_eager) return;
+    vm->flags_pending = false;
+    vm->registers[REG_OF] = 0;
 }
 
-void set_zero_flag_int(uint32_t result) {
-    registers[REG_ZF] = (result == 0);
+void set_zero_flag_int(VM* vm, uint32_t result) {
+    if (!vm->flags_eager) { record_flags(vm, (double)(int32_t)result); return; }
+    vm->registers[REG_ZF] = (result == 0);
+    vm->flags_pending = false;
 }
 
-void set_sign_flag_int(uint32_t result) {
-    registers[REG_SF] = ((int32_t)result < 0);
+void set_sign_flag_int(VM* vm, uint32_t result) {
+    if (!vm->flags_eager) { record_flags(vm, (double)(int32_t)result); return; }
+    vm->registers[REG_SF] = ((int32_t)result < 0);
+    vm->flags_pending = false;
 }
 
-void set_carry_flag_int(uint32_t result, uint32_t operand1, uint32_t operand2, Opcode opcode) {
+// Only bitwise and shift instructions use the int setters, so CF and OF stay 0 in the lazy path.
+void set_carry_flag_int(VM* vm, uint32_t result, uint32_t operand1, uint32_t operand2, Opcode opcode) {
+    if (!vm->flags_eager) return;
+    vm->flags_pending = false;
     if (opcode == OP_ADD_REG_REG || opcode == OP_ADD_REG_VAL) {
-        registers[REG_CF] = (result < operand1);
+        vm->registers[REG_CF] = (result < operand1);
     }
     else if (opcode == OP_SUB_REG_REG || opcode == OP_SUB_REG_VAL) {
-        registers[REG_CF] = (result > operand1);
+        vm->registers[REG_CF] = (result > operand1);
     }
     else if (opcode >= OP_SHL_REG_REG && opcode <= OP_ROR_REG_VAL) {
-        registers[REG_CF] = 0;
+        vm->registers[REG_CF] = 0;
     }
     else {
-        registers[REG_CF] = 0;
+        vm->registers[REG_CF] = 0;
     }
 }
 
-void set_overflow_flag_int(uint32_t result, uint32_t operand1, uint32_t operand2, Opcode opcode) {
+void set_overflow_flag_int(VM* vm, uint32_t result, uint32_t operand1, uint32_t operand2, Opcode opcode) {
+    if (!vm->flags_eager) return;
+    vm->flags_pending = false;
     if (opcode == OP_ADD_REG_REG || opcode == OP_ADD_REG_VAL) {
-        registers[REG_OF] = (((operand1 ^ operand2) & 0x80000000) == 0 && ((operand1 ^ result) & 0x80000000) != 0);
+        vm->registers[REG_OF] = (((operand1 ^ operand2) & 0x80000000) == 0 && ((operand1 ^ result) & 0x80000000) != 0);
     }
     else if (opcode == OP_SUB_REG_REG || opcode == OP_SUB_REG_VAL) {
-        registers[REG_OF] = (((operand1 ^ operand2) & 0x80000000) != 0 && ((operand1 ^ result) & 0x80000000) != 0);
+        vm->registers[REG_OF] = (((operand1 ^ operand2) & 0x80000000) != 0 && ((operand1 ^ result) & 0x80000000) != 0);
     }
     else {
-        registers[REG_OF] = 0;
+        vm->registers[REG_OF] = 0;
     }
 }
 
@@ -1063,535 +2284,545 @@ const char* register_string(RegisterIndex reg) {
 }
 
 // CPU Instruction Execution
-void execute_instruction(Opcode opcode) {
+
+// The switch core. `trace` is a compile-time constant at both call sites below, so the release
+// instantiation carries no tracing code at all.
+static VM_ALWAYS_INLINE void execute_instruction_impl(VM* vm, Opcode opcode, const bool trace) {
     RegisterIndex reg1, reg2, reg3, reg_dest, reg_src;
     double value_double;
     uint32_t value_uint32, address, count;
+    OperandKind immediate = OPERAND_F64;
+    if (opcode >= OP_MOV_REG_VAL8 && opcode < OP_INVALID) { // Only without the predecode cache, which widens them
+        immediate = opcode_info[opcode].operands[1];
+        opcode = opcode_widened(opcode);
+    }
 
     switch (opcode) {
     case OP_NOP:
-        if (debug_mode) printf("NOP\n");
+        if (trace) printf("NOP\n");
         break;
     case OP_MOV_REG_REG: {
-        reg_dest = decode_register();
-        reg_src = decode_register();
-        if (debug_mode) printf("MOV %s, %s\n", register_string(reg_dest), register_string(reg_src));
+        reg_dest = decode_register(vm);
+        reg_src = decode_register(vm);
+        if (trace) printf("MOV %s, %s\n", register_string(reg_dest), register_string(reg_src));
         if (reg_dest != REG_INVALID && reg_src != REG_INVALID) {
-            registers[reg_dest] = registers[reg_src];
+            vm->registers[reg_dest] = vm->registers[reg_src];
         }
         break;
     }
     case OP_MOV_REG_VAL: {
-        reg_dest = decode_register();
-        value_double = decode_value_double();
-        if (debug_mode) printf("MOV %s, %f\n", register_string(reg_dest), value_double);
+        reg_dest = decode_register(vm);
+        value_double = decode_value_immediate(vm, immediate);
+        if (trace) printf("MOV %s, %f\n", register_string(reg_dest), value_double);
         if (reg_dest != REG_INVALID) {
-            registers[reg_dest] = value_double;
+            vm->registers[reg_dest] = value_double;
         }
         break;
     }
     case OP_MOV_REG_MEM: {
-        reg1 = decode_register();
-        address = decode_address();
-        if (debug_mode) printf("MOV %s, [%u]\n", register_string(reg1), address);
-        if (reg1 != REG_INVALID && address < MEMORY_SIZE - 8) registers[reg1] = *(double*)&memory[address];
+        reg1 = decode_register(vm);
+        address = decode_address(vm);
+        if (trace) printf("MOV %s, [%u]\n", register_string(reg1), address);
+        if (reg1 != REG_INVALID && address < vm->memory_size - 8) vm->registers[reg1] = *(double*)&vm->memory[address];
         break;
     }
     case OP_MOV_MEM_REG: {
-        address = decode_address();
-        reg1 = decode_register();
-        if (debug_mode) printf("MOV [%u], %s\n", address, register_string(reg1));
-        if (reg1 != REG_INVALID && address < MEMORY_SIZE - 8) *(double*)&memory[address] = registers[reg1];
+        address = decode_address(vm);
+        reg1 = decode_register(vm);
+        if (trace) printf("MOV [%u], %s\n", address, register_string(reg1));
+        if (reg1 != REG_INVALID && address < vm->memory_size - 8) {
+            *(double*)&vm->memory[address] = vm->registers[reg1];
+            decode_cache_invalidate(vm, address, 8);
+        }
         break;
     }
     case OP_ADD_REG_REG: {
-        reg1 = decode_register();
-        reg2 = decode_register();
-        if (debug_mode) printf("ADD %s, %s\n", register_string(reg1), register_string(reg2));
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        if (trace) printf("ADD %s, %s\n", register_string(reg1), register_string(reg2));
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            double result = registers[reg1] + registers[reg2];
-            set_carry_flag_float(result, registers[reg1], registers[reg2], opcode);
-            set_overflow_flag_float(result, registers[reg1], registers[reg2], opcode);
-            registers[reg1] = result;
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
+            double result = vm->registers[reg1] + vm->registers[reg2];
+            set_carry_flag_float(vm, result, vm->registers[reg1], vm->registers[reg2], opcode);
+            set_overflow_flag_float(vm, result, vm->registers[reg1], vm->registers[reg2], opcode);
+            vm->registers[reg1] = result;
+            set_zero_flag_float(vm, vm->registers[reg1]);
+            set_sign_flag_float(vm, vm->registers[reg1]);
         }
         break;
     }
     case OP_ADD_REG_VAL: {
-        reg1 = decode_register();
-        value_double = decode_value_double();
-        if (debug_mode) printf("ADD %s, %f\n", register_string(reg1), value_double);
+        reg1 = decode_register(vm);
+        value_double = decode_value_immediate(vm, immediate);
+        if (trace) printf("ADD %s, %f\n", register_string(reg1), value_double);
         if (reg1 != REG_INVALID) {
-            double result = registers[reg1] + value_double;
-            set_carry_flag_float(result, registers[reg1], value_double, opcode);
-            set_overflow_flag_float(result, registers[reg1], value_double, opcode);
-            registers[reg1] = result;
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
+            double result = vm->registers[reg1] + value_double;
+            set_carry_flag_float(vm, result, vm->registers[reg1], value_double, opcode);
+            set_overflow_flag_float(vm, result, vm->registers[reg1], value_double, opcode);
+            vm->registers[reg1] = result;
+            set_zero_flag_float(vm, vm->registers[reg1]);
+            set_sign_flag_float(vm, vm->registers[reg1]);
         }
         break;
     }
     case OP_SUB_REG_REG: {
-        reg1 = decode_register();
-        reg2 = decode_register();
-        if (debug_mode) printf("SUB %s, %s\n", register_string(reg1), register_string(reg2));
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        if (trace) printf("SUB %s, %s\n", register_string(reg1), register_string(reg2));
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            double result = registers[reg1] - registers[reg2];
-            set_carry_flag_float(result, registers[reg1], registers[reg2], opcode);
-            set_overflow_flag_float(result, registers[reg1], registers[reg2], opcode);
-            registers[reg1] = result;
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
+            double result = vm->registers[reg1] - vm->registers[reg2];
+            set_carry_flag_float(vm, result, vm->registers[reg1], vm->registers[reg2], opcode);
+            set_overflow_flag_float(vm, result, vm->registers[reg1], vm->registers[reg2], opcode);
+            vm->registers[reg1] = result;
+            set_zero_flag_float(vm, vm->registers[reg1]);
+            set_sign_flag_float(vm, vm->registers[reg1]);
         }
         break;
     }
     case OP_SUB_REG_VAL: {
-        reg1 = decode_register();
-        value_double = decode_value_double();
-        if (debug_mode) printf("SUB %s, %f\n", register_string(reg1), value_double);
+        reg1 = decode_register(vm);
+        value_double = decode_value_immediate(vm, immediate);
+        if (trace) printf("SUB %s, %f\n", register_string(reg1), value_double);
         if (reg1 != REG_INVALID) {
-            double result = registers[reg1] - value_double;
-            set_carry_flag_float(result, registers[reg1], value_double, opcode);
-            set_overflow_flag_float(result, registers[reg1], value_double, opcode);
-            registers[reg1] = result;
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
+            double result = vm->registers[reg1] - value_double;
+            set_carry_flag_float(vm, result, vm->registers[reg1], value_double, opcode);
+            set_overflow_flag_float(vm, result, vm->registers[reg1], value_double, opcode);
+            vm->registers[reg1] = result;
+            set_zero_flag_float(vm, vm->registers[reg1]);
+            set_sign_flag_float(vm, vm->registers[reg1]);
         }
         break;
     }
     case OP_MUL_REG_REG: {
-        reg1 = decode_register();
-        reg2 = decode_register();
-        if (debug_mode) printf("MUL %s, %s\n", register_string(reg1), register_string(reg2));
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        if (trace) printf("MUL %s, %s\n", register_string(reg1), register_string(reg2));
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            double result = registers[reg1] * registers[reg2];
-            set_carry_flag_float(result, registers[reg1], registers[reg2], opcode);
-            set_overflow_flag_float(result, registers[reg1], registers[reg2], opcode);
-            registers[reg1] = result;
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
+            double result = vm->registers[reg1] * vm->registers[reg2];
+            set_carry_flag_float(vm, result, vm->registers[reg1], vm->registers[reg2], opcode);
+            set_overflow_flag_float(vm, result, vm->registers[reg1], vm->registers[reg2], opcode);
+            vm->registers[reg1] = result;
+            set_zero_flag_float(vm, vm->registers[reg1]);
+            set_sign_flag_float(vm, vm->registers[reg1]);
         }
         break;
     }
     case OP_MUL_REG_VAL: {
-        reg1 = decode_register();
-        value_double = decode_value_double();
-        if (debug_mode) printf("MUL %s, %f\n", register_string(reg1), value_double);
+        reg1 = decode_register(vm);
+        value_double = decode_value_immediate(vm, immediate);
+        if (trace) printf("MUL %s, %f\n", register_string(reg1), value_double);
         if (reg1 != REG_INVALID) {
-            double result = registers[reg1] * value_double;
-            set_carry_flag_float(result, registers[reg1], value_double, opcode);
-            set_overflow_flag_float(result, registers[reg1], value_double, opcode);
-            registers[reg1] = result;
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
+            double result = vm->registers[reg1] * value_double;
+            set_carry_flag_float(vm, result, vm->registers[reg1], value_double, opcode);
+            set_overflow_flag_float(vm, result, vm->registers[reg1], value_double, opcode);
+            vm->registers[reg1] = result;
+            set_zero_flag_float(vm, vm->registers[reg1]);
+            set_sign_flag_float(vm, vm->registers[reg1]);
         }
         break;
     }
     case OP_DIV_REG_REG: {
-        reg1 = decode_register();
-        reg2 = decode_register();
-        if (debug_mode) printf("DIV %s, %s\n", register_string(reg1), register_string(reg2));
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        if (trace) printf("DIV %s, %s\n", register_string(reg1), register_string(reg2));
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            if (fabs(registers[reg2]) > 1e-9) {
-                double result = registers[reg1] / registers[reg2];
-                set_carry_flag_float(result, registers[reg1], registers[reg2], opcode);
-                set_overflow_flag_float(result, registers[reg1], registers[reg2], opcode);
-                registers[reg1] = result;
-                set_zero_flag_float(registers[reg1]);
-                set_sign_flag_float(registers[reg1]);
+            if (fabs(vm->registers[reg2]) > 1e-9) {
+                double result = vm->registers[reg1] / vm->registers[reg2];
+                set_carry_flag_float(vm, result, vm->registers[reg1], vm->registers[reg2], opcode);
+                set_overflow_flag_float(vm, result, vm->registers[reg1], vm->registers[reg2], opcode);
+                vm->registers[reg1] = result;
+                set_zero_flag_float(vm, vm->registers[reg1]);
+                set_sign_flag_float(vm, vm->registers[reg1]);
             }
             else {
                 printf("Error: Division by zero!\n");
-                running = false;
+                vm->running = false;
             }
         }
         break;
     }
     case OP_DIV_REG_VAL: {
-        reg1 = decode_register();
-        value_double = decode_value_double();
-        if (debug_mode) printf("DIV %s, %f\n", register_string(reg1), value_double);
+        reg1 = decode_register(vm);
+        value_double = decode_value_immediate(vm, immediate);
+        if (trace) printf("DIV %s, %f\n", register_string(reg1), value_double);
         if (reg1 != REG_INVALID) {
             if (fabs(value_double) > 1e-9) {
-                double result = registers[reg1] / value_double;
-                set_carry_flag_float(result, registers[reg1], value_double, opcode);
-                set_overflow_flag_float(result, registers[reg1], value_double, opcode);
-                registers[reg1] = result;
-                set_zero_flag_float(registers[reg1]);
-                set_sign_flag_float(registers[reg1]);
+                double result = vm->registers[reg1] / value_double;
+                set_carry_flag_float(vm, result, vm->registers[reg1], value_double, opcode);
+                set_overflow_flag_float(vm, result, vm->registers[reg1], value_double, opcode);
+                vm->registers[reg1] = result;
+                set_zero_flag_float(vm, vm->registers[reg1]);
+                set_sign_flag_float(vm, vm->registers[reg1]);
             }
             else {
                 printf("Error: Division by zero!\n");
-                running = false;
+                vm->running = false;
             }
         }
         break;
     }
     case OP_MOD_REG_REG: {
-        reg1 = decode_register();
-        reg2 = decode_register();
-        if (debug_mode) printf("MOD %s, %s\n", register_string(reg1), register_string(reg2));
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        if (trace) printf("MOD %s, %s\n", register_string(reg1), register_string(reg2));
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            if (fabs(registers[reg2]) > 1e-9) {
-                double result = fmod(registers[reg1], registers[reg2]);
-                set_carry_flag_float(result, registers[reg1], registers[reg2], opcode);
-                set_overflow_flag_float(result, registers[reg1], registers[reg2], opcode);
-                registers[reg1] = result;
-                set_zero_flag_float(registers[reg1]);
-                set_sign_flag_float(registers[reg1]);
+            if (fabs(vm->registers[reg2]) > 1e-9) {
+                double result = fmod(vm->registers[reg1], vm->registers[reg2]);
+                set_carry_flag_float(vm, result, vm->registers[reg1], vm->registers[reg2], opcode);
+                set_overflow_flag_float(vm, result, vm->registers[reg1], vm->registers[reg2], opcode);
+                vm->registers[reg1] = result;
+                set_zero_flag_float(vm, vm->registers[reg1]);
+                set_sign_flag_float(vm, vm->registers[reg1]);
             }
             else {
                 printf("Error: Modulo by zero!\n");
-                running = false;
+                vm->running = false;
             }
         }
         break;
     }
     case OP_MOD_REG_VAL: {
-        reg1 = decode_register();
-        value_double = decode_value_double();
-        if (debug_mode) printf("MOD %s, %f\n", register_string(reg1), value_double);
+        reg1 = decode_register(vm);
+        value_double = decode_value_immediate(vm, immediate);
+        if (trace) printf("MOD %s, %f\n", register_string(reg1), value_double);
         if (reg1 != REG_INVALID) {
             if (fabs(value_double) > 1e-9) {
-                double result = fmod(registers[reg1], value_double);
-                set_carry_flag_float(result, registers[reg1], value_double, opcode);
-                set_overflow_flag_float(result, registers[reg1], value_double, opcode);
-                registers[reg1] = result;
-                set_zero_flag_float(registers[reg1]);
-                set_sign_flag_float(registers[reg1]);
+                double result = fmod(vm->registers[reg1], value_double);
+                set_carry_flag_float(vm, result, vm->registers[reg1], value_double, opcode);
+                set_overflow_flag_float(vm, result, vm->registers[reg1], value_double, opcode);
+                vm->registers[reg1] = result;
+                set_zero_flag_float(vm, vm->registers[reg1]);
+                set_sign_flag_float(vm, vm->registers[reg1]);
             }
             else {
                 printf("Error: Modulo by zero!\n");
-                running = false;
+                vm->running = false;
             }
         }
         break;
     }
     case OP_AND_REG_REG: {
-        reg1 = decode_register();
-        reg2 = decode_register();
-        if (debug_mode) printf("AND %s, %s\n", register_string(reg1), register_string(reg2));
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        if (trace) printf("AND %s, %s\n", register_string(reg1), register_string(reg2));
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            uint32_t val1 = (uint32_t)registers[reg1];
-            uint32_t val2 = (uint32_t)registers[reg2];
+            uint32_t val1 = (uint32_t)vm->registers[reg1];
+            uint32_t val2 = (uint32_t)vm->registers[reg2];
             uint32_t result = val1 & val2;
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_AND_REG_VAL: {
-        reg1 = decode_register();
-        value_uint32 = decode_value_uint32();
-        if (debug_mode) printf("AND %s, %u\n", register_string(reg1), value_uint32);
+        reg1 = decode_register(vm);
+        value_uint32 = decode_value_uint32(vm);
+        if (trace) printf("AND %s, %u\n", register_string(reg1), value_uint32);
         if (reg1 != REG_INVALID) {
-            uint32_t val1 = (uint32_t)registers[reg1];
+            uint32_t val1 = (uint32_t)vm->registers[reg1];
             uint32_t val2 = value_uint32;
             uint32_t result = val1 & val2;
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_OR_REG_REG: {
-        reg1 = decode_register();
-        reg2 = decode_register();
-        if (debug_mode) printf("OR %s, %s\n", register_string(reg1), register_string(reg2));
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        if (trace) printf("OR %s, %s\n", register_string(reg1), register_string(reg2));
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            uint32_t val1 = (uint32_t)registers[reg1];
-            uint32_t val2 = (uint32_t)registers[reg2];
+            uint32_t val1 = (uint32_t)vm->registers[reg1];
+            uint32_t val2 = (uint32_t)vm->registers[reg2];
             uint32_t result = val1 | val2;
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_OR_REG_VAL: {
-        reg1 = decode_register();
-        value_uint32 = decode_value_uint32();
-        if (debug_mode) printf("OR %s, %u\n", register_string(reg1), value_uint32);
+        reg1 = decode_register(vm);
+        value_uint32 = decode_value_uint32(vm);
+        if (trace) printf("OR %s, %u\n", register_string(reg1), value_uint32);
         if (reg1 != REG_INVALID) {
-            uint32_t val1 = (uint32_t)registers[reg1];
+            uint32_t val1 = (uint32_t)vm->registers[reg1];
             uint32_t val2 = value_uint32;
             uint32_t result = val1 | val2;
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_XOR_REG_REG: {
-        reg1 = decode_register();
-        reg2 = decode_register();
-        if (debug_mode) printf("XOR %s, %s\n", register_string(reg1), register_string(reg2));
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        if (trace) printf("XOR %s, %s\n", register_string(reg1), register_string(reg2));
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            uint32_t val1 = (uint32_t)registers[reg1];
-            uint32_t val2 = (uint32_t)registers[reg2];
+            uint32_t val1 = (uint32_t)vm->registers[reg1];
+            uint32_t val2 = (uint32_t)vm->registers[reg2];
             uint32_t result = val1 ^ val2;
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_XOR_REG_VAL: {
-        reg1 = decode_register();
-        value_uint32 = decode_value_uint32();
-        if (debug_mode) printf("XOR %s, %u\n", register_string(reg1), value_uint32);
+        reg1 = decode_register(vm);
+        value_uint32 = decode_value_uint32(vm);
+        if (trace) printf("XOR %s, %u\n", register_string(reg1), value_uint32);
         if (reg1 != REG_INVALID) {
-            uint32_t val1 = (uint32_t)registers[reg1];
+            uint32_t val1 = (uint32_t)vm->registers[reg1];
             uint32_t val2 = value_uint32;
             uint32_t result = val1 ^ val2;
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_NOT_REG: {
-        reg1 = decode_register();
-        if (debug_mode) printf("NOT %s\n", register_string(reg1));
+        reg1 = decode_register(vm);
+        if (trace) printf("NOT %s\n", register_string(reg1));
         if (reg1 != REG_INVALID) {
-            uint32_t val1 = (uint32_t)registers[reg1];
+            uint32_t val1 = (uint32_t)vm->registers[reg1];
             uint32_t result = ~val1;
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, 0, opcode);
-            set_overflow_flag_int(result, val1, 0, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, 0, opcode);
+            set_overflow_flag_int(vm, result, val1, 0, opcode);
         }
         break;
     }
     case OP_NEG_REG: {
-        reg1 = decode_register();
-        if (debug_mode) printf("NEG %s\n", register_string(reg1));
+        reg1 = decode_register(vm);
+        if (trace) printf("NEG %s\n", register_string(reg1));
         if (reg1 != REG_INVALID) {
-            int32_t val1 = (int32_t)registers[reg1];
+            int32_t val1 = (int32_t)vm->registers[reg1];
             int32_t result = -val1;
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, 0, opcode);
-            set_overflow_flag_int(result, val1, 0, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, 0, opcode);
+            set_overflow_flag_int(vm, result, val1, 0, opcode);
         }
         break;
     }
     case OP_TEST_REG_REG: {
-        reg1 = decode_register();
-        reg2 = decode_register();
-        if (debug_mode) printf("TEST %s, %s\n", register_string(reg1), register_string(reg2));
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        if (trace) printf("TEST %s, %s\n", register_string(reg1), register_string(reg2));
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            uint32_t val1 = (uint32_t)registers[reg1];
-            uint32_t val2 = (uint32_t)registers[reg2];
+            uint32_t val1 = (uint32_t)vm->registers[reg1];
+            uint32_t val2 = (uint32_t)vm->registers[reg2];
             uint32_t result = val1 & val2;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_TEST_REG_VAL: {
-        reg1 = decode_register();
-        value_uint32 = decode_value_uint32();
-        if (debug_mode) printf("TEST %s, %u\n", register_string(reg1), value_uint32);
+        reg1 = decode_register(vm);
+        value_uint32 = decode_value_uint32(vm);
+        if (trace) printf("TEST %s, %u\n", register_string(reg1), value_uint32);
         if (reg1 != REG_INVALID) {
-            uint32_t val1 = (uint32_t)registers[reg1];
+            uint32_t val1 = (uint32_t)vm->registers[reg1];
             uint32_t val2 = value_uint32;
             uint32_t result = val1 & val2;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_SHL_REG_REG:
     case OP_SHL_REG_VAL: {
         uint32_t val1, val2, result = 0;
-        reg1 = decode_register();
+        reg1 = decode_register(vm);
         if (opcode == OP_SHL_REG_VAL) {
-            value_uint32 = decode_value_uint32();
-            if (debug_mode) printf("SHL %s, %u\n", register_string(reg1), value_uint32);
+            value_uint32 = decode_value_uint32(vm);
+            if (trace) printf("SHL %s, %u\n", register_string(reg1), value_uint32);
         }
         else {
-            reg2 = decode_register();
-            if (debug_mode) printf("SHL %s, %s\n", register_string(reg1), register_string(reg2));
+            reg2 = decode_register(vm);
+            if (trace) printf("SHL %s, %s\n", register_string(reg1), register_string(reg2));
         }
 
         if (reg1 != REG_INVALID) {
-            val1 = (uint32_t)registers[reg1];
-            val2 = (opcode == OP_SHL_REG_VAL) ? value_uint32 : (uint32_t)registers[reg2];
+            val1 = (uint32_t)vm->registers[reg1];
+            val2 = (opcode == OP_SHL_REG_VAL) ? value_uint32 : (uint32_t)vm->registers[reg2];
             result = val1 << (val2 & 0x1F);
 
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_SHR_REG_REG:
     case OP_SHR_REG_VAL: {
         uint32_t val1, val2, result = 0;
-        reg1 = decode_register();
+        reg1 = decode_register(vm);
         if (opcode == OP_SHR_REG_VAL) {
-            value_uint32 = decode_value_uint32();
-            if (debug_mode) printf("SHR %s, %u\n", register_string(reg1), value_uint32);
+            value_uint32 = decode_value_uint32(vm);
+            if (trace) printf("SHR %s, %u\n", register_string(reg1), value_uint32);
         }
         else {
-            reg2 = decode_register();
-            if (debug_mode) printf("SHR %s, %s\n", register_string(reg1), register_string(reg2));
+            reg2 = decode_register(vm);
+            if (trace) printf("SHR %s, %s\n", register_string(reg1), register_string(reg2));
         }
 
         if (reg1 != REG_INVALID) {
-            val1 = (uint32_t)registers[reg1];
-            val2 = (opcode == OP_SHR_REG_VAL) ? value_uint32 : (uint32_t)registers[reg2];
+            val1 = (uint32_t)vm->registers[reg1];
+            val2 = (opcode == OP_SHR_REG_VAL) ? value_uint32 : (uint32_t)vm->registers[reg2];
             result = val1 >> (val2 & 0x1F);
 
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_SAR_REG_REG:
     case OP_SAR_REG_VAL: {
         uint32_t val1, val2, result = 0;
-        reg1 = decode_register();
+        reg1 = decode_register(vm);
         if (opcode == OP_SAR_REG_VAL) {
-            value_uint32 = decode_value_uint32();
-            if (debug_mode) printf("SAR %s, %u\n", register_string(reg1), value_uint32);
+            value_uint32 = decode_value_uint32(vm);
+            if (trace) printf("SAR %s, %u\n", register_string(reg1), value_uint32);
         }
         else {
-            reg2 = decode_register();
-            if (debug_mode) printf("SAR %s, %s\n", register_string(reg1), register_string(reg2));
+            reg2 = decode_register(vm);
+            if (trace) printf("SAR %s, %s\n", register_string(reg1), register_string(reg2));
         }
 
         if (reg1 != REG_INVALID) {
-            val1 = (uint32_t)registers[reg1];
-            val2 = (opcode == OP_SAR_REG_VAL) ? value_uint32 : (uint32_t)registers[reg2];
+            val1 = (uint32_t)vm->registers[reg1];
+            val2 = (opcode == OP_SAR_REG_VAL) ? value_uint32 : (uint32_t)vm->registers[reg2];
             result = (int32_t)val1 >> (val2 & 0x1F);
 
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_ROL_REG_REG:
     case OP_ROL_REG_VAL: {
         uint32_t val1, val2, result = 0;
-        reg1 = decode_register();
+        reg1 = decode_register(vm);
         if (opcode == OP_ROL_REG_VAL) {
-            value_uint32 = decode_value_uint32();
-            if (debug_mode) printf("ROL %s, %u\n", register_string(reg1), value_uint32);
+            value_uint32 = decode_value_uint32(vm);
+            if (trace) printf("ROL %s, %u\n", register_string(reg1), value_uint32);
         }
         else {
-            reg2 = decode_register();
-            if (debug_mode) printf("ROL %s, %s\n", register_string(reg1), register_string(reg2));
+            reg2 = decode_register(vm);
+            if (trace) printf("ROL %s, %s\n", register_string(reg1), register_string(reg2));
         }
 
         if (reg1 != REG_INVALID) {
-            val1 = (uint32_t)registers[reg1];
-            val2 = (opcode == OP_ROL_REG_VAL) ? value_uint32 : (uint32_t)registers[reg2];
+            val1 = (uint32_t)vm->registers[reg1];
+            val2 = (opcode == OP_ROL_REG_VAL) ? value_uint32 : (uint32_t)vm->registers[reg2];
             uint32_t bits = val2 & 0x1F;
             result = (val1 << bits) | (val1 >> (32 - bits));
 
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_ROR_REG_REG:
     case OP_ROR_REG_VAL: {
         uint32_t val1, val2, result = 0;
-        reg1 = decode_register();
+        reg1 = decode_register(vm);
         if (opcode == OP_ROR_REG_VAL) {
-            value_uint32 = decode_value_uint32();
-            if (debug_mode) printf("ROR %s, %u\n", register_string(reg1), value_uint32);
+            value_uint32 = decode_value_uint32(vm);
+            if (trace) printf("ROR %s, %u\n", register_string(reg1), value_uint32);
         }
         else {
-            reg2 = decode_register();
-            if (debug_mode) printf("ROR %s, %s\n", register_string(reg1), register_string(reg2));
+            reg2 = decode_register(vm);
+            if (trace) printf("ROR %s, %s\n", register_string(reg1), register_string(reg2));
         }
 
         if (reg1 != REG_INVALID) {
-            val1 = (uint32_t)registers[reg1];
-            val2 = (opcode == OP_ROR_REG_VAL) ? value_uint32 : (uint32_t)registers[reg2];
+            val1 = (uint32_t)vm->registers[reg1];
+            val2 = (opcode == OP_ROR_REG_VAL) ? value_uint32 : (uint32_t)vm->registers[reg2];
             uint32_t bits = val2 & 0x1F;
             result = (val1 >> bits) | (val1 << (32 - bits));
 
-            registers[reg1] = (double)result;
-            set_zero_flag_int(result);
-            set_sign_flag_int(result);
-            set_carry_flag_int(result, val1, val2, opcode);
-            set_overflow_flag_int(result, val1, val2, opcode);
+            vm->registers[reg1] = (double)result;
+            set_zero_flag_int(vm, result);
+            set_sign_flag_int(vm, result);
+            set_carry_flag_int(vm, result, val1, val2, opcode);
+            set_overflow_flag_int(vm, result, val1, val2, opcode);
         }
         break;
     }
     case OP_CMP_REG_REG:
     case OP_CMP_REG_VAL: {
-        reg1 = decode_register();
+        reg1 = decode_register(vm);
         if (opcode == OP_CMP_REG_VAL) {
-            value_double = decode_value_double();
-            if (debug_mode) printf("CMP %s, %f\n", register_string(reg1), value_double);
+            value_double = decode_value_immediate(vm, immediate);
+            if (trace) printf("CMP %s, %f\n", register_string(reg1), value_double);
         }
         else {
-            reg2 = decode_register();
-            if (debug_mode) printf("CMP %s, %s\n", register_string(reg1), register_string(reg2));
+            reg2 = decode_register(vm);
+            if (trace) printf("CMP %s, %s\n", register_string(reg1), register_string(reg2));
         }
 
         if (reg1 != REG_INVALID) {
-            double val1 = registers[reg1];
-            double val2 = (opcode == OP_CMP_REG_VAL) ? value_double : registers[reg2];
-            set_zero_flag_float(val1 - val2);
-            set_sign_flag_float(val1 - val2);
-            set_carry_flag_float(val1 - val2, val1, val2, opcode);
-            set_overflow_flag_float(val1 - val2, val1, val2, opcode);
+            double val1 = vm->registers[reg1];
+            double val2 = (opcode == OP_CMP_REG_VAL) ? value_double : vm->registers[reg2];
+            set_zero_flag_float(vm, val1 - val2);
+            set_sign_flag_float(vm, val1 - val2);
+            set_carry_flag_float(vm, val1 - val2, val1, val2, opcode);
+            set_overflow_flag_float(vm, val1 - val2, val1, val2, opcode);
         }
         break;
     }
     case OP_IMUL_REG_REG:
     case OP_IDIV_REG_REG: {
-        reg1 = decode_register();
-        reg2 = decode_register();
-        if (opcode == OP_IMUL_REG_REG) if (debug_mode) printf("IMUL %s, %s\n", register_string(reg1), register_string(reg2));
-        else if (debug_mode) printf("IDIV %s, %s\n", register_string(reg1), register_string(reg2));
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        if (trace) printf(opcode == OP_IMUL_REG_REG ? "IMUL %s, %s\n" : "IDIV %s, %s\n", register_string(reg1), register_string(reg2));
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            if (opcode == OP_IMUL_REG_REG) registers[reg1] = (double)((int32_t)registers[reg1] * (int32_t)registers[reg2]);
+            if (opcode == OP_IMUL_REG_REG) vm->registers[reg1] = (double)((int32_t)vm->registers[reg1] * (int32_t)vm->registers[reg2]);
             else if (opcode == OP_IDIV_REG_REG) {
-                if ((int32_t)registers[reg2] != 0) registers[reg1] = (double)((int32_t)registers[reg1] / (int32_t)registers[reg2]);
-                else { printf("Error: Signed division by zero!\n"); running = false; }
+                if ((int32_t)vm->registers[reg2] != 0) vm->registers[reg1] = (double)((int32_t)vm->registers[reg1] / (int32_t)vm->registers[reg2]);
+                else { printf("Error: Signed division by zero!\n"); vm->running = false; }
             }
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
-            set_carry_flag_float(registers[reg1], registers[reg2], 0, opcode);
-            set_overflow_flag_float(registers[reg1], registers[reg2], 0, opcode);
+            set_zero_flag_float(vm, vm->registers[reg1]);
+            set_sign_flag_float(vm, vm->registers[reg1]);
+            set_carry_flag_float(vm, vm->registers[reg1], vm->registers[reg2], 0, opcode);
+            set_overflow_flag_float(vm, vm->registers[reg1], vm->registers[reg2], 0, opcode);
         }
         break;
     }
@@ -1600,25 +2831,22 @@ void execute_instruction(Opcode opcode) {
     case OP_MOVSX_REG_REG:
     case OP_MOVSX_REG_MEM:
     case OP_LEA_REG_MEM: {
-        reg_dest = decode_register();
+        reg_dest = decode_register(vm);
         if (opcode == OP_MOVZX_REG_REG || opcode == OP_MOVSX_REG_REG) {
-            reg_src = decode_register();
-            if (opcode == OP_MOVZX_REG_REG) if (debug_mode) printf("MOVZX %s, %s\n", register_string(reg_dest), register_string(reg_src));
-            else if (debug_mode) printf("MOVSX %s, %s\n", register_string(reg_dest), register_string(reg_src));
+            reg_src = decode_register(vm);
+            if (trace) printf(opcode == OP_MOVZX_REG_REG ? "MOVZX %s, %s\n" : "MOVSX %s, %s\n", register_string(reg_dest), register_string(reg_src));
         }
         else {
-            address = decode_address();
-            if (opcode == OP_MOVZX_REG_MEM) if (debug_mode) printf("MOVZX %s, [%u]\n", register_string(reg_dest), address);
-            else if (debug_mode) printf("MOVSX %s, [%u]\n", register_string(reg_dest), address);
-            else if (debug_mode) printf("LEA %s, [%u]\n", register_string(reg_dest), address);
+            address = decode_address(vm);
+            if (trace) printf(opcode == OP_MOVZX_REG_MEM ? "MOVZX %s, [%u]\n" : opcode == OP_MOVSX_REG_MEM ? "MOVSX %s, [%u]\n" : "LEA %s, [%u]\n", register_string(reg_dest), address);
         }
 
         if (reg_dest != REG_INVALID) {
-            if (opcode == OP_MOVZX_REG_REG) registers[reg_dest] = (double)(uint32_t)registers[reg_src];
-            else if (opcode == OP_MOVZX_REG_MEM && address < MEMORY_SIZE - 4) registers[reg_dest] = (double)*(uint32_t*)&memory[address];
-            else if (opcode == OP_MOVSX_REG_REG) registers[reg_dest] = (double)(int32_t)registers[reg_src];
-            else if (opcode == OP_MOVSX_REG_MEM && address < MEMORY_SIZE - 4) registers[reg_dest] = (double)*(int32_t*)&memory[address];
-            else if (opcode == OP_LEA_REG_MEM) registers[reg_dest] = (double)address;
+            if (opcode == OP_MOVZX_REG_REG) vm->registers[reg_dest] = (double)(uint32_t)vm->registers[reg_src];
+            else if (opcode == OP_MOVZX_REG_MEM && address < vm->memory_size - 4) vm->registers[reg_dest] = (double)*(uint32_t*)&vm->memory[address];
+            else if (opcode == OP_MOVSX_REG_REG) vm->registers[reg_dest] = (double)(int32_t)vm->registers[reg_src];
+            else if (opcode == OP_MOVSX_REG_MEM && address < vm->memory_size - 4) vm->registers[reg_dest] = (double)*(int32_t*)&vm->memory[address];
+            else if (opcode == OP_LEA_REG_MEM) vm->registers[reg_dest] = (double)address;
         }
         break;
     }
@@ -1636,212 +2864,215 @@ void execute_instruction(Opcode opcode) {
     case OP_JMP_G:
     case OP_JMP_L:
     case OP_CALL_ADDR: {
-        address = decode_address();
+        address = decode_address(vm);
         bool jump = false;
-        if (opcode == OP_JMP && debug_mode) printf("JMP %u\n", address);
-        else if (opcode == OP_JMP_NZ && debug_mode) printf("JNZ %u\n", address);
-        else if (opcode == OP_JMP_Z && debug_mode) printf("JZ %u\n", address);
-        else if (opcode == OP_JMP_S && debug_mode) printf("JS %u\n", address);
-        else if (opcode == OP_JMP_NS && debug_mode) printf("JNS %u\n", address);
-        else if (opcode == OP_JMP_C && debug_mode) printf("JC %u\n", address);
-        else if (opcode == OP_JMP_NC && debug_mode) printf("JNC %u\n", address);
-        else if (opcode == OP_JMP_O && debug_mode) printf("JO %u\n", address);
-        else if (opcode == OP_JMP_NO && debug_mode) printf("JNO %u\n", address);
-        else if (opcode == OP_JMP_GE && debug_mode) printf("JGE %u\n", address);
-        else if (opcode == OP_JMP_LE && debug_mode) printf("JLE %u\n", address);
-        else if (opcode == OP_JMP_G && debug_mode) printf("JG %u\n", address);
-        else if (opcode == OP_JMP_L && debug_mode) printf("JL %u\n", address);
-        else if (opcode == OP_CALL_ADDR && debug_mode) printf("CALL %u\n", address);
+        if (opcode == OP_JMP && trace) printf("JMP %u\n", address);
+        else if (opcode == OP_JMP_NZ && trace) printf("JNZ %u\n", address);
+        else if (opcode == OP_JMP_Z && trace) printf("JZ %u\n", address);
+        else if (opcode == OP_JMP_S && trace) printf("JS %u\n", address);
+        else if (opcode == OP_JMP_NS && trace) printf("JNS %u\n", address);
+        else if (opcode == OP_JMP_C && trace) printf("JC %u\n", address);
+        else if (opcode == OP_JMP_NC && trace) printf("JNC %u\n", address);
+        else if (opcode == OP_JMP_O && trace) printf("JO %u\n", address);
+        else if (opcode == OP_JMP_NO && trace) printf("JNO %u\n", address);
+        else if (opcode == OP_JMP_GE && trace) printf("JGE %u\n", address);
+        else if (opcode == OP_JMP_LE && trace) printf("JLE %u\n", address);
+        else if (opcode == OP_JMP_G && trace) printf("JG %u\n", address);
+        else if (opcode == OP_JMP_L && trace) printf("JL %u\n", address);
+        else if (opcode == OP_CALL_ADDR && trace) printf("CALL %u\n", address);
 
         if (opcode == OP_JMP) jump = true;
-        else if (opcode == OP_JMP_NZ && !registers[REG_ZF]) jump = true;
-        else if (opcode == OP_JMP_Z && registers[REG_ZF]) jump = true;
-        else if (opcode == OP_JMP_S && registers[REG_SF]) jump = true;
-        else if (opcode == OP_JMP_NS && !registers[REG_SF]) jump = true;
-        else if (opcode == OP_JMP_C && registers[REG_CF]) jump = true;
-        else if (opcode == OP_JMP_NC && !registers[REG_CF]) jump = true;
-        else if (opcode == OP_JMP_O && registers[REG_OF]) jump = true;
-        else if (opcode == OP_JMP_NO && !registers[REG_OF]) jump = true;
-        else if (opcode == OP_JMP_GE && !(registers[REG_SF])) jump = true;
-        else if (opcode == OP_JMP_LE && (registers[REG_ZF] || registers[REG_SF])) jump = true;
-        else if (opcode == OP_JMP_G && (!(registers[REG_ZF]) && !(registers[REG_SF]))) jump = true;
-        else if (opcode == OP_JMP_L && (!(registers[REG_ZF]) && registers[REG_SF])) jump = true;
-
-        if (jump) program_counter = address;
+        else if (opcode == OP_JMP_NZ && !flag_zero(vm)) jump = true;
+        else if (opcode == OP_JMP_Z && flag_zero(vm)) jump = true;
+        else if (opcode == OP_JMP_S && flag_sign(vm)) jump = true;
+        else if (opcode == OP_JMP_NS && !flag_sign(vm)) jump = true;
+        else if (opcode == OP_JMP_C && flag_carry(vm)) jump = true;
+        else if (opcode == OP_JMP_NC && !flag_carry(vm)) jump = true;
+        else if (opcode == OP_JMP_O && flag_overflow(vm)) jump = true;
+        else if (opcode == OP_JMP_NO && !flag_overflow(vm)) jump = true;
+        else if (opcode == OP_JMP_GE && !flag_sign(vm)) jump = true;
+        else if (opcode == OP_JMP_LE && (flag_zero(vm) || flag_sign(vm))) jump = true;
+        else if (opcode == OP_JMP_G && (!flag_zero(vm) && !flag_sign(vm))) jump = true;
+        else if (opcode == OP_JMP_L && (!flag_zero(vm) && flag_sign(vm))) jump = true;
+
+        if (jump) vm->program_counter = address;
         if (opcode == OP_CALL_ADDR) {
-            registers[REG_SP] -= 8;
-            if ((int32_t)registers[REG_SP] < 0) { printf("Stack Overflow during CALL!\n"); running = false; break; }
-            *(double*)&memory[(uint32_t)registers[REG_SP]] = (double)program_counter;
-            program_counter = address;
+            vm->registers[REG_SP] -= 8;
+            if ((int32_t)vm->registers[REG_SP] < 0) { printf("Stack Overflow during CALL!\n"); vm->running = false; break; }
+            *(double*)&vm->memory[(uint32_t)vm->registers[REG_SP]] = (double)vm->program_counter;
+            decode_cache_invalidate(vm, (uint32_t)vm->registers[REG_SP], 8);
+            vm->program_counter = address;
         }
         break;
     }
     case OP_HLT:
-        if (debug_mode) printf("HLT\n");
-        running = false; break;
+        if (trace) printf("HLT\n");
+        vm->running = false; break;
     case OP_INC_REG:
     case OP_DEC_REG: {
-        reg1 = decode_register();
-        if (opcode == OP_INC_REG) if (debug_mode) printf("INC %s\n", register_string(reg1));
-        else if (debug_mode) printf("DEC %s\n", register_string(reg1));
+        reg1 = decode_register(vm);
+        if (trace) printf(opcode == OP_INC_REG ? "INC %s\n" : "DEC %s\n", register_string(reg1));
         if (reg1 != REG_INVALID) {
-            if (opcode == OP_INC_REG) registers[reg1]++;
-            else registers[reg1]--;
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
-            set_overflow_flag_float(registers[reg1], 0, 0, opcode);
-            set_carry_flag_float(registers[reg1], 0, 0, opcode);
+            if (opcode == OP_INC_REG) vm->registers[reg1]++;
+            else vm->registers[reg1]--;
+            set_zero_flag_float(vm, vm->registers[reg1]);
+            set_sign_flag_float(vm, vm->registers[reg1]);
+            set_overflow_flag_float(vm, vm->registers[reg1], 0, 0, opcode);
+            set_carry_flag_float(vm, vm->registers[reg1], 0, 0, opcode);
         }
         break;
     }
     case OP_INC_MEM:
     case OP_DEC_MEM: {
-        address = decode_address();
-        if (opcode == OP_INC_MEM) if (debug_mode) printf("INC [%u]\n", address);
-        else if (debug_mode) printf("DEC [%u]\n", address);
-        if (address < MEMORY_SIZE - 8) {
-            double val = *(double*)&memory[address];
+        address = decode_address(vm);
+        if (trace) printf(opcode == OP_INC_MEM ? "INC [%u]\n" : "DEC [%u]\n", address);
+        if (address < vm->memory_size - 8) {
+            double val = *(double*)&vm->memory[address];
             if (opcode == OP_INC_MEM) val++;
             else val--;
-            *(double*)&memory[address] = val;
+            *(double*)&vm->memory[address] = val;
+            decode_cache_invalidate(vm, address, 8);
         }
         break;
     }
     case OP_RND_REG: {
-        reg1 = decode_register();
-        if (debug_mode) printf("RND %s\n", register_string(reg1));
-        if (reg1 != REG_INVALID) registers[reg1] = (double)rand();
+        reg1 = decode_register(vm);
+        if (trace) printf("RND %s\n", register_string(reg1));
+        if (reg1 != REG_INVALID) vm->registers[reg1] = (double)rand();
         break;
     }
     case OP_PUSH_REG: {
-        reg1 = decode_register();
-        if (debug_mode) printf("PUSH %s\n", register_string(reg1));
+        reg1 = decode_register(vm);
+        if (trace) printf("PUSH %s\n", register_string(reg1));
         if (reg1 != REG_INVALID) {
-            registers[REG_SP] -= 8;
-            if ((int32_t)registers[REG_SP] < 0) { printf("Stack Overflow!\n"); running = false; break; }
-            *(double*)&memory[(uint32_t)registers[REG_SP]] = registers[reg1];
+            vm->registers[REG_SP] -= 8;
+            if ((int32_t)vm->registers[REG_SP] < 0) { printf("Stack Overflow!\n"); vm->running = false; break; }
+            *(double*)&vm->memory[(uint32_t)vm->registers[REG_SP]] = vm->registers[reg1];
+            decode_cache_invalidate(vm, (uint32_t)vm->registers[REG_SP], 8);
         }
         break;
     }
     case OP_POP_REG: {
-        reg1 = decode_register();
-        if (debug_mode) printf("POP %s\n", register_string(reg1));
+        reg1 = decode_register(vm);
+        if (trace) printf("POP %s\n", register_string(reg1));
         if (reg1 != REG_INVALID) {
-            if ((uint32_t)registers[REG_SP] >= MEMORY_SIZE) { printf("Stack Underflow!\n"); running = false; break; }
-            registers[reg1] = *(double*)&memory[(uint32_t)registers[REG_SP]];
-            registers[REG_SP] += 8;
+            if ((uint32_t)vm->registers[REG_SP] >= vm->memory_size) { printf("Stack Underflow!\n"); vm->running = false; break; }
+            vm->registers[reg1] = *(double*)&vm->memory[(uint32_t)vm->registers[REG_SP]];
+            vm->registers[REG_SP] += 8;
         }
         break;
     }
     case OP_RET: {
-        if (debug_mode) printf("RET\n");
-        if ((uint32_t)registers[REG_SP] >= MEMORY_SIZE) { printf("Stack Underflow during RET!\n"); running = false; break; }
-        program_counter = (uint32_t) * (double*)&memory[(uint32_t)registers[REG_SP]];
-        registers[REG_SP] += 8;
+        if (trace) printf("RET\n");
+        if ((uint32_t)vm->registers[REG_SP] >= vm->memory_size) { printf("Stack Underflow during RET!\n"); vm->running = false; break; }
+        vm->program_counter = (uint32_t) * (double*)&vm->memory[(uint32_t)vm->registers[REG_SP]];
+        vm->registers[REG_SP] += 8;
         break;
     }
     case OP_XCHG_REG_REG: {
-        reg1 = decode_register();
-        reg2 = decode_register();
-        if (debug_mode) printf("XCHG %s, %s\n", register_string(reg1), register_string(reg2));
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        if (trace) printf("XCHG %s, %s\n", register_string(reg1), register_string(reg2));
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            double temp = registers[reg1];
-            registers[reg1] = registers[reg2];
-            registers[reg2] = temp;
+            double temp = vm->registers[reg1];
+            vm->registers[reg1] = vm->registers[reg2];
+            vm->registers[reg2] = temp;
         }
         break;
     }
     case OP_BSWAP_REG: {
-        reg1 = decode_register();
-        if (debug_mode) printf("BSWAP %s\n", register_string(reg1));
+        reg1 = decode_register(vm);
+        if (trace) printf("BSWAP %s\n", register_string(reg1));
         if (reg1 != REG_INVALID) {
-            uint32_t val = (uint32_t)registers[reg1];
+            uint32_t val = (uint32_t)vm->registers[reg1];
             uint32_t bswap_val = ((val >> 24) & 0x000000FF) | ((val >> 8) & 0x0000FF00) | ((val << 8) & 0x00FF0000) | ((val << 24) & 0xFF000000);
-            registers[reg1] = (double)bswap_val;
+            vm->registers[reg1] = (double)bswap_val;
         }
         break;
     }
     case OP_SETZ_REG:
     case OP_SETNZ_REG: {
-        reg1 = decode_register();
-        if (opcode == OP_SETZ_REG) if (debug_mode) printf("SETZ %s\n", register_string(reg1));
-        else if (debug_mode) printf("SETNZ %s\n", register_string(reg1));
+        reg1 = decode_register(vm);
+        if (trace) printf(opcode == OP_SETZ_REG ? "SETZ %s\n" : "SETNZ %s\n", register_string(reg1));
         if (reg1 != REG_INVALID) {
-            registers[reg1] = (opcode == OP_SETZ_REG) ? registers[REG_ZF] : !registers[REG_ZF];
+            vm->registers[reg1] = (opcode == OP_SETZ_REG) ? flag_zero(vm) : !flag_zero(vm);
         }
         break;
     }
     case OP_PUSHA:
-        if (debug_mode) printf("PUSHA\n");
+        if (trace) printf("PUSHA\n");
         for (int i = 0; i < NUM_GENERAL_REGISTERS; i++) {
-            registers[REG_SP] -= 8;
-            if ((int32_t)registers[REG_SP] < 0) { printf("Stack Overflow during PUSHA!\n"); running = false; return; }
-            *(double*)&memory[(uint32_t)registers[REG_SP]] = registers[i];
+            vm->registers[REG_SP] -= 8;
+            if ((int32_t)vm->registers[REG_SP] < 0) { printf("Stack Overflow during PUSHA!\n"); vm->running = false; return; }
+            *(double*)&vm->memory[(uint32_t)vm->registers[REG_SP]] = vm->registers[i];
+            decode_cache_invalidate(vm, (uint32_t)vm->registers[REG_SP], 8);
         }
         break;
     case OP_POPA:
-        if (debug_mode) printf("POPA\n");
+        if (trace) printf("POPA\n");
         for (int i = NUM_GENERAL_REGISTERS - 1; i >= 0; i--) {
-            if ((uint32_t)registers[REG_SP] >= MEMORY_SIZE) { printf("Stack Underflow during POPA!\n"); running = false; return; }
-            registers[i] = *(double*)&memory[(uint32_t)registers[REG_SP]];
-            registers[REG_SP] += 8;
+            if ((uint32_t)vm->registers[REG_SP] >= vm->memory_size) { printf("Stack Underflow during POPA!\n"); vm->running = false; return; }
+            vm->registers[i] = *(double*)&vm->memory[(uint32_t)vm->registers[REG_SP]];
+            vm->registers[REG_SP] += 8;
         }
         break;
     case OP_PUSHFD:
-        if (debug_mode) printf("PUSHFD\n");
-        registers[REG_SP] -= 8;
-        if ((int32_t)registers[REG_SP] < 0) { printf("Stack Overflow during PUSHFD!\n"); running = false; return; }
+        if (trace) printf("PUSHFD\n");
+        vm->registers[REG_SP] -= 8;
+        if ((int32_t)vm->registers[REG_SP] < 0) { printf("Stack Overflow during PUSHFD!\n"); vm->running = false; return; }
         uint32_t flags = 0;
-        if (registers[REG_ZF]) flags |= 1;
-        if (registers[REG_SF]) flags |= 2;
-        if (registers[REG_CF]) flags |= 4;
-        if (registers[REG_OF]) flags |= 8;
-        *(double*)&memory[(uint32_t)registers[REG_SP]] = (double)flags;
+        if (flag_zero(vm)) flags |= 1;
+        if (flag_sign(vm)) flags |= 2;
+        if (flag_carry(vm)) flags |= 4;
+        if (flag_overflow(vm)) flags |= 8;
+        *(double*)&vm->memory[(uint32_t)vm->registers[REG_SP]] = (double)flags;
+        decode_cache_invalidate(vm, (uint32_t)vm->registers[REG_SP], 8);
         break;
     case OP_POPFD:
-        if (debug_mode) printf("POPFD\n");
-        if ((uint32_t)registers[REG_SP] >= MEMORY_SIZE) { printf("Stack Underflow during POPFD!\n"); running = false; return; }
-        flags = (uint32_t) * (double*)&memory[(uint32_t)registers[REG_SP]];
-        registers[REG_SP] += 8;
-        registers[REG_ZF] = (flags & 1) != 0;
-        registers[REG_SF] = (flags & 2) != 0;
-        registers[REG_CF] = (flags & 4) != 0;
-        registers[REG_OF] = (flags & 8) != 0;
+        if (trace) printf("POPFD\n");
+        if ((uint32_t)vm->registers[REG_SP] >= vm->memory_size) { printf("Stack Underflow during POPFD!\n"); vm->running = false; return; }
+        flags = (uint32_t) * (double*)&vm->memory[(uint32_t)vm->registers[REG_SP]];
+        vm->registers[REG_SP] += 8;
+        vm->flags_pending = false;
+        vm->registers[REG_ZF] = (flags & 1) != 0;
+        vm->registers[REG_SF] = (flags & 2) != 0;
+        vm->registers[REG_CF] = (flags & 4) != 0;
+        vm->registers[REG_OF] = (flags & 8) != 0;
         break;
 
         // Math Standard Library Implementation
     case OP_MATH_ADD: case OP_MATH_SUB: case OP_MATH_MUL: case OP_MATH_DIV: case OP_MATH_MOD:
     case OP_MATH_POW: case OP_MATH_MIN: case OP_MATH_MAX: case OP_MATH_ATAN2:
     {
-        reg1 = decode_register();
-        reg2 = decode_register();
-        if (opcode == OP_MATH_ADD && debug_mode) printf("math.add %s, %s\n", register_string(reg1), register_string(reg2));
-        else if (opcode == OP_MATH_SUB && debug_mode) printf("math.sub %s, %s\n", register_string(reg1), register_string(reg2));
-        else if (opcode == OP_MATH_MUL && debug_mode) printf("math.mul %s, %s\n", register_string(reg1), register_string(reg2));
-        else if (opcode == OP_MATH_DIV && debug_mode) printf("math.div %s, %s\n", register_string(reg1), register_string(reg2));
-        else if (opcode == OP_MATH_MOD && debug_mode) printf("math.mod %s, %s\n", register_string(reg1), register_string(reg2));
-        else if (opcode == OP_MATH_POW && debug_mode) printf("math.pow %s, %s\n", register_string(reg1), register_string(reg2));
-        else if (opcode == OP_MATH_MIN && debug_mode) printf("math.min %s, %s\n", register_string(reg1), register_string(reg2));
-        else if (opcode == OP_MATH_MAX && debug_mode) printf("math.max %s, %s\n", register_string(reg1), register_string(reg2));
-        else if (opcode == OP_MATH_ATAN2 && debug_mode) printf("math.atan2 %s, %s\n", register_string(reg1), register_string(reg2));
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        if (opcode == OP_MATH_ADD && trace) printf("math.add %s, %s\n", register_string(reg1), register_string(reg2));
+        else if (opcode == OP_MATH_SUB && trace) printf("math.sub %s, %s\n", register_string(reg1), register_string(reg2));
+        else if (opcode == OP_MATH_MUL && trace) printf("math.mul %s, %s\n", register_string(reg1), register_string(reg2));
+        else if (opcode == OP_MATH_DIV && trace) printf("math.div %s, %s\n", register_string(reg1), register_string(reg2));
+        else if (opcode == OP_MATH_MOD && trace) printf("math.mod %s, %s\n", register_string(reg1), register_string(reg2));
+        else if (opcode == OP_MATH_POW && trace) printf("math.pow %s, %s\n", register_string(reg1), register_string(reg2));
+        else if (opcode == OP_MATH_MIN && trace) printf("math.min %s, %s\n", register_string(reg1), register_string(reg2));
+        else if (opcode == OP_MATH_MAX && trace) printf("math.max %s, %s\n", register_string(reg1), register_string(reg2));
+        else if (opcode == OP_MATH_ATAN2 && trace) printf("math.atan2 %s, %s\n", register_string(reg1), register_string(reg2));
 
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
             double result = 0;
-            if (opcode == OP_MATH_ADD) result = registers[reg1] + registers[reg2];
-            else if (opcode == OP_MATH_SUB) result = registers[reg1] - registers[reg2];
-            else if (opcode == OP_MATH_MUL) result = registers[reg1] * registers[reg2];
-            else if (opcode == OP_MATH_DIV) { if (fabs(registers[reg2]) > 1e-9) result = registers[reg1] / registers[reg2]; else { printf("Math Error: Division by zero!\n"); running = false; break; } }
-            else if (opcode == OP_MATH_MOD) { if (fabs(registers[reg2]) > 1e-9) result = fmod(registers[reg1], registers[reg2]); else { printf("Math Error: Modulo by zero!\n"); running = false; break; } }
-            else if (opcode == OP_MATH_POW) result = pow(registers[reg1], registers[reg2]);
-            else if (opcode == OP_MATH_MIN) result = (registers[reg1] < registers[reg2]) ? registers[reg1] : registers[reg2];
-            else if (opcode == OP_MATH_MAX) result = (registers[reg1] > registers[reg2]) ? registers[reg1] : registers[reg2];
-            else if (opcode == OP_MATH_ATAN2) result = atan2(registers[reg1], registers[reg2]);
-
-            set_carry_flag_float(result, registers[reg1], registers[reg2], opcode);
-            set_overflow_flag_float(result, registers[reg1], registers[reg2], opcode);
-            registers[reg1] = result;
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
+            if (opcode == OP_MATH_ADD) result = vm->registers[reg1] + vm->registers[reg2];
+            else if (opcode == OP_MATH_SUB) result = vm->registers[reg1] - vm->registers[reg2];
+            else if (opcode == OP_MATH_MUL) result = vm->registers[reg1] * vm->registers[reg2];
+            else if (opcode == OP_MATH_DIV) { if (fabs(vm->registers[reg2]) > 1e-9) result = vm->registers[reg1] / vm->registers[reg2]; else { printf("Math Error: Division by zero!\n"); vm->running = false; break; } }
+            else if (opcode == OP_MATH_MOD) { if (fabs(vm->registers[reg2]) > 1e-9) result = fmod(vm->registers[reg1], vm->registers[reg2]); else { printf("Math Error: Modulo by zero!\n"); vm->running = false; break; } }
+            else if (opcode == OP_MATH_POW) result = pow(vm->registers[reg1], vm->registers[reg2]);
+            else if (opcode == OP_MATH_MIN) result = (vm->registers[reg1] < vm->registers[reg2]) ? vm->registers[reg1] : vm->registers[reg2];
+            else if (opcode == OP_MATH_MAX) result = (vm->registers[reg1] > vm->registers[reg2]) ? vm->registers[reg1] : vm->registers[reg2];
+            else if (opcode == OP_MATH_ATAN2) result = atan2(vm->registers[reg1], vm->registers[reg2]);
+
+            set_carry_flag_float(vm, result, vm->registers[reg1], vm->registers[reg2], opcode);
+            set_overflow_flag_float(vm, result, vm->registers[reg1], vm->registers[reg2], opcode);
+            vm->registers[reg1] = result;
+            set_zero_flag_float(vm, vm->registers[reg1]);
+            set_sign_flag_float(vm, vm->registers[reg1]);
         }
         break;
     }
@@ -1850,116 +3081,116 @@ void execute_instruction(Opcode opcode) {
     case OP_MATH_FLOOR: case OP_MATH_CEIL: case OP_MATH_ROUND: case OP_MATH_NEG: case OP_MATH_LOG10:
     case OP_MATH_CLAMP: case OP_MATH_LERP:
     {
-        reg1 = decode_register();
+        reg1 = decode_register(vm);
         if (opcode == OP_MATH_CLAMP) {
-            reg2 = decode_register();
-            reg3 = decode_register();
-            if (debug_mode) printf("math.clamp %s, %s, %s\n", register_string(reg1), register_string(reg2), register_string(reg3));
+            reg2 = decode_register(vm);
+            reg3 = decode_register(vm);
+            if (trace) printf("math.clamp %s, %s, %s\n", register_string(reg1), register_string(reg2), register_string(reg3));
             if (reg1 != REG_INVALID && reg2 != REG_INVALID && reg3 != REG_INVALID) {
-                registers[reg1] = fmax(registers[reg2], fmin(registers[reg1], registers[reg3]));
+                vm->registers[reg1] = fmax(vm->registers[reg2], fmin(vm->registers[reg1], vm->registers[reg3]));
             }
             break;
         }
         else if (opcode == OP_MATH_LERP) {
-            reg2 = decode_register();
-            reg3 = decode_register();
-            RegisterIndex reg4 = decode_register();
-            if (debug_mode) printf("math.lerp %s, %s, %s, %s\n", register_string(reg1), register_string(reg2), register_string(reg3), register_string(reg4));
+            reg2 = decode_register(vm);
+            reg3 = decode_register(vm);
+            RegisterIndex reg4 = decode_register(vm);
+            if (trace) printf("math.lerp %s, %s, %s, %s\n", register_string(reg1), register_string(reg2), register_string(reg3), register_string(reg4));
             if (reg1 != REG_INVALID && reg2 != REG_INVALID && reg3 != REG_INVALID && reg4 != REG_INVALID) {
-                registers[reg1] = registers[reg2] + (registers[reg3] - registers[reg2]) * registers[reg4];
+                vm->registers[reg1] = vm->registers[reg2] + (vm->registers[reg3] - vm->registers[reg2]) * vm->registers[reg4];
             }
             break;
         }
 
         if (reg1 != REG_INVALID) {
             double result = 0;
-            if (opcode == OP_MATH_ABS && debug_mode) {
-                printf("math.abs %s\n", register_string(reg1));
-                result = fabs(registers[reg1]);
-            }
-            else if (opcode == OP_MATH_SIN && debug_mode) {
-                printf("math.sin %s\n", register_string(reg1));
-                result = sin(registers[reg1]);
-            }
-            else if (opcode == OP_MATH_COS && debug_mode) {
-                printf("math.cos %s\n", register_string(reg1));
-                result = cos(registers[reg1]);
-            }
-            else if (opcode == OP_MATH_TAN && debug_mode) {
-                printf("math.tan %s\n", register_string(reg1));
-                result = tan(registers[reg1]);
-            }
-            else if (opcode == OP_MATH_ASIN && debug_mode) {
-                printf("math.asin %s\n", register_string(reg1));
-                result = asin(registers[reg1]);
-            }
-            else if (opcode == OP_MATH_ACOS && debug_mode) {
-                printf("math.acos %s\n", register_string(reg1));
-                result = acos(registers[reg1]);
-            }
-            else if (opcode == OP_MATH_ATAN && debug_mode) {
-                printf("math.atan %s\n", register_string(reg1));
-                result = atan(registers[reg1]);
-            }
-            else if (opcode == OP_MATH_SQRT && debug_mode) {
-                printf("math.sqrt %s\n", register_string(reg1));
-                if (registers[reg1] >= 0) {
-                    result = sqrt(registers[reg1]);
+            if (opcode == OP_MATH_ABS) {
+                if (trace) printf("math.abs %s\n", register_string(reg1));
+                result = fabs(vm->registers[reg1]);
+            }
+            else if (opcode == OP_MATH_SIN) {
+                if (trace) printf("math.sin %s\n", register_string(reg1));
+                result = sin(vm->registers[reg1]);
+            }
+            else if (opcode == OP_MATH_COS) {
+                if (trace) printf("math.cos %s\n", register_string(reg1));
+                result = cos(vm->registers[reg1]);
+            }
+            else if (opcode == OP_MATH_TAN) {
+                if (trace) printf("math.tan %s\n", register_string(reg1));
+                result = tan(vm->registers[reg1]);
+            }
+            else if (opcode == OP_MATH_ASIN) {
+                if (trace) printf("math.asin %s\n", register_string(reg1));
+                result = asin(vm->registers[reg1]);
+            }
+            else if (opcode == OP_MATH_ACOS) {
+                if (trace) printf("math.acos %s\n", register_string(reg1));
+                result = acos(vm->registers[reg1]);
+            }
+            else if (opcode == OP_MATH_ATAN) {
+                if (trace) printf("math.atan %s\n", register_string(reg1));
+                result = atan(vm->registers[reg1]);
+            }
+            else if (opcode == OP_MATH_SQRT) {
+                if (trace) printf("math.sqrt %s\n", register_string(reg1));
+                if (vm->registers[reg1] >= 0) {
+                    result = sqrt(vm->registers[reg1]);
                 }
                 else {
                     printf("Math Error: Sqrt of negative!\n");
-                    running = false;
+                    vm->running = false;
                     break;
                 }
             }
-            else if (opcode == OP_MATH_LOG && debug_mode) {
-                printf("math.log %s\n", register_string(reg1));
-                if (registers[reg1] > 0) {
-                    result = log(registers[reg1]);
+            else if (opcode == OP_MATH_LOG) {
+                if (trace) printf("math.log %s\n", register_string(reg1));
+                if (vm->registers[reg1] > 0) {
+                    result = log(vm->registers[reg1]);
                 }
                 else {
                     printf("Math Error: Log of non-positive!\n");
-                    running = false;
+                    vm->running = false;
                     break;
                 }
             }
-            else if (opcode == OP_MATH_EXP && debug_mode) {
-                printf("math.exp %s\n", register_string(reg1));
-                result = exp(registers[reg1]);
+            else if (opcode == OP_MATH_EXP) {
+                if (trace) printf("math.exp %s\n", register_string(reg1));
+                result = exp(vm->registers[reg1]);
             }
-            else if (opcode == OP_MATH_FLOOR && debug_mode) {
-                printf("math.floor %s\n", register_string(reg1));
-                result = floor(registers[reg1]);
+            else if (opcode == OP_MATH_FLOOR) {
+                if (trace) printf("math.floor %s\n", register_string(reg1));
+                result = floor(vm->registers[reg1]);
             }
-            else if (opcode == OP_MATH_CEIL && debug_mode) {
-                printf("math.ceil %s\n", register_string(reg1));
-                result = ceil(registers[reg1]);
+            else if (opcode == OP_MATH_CEIL) {
+                if (trace) printf("math.ceil %s\n", register_string(reg1));
+                result = ceil(vm->registers[reg1]);
             }
-            else if (opcode == OP_MATH_ROUND && debug_mode) {
-                printf("math.round %s\n", register_string(reg1));
-                result = round(registers[reg1]);
+            else if (opcode == OP_MATH_ROUND) {
+                if (trace) printf("math.round %s\n", register_string(reg1));
+                result = round(vm->registers[reg1]);
             }
-            else if (opcode == OP_MATH_NEG && debug_mode) {
-                printf("math.neg %s\n", register_string(reg1));
-                result = -registers[reg1];
+            else if (opcode == OP_MATH_NEG) {
+                if (trace) printf("math.neg %s\n", register_string(reg1));
+                result = -vm->registers[reg1];
             }
-            else if (opcode == OP_MATH_LOG10 && debug_mode) {
-                printf("math.log10 %s\n", register_string(reg1));
-                if (registers[reg1] > 0) {
-                    result = log10(registers[reg1]);
+            else if (opcode == OP_MATH_LOG10) {
+                if (trace) printf("math.log10 %s\n", register_string(reg1));
+                if (vm->registers[reg1] > 0) {
+                    result = log10(vm->registers[reg1]);
                 }
                 else {
                     printf("Math Error: Log10 of non-positive!\n");
-                    running = false;
+                    vm->running = false;
                     break;
                 }
             }
 
-            set_carry_flag_float(result, registers[reg1], 0, opcode);
-            set_overflow_flag_float(result, registers[reg1], 0, opcode);
-            registers[reg1] = result;
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
+            set_carry_flag_float(vm, result, vm->registers[reg1], 0, opcode);
+            set_overflow_flag_float(vm, result, vm->registers[reg1], 0, opcode);
+            vm->registers[reg1] = result;
+            set_zero_flag_float(vm, vm->registers[reg1]);
+            set_sign_flag_float(vm, vm->registers[reg1]);
         }
         break;
     }
@@ -1971,100 +3202,113 @@ void execute_instruction(Opcode opcode) {
     case OP_STR_SUBSTR_MEM_MEM_REG_REG: case OP_STR_FMT_MEM_MEM_REG_REG:
     {
         if (opcode == OP_STR_LEN_REG_MEM) {
-            reg1 = decode_register(); address = decode_address();
-            if (debug_mode) printf("str.len %s, [%u]\n", register_string(reg1), address);
-            if (reg1 != REG_INVALID && address < MEMORY_SIZE) registers[reg1] = (double)strlen((char*)&memory[address]);
+            reg1 = decode_register(vm); address = decode_address(vm);
+            if (trace) printf("str.len %s, [%u]\n", register_string(reg1), address);
+            if (reg1 != REG_INVALID && address < vm->memory_size) vm->registers[reg1] = (double)strlen((char*)&vm->memory[address]);
         }
         else if (opcode == OP_STR_CPY_MEM_MEM) {
-            uint32_t dest_addr = decode_address(); uint32_t src_addr = decode_address();
-            if (debug_mode) printf("str.cpy [%u], [%u]\n", dest_addr, src_addr);
-            if (dest_addr < MEMORY_SIZE && src_addr < MEMORY_SIZE) strcpy((char*)&memory[dest_addr], (char*)&memory[src_addr]);
+            uint32_t dest_addr = decode_address(vm); uint32_t src_addr = decode_address(vm);
+            if (trace) printf("str.cpy [%u], [%u]\n", dest_addr, src_addr);
+            if (dest_addr < vm->memory_size && src_addr < vm->memory_size) {
+                strcpy((char*)&vm->memory[dest_addr], (char*)&vm->memory[src_addr]);
+                decode_cache_invalidate(vm, dest_addr, (uint32_t)strlen((char*)&vm->memory[dest_addr]) + 1);
+            }
         }
         else if (opcode == OP_STR_CAT_MEM_MEM) {
-            uint32_t dest_addr = decode_address(); uint32_t src_addr = decode_address();
-            if (debug_mode) printf("str.cat [%u], [%u]\n", dest_addr, src_addr);
-            if (dest_addr < MEMORY_SIZE && src_addr < MEMORY_SIZE) strcat((char*)&memory[dest_addr], (char*)&memory[src_addr]);
+            uint32_t dest_addr = decode_address(vm); uint32_t src_addr = decode_address(vm);
+            if (trace) printf("str.cat [%u], [%u]\n", dest_addr, src_addr);
+            if (dest_addr < vm->memory_size && src_addr < vm->memory_size) {
+                strcat((char*)&vm->memory[dest_addr], (char*)&vm->memory[src_addr]);
+                decode_cache_invalidate(vm, dest_addr, (uint32_t)strlen((char*)&vm->memory[dest_addr]) + 1);
+            }
         }
         else if (opcode == OP_STR_CMP_REG_MEM_MEM) {
-            reg1 = decode_register(); uint32_t addr1 = decode_address(); uint32_t addr2 = decode_address();
-            if (debug_mode) printf("str.cmp %s, [%u], [%u]\n", register_string(reg1), addr1, addr2);
-            if (reg1 != REG_INVALID && addr1 < MEMORY_SIZE && addr2 < MEMORY_SIZE) registers[reg1] = (double)strcmp((char*)&memory[addr1], (char*)&memory[addr2]);
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
+            reg1 = decode_register(vm); uint32_t addr1 = decode_address(vm); uint32_t addr2 = decode_address(vm);
+            if (trace) printf("str.cmp %s, [%u], [%u]\n", register_string(reg1), addr1, addr2);
+            if (reg1 != REG_INVALID && addr1 < vm->memory_size && addr2 < vm->memory_size) vm->registers[reg1] = (double)strcmp((char*)&vm->memory[addr1], (char*)&vm->memory[addr2]);
+            set_zero_sign_flags_float(vm, vm->registers[reg1]);
         }
         else if (opcode == OP_STR_NCPY_MEM_MEM_REG) {
-            uint32_t dest_addr = decode_address(); uint32_t src_addr = decode_address(); reg1 = decode_register();
-            if (debug_mode) printf("str.ncpy [%u], [%u], %s\n", dest_addr, src_addr, register_string(reg1));
-            if (dest_addr < MEMORY_SIZE && src_addr < MEMORY_SIZE && reg1 != REG_INVALID) strncpy((char*)&memory[dest_addr], (char*)&memory[src_addr], (uint32_t)registers[reg1]);
+            uint32_t dest_addr = decode_address(vm); uint32_t src_addr = decode_address(vm); reg1 = decode_register(vm);
+            if (trace) printf("str.ncpy [%u], [%u], %s\n", dest_addr, src_addr, register_string(reg1));
+            if (dest_addr < vm->memory_size && src_addr < vm->memory_size && reg1 != REG_INVALID) {
+                strncpy((char*)&vm->memory[dest_addr], (char*)&vm->memory[src_addr], (uint32_t)vm->registers[reg1]);
+                decode_cache_invalidate(vm, dest_addr, (uint32_t)vm->registers[reg1]);
+            }
         }
         else if (opcode == OP_STR_NCAT_MEM_MEM_REG) {
-            uint32_t dest_addr = decode_address(); uint32_t src_addr = decode_address(); reg1 = decode_register();
-            if (debug_mode) printf("str.ncat [%u], [%u], %s\n", dest_addr, src_addr, register_string(reg1));
-            if (dest_addr < MEMORY_SIZE && src_addr < MEMORY_SIZE && reg1 != REG_INVALID) strncat((char*)&memory[dest_addr], (char*)&memory[src_addr], (uint32_t)registers[reg1]);
+            uint32_t dest_addr = decode_address(vm); uint32_t src_addr = decode_address(vm); reg1 = decode_register(vm);
+            if (trace) printf("str.ncat [%u], [%u], %s\n", dest_addr, src_addr, register_string(reg1));
+            if (dest_addr < vm->memory_size && src_addr < vm->memory_size && reg1 != REG_INVALID) {
+                strncat((char*)&vm->memory[dest_addr], (char*)&vm->memory[src_addr], (uint32_t)vm->registers[reg1]);
+                decode_cache_invalidate(vm, dest_addr, (uint32_t)strlen((char*)&vm->memory[dest_addr]) + 1);
+            }
         }
         else if (opcode == OP_STR_TOUPPER_MEM) {
-            address = decode_address(); if (debug_mode) printf("str.toupper [%u]\n", address); if (address < MEMORY_SIZE) { char* str = (char*)&memory[address]; while (*str) { *str = toupper((unsigned char)*str); str++; } }
+            address = decode_address(vm); if (trace) printf("str.toupper [%u]\n", address); if (address < vm->memory_size) { char* str = (char*)&vm->memory[address]; while (*str) { *str = toupper((unsigned char)*str); str++; } decode_cache_invalidate(vm, address, (uint32_t)(str - (char*)&vm->memory[address])); }
         }
         else if (opcode == OP_STR_TOLOWER_MEM) {
-            address = decode_address(); if (debug_mode) printf("str.tolower [%u]\n", address); if (address < MEMORY_SIZE) { char* str = (char*)&memory[address]; while (*str) { *str = tolower((unsigned char)*str); str++; } }
+            address = decode_address(vm); if (trace) printf("str.tolower [%u]\n", address); if (address < vm->memory_size) { char* str = (char*)&vm->memory[address]; while (*str) { *str = tolower((unsigned char)*str); str++; } decode_cache_invalidate(vm, address, (uint32_t)(str - (char*)&vm->memory[address])); }
         }
         else if (opcode == OP_STR_CHR_REG_MEM_VAL) {
-            reg1 = decode_register(); address = decode_address(); value_uint32 = decode_value_uint32();
-            if (debug_mode) printf("str.chr %s, [%u], %u\n", register_string(reg1), address, value_uint32);
-            if (reg1 != REG_INVALID && address < MEMORY_SIZE) { char* res = strchr((char*)&memory[address], (char)value_uint32); registers[reg1] = (double)(res ? res - (char*)&memory[address] : -1); }
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
+            reg1 = decode_register(vm); address = decode_address(vm); value_uint32 = decode_value_uint32(vm);
+            if (trace) printf("str.chr %s, [%u], %u\n", register_string(reg1), address, value_uint32);
+            if (reg1 != REG_INVALID && address < vm->memory_size) { char* res = strchr((char*)&vm->memory[address], (char)value_uint32); vm->registers[reg1] = (double)(res ? res - (char*)&vm->memory[address] : -1); }
+            set_zero_sign_flags_float(vm, vm->registers[reg1]);
         }
         else if (opcode == OP_STR_STR_REG_MEM_MEM) {
-            reg1 = decode_register(); uint32_t addr1 = decode_address(); uint32_t addr2 = decode_address();
-            if (debug_mode) printf("str.str %s, [%u], [%u]\n", register_string(reg1), addr1, addr2);
-            if (reg1 != REG_INVALID && addr1 < MEMORY_SIZE && addr2 < MEMORY_SIZE) { char* res = strstr((char*)&memory[addr1], (char*)&memory[addr2]); registers[reg1] = (double)(res ? res - (char*)&memory[addr1] : -1); }
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
+            reg1 = decode_register(vm); uint32_t addr1 = decode_address(vm); uint32_t addr2 = decode_address(vm);
+            if (trace) printf("str.str %s, [%u], [%u]\n", register_string(reg1), addr1, addr2);
+            if (reg1 != REG_INVALID && addr1 < vm->memory_size && addr2 < vm->memory_size) { char* res = strstr((char*)&vm->memory[addr1], (char*)&vm->memory[addr2]); vm->registers[reg1] = (double)(res ? res - (char*)&vm->memory[addr1] : -1); }
+            set_zero_sign_flags_float(vm, vm->registers[reg1]);
         }
         else if (opcode == OP_STR_ATOI_REG_MEM) {
-            reg1 = decode_register(); address = decode_address();
-            if (debug_mode) printf("str.atoi %s, [%u]\n", register_string(reg1), address);
-            if (reg1 != REG_INVALID && address < MEMORY_SIZE) registers[reg1] = (double)atoi((char*)&memory[address]);
-            set_zero_flag_float(registers[reg1]);
-            set_sign_flag_float(registers[reg1]);
+            reg1 = decode_register(vm); address = decode_address(vm);
+            if (trace) printf("str.atoi %s, [%u]\n", register_string(reg1), address);
+            if (reg1 != REG_INVALID && address < vm->memory_size) vm->registers[reg1] = (double)atoi((char*)&vm->memory[address]);
+            set_zero_sign_flags_float(vm, vm->registers[reg1]);
         }
         else if (opcode == OP_STR_ITOA_MEM_REG_REG) {
-            address = decode_address(); reg1 = decode_register(); reg2 = decode_register();
-            if (debug_mode) printf("str.itoa [%u], %s, %s\n", address, register_string(reg1), register_string(reg2));
-            if (address < MEMORY_SIZE && reg1 != REG_INVALID && reg2 != REG_INVALID) {
-                sprintf((char*)&memory[address], "%d", (int)registers[reg1]);
+            address = decode_address(vm); reg1 = decode_register(vm); reg2 = decode_register(vm);
+            if (trace) printf("str.itoa [%u], %s, %s\n", address, register_string(reg1), register_string(reg2));
+            if (address < vm->memory_size && reg1 != REG_INVALID && reg2 != REG_INVALID) {
+                sprintf((char*)&vm->memory[address], "%d", (int)vm->registers[reg1]);
+                decode_cache_invalidate(vm, address, (uint32_t)strlen((char*)&vm->memory[address]) + 1);
             }
         }
         else if (opcode == OP_STR_SUBSTR_MEM_MEM_REG_REG) {
-            uint32_t dest_addr = decode_address(); uint32_t src_addr = decode_address(); reg1 = decode_register(); reg2 = decode_register();
-            if (debug_mode) printf("str.substr [%u], [%u], %s, %s\n", dest_addr, src_addr, register_string(reg1), register_string(reg2));
-            if (dest_addr < MEMORY_SIZE && src_addr < MEMORY_SIZE && reg1 != REG_INVALID && reg2 != REG_INVALID) {
-                char* src = (char*)&memory[src_addr];
-                char* dest = (char*)&memory[dest_addr];
-                int start = (int)registers[reg1];
-                int len = (int)registers[reg2];
+            uint32_t dest_addr = decode_address(vm); uint32_t src_addr = decode_address(vm); reg1 = decode_register(vm); reg2 = decode_register(vm);
+            if (trace) printf("str.substr [%u], [%u], %s, %s\n", dest_addr, src_addr, register_string(reg1), register_string(reg2));
+            if (dest_addr < vm->memory_size && src_addr < vm->memory_size && reg1 != REG_INVALID && reg2 != REG_INVALID) {
+                char* src = (char*)&vm->memory[src_addr];
+                char* dest = (char*)&vm->memory[dest_addr];
+                int start = (int)vm->registers[reg1];
+                int len = (int)vm->registers[reg2];
                 int src_len = strlen(src);
                 if (start >= 0 && start < src_len && len > 0) {
                     strncpy(dest, src + start, len);
                     dest[len] = '\0';
+                    decode_cache_invalidate(vm, dest_addr, (uint32_t)len + 1);
                 }
                 else if (len <= 0) {
                     dest[0] = '\0';
+                    decode_cache_invalidate(vm, dest_addr, 1);
                 }
                 else {
                     dest[0] = '\0';
+                    decode_cache_invalidate(vm, dest_addr, 1);
                 }
             }
         }
         else if (opcode == OP_STR_FMT_MEM_MEM_REG_REG) {
-            uint32_t dest_addr = decode_address();
-            uint32_t fmt_addr = decode_address();
-            reg1 = decode_register();
-            reg2 = decode_register();
-            if (debug_mode) printf("str.fmt [%u], [%u], %s, %s\n", dest_addr, fmt_addr, register_string(reg1), register_string(reg2));
-            if (dest_addr < MEMORY_SIZE && fmt_addr < MEMORY_SIZE && reg1 != REG_INVALID && reg2 != REG_INVALID) {
-                sprintf((char*)&memory[dest_addr], (char*)&memory[fmt_addr], registers[reg1], registers[reg2]);
+            uint32_t dest_addr = decode_address(vm);
+            uint32_t fmt_addr = decode_address(vm);
+            reg1 = decode_register(vm);
+            reg2 = decode_register(vm);
+            if (trace) printf("str.fmt [%u], [%u], %s, %s\n", dest_addr, fmt_addr, register_string(reg1), register_string(reg2));
+            if (dest_addr < vm->memory_size && fmt_addr < vm->memory_size && reg1 != REG_INVALID && reg2 != REG_INVALID) {
+                sprintf((char*)&vm->memory[dest_addr], (char*)&vm->memory[fmt_addr], vm->registers[reg1], vm->registers[reg2]);
+                decode_cache_invalidate(vm, dest_addr, (uint32_t)strlen((char*)&vm->memory[dest_addr]) + 1);
             }
         }
         break;
@@ -2073,103 +3317,101 @@ void execute_instruction(Opcode opcode) {
     // Memory Standard Library Implementation
     case OP_MEM_CPY_MEM_MEM_REG: case OP_MEM_SET_MEM_REG_VAL: case OP_MEM_FREE_MEM: case OP_MEM_SET_MEM_REG_REG: {
         if (opcode == OP_MEM_CPY_MEM_MEM_REG) {
-            uint32_t dest_addr = decode_address(); uint32_t src_addr = decode_address(); reg1 = decode_register();
-            if (debug_mode) printf("mem.cpy [%u], [%u], %s\n", dest_addr, src_addr, register_string(reg1));
-            if (dest_addr < MEMORY_SIZE && src_addr < MEMORY_SIZE && reg1 != REG_INVALID) memcpy(&memory[dest_addr], &memory[src_addr], (uint32_t)registers[reg1]);
+            uint32_t dest_addr = decode_address(vm); uint32_t src_addr = decode_address(vm); reg1 = decode_register(vm);
+            if (trace) printf("mem.cpy [%u], [%u], %s\n", dest_addr, src_addr, register_string(reg1));
+            if (dest_addr < vm->memory_size && src_addr < vm->memory_size && reg1 != REG_INVALID) {
+                memcpy(&vm->memory[dest_addr], &vm->memory[src_addr], (uint32_t)vm->registers[reg1]);
+                decode_cache_invalidate(vm, dest_addr, (uint32_t)vm->registers[reg1]);
+            }
         }
         else if (opcode == OP_MEM_SET_MEM_REG_VAL) {
-            uint32_t dest_addr = decode_address(); reg1 = decode_register(); value_uint32 = decode_value_uint32();
-            if (debug_mode) printf("mem.set [%u], %s, %u\n", dest_addr, register_string(reg1), value_uint32);
-            if (dest_addr < MEMORY_SIZE && reg1 != REG_INVALID) memset(&memory[dest_addr], (uint8_t)registers[reg1], value_uint32);
+            uint32_t dest_addr = decode_address(vm); reg1 = decode_register(vm); value_uint32 = decode_value_uint32(vm);
+            if (trace) printf("mem.set [%u], %s, %u\n", dest_addr, register_string(reg1), value_uint32);
+            if (dest_addr < vm->memory_size && reg1 != REG_INVALID) {
+                memset(&vm->memory[dest_addr], (uint8_t)vm->registers[reg1], value_uint32);
+                decode_cache_invalidate(vm, dest_addr, value_uint32);
+            }
         }
         else if (opcode == OP_MEM_SET_MEM_REG_REG) {
-            uint32_t dest_addr = decode_address();
-            reg1 = decode_register();
-            reg2 = decode_register();
-            if (debug_mode) printf("mem.set [%u], %s, %s\n", dest_addr, register_string(reg1), register_string(reg2));
-            if (dest_addr < MEMORY_SIZE && reg1 != REG_INVALID && reg2 != REG_INVALID) {
-                memset(&memory[dest_addr], (uint8_t)registers[reg1], (uint32_t)registers[reg2]);
+            uint32_t dest_addr = decode_address(vm);
+            reg1 = decode_register(vm);
+            reg2 = decode_register(vm);
+            if (trace) printf("mem.set [%u], %s, %s\n", dest_addr, register_string(reg1), register_string(reg2));
+            if (dest_addr < vm->memory_size && reg1 != REG_INVALID && reg2 != REG_INVALID) {
+                memset(&vm->memory[dest_addr], (uint8_t)vm->registers[reg1], (uint32_t)vm->registers[reg2]);
+                decode_cache_invalidate(vm, dest_addr, (uint32_t)vm->registers[reg2]);
             }
         }
         else if (opcode == OP_MEM_FREE_MEM) {
-            address = decode_address();
-            if (debug_mode) printf("mem.clear [%u]\n", address);
-            if (address < MEMORY_SIZE) {
+            address = decode_address(vm);
+            if (trace) printf("mem.clear [%u]\n", address);
+            if (address < vm->memory_size) {
                 uint32_t buffer_size = 0;
                 for (int i = 0; i < buffer_count; i++) { if (buffers[i].address == address) { buffer_size = buffers[i].size; break; } }
-                if (buffer_size > 0) memset(&memory[address], 0, buffer_size);
-                else if (debug_mode) printf("Warning: mem.clear called on address without known buffer size.\n");
+                if (buffer_size > 0) {
+                    memset(&vm->memory[address], 0, buffer_size);
+                    decode_cache_invalidate(vm, address, buffer_size);
+                }
+                else if (trace) printf("Warning: mem.clear called on address without known buffer size.\n");
             }
-            else if (debug_mode) printf("Error: MEMFREE address out of bounds!\n");
+            else if (trace) printf("Error: MEMFREE address out of bounds!\n");
         }
         break;
     }
 
                                // System Library Opcodes Implementation
-    case OP_SYS_PRINT_CHAR: { reg1 = decode_register(); if (debug_mode) printf("sys.print_char %s\n", register_string(reg1)); if (reg1 != REG_INVALID) sys_print_char((char)(uint32_t)registers[reg1]); cursor_x++; break; }
-    case OP_SYS_CLEAR_SCREEN: if (debug_mode) printf("sys.clear_screen\n"); sys_clear_screen(); break;
-    case OP_SYS_PRINT_STRING: { reg1 = decode_register(); if (debug_mode) printf("sys.print_string %s\n", register_string(reg1)); if (reg1 != REG_INVALID) sys_print_string((uint32_t)registers[reg1]); break; }
-    case OP_SYS_PRINT_NEWLINE: if (debug_mode) printf("sys.newline\n"); sys_print_newline(); break;
-    case OP_SYS_SET_CURSOR_POS: { reg1 = decode_register(); reg2 = decode_register(); if (debug_mode) printf("sys.set_cursor_pos %s, %s\n", register_string(reg1), register_string(reg2)); if (reg1 != REG_INVALID && reg2 != REG_INVALID) sys_set_cursor_pos((uint32_t)registers[reg1], (uint32_t)registers[reg2]); break; }
-    case OP_SYS_GET_CURSOR_POS: { reg1 = decode_register(); reg2 = decode_register(); if (debug_mode) printf("sys.get_cursor_pos %s, %s\n", register_string(reg1), register_string(reg2)); uint32_t x_pos, y_pos; sys_get_cursor_pos(&x_pos, &y_pos); if (reg1 != REG_INVALID && reg2 != REG_INVALID) { registers[reg1] = (double)x_pos; registers[reg2] = (double)y_pos; } break; }
-    case OP_SYS_SET_TEXT_COLOR: { reg1 = decode_register(); if (debug_mode) printf("sys.set_text_color %s\n", register_string(reg1)); if (reg1 != REG_INVALID) sys_set_text_color((uint32_t)registers[reg1]); break; }
-    case OP_SYS_RESET_TEXT_COLOR: if (debug_mode) printf("sys.reset_text_color\n"); sys_reset_text_color(); break;
-    case OP_SYS_PRINT_NUMBER_DEC: { reg1 = decode_register(); if (debug_mode) printf("sys.print_number_dec %s\n", register_string(reg1)); if (reg1 != REG_INVALID) sys_print_number_dec(registers[reg1]); break; }
-    case OP_SYS_PRINT_NUMBER_HEX: { reg1 = decode_register(); if (debug_mode) printf("sys.print_number_hex %s\n", register_string(reg1)); if (reg1 != REG_INVALID) sys_print_number_hex((uint32_t)registers[reg1]); break; }
-    case OP_SYS_NUMBER_TO_STRING: { reg1 = decode_register(); reg2 = decode_register(); reg3 = decode_register(); if (debug_mode) printf("sys.number_to_string %s, %s, %s\n", register_string(reg1), register_string(reg2), register_string(reg3)); if (reg1 != REG_INVALID && reg2 != REG_INVALID && reg3 != REG_INVALID) sys_number_to_string((uint32_t)registers[reg1], (uint32_t)registers[reg2], (uint32_t)registers[reg3]); break; }
-    case OP_SYS_READ_CHAR: { reg1 = decode_register(); if (debug_mode) printf("sys.read_char %s\n", register_string(reg1)); if (reg1 != REG_INVALID) registers[reg1] = (double)sys_read_char(); break; }
-    case OP_SYS_READ_STRING: { reg1 = decode_register(); reg2 = decode_register(); if (debug_mode) printf("sys.read_string %s, %s\n", register_string(reg1), register_string(reg2)); if (reg1 != REG_INVALID && reg2 != REG_INVALID) sys_read_string((uint32_t)registers[reg1], (uint32_t)registers[reg2]); break; }
-    case OP_SYS_GET_KEY_PRESS: { reg1 = decode_register(); if (debug_mode) printf("sys.get_key_press %s\n", register_string(reg1)); if (reg1 != REG_INVALID) registers[reg1] = (double)sys_get_key_press(); break; }
-    case OP_SYS_GET_CPU_VER: { reg1 = decode_register(); if (debug_mode) printf("sys.cpu_ver %s\n", register_string(reg1)); if (reg1 != REG_INVALID) registers[reg1] = sys_get_cpu_ver(); break; }
-    case OP_SYS_WAIT: { reg1 = decode_register(); if (debug_mode) printf("sys.wait %s\n", register_string(reg1)); if (reg1 != REG_INVALID) sys_wait((uint32_t)registers[reg1]); break; }
-    case OP_SYS_TIME_REG: { reg1 = decode_register(); if (debug_mode) printf("sys.time %s\n", register_string(reg1)); if (reg1 != REG_INVALID) registers[reg1] = sys_time(); break; }
+    case OP_SYS_PRINT_CHAR: { reg1 = decode_register(vm); if (trace) printf("sys.print_char %s\n", register_string(reg1)); if (reg1 != REG_INVALID) sys_print_char(vm, (char)(uint32_t)vm->registers[reg1]); vm->cursor_x++; break; }
+    case OP_SYS_CLEAR_SCREEN: if (trace) printf("sys.clear_screen\n"); sys_clear_screen(vm); break;
+    case OP_SYS_PRINT_STRING: { reg1 = decode_register(vm); if (trace) printf("sys.print_string %s\n", register_string(reg1)); if (reg1 != REG_INVALID) sys_print_string(vm, (uint32_t)vm->registers[reg1]); break; }
+    case OP_SYS_PRINT_NEWLINE: if (trace) printf("sys.newline\n"); sys_print_newline(vm); break;
+    case OP_SYS_SET_CURSOR_POS: { reg1 = decode_register(vm); reg2 = decode_register(vm); if (trace) printf("sys.set_cursor_pos %s, %s\n", register_string(reg1), register_string(reg2)); if (reg1 != REG_INVALID && reg2 != REG_INVALID) sys_set_cursor_pos(vm, (uint32_t)vm->registers[reg1], (uint32_t)vm->registers[reg2]); break; }
+    case OP_SYS_GET_CURSOR_POS: { reg1 = decode_register(vm); reg2 = decode_register(vm); if (trace) printf("sys.get_cursor_pos %s, %s\n", register_string(reg1), register_string(reg2)); uint32_t x_pos, y_pos; sys_get_cursor_pos(vm, &x_pos, &y_pos); if (reg1 != REG_INVALID && reg2 != REG_INVALID) { vm->registers[reg1] = (double)x_pos; vm->registers[reg2] = (double)y_pos; } break; }
+    case OP_SYS_SET_TEXT_COLOR: { reg1 = decode_register(vm); if (trace) printf("sys.set_text_color %s\n", register_string(reg1)); if (reg1 != REG_INVALID) sys_set_text_color(vm, (uint32_t)vm->registers[reg1]); break; }
+    case OP_SYS_RESET_TEXT_COLOR: if (trace) printf("sys.reset_text_color\n"); sys_reset_text_color(vm); break;
+    case OP_SYS_PRINT_NUMBER_DEC: { reg1 = decode_register(vm); if (trace) printf("sys.print_number_dec %s\n", register_string(reg1)); if (reg1 != REG_INVALID) sys_print_number_dec(vm, vm->registers[reg1]); break; }
+    case OP_SYS_PRINT_NUMBER_HEX: { reg1 = decode_register(vm); if (trace) printf("sys.print_number_hex %s\n", register_string(reg1)); if (reg1 != REG_INVALID) sys_print_number_hex(vm, (uint32_t)vm->registers[reg1]); break; }
+    case OP_SYS_NUMBER_TO_STRING: { reg1 = decode_register(vm); reg2 = decode_register(vm); reg3 = decode_register(vm); if (trace) printf("sys.number_to_string %s, %s, %s\n", register_string(reg1), register_string(reg2), register_string(reg3)); if (reg1 != REG_INVALID && reg2 != REG_INVALID && reg3 != REG_INVALID) sys_number_to_string(vm, (uint32_t)vm->registers[reg1], (uint32_t)vm->registers[reg2], (uint32_t)vm->registers[reg3]); break; }
+    case OP_SYS_READ_CHAR: { reg1 = decode_register(vm); if (trace) printf("sys.read_char %s\n", register_string(reg1)); if (reg1 != REG_INVALID) vm->registers[reg1] = (double)sys_read_char(vm); break; }
+    case OP_SYS_READ_STRING: { reg1 = decode_register(vm); reg2 = decode_register(vm); if (trace) printf("sys.read_string %s, %s\n", register_string(reg1), register_string(reg2)); if (reg1 != REG_INVALID && reg2 != REG_INVALID) sys_read_string(vm, (uint32_t)vm->registers[reg1], (uint32_t)vm->registers[reg2]); break; }
+    case OP_SYS_GET_KEY_PRESS: { reg1 = decode_register(vm); if (trace) printf("sys.get_key_press %s\n", register_string(reg1)); if (reg1 != REG_INVALID) vm->registers[reg1] = (double)sys_get_key_press(vm); break; }
+    case OP_SYS_GET_CPU_VER: { reg1 = decode_register(vm); if (trace) printf("sys.cpu_ver %s\n", register_string(reg1)); if (reg1 != REG_INVALID) vm->registers[reg1] = sys_get_cpu_ver(vm); break; }
+    case OP_SYS_WAIT: {
+        reg1 = decode_register(vm);
+        if (trace) printf("sys.wait %s\n", register_string(reg1));
+        if (vm->needs_gfx_update) gfx_update_screen(vm); // Show the finished frame before pausing
+        if (reg1 != REG_INVALID) sys_wait(vm, (uint32_t)vm->registers[reg1]);
+        break;
+    }
+    case OP_SYS_TIME_REG: { reg1 = decode_register(vm); if (trace) printf("sys.time %s\n", register_string(reg1)); if (reg1 != REG_INVALID) vm->registers[reg1] = sys_time(vm); break; }
     case OP_MEM_TEST: {
-        if (debug_mode) printf("MEM_TEST\n");
-        memcpy(backup_memory, memory, MEMORY_SIZE);
-        memset(memory, 0x00, MEMORY_SIZE);
-
-        bool test_failed = false;
-        for (uint32_t i = 0; i < MEMORY_SIZE; ++i) {
-            if (memory[i] != 0x00) {
-                printf("Error at address 0x%08X: Expected 0x00, but got 0x%02X\n", i, memory[i]);
-                test_failed = true;
-            }
-        }
-
-        memcpy(memory, backup_memory, MEMORY_SIZE);
-
-        if (test_failed) {
-            registers[REG_R0] = 1.0; // Indicate failure
-        }
-        else {
-            registers[REG_R0] = 0.0; // Indicate success
-        }
+        if (trace) printf("MEM_TEST\n");
+        vm->registers[REG_R0] = sys_mem_test(vm) ? 0.0 : 1.0; // 0 = success, 1 = failure
         break;
     }
                         // Disk Standard Library Implementation
     case OP_DISK_GET_SIZE_REG: {
-        reg1 = decode_register();
-        if (debug_mode) printf("disk.get_size %s\n", register_string(reg1));
+        reg1 = decode_register(vm);
+        if (trace) printf("disk.get_size %s\n", register_string(reg1));
         uint32_t disk_size;
-        DiskResultCode result = disk_get_size(&disk_size);
+        DiskResultCode result = disk_get_size(vm, &disk_size);
         if (result == DISK_OK && reg1 != REG_INVALID) {
-            registers[reg1] = (double)disk_size;
+            vm->registers[reg1] = (double)disk_size;
         }
         else {
             printf("DISK Error: Get Size failed with code %d\n", result);
-            registers[reg1] = (double)result;
+            vm->registers[reg1] = (double)result;
         }
         break;
     }
     case OP_DISK_READ_SECTOR_MEM_REG_REG: {
         uint32_t address_mem;
-        reg1 = decode_register();
-        reg2 = decode_register();
-        address_mem = decode_address();
-        if (debug_mode) printf("disk.read_sector %s, %s, [%u]\n", register_string(reg1), register_string(reg2), address_mem);
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        address_mem = decode_address(vm);
+        if (trace) printf("disk.read_sector %s, %s, [%u]\n", register_string(reg1), register_string(reg2), address_mem);
 
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            DiskResultCode result = disk_read_sector((uint32_t)registers[reg1], address_mem, (uint32_t)registers[reg2]);
+            DiskResultCode result = disk_read_sector(vm, (uint32_t)vm->registers[reg1], address_mem, (uint32_t)vm->registers[reg2]);
             if (result != DISK_OK) {
                 printf("DISK Error: Read Sector failed with code %d\n", result);
             }
@@ -2178,13 +3420,13 @@ void execute_instruction(Opcode opcode) {
     }
     case OP_DISK_WRITE_SECTOR_MEM_REG_REG: {
         uint32_t address_mem;
-        reg1 = decode_register();
-        reg2 = decode_register();
-        address_mem = decode_address();
-        if (debug_mode) printf("disk.write_sector %s, %s, [%u]\n", register_string(reg1), register_string(reg2), address_mem);
+        reg1 = decode_register(vm);
+        reg2 = decode_register(vm);
+        address_mem = decode_address(vm);
+        if (trace) printf("disk.write_sector %s, %s, [%u]\n", register_string(reg1), register_string(reg2), address_mem);
 
         if (reg1 != REG_INVALID && reg2 != REG_INVALID) {
-            DiskResultCode result = disk_write_sector((uint32_t)registers[reg1], address_mem, (uint32_t)registers[reg2]);
+            DiskResultCode result = disk_write_sector(vm, (uint32_t)vm->registers[reg1], address_mem, (uint32_t)vm->registers[reg2]);
             if (result != DISK_OK) {
                 printf("DISK Error: Write Sector failed with code %d\n", result);
             }
@@ -2192,34 +3434,34 @@ void execute_instruction(Opcode opcode) {
         break;
     }
     case OP_DISK_CREATE_IMAGE: {
-        if (debug_mode) printf("disk.create_image\n");
-        DiskResultCode result = create_disk_image();
+        if (trace) printf("disk.create_image\n");
+        DiskResultCode result = create_disk_image(vm);
         if (result != DISK_OK) {
             printf("DISK Error: Create Image failed with code %d\n", result);
         }
         break;
     }
     case OP_DISK_FORMAT_DISK: {
-        if (debug_mode) printf("disk.format_disk\n");
-        DiskResultCode result = format_disk();
+        if (trace) printf("disk.format_disk\n");
+        DiskResultCode result = format_disk(vm);
         if (result != DISK_OK) {
             printf("DISK Error: Format Disk failed with code %d\n", result);
         }
         break;
     }
     case OP_DISK_GET_VOLUME_LABEL_MEM: {
-        address = decode_address();
-        if (debug_mode) printf("disk.get_volume_label [%u]\n", address);
-        DiskResultCode result = disk_get_volume_label(address);
+        address = decode_address(vm);
+        if (trace) printf("disk.get_volume_label [%u]\n", address);
+        DiskResultCode result = disk_get_volume_label(vm, address);
         if (result != DISK_OK) {
             printf("DISK Error: Get Volume Label failed with code %d\n", result);
         }
         break;
     }
     case OP_DISK_SET_VOLUME_LABEL_MEM: {
-        address = decode_address();
-        if (debug_mode) printf("disk.set_volume_label [%u]\n", address);
-        DiskResultCode result = disk_set_volume_label(address);
+        address = decode_address(vm);
+        if (trace) printf("disk.set_volume_label [%u]\n", address);
+        DiskResultCode result = disk_set_volume_label(vm, address);
         if (result != DISK_OK) {
             printf("DISK Error: Set Volume Label failed with code %d\n", result);
         }
@@ -2227,360 +3469,1802 @@ void execute_instruction(Opcode opcode) {
     }
 
     case OP_GFX_INIT:
-        if (debug_mode) printf("gfx.init\n");
-        if (!gfx_initialized) {
-            if (!gfx_init()) {
+        if (trace) printf("gfx.init\n");
+        if (!vm->gfx_initialized) {
+            if (!gfx_init(vm)) {
                 printf("GFX Error: Initialization failed!\n");
-                running = false;
+                vm->running = false;
             }
         }
-        needs_gfx_update = true; 
+        vm->needs_gfx_update = true; 
         break;
 
     case OP_GFX_CLOSE:
-        if (debug_mode) printf("gfx.close\n");
-        gfx_close();
-        needs_gfx_update = true;
+        if (trace) printf("gfx.close\n");
+        gfx_close(vm);
+        vm->needs_gfx_update = true;
+        break;
+
+    case OP_GFX_PRESENT:
+        if (trace) printf("gfx.present\n");
+        gfx_update_screen(vm);
+        break;
+
+    case OP_VM_SNAPSHOT:
+        if (trace) printf("vm.snapshot\n");
+        vm->registers[REG_R0] = snapshot_write(vm) ? SNAPSHOT_WRITTEN : SNAPSHOT_FAILED;
         break;
 
     case OP_GFX_DRAW_PIXEL: {
-        reg1 = decode_register(); // X
-        reg2 = decode_register(); // Y
-        reg3 = decode_register(); // Color
-        if (debug_mode) printf("gfx.pixel %s, %s, %s\n", register_string(reg1), register_string(reg2), register_string(reg3));
+        reg1 = decode_register(vm); // X
+        reg2 = decode_register(vm); // Y
+        reg3 = decode_register(vm); // Color
+        if (trace) printf("gfx.pixel %s, %s, %s\n", register_string(reg1), register_string(reg2), register_string(reg3));
         if (reg1 != REG_INVALID && reg2 != REG_INVALID && reg3 != REG_INVALID) {
-            gfx_draw_pixel((int)registers[reg1], (int)registers[reg2], (uint32_t)registers[reg3]);
+            gfx_draw_pixel(vm, (int)vm->registers[reg1], (int)vm->registers[reg2], (uint32_t)vm->registers[reg3]);
         }
-        needs_gfx_update = true; 
+        vm->needs_gfx_update = true; 
         break;
     }
     case OP_GFX_CLEAR: {
-        reg1 = decode_register(); // Color register
-        if (debug_mode) printf("gfx.clear %s\n", register_string(reg1));
+        reg1 = decode_register(vm); // Color register
+        if (trace) printf("gfx.clear %s\n", register_string(reg1));
         if (reg1 != REG_INVALID) {
-            gfx_clear_screen((uint32_t)registers[reg1]);
+            gfx_clear_screen(vm, (uint32_t)vm->registers[reg1]);
         }
-        needs_gfx_update = true;
+        vm->needs_gfx_update = true;
         break;
     }
     case OP_GFX_GET_SCREEN_WIDTH_REG: {
-        reg1 = decode_register();
-        if (debug_mode) printf("gfx.get_screen_width %s\n", register_string(reg1));
-        if (reg1 != REG_INVALID) registers[reg1] = gfx_get_screen_width();
+        reg1 = decode_register(vm);
+        if (trace) printf("gfx.get_screen_width %s\n", register_string(reg1));
+        if (reg1 != REG_INVALID) vm->registers[reg1] = gfx_get_screen_width(vm);
         break;
     }
     case OP_GFX_GET_SCREEN_HEIGHT_REG: {
-        reg1 = decode_register();
-        if (debug_mode) printf("gfx.get_screen_height %s\n", register_string(reg1));
-        if (reg1 != REG_INVALID) registers[reg1] = gfx_get_screen_height();
+        reg1 = decode_register(vm);
+        if (trace) printf("gfx.get_screen_height %s\n", register_string(reg1));
+        if (reg1 != REG_INVALID) vm->registers[reg1] = gfx_get_screen_height(vm);
         break;
     }
     case OP_GFX_GET_VRAM_SIZE_REG: {
-        reg1 = decode_register();
-        if (debug_mode) printf("gfx.get_vram_size %s\n", register_string(reg1));
-        if (reg1 != REG_INVALID) registers[reg1] = gfx_get_vram_size();
+        reg1 = decode_register(vm);
+        if (trace) printf("gfx.get_vram_size %s\n", register_string(reg1));
+        if (reg1 != REG_INVALID) vm->registers[reg1] = gfx_get_vram_size(vm);
         break;
     }
     case OP_GFX_GET_GPU_VER_REG: {
-        reg1 = decode_register();
-        if (debug_mode) printf("gfx.get_gpu_ver %s\n", register_string(reg1));
-        if (reg1 != REG_INVALID) registers[reg1] = gfx_get_gpu_ver();
+        reg1 = decode_register(vm);
+        if (trace) printf("gfx.get_gpu_ver %s\n", register_string(reg1));
+        if (reg1 != REG_INVALID) vm->registers[reg1] = gfx_get_gpu_ver(vm);
         break;
     }
 
     case OP_AUDIO_INIT:
-        if (debug_mode) printf("audio.init\n");
-        if (!audio_initialized) {
-            if (!sys_audio_init()) {
+        if (trace) printf("audio.init\n");
+        if (!vm->audio_initialized) {
+            if (!sys_audio_init(vm)) {
                 printf("AUDIO Error: Initialization failed!\n");
-                running = false;
+                vm->running = false;
             }
         }
         break;
     case OP_AUDIO_CLOSE:
-        if (debug_mode) printf("audio.close\n");
-        sys_audio_close();
+        if (trace) printf("audio.close\n");
+        sys_audio_close(vm);
         break;
     case OP_AUDIO_SPEAKER_ON:
-        if (debug_mode) printf("audio.speaker_on\n");
-        sys_audio_speaker_on();
+        if (trace) printf("audio.speaker_on\n");
+        sys_audio_speaker_on(vm);
         break;
     case OP_AUDIO_SPEAKER_OFF:
-        if (debug_mode) printf("audio.speaker_off\n");
-        sys_audio_speaker_off();
+        if (trace) printf("audio.speaker_off\n");
+        sys_audio_speaker_off(vm);
         break;
     case OP_AUDIO_SET_PITCH_REG: {
-        RegisterIndex reg1 = decode_register();
-        if (debug_mode) printf("audio.set_pitch %s\n", register_string(reg1));
-        if (reg1 != REG_INVALID) sys_audio_set_pitch(registers[reg1]);
+        RegisterIndex reg1 = decode_register(vm);
+        if (trace) printf("audio.set_pitch %s\n", register_string(reg1));
+        if (reg1 != REG_INVALID) sys_audio_set_pitch(vm, vm->registers[reg1]);
         break;
     }
     case OP_AUDIO_GET_AUDIO_VER_REG: {
-        RegisterIndex reg1 = decode_register();
-        if (debug_mode) printf("audio.get_ver %s\n", register_string(reg1));
-        if (reg1 != REG_INVALID) registers[reg1] = sys_get_audio_ver();
+        RegisterIndex reg1 = decode_register(vm);
+        if (trace) printf("audio.get_ver %s\n", register_string(reg1));
+        if (reg1 != REG_INVALID) vm->registers[reg1] = sys_get_audio_ver(vm);
         break;
     }
 
-    case OP_INVALID: printf("Invalid Opcode!\n"); running = false; break;
-    default: printf("Unknown Opcode: %d\n", opcode); running = false; break;
+    case OP_INVALID: printf("Invalid Opcode!\n"); vm->running = false; break;
+    default: printf("Unknown Opcode: %d\n", opcode); vm->running = false; break;
     }
+    vm->flags_eager = false;
 }
 
-void run_vm() {
-    program_counter = 0;
-    running = true;
-    memset(registers, 0, sizeof(registers));
-    registers[REG_SP] = MEMORY_SIZE - 8;
-    sys_reset_text_color();
-    sys_clear_screen();
-    srand(time(NULL));
-    needs_gfx_update = false;
+void execute_instruction_release(VM* vm, Opcode opcode) {
+    execute_instruction_impl(vm, opcode, false);
+}
 
-    uint64_t instruction_count = 0;
-    clock_t start_time = clock();
+void execute_instruction_trace(VM* vm, Opcode opcode) {
+    execute_instruction_impl(vm, opcode, true);
+}
 
-    while (running) {
-        Opcode opcode = decode_opcode();
-        execute_instruction(opcode);
-        if (needs_gfx_update) {
-            gfx_update_screen();
-            needs_gfx_update = false; 
-        }
+// JIT Compiler (x86-64)
+//
+// Hot loop heads found by the threaded core are translated into host code, one basic block at a time.
+// Inside a block the guest registers it touches live in xmm2-xmm13; they are loaded on entry and written
+// back on every exit. The last flag-producing result is kept in xmm14 and only turned into ZF/SF/CF/OF
+// doubles when the block exits. Blocks that exit to an already compiled PC are chained with a direct jump.
+// Code runs System V style: rbx = registers[], rbp = memory[], r13 = retired instruction counter,
+// xmm15 = sign mask for fabs. A block returns the guest PC to continue at in eax.
+// Each thread has its own code buffer. Blocks refer to the VM they were compiled for, so run_vm drops
+// them when it returns and the next VM on the same thread starts from an empty buffer.
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define VM_JIT_AVAILABLE 1
+#endif
 
-        if (!running) break;
-        instruction_count++;
-    }
-    sys_reset_text_color();
+#ifdef VM_JIT_AVAILABLE
+bool jit_enabled = true;
+#else
+bool jit_enabled = false;
+#endif
+VM_THREAD_LOCAL uint64_t jit_instruction_count; // Instructions retired inside compiled code, collected by the threaded core
 
-    clock_t end_time = clock();
-    double cpu_time_used = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
+#ifdef VM_JIT_AVAILABLE
 
-    printf("\n--- Execution Summary ---\n");
-    printf("Total Instructions Executed: %llu\n", instruction_count);
-    printf("Execution Time: %.6f seconds\n", cpu_time_used);
-}
+#define JIT_BUFFER_SIZE (4 * 1024 * 1024)
+#define JIT_BLOCK_RESERVE (32 * 1024)   // Worst-case size of one block including its exit stubs
+#define JIT_MAX_BLOCK_INSTRUCTIONS 32
+#define JIT_MAX_CACHED_REGISTERS 12     // xmm2-xmm13
+#define JIT_FIRST_GUEST_XMM 2
+#define JIT_FLAG_XMM 14
+#define JIT_ABS_MASK_XMM 15
+#define JIT_HOT_THRESHOLD 64            // Taken backward branches to a PC before it is compiled
+#define JIT_HOT_SLOTS 4096
+#define JIT_MAX_PENDING_EXITS 4096
+#define JIT_UNCOMPILABLE ((uint8_t*)1)
 
-// Assembler Functions
+#define JIT_RBX 3
+#define JIT_RBP 5
 
-bool is_register_str(const char* str) {
-    return register_from_string(str) != REG_INVALID;
+typedef uint32_t(*JitEntryFn)(double* regs, uint8_t* mem, uint64_t* retired, const uint8_t* block);
+
+typedef struct {
+    uint32_t patch_offset; // Offset of the rel32 of an exit jump that still goes to the epilogue
+    uint32_t target_pc;
+} JitPendingExit;
+
+typedef struct {
+    uint8_t* rel32;        // Conditional jump in the block body to patch once the stub is emitted
+    uint32_t pc;
+    uint32_t executed;
+    uint32_t invalidate_address;
+    bool flags_pending;
+    bool invalidate;
+} JitSideExit;
+
+VM_THREAD_LOCAL uint8_t* jit_buffer = NULL;
+VM_THREAD_LOCAL bool jit_unavailable;         // The code buffer could not be mapped or made writable on this thread
+VM_THREAD_LOCAL uint8_t* jit_cursor;
+VM_THREAD_LOCAL uint8_t* jit_epilogue;
+VM_THREAD_LOCAL size_t jit_code_start;
+VM_THREAD_LOCAL size_t jit_used;
+VM_THREAD_LOCAL uint32_t jit_block_count;
+VM_THREAD_LOCAL JitEntryFn jit_enter;
+VM_THREAD_LOCAL uint8_t** jit_entry_pages[DECODE_PAGE_COUNT]; // PC -> compiled block, allocated per 4KB page like the decode cache
+VM_THREAD_LOCAL uint16_t jit_hot_counters[JIT_HOT_SLOTS];
+VM_THREAD_LOCAL JitPendingExit jit_pending_exits[JIT_MAX_PENDING_EXITS];
+VM_THREAD_LOCAL int jit_pending_exit_count;
+
+static void jit_emit8(uint8_t value) { *jit_cursor++ = value; }
+static void jit_emit32(uint32_t value) { memcpy(jit_cursor, &value, 4); jit_cursor += 4; }
+static void jit_emit64(uint64_t value) { memcpy(jit_cursor, &value, 8); jit_cursor += 8; }
+
+static void jit_patch_rel32(uint8_t* rel32, const uint8_t* target) {
+    int32_t rel = (int32_t)(target - (rel32 + 4));
+    memcpy(rel32, &rel, 4);
 }
 
-bool is_memory_address_str(const char* str) {
-    return (str[0] == '[' && str[strlen(str) - 1] == ']');
+// SSE2 instruction between two xmm registers (or xmm and a low GPR for cvtsi2sd): [prefix] [REX] 0F op modrm
+static void jit_emit_sse_rr(uint8_t prefix, uint8_t op, int reg, int rm) {
+    if (prefix) jit_emit8(prefix);
+    if (reg >= 8 || rm >= 8) jit_emit8(0x40 | ((reg >> 3) << 2) | (rm >> 3));
+    jit_emit8(0x0F);
+    jit_emit8(op);
+    jit_emit8(0xC0 | ((reg & 7) << 3) | (rm & 7));
 }
 
-int strcasecmp_portable(const char* s1, const char* s2) {
-    if (!s1 || !s2) {
-        if (s1 == s2) return 0; // Both NULL are equal
-        return (s1 == NULL) ? -1 : 1; // NULL is less than non-NULL
+// SSE2 instruction with a [base + disp32] operand, base being rbx or rbp
+static void jit_emit_sse_rm(uint8_t prefix, uint8_t op, int reg, int base, uint32_t disp) {
+    if (prefix) jit_emit8(prefix);
+    if (reg >= 8) jit_emit8(0x44);
+    jit_emit8(0x0F);
+    jit_emit8(op);
+    jit_emit8(0x80 | ((reg & 7) << 3) | base);
+    jit_emit32(disp);
+}
+
+static void jit_emit_load_const(int xmm, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    if (bits == 0) {
+        jit_emit_sse_rr(0x66, 0x57, xmm, xmm); // xorpd
+        return;
     }
+    jit_emit8(0x48); jit_emit8(0xB8); jit_emit64(bits);             // mov rax, imm64
+    jit_emit8(0x66); jit_emit8(0x48 | ((xmm >> 3) << 2));            // movq xmm, rax
+    jit_emit8(0x0F); jit_emit8(0x6E); jit_emit8(0xC0 | ((xmm & 7) << 3));
+}
 
-    while (*s1 != '\0' && *s2 != '\0') {
-        int diff = tolower((unsigned char)*s1) - tolower((unsigned char)*s2);
-        if (diff != 0) {
-            return diff;
+static void jit_emit_jcc(uint8_t cc, uint8_t** rel32) {
+    jit_emit8(0x0F); jit_emit8(0x80 | cc);
+    *rel32 = jit_cursor;
+    jit_emit32(0);
+}
+
+#define JIT_CC_E 0x4
+#define JIT_CC_NE 0x5
+#define JIT_CC_BE 0x6
+#define JIT_CC_A 0x7
+#define JIT_CC_P 0xA
+
+// Computes a guest flag as 0/1 into al (r8 = 0), cl (1) or dl (2). With a pending result in xmm14 the
+// flag follows set_zero_flag_float/set_sign_flag_float (CF and OF are always 0 then). Otherwise the
+// stored flag double is tested like the interpreter does: any nonzero value, NaN included, is set.
+static void jit_emit_flag(RegisterIndex flag, int r8, bool pending) {
+    if (pending) {
+        if (flag == REG_ZF) {
+            jit_emit_sse_rr(0x66, 0x28, 0, JIT_FLAG_XMM);          // movapd xmm0, xmm14
+            jit_emit_sse_rr(0x66, 0x54, 0, JIT_ABS_MASK_XMM);      // andpd xmm0, xmm15
+            jit_emit_load_const(1, 1e-9);
+            jit_emit_sse_rr(0x66, 0x2E, 1, 0);                     // ucomisd xmm1, xmm0
+        }
+        else if (flag == REG_SF) {
+            jit_emit_sse_rr(0x66, 0x57, 1, 1);                     // xorpd xmm1, xmm1
+            jit_emit_sse_rr(0x66, 0x2E, 1, JIT_FLAG_XMM);          // ucomisd xmm1, xmm14
+        }
+        else {
+            jit_emit8(0x31); jit_emit8(0xC0 | (r8 << 3) | r8);    // xor r32, r32
+            return;
+        }
+        jit_emit8(0x0F); jit_emit8(0x90 | JIT_CC_A); jit_emit8(0xC0 | r8); // seta r8
+        return;
+    }
+    jit_emit_sse_rr(0x66, 0x57, 0, 0);                             // xorpd xmm0, xmm0
+    jit_emit_sse_rm(0x66, 0x2E, 0, JIT_RBX, flag * 8);             // ucomisd xmm0, [rbx + flag]
+    jit_emit8(0x0F); jit_emit8(0x90 | JIT_CC_NE); jit_emit8(0xC0 | r8); // setne r8
+    jit_emit8(0x0F); jit_emit8(0x90 | JIT_CC_P); jit_emit8(0xC2);       // setp dl
+    jit_emit8(0x08); jit_emit8(0xD0 | r8);                              // or r8, dl
+}
+
+static void jit_emit_materialize_flags() {
+    RegisterIndex computed[2] = { REG_ZF, REG_SF };
+    for (int i = 0; i < 2; i++) {
+        jit_emit_flag(computed[i], 0, true);
+        jit_emit8(0x0F); jit_emit8(0xB6); jit_emit8(0xC0);                 // movzx eax, al
+        jit_emit_sse_rr(0xF2, 0x2A, 0, 0);                                  // cvtsi2sd xmm0, eax
+        jit_emit_sse_rm(0xF2, 0x11, 0, JIT_RBX, computed[i] * 8);          // movsd [rbx + flag], xmm0
+    }
+    RegisterIndex cleared[2] = { REG_CF, REG_OF };
+    for (int i = 0; i < 2; i++) {
+        jit_emit8(0x48); jit_emit8(0xC7); jit_emit8(0x83); jit_emit32(cleared[i] * 8); jit_emit32(0); // mov qword [rbx + flag], 0
+    }
+}
+
+static void jit_emit_add_retired(uint32_t executed) {
+    if (executed == 0) return;
+    jit_emit8(0x49); jit_emit8(0x81); jit_emit8(0x45); jit_emit8(0x00); jit_emit32(executed); // add qword [r13], imm32
+}
+
+static uint8_t* jit_block_at(uint32_t pc) {
+    if (pc >= MEMORY_SIZE) return NULL;
+    uint8_t** page = jit_entry_pages[pc >> DECODE_PAGE_SHIFT];
+    return page ? page[pc & (DECODE_PAGE_SIZE - 1)] : NULL;
+}
+
+static bool jit_set_block(uint32_t pc, uint8_t* block) {
+    uint8_t** page = jit_entry_pages[pc >> DECODE_PAGE_SHIFT];
+    if (page == NULL) {
+        page = (uint8_t**)calloc(DECODE_PAGE_SIZE, sizeof(uint8_t*));
+        if (page == NULL) return false;
+        jit_entry_pages[pc >> DECODE_PAGE_SHIFT] = page;
+    }
+    page[pc & (DECODE_PAGE_SIZE - 1)] = block;
+    return true;
+}
+
+// Writes back the block's modified registers and flags, then leaves to target_pc. Chainable exits jump
+// straight into the target's block when there is one, or are patched to do so once it is compiled.
+static void jit_emit_exit(const int8_t* xmm_of, const bool* written, bool flags_pending, uint32_t executed, uint32_t target_pc, bool chainable) {
+    for (int reg = 0; reg < REG_ZF; reg++) {
+        if (written[reg]) jit_emit_sse_rm(0xF2, 0x11, xmm_of[reg], JIT_RBX, reg * 8); // movsd [rbx + reg], xmm
+    }
+    if (flags_pending) jit_emit_materialize_flags();
+    jit_emit_add_retired(executed);
+    jit_emit8(0xB8); jit_emit32(target_pc);                  // mov eax, target_pc
+    jit_emit8(0xE9);                                         // jmp rel32
+    uint8_t* rel32 = jit_cursor;
+    jit_emit32(0);
+    uint8_t* target = chainable ? jit_block_at(target_pc) : NULL;
+    if (target != NULL && target != JIT_UNCOMPILABLE) {
+        jit_patch_rel32(rel32, target);
+        return;
+    }
+    jit_patch_rel32(rel32, jit_epilogue);
+    if (chainable && target == NULL && jit_pending_exit_count < JIT_MAX_PENDING_EXITS) {
+        jit_pending_exits[jit_pending_exit_count].patch_offset = (uint32_t)(rel32 - jit_buffer);
+        jit_pending_exits[jit_pending_exit_count].target_pc = target_pc;
+        jit_pending_exit_count++;
+    }
+}
+
+bool jit_init() {
+    if (jit_buffer != NULL) return true;
+    void* buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        fprintf(stderr, "JIT Error: Could not map code buffer, continuing in the interpreter.\n");
+        return false;
+    }
+    jit_buffer = (uint8_t*)buffer;
+    jit_cursor = jit_buffer;
+
+    // uint32_t entry(double* regs, uint8_t* mem, uint64_t* retired, const uint8_t* block)
+    jit_enter = (JitEntryFn)(void*)jit_cursor;
+    jit_emit8(0x53);                                         // push rbx
+    jit_emit8(0x55);                                         // push rbp
+    jit_emit8(0x41); jit_emit8(0x55);                        // push r13 (stack is 16-byte aligned again)
+    jit_emit8(0x48); jit_emit8(0x89); jit_emit8(0xFB);       // mov rbx, rdi
+    jit_emit8(0x48); jit_emit8(0x89); jit_emit8(0xF5);       // mov rbp, rsi
+    jit_emit8(0x49); jit_emit8(0x89); jit_emit8(0xD5);       // mov r13, rdx
+    jit_emit8(0x48); jit_emit8(0xB8); jit_emit64(0x7FFFFFFFFFFFFFFFull); // mov rax, sign mask
+    jit_emit8(0x66); jit_emit8(0x4C); jit_emit8(0x0F); jit_emit8(0x6E); jit_emit8(0xF8); // movq xmm15, rax
+    jit_emit8(0xFF); jit_emit8(0xE1);                        // jmp rcx
+
+    jit_epilogue = jit_cursor;
+    jit_emit8(0x41); jit_emit8(0x5D);                        // pop r13
+    jit_emit8(0x5D);                                         // pop rbp
+    jit_emit8(0x5B);                                         // pop rbx
+    jit_emit8(0xC3);                                         // ret
+
+    jit_code_start = jit_used = (size_t)(jit_cursor - jit_buffer);
+    if (mprotect(jit_buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        fprintf(stderr, "JIT Error: Could not make code buffer executable, continuing in the interpreter.\n");
+        munmap(jit_buffer, JIT_BUFFER_SIZE);
+        jit_buffer = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Drops every compiled block. The trampoline and epilogue at the start of the buffer are kept, so this
+// is safe to call from a helper invoked by compiled code that is about to return through the epilogue.
+void jit_flush(VM* vm) {
+    if (jit_block_count == 0) return;
+    // Blocks start in a page with entries and are short enough to end in it or the next one. Only those
+    // parts of code_map are cleared, so the untouched rest stays uncommitted.
+    uint32_t chunks_per_page = DECODE_PAGE_SIZE >> CODE_MAP_SHIFT;
+    uint32_t chunk_count = vm->memory_size >> CODE_MAP_SHIFT;
+    for (uint32_t i = 0; i < DECODE_PAGE_COUNT; i++) {
+        if (jit_entry_pages[i] == NULL) continue;
+        uint32_t end = (i + 2) * chunks_per_page;
+        if (end > chunk_count) end = chunk_count;
+        for (uint32_t chunk = i * chunks_per_page; chunk < end; chunk++) vm->code_map[chunk] &= ~CODE_MAP_COMPILED;
+        free(jit_entry_pages[i]);
+        jit_entry_pages[i] = NULL;
+    }
+    memset(jit_hot_counters, 0, sizeof(jit_hot_counters));
+    jit_pending_exit_count = 0;
+    jit_used = jit_code_start;
+    jit_block_count = 0;
+}
+
+static bool jit_is_branch(Opcode opcode) {
+    return opcode >= OP_JMP && opcode <= OP_JMP_L;
+}
+
+// Returns whether the instruction can be compiled, and the guest registers it uses (destination first).
+static bool jit_instruction_supported(const DecodedInstruction* d, RegisterIndex regs[2], int* reg_count, bool* writes_dest) {
+    const DecodedOperand* op = d->operands;
+    *reg_count = 0;
+    *writes_dest = false;
+    switch (d->opcode) {
+    case OP_NOP:
+        return true;
+    case OP_MOV_REG_REG: case OP_ADD_REG_REG: case OP_SUB_REG_REG: case OP_MUL_REG_REG: case OP_DIV_REG_REG:
+        *writes_dest = true;
+        regs[0] = op[0].reg; regs[1] = op[1].reg; *reg_count = 2;
+        break;
+    case OP_CMP_REG_REG:
+        regs[0] = op[0].reg; regs[1] = op[1].reg; *reg_count = 2;
+        break;
+    case OP_DIV_REG_VAL:
+        if (!(fabs(op[1].f64) > 1e-9)) return false; // Let the interpreter report the division by zero
+        // fall through
+    case OP_MOV_REG_VAL: case OP_ADD_REG_VAL: case OP_SUB_REG_VAL: case OP_MUL_REG_VAL: case OP_MOV_REG_MEM:
+    case OP_INC_REG: case OP_DEC_REG:
+        *writes_dest = true;
+        regs[0] = op[0].reg; *reg_count = 1;
+        break;
+    case OP_CMP_REG_VAL:
+        regs[0] = op[0].reg; *reg_count = 1;
+        break;
+    case OP_MOV_MEM_REG:
+        regs[0] = op[1].reg; *reg_count = 1;
+        break;
+    default:
+        if (jit_is_branch((Opcode)d->opcode)) return true;
+        return false;
+    }
+    for (int i = 0; i < *reg_count; i++) {
+        if (regs[i] >= REG_ZF) return false; // Flag registers and REG_INVALID stay in the interpreter
+    }
+    return true;
+}
+
+// Emits the branch condition of a terminating jump as 0/1 tests on al/cl. Returns the x86 condition code
+// that means "taken", or -1 for always taken and -2 for never taken.
+static int jit_emit_branch_condition(Opcode opcode, bool pending) {
+    switch (opcode) {
+    case OP_JMP: return -1;
+    case OP_JMP_Z: case OP_JMP_NZ:
+        jit_emit_flag(REG_ZF, 0, pending);
+        jit_emit8(0x84); jit_emit8(0xC0);                    // test al, al
+        return opcode == OP_JMP_Z ? JIT_CC_NE : JIT_CC_E;
+    case OP_JMP_S: case OP_JMP_NS: case OP_JMP_GE:
+        jit_emit_flag(REG_SF, 1, pending);
+        jit_emit8(0x84); jit_emit8(0xC9);                    // test cl, cl
+        return opcode == OP_JMP_S ? JIT_CC_NE : JIT_CC_E;
+    case OP_JMP_C: case OP_JMP_NC: case OP_JMP_O: case OP_JMP_NO: {
+        bool jump_if_set = (opcode == OP_JMP_C || opcode == OP_JMP_O);
+        if (pending) return jump_if_set ? -2 : -1;           // CF and OF are 0 after any compiled flag producer
+        jit_emit_flag((opcode == OP_JMP_C || opcode == OP_JMP_NC) ? REG_CF : REG_OF, 0, false);
+        jit_emit8(0x84); jit_emit8(0xC0);                    // test al, al
+        return jump_if_set ? JIT_CC_NE : JIT_CC_E;
+    }
+    case OP_JMP_LE: case OP_JMP_G:
+        jit_emit_flag(REG_ZF, 0, pending);
+        jit_emit_flag(REG_SF, 1, pending);
+        jit_emit8(0x08); jit_emit8(0xC8);                    // or al, cl
+        return opcode == OP_JMP_LE ? JIT_CC_NE : JIT_CC_E;
+    case OP_JMP_L:
+        jit_emit_flag(REG_ZF, 0, pending);
+        jit_emit_flag(REG_SF, 1, pending);
+        jit_emit8(0x38); jit_emit8(0xC1);                    // cmp cl, al: SF && !ZF
+        return JIT_CC_A;
+    default:
+        return -2;
+    }
+}
+
+// Compiles the basic block starting at start_pc. Returns the block, or JIT_UNCOMPILABLE when its first
+// instruction is not supported, or NULL when the JIT cannot run on this system.
+uint8_t* jit_compile_block(VM* vm, uint32_t start_pc) {
+    if (!jit_init()) {
+        jit_unavailable = true;
+        return NULL;
+    }
+
+    DecodedInstruction insns[JIT_MAX_BLOCK_INSTRUCTIONS];
+    int8_t xmm_of[NUM_TOTAL_REGISTERS];
+    bool written[NUM_TOTAL_REGISTERS];
+    int insn_count = 0, cached = 0;
+    bool terminated = false;
+    uint32_t pc = start_pc;
+    memset(xmm_of, -1, sizeof(xmm_of));
+    memset(written, 0, sizeof(written));
+
+    while (insn_count < JIT_MAX_BLOCK_INSTRUCTIONS && pc < vm->memory_size) {
+        const DecodedInstruction* d = decode_cache_fetch(vm, pc);
+        RegisterIndex regs[2];
+        int reg_count, needed = 0;
+        bool writes_dest;
+        if (!jit_instruction_supported(d, regs, &reg_count, &writes_dest)) break;
+        for (int i = 0; i < reg_count; i++) {
+            if (xmm_of[regs[i]] < 0 && (i == 0 || regs[i] != regs[0])) needed++;
+        }
+        if (cached + needed > JIT_MAX_CACHED_REGISTERS) break;
+        for (int i = 0; i < reg_count; i++) {
+            if (xmm_of[regs[i]] < 0) xmm_of[regs[i]] = (int8_t)(JIT_FIRST_GUEST_XMM + cached++);
+        }
+        if (writes_dest) written[regs[0]] = true;
+        insns[insn_count++] = *d;
+        pc = d->next_pc;
+        if (jit_is_branch((Opcode)d->opcode)) {
+            terminated = true;
+            break;
+        }
+    }
+    if (insn_count == 0) {
+        jit_set_block(start_pc, JIT_UNCOMPILABLE);
+        return JIT_UNCOMPILABLE;
+    }
+
+    if (jit_used + JIT_BLOCK_RESERVE > JIT_BUFFER_SIZE) jit_flush(vm);
+    if (mprotect(jit_buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        jit_unavailable = true;
+        return NULL;
+    }
+
+    uint8_t* entry = jit_buffer + jit_used;
+    jit_cursor = entry;
+    for (int reg = 0; reg < REG_ZF; reg++) {
+        if (xmm_of[reg] >= 0) jit_emit_sse_rm(0xF2, 0x10, xmm_of[reg], JIT_RBX, reg * 8); // movsd xmm, [rbx + reg]
+    }
+    uint8_t* loop_top = jit_cursor;
+
+    JitSideExit side_exits[JIT_MAX_BLOCK_INSTRUCTIONS * 2];
+    int side_exit_count = 0;
+    bool pending = false;
+    uint32_t executed = 0;
+    int body_count = terminated ? insn_count - 1 : insn_count;
+    uint32_t insn_pc = start_pc;
+
+    for (int i = 0; i < body_count; i++) {
+        const DecodedInstruction* d = &insns[i];
+        const DecodedOperand* op = d->operands;
+        int a = (d->opcode == OP_MOV_MEM_REG) ? -1 : xmm_of[op[0].reg];
+        switch (d->opcode) {
+        case OP_NOP:
+            break;
+        case OP_MOV_REG_REG:
+            if (op[0].reg != op[1].reg) jit_emit_sse_rr(0x66, 0x28, a, xmm_of[op[1].reg]); // movapd
+            break;
+        case OP_MOV_REG_VAL:
+            jit_emit_load_const(a, op[1].f64);
+            break;
+        case OP_MOV_REG_MEM:
+            if (op[1].u32 < vm->memory_size - 8) jit_emit_sse_rm(0xF2, 0x10, a, JIT_RBP, op[1].u32); // movsd xmm, [rbp + address]
+            break;
+        case OP_MOV_MEM_REG: {
+            uint32_t address = op[0].u32;
+            if (address >= vm->memory_size - 8) break;
+            // The address is fixed, so the page is marked written here instead of on every store. Compiled code
+            // only lives for one run, so a page marked but not stored to just costs vm_reset_image one page copy.
+            dirty_mark(vm, address, address + 8);
+            jit_emit_sse_rm(0xF2, 0x11, xmm_of[op[1].reg], JIT_RBP, address); // movsd [rbp + address], xmm
+            // Leave through the invalidation path if the store hit instruction bytes
+            jit_emit8(0x48); jit_emit8(0xB8); jit_emit64((uint64_t)(uintptr_t)&vm->code_map[address >> CODE_MAP_SHIFT]); // mov rax, &code_map[chunk]
+            for (uint32_t chunk = 0; chunk <= ((address + 7) >> CODE_MAP_SHIFT) - (address >> CODE_MAP_SHIFT); chunk++) {
+                jit_emit8(0x80); jit_emit8(0x78); jit_emit8((uint8_t)chunk); jit_emit8(0x00); // cmp byte [rax + chunk], 0
+                JitSideExit* side = &side_exits[side_exit_count++];
+                jit_emit_jcc(JIT_CC_NE, &side->rel32);
+                side->pc = d->next_pc;
+                side->executed = executed + 1 + d->folded_nops;
+                side->flags_pending = pending;
+                side->invalidate = true;
+                side->invalidate_address = address;
+            }
+            break;
+        }
+        case OP_ADD_REG_REG: case OP_SUB_REG_REG: case OP_MUL_REG_REG: case OP_DIV_REG_REG: {
+            int b = xmm_of[op[1].reg];
+            uint8_t sse_op = (d->opcode == OP_ADD_REG_REG) ? 0x58 : (d->opcode == OP_SUB_REG_REG) ? 0x5C : (d->opcode == OP_MUL_REG_REG) ? 0x59 : 0x5E;
+            if (d->opcode == OP_DIV_REG_REG) {
+                // fabs(divisor) > 1e-9, otherwise the interpreter re-executes the DIV and reports the error
+                jit_emit_sse_rr(0x66, 0x28, 0, b);                        // movapd xmm0, divisor
+                jit_emit_sse_rr(0x66, 0x54, 0, JIT_ABS_MASK_XMM);         // andpd xmm0, xmm15
+                jit_emit_load_const(1, 1e-9);
+                jit_emit_sse_rr(0x66, 0x2E, 0, 1);                        // ucomisd xmm0, xmm1
+                JitSideExit* side = &side_exits[side_exit_count++];
+                jit_emit_jcc(JIT_CC_BE, &side->rel32);
+                side->pc = insn_pc;
+                side->executed = executed;
+                side->flags_pending = pending;
+                side->invalidate = false;
+            }
+            jit_emit_sse_rr(0xF2, sse_op, a, b);
+            jit_emit_sse_rr(0x66, 0x28, JIT_FLAG_XMM, a);                 // movapd xmm14, result
+            pending = true;
+            break;
+        }
+        case OP_ADD_REG_VAL: case OP_SUB_REG_VAL: case OP_MUL_REG_VAL: case OP_DIV_REG_VAL: {
+            uint8_t sse_op = (d->opcode == OP_ADD_REG_VAL) ? 0x58 : (d->opcode == OP_SUB_REG_VAL) ? 0x5C : (d->opcode == OP_MUL_REG_VAL) ? 0x59 : 0x5E;
+            jit_emit_load_const(0, op[1].f64);
+            jit_emit_sse_rr(0xF2, sse_op, a, 0);
+            jit_emit_sse_rr(0x66, 0x28, JIT_FLAG_XMM, a);
+            pending = true;
+            break;
+        }
+        case OP_INC_REG: case OP_DEC_REG:
+            jit_emit_load_const(0, 1.0);
+            jit_emit_sse_rr(0xF2, d->opcode == OP_INC_REG ? 0x58 : 0x5C, a, 0);
+            jit_emit_sse_rr(0x66, 0x28, JIT_FLAG_XMM, a);
+            pending = true;
+            break;
+        case OP_CMP_REG_REG:
+            jit_emit_sse_rr(0x66, 0x28, JIT_FLAG_XMM, a);
+            jit_emit_sse_rr(0xF2, 0x5C, JIT_FLAG_XMM, xmm_of[op[1].reg]); // subsd xmm14, b
+            pending = true;
+            break;
+        case OP_CMP_REG_VAL:
+            jit_emit_load_const(0, op[1].f64);
+            jit_emit_sse_rr(0x66, 0x28, JIT_FLAG_XMM, a);
+            jit_emit_sse_rr(0xF2, 0x5C, JIT_FLAG_XMM, 0);
+            pending = true;
+            break;
+        default:
+            break;
+        }
+        executed += 1 + d->folded_nops;
+        insn_pc = d->next_pc;
+    }
+
+    if (terminated) {
+        const DecodedInstruction* branch = &insns[insn_count - 1];
+        uint32_t target = branch->operands[0].u32;
+        uint32_t after = executed + 1 + branch->folded_nops;
+        int cc = jit_emit_branch_condition((Opcode)branch->opcode, pending);
+        uint8_t* taken_rel32 = NULL;
+        if (cc >= 0) jit_emit_jcc((uint8_t)cc, &taken_rel32);
+        if (cc != -1) jit_emit_exit(xmm_of, written, pending, after, branch->next_pc, true);
+        if (cc != -2) {
+            if (taken_rel32) jit_patch_rel32(taken_rel32, jit_cursor);
+            if (target == start_pc) {
+                // Loop back without leaving: registers stay cached, flags are stored for the next iteration
+                if (pending) jit_emit_materialize_flags();
+                jit_emit_add_retired(after);
+                jit_emit8(0xE9);
+                uint8_t* rel32 = jit_cursor;
+                jit_emit32(0);
+                jit_patch_rel32(rel32, loop_top);
+            }
+            else {
+                jit_emit_exit(xmm_of, written, pending, after, target, true);
+            }
+        }
+    }
+    else {
+        jit_emit_exit(xmm_of, written, pending, executed, insn_pc, true);
+    }
+
+    for (int i = 0; i < side_exit_count; i++) {
+        JitSideExit* side = &side_exits[i];
+        jit_patch_rel32(side->rel32, jit_cursor);
+        if (side->invalidate) {
+            for (int reg = 0; reg < REG_ZF; reg++) {
+                if (written[reg]) jit_emit_sse_rm(0xF2, 0x11, xmm_of[reg], JIT_RBX, reg * 8);
+            }
+            if (side->flags_pending) jit_emit_materialize_flags();
+            jit_emit_add_retired(side->executed);
+            jit_emit8(0x48); jit_emit8(0xBF); jit_emit64((uint64_t)(uintptr_t)vm);    // mov rdi, vm
+            jit_emit8(0xBE); jit_emit32(side->invalidate_address);                    // mov esi, address
+            jit_emit8(0xBA); jit_emit32(8);                                           // mov edx, 8
+            jit_emit8(0x48); jit_emit8(0xB8); jit_emit64((uint64_t)(uintptr_t)&decode_cache_invalidate); // mov rax, helper
+            jit_emit8(0xFF); jit_emit8(0xD0);                                         // call rax
+            jit_emit8(0xB8); jit_emit32(side->pc);                                    // mov eax, pc
+            jit_emit8(0xE9);
+            uint8_t* rel32 = jit_cursor;
+            jit_emit32(0);
+            jit_patch_rel32(rel32, jit_epilogue);
+        }
+        else {
+            jit_emit_exit(xmm_of, written, side->flags_pending, side->executed, side->pc, false);
+        }
+    }
+
+    jit_used = (size_t)(jit_cursor - jit_buffer);
+    if (jit_set_block(start_pc, entry)) {
+        jit_block_count++;
+        for (int i = 0; i < jit_pending_exit_count; i++) {
+            if (jit_pending_exits[i].target_pc != start_pc) continue;
+            jit_patch_rel32(jit_buffer + jit_pending_exits[i].patch_offset, entry);
+            jit_pending_exits[i--] = jit_pending_exits[--jit_pending_exit_count];
+        }
+        for (uint32_t chunk = start_pc >> CODE_MAP_SHIFT; chunk <= (pc - 1) >> CODE_MAP_SHIFT; chunk++) vm->code_map[chunk] |= CODE_MAP_COMPILED;
+    }
+    else {
+        entry = JIT_UNCOMPILABLE;
+    }
+    mprotect(jit_buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+    return entry;
+}
+
+// Called by the threaded core on every taken backward branch. Counts the target, compiles it once it is
+// hot, and runs compiled code when available. Returns the PC the interpreter continues at.
+uint32_t jit_backedge(VM* vm, uint32_t target) {
+    uint8_t* block = jit_block_at(target);
+    if (block == NULL) {
+        uint16_t* counter = &jit_hot_counters[(target ^ (target >> 12)) & (JIT_HOT_SLOTS - 1)];
+        if (++*counter < JIT_HOT_THRESHOLD) return target;
+        *counter = 0;
+        block = jit_compile_block(vm, target);
+    }
+    if (block == NULL || block == JIT_UNCOMPILABLE) return target;
+    materialize_flags(vm); // Compiled code reads and writes registers[REG_ZF..REG_OF] directly
+    return jit_enter(vm->registers, vm->memory, &jit_instruction_count, block);
+}
+
+// Frees the calling thread's code buffer. Called by batch workers before they exit.
+void jit_release(VM* vm) {
+    jit_flush(vm);
+    if (jit_buffer == NULL) return;
+    munmap(jit_buffer, JIT_BUFFER_SIZE);
+    jit_buffer = NULL;
+}
+#else
+void jit_flush(VM* vm) {
+}
+
+void jit_release(VM* vm) {
+}
+#endif
+
+// Threaded Interpreter Core
+
+typedef enum {
+    CORE_SWITCH,
+    CORE_THREADED
+} InterpreterCore;
+
+InterpreterCore interpreter_core = CORE_THREADED;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define THREADED_COMPUTED_GOTO 1 // Labels-as-values are available, dispatch through a handler table
+#endif
+
+// Opcodes with a dedicated handler in execute_threaded. Everything else (the library opcodes) goes
+// through the generic handler, which re-enters execute_instruction with the predecoded operands.
+#define THREADED_OPCODE_LIST(X) \
+    X(OP_NOP) X(OP_MOV_REG_REG) X(OP_MOV_REG_VAL) X(OP_MOV_REG_MEM) X(OP_MOV_MEM_REG) \
+    X(OP_ADD_REG_REG) X(OP_ADD_REG_VAL) X(OP_SUB_REG_REG) X(OP_SUB_REG_VAL) X(OP_MUL_REG_REG) X(OP_MUL_REG_VAL) \
+    X(OP_DIV_REG_REG) X(OP_DIV_REG_VAL) X(OP_MOD_REG_REG) X(OP_MOD_REG_VAL) \
+    X(OP_AND_REG_REG) X(OP_AND_REG_VAL) X(OP_OR_REG_REG) X(OP_OR_REG_VAL) X(OP_XOR_REG_REG) X(OP_XOR_REG_VAL) \
+    X(OP_NOT_REG) X(OP_NEG_REG) X(OP_TEST_REG_REG) X(OP_TEST_REG_VAL) \
+    X(OP_SHL_REG_REG) X(OP_SHL_REG_VAL) X(OP_SHR_REG_REG) X(OP_SHR_REG_VAL) X(OP_SAR_REG_REG) X(OP_SAR_REG_VAL) \
+    X(OP_ROL_REG_REG) X(OP_ROL_REG_VAL) X(OP_ROR_REG_REG) X(OP_ROR_REG_VAL) \
+    X(OP_CMP_REG_REG) X(OP_CMP_REG_VAL) X(OP_IMUL_REG_REG) X(OP_IDIV_REG_REG) \
+    X(OP_MOVZX_REG_REG) X(OP_MOVZX_REG_MEM) X(OP_MOVSX_REG_REG) X(OP_MOVSX_REG_MEM) X(OP_LEA_REG_MEM) \
+    X(OP_JMP) X(OP_JMP_NZ) X(OP_JMP_Z) X(OP_JMP_S) X(OP_JMP_NS) X(OP_JMP_C) X(OP_JMP_NC) \
+    X(OP_JMP_O) X(OP_JMP_NO) X(OP_JMP_GE) X(OP_JMP_LE) X(OP_JMP_G) X(OP_JMP_L) X(OP_CALL_ADDR) X(OP_HLT) \
+    X(OP_INC_REG) X(OP_DEC_REG) X(OP_INC_MEM) X(OP_DEC_MEM) X(OP_RND_REG) X(OP_PUSH_REG) X(OP_POP_REG) X(OP_RET) \
+    X(OP_XCHG_REG_REG) X(OP_BSWAP_REG) X(OP_SETZ_REG) X(OP_SETNZ_REG) X(OP_PUSHA) X(OP_POPA) X(OP_PUSHFD) X(OP_POPFD) \
+    X(OP_MATH_ADD) X(OP_MATH_SUB) X(OP_MATH_MUL) X(OP_MATH_DIV) X(OP_MATH_MOD) \
+    X(OP_MATH_POW) X(OP_MATH_MIN) X(OP_MATH_MAX) X(OP_MATH_ATAN2)
+
+#define FUSED_OPCODE_LIST(X) \
+    X(FUSED_INC_CMP_VAL_JCC) X(FUSED_INC_CMP_REG_JCC) X(FUSED_DEC_CMP_VAL_JCC) X(FUSED_DEC_CMP_REG_JCC) \
+    X(FUSED_CMP_VAL_JCC) X(FUSED_CMP_REG_JCC)
+
+// Flag results shared by the handlers below. Floating-point results never set CF or OF
+// (see set_carry_flag_float/set_overflow_flag_float), and neither do the bitwise operations, so the
+// result is all the lazy flag state needs. Instructions with flag register operands never get here.
+static inline void set_result_flags_float(VM* vm, double result) {
+    record_flags(vm, result);
+}
+
+static inline void set_result_flags_int(VM* vm, uint32_t result) {
+    record_flags(vm, (double)(int32_t)result);
+}
+
+#define THREADED_CORE_NAME execute_threaded_release
+#define THREADED_CORE_TRACE 0
+#include "threaded_core.inc"
+
+#define THREADED_CORE_NAME execute_threaded_trace
+#define THREADED_CORE_TRACE 1
+#include "threaded_core.inc"
+
+#define THREADED_CORE_NAME execute_threaded_profile
+#define THREADED_CORE_TRACE 0
+#define THREADED_CORE_PROFILE 1
+#include "threaded_core.inc"
+
+// Counts one execution of the instruction at pc for the hotspot listing
+static inline void hotspot_count(VM* vm, uint32_t pc) {
+    if (pc >= vm->memory_size) return;
+    uint64_t* page = vm->hotspot_pages[pc >> DECODE_PAGE_SHIFT];
+    if (page == NULL) {
+        page = (uint64_t*)calloc(DECODE_PAGE_SIZE, sizeof(uint64_t));
+        if (page == NULL) return;
+        vm->hotspot_pages[pc >> DECODE_PAGE_SHIFT] = page;
+    }
+    page[pc & (DECODE_PAGE_SIZE - 1)]++;
+}
+
+// Call stack sampling hooks for the switch core's profiling loop, see Call Stack Sampling.
+// The hash of every stack prefix is kept next to the frame, so pushing a frame costs one hash step.
+static inline uint64_t stack_hash_step(uint64_t hash, uint32_t frame) {
+    return (hash ^ frame) * 0x100000001B3ull;
+}
+
+static void shadow_push(VM* vm, uint32_t entry) {
+    if (vm->shadow_depth < STACK_SAMPLE_MAX_DEPTH) {
+        uint64_t parent = vm->shadow_depth > 0 ? vm->shadow_hashes[vm->shadow_depth - 1] : 0xCBF29CE484222325ull;
+        vm->shadow_frames[vm->shadow_depth] = entry;
+        vm->shadow_hashes[vm->shadow_depth] = stack_hash_step(parent, entry);
+    }
+    vm->shadow_depth++;
+}
+
+static bool stack_sample_grow(VM* vm) {
+    uint32_t capacity = vm->stack_sample_capacity > 0 ? vm->stack_sample_capacity * 2 : 1024;
+    StackSample* table = (StackSample*)calloc(capacity, sizeof(StackSample));
+    if (table == NULL) return false;
+    for (uint32_t i = 0; i < vm->stack_sample_capacity; i++) {
+        StackSample* old = &vm->stack_samples[i];
+        if (old->frames == NULL) continue;
+        uint32_t slot = (uint32_t)old->hash & (capacity - 1);
+        while (table[slot].frames != NULL) slot = (slot + 1) & (capacity - 1);
+        table[slot] = *old;
+    }
+    free(vm->stack_samples);
+    vm->stack_samples = table;
+    vm->stack_sample_capacity = capacity;
+    return true;
+}
+
+// Adds one sample of the current shadow stack
+static void stack_sample_record(VM* vm) {
+    uint32_t depth = vm->shadow_depth < STACK_SAMPLE_MAX_DEPTH ? vm->shadow_depth : STACK_SAMPLE_MAX_DEPTH;
+    if (depth == 0) return;
+    if ((vm->stack_sample_used + 1) * 2 > vm->stack_sample_capacity && !stack_sample_grow(vm)) return;
+    uint64_t hash = vm->shadow_hashes[depth - 1];
+    uint32_t slot = (uint32_t)hash & (vm->stack_sample_capacity - 1);
+    while (vm->stack_samples[slot].frames != NULL) {
+        StackSample* sample = &vm->stack_samples[slot];
+        if (sample->hash == hash && sample->depth == depth && memcmp(sample->frames, vm->shadow_frames, depth * sizeof(uint32_t)) == 0) {
+            sample->count++;
+            vm->stack_sample_total++;
+            return;
+        }
+        slot = (slot + 1) & (vm->stack_sample_capacity - 1);
+    }
+    uint32_t* frames = (uint32_t*)malloc(depth * sizeof(uint32_t));
+    if (frames == NULL) return;
+    memcpy(frames, vm->shadow_frames, depth * sizeof(uint32_t));
+    StackSample* sample = &vm->stack_samples[slot];
+    sample->hash = hash;
+    sample->depth = depth;
+    sample->frames = frames;
+    sample->count = 1;
+    vm->stack_sample_used++;
+    vm->stack_sample_total++;
+}
+
+// Runs after each instruction. A CALL has already jumped, so the PC is the callee's entry address.
+// A RET without a matching CALL (the guest adjusted SP itself) keeps the outermost frame.
+static inline void stack_sampler_step(VM* vm, Opcode opcode, uint32_t retired) {
+    if (opcode == OP_CALL_ADDR) shadow_push(vm, vm->program_counter);
+    else if (opcode == OP_RET && vm->shadow_depth > 1) vm->shadow_depth--;
+    vm->stack_sample_countdown -= retired;
+    if (vm->stack_sample_countdown <= 0) {
+        vm->stack_sample_countdown += vm->stack_sample_interval;
+        stack_sample_record(vm);
+    }
+}
+
+// Fetch/execute loop around the switch core, instantiated once per tracing and profiling mode like the
+// cores themselves. The switch core never fuses, so its profile only uses the opcode slots. It also never
+// enters compiled code, which is why hotspot and call stack runs always use it: every instruction is seen
+// at its own PC.
+static VM_ALWAYS_INLINE uint64_t execute_switch_impl(VM* vm, const bool trace, const bool profile) {
+    uint64_t count = 0;
+    while (vm->running) {
+        uint32_t instruction_pc = vm->program_counter;
+        Opcode opcode;
+        uint32_t folded_nops = 0;
+        if (predecode_enabled) {
+            const DecodedInstruction* decoded = decode_cache_fetch(vm, vm->program_counter);
+            vm->program_counter = decoded->next_pc;
+            vm->current_decoded = decoded->operands;
+            opcode = (Opcode)decoded->opcode;
+            folded_nops = decoded->folded_nops;
+        }
+        else {
+            opcode = decode_opcode(vm);
+        }
+        if (profile) {
+            vm->profile_current = (uint16_t)opcode;
+            vm->profile_counts[opcode]++;
+            vm->profile_counts[OP_NOP] += folded_nops;
+            if (vm->hotspot_counting) hotspot_count(vm, instruction_pc);
+        }
+        if (trace) execute_instruction_trace(vm, opcode);
+        else execute_instruction_release(vm, opcode);
+        if (profile && vm->stack_sampling) stack_sampler_step(vm, opcode, 1 + folded_nops);
+        if (vm->needs_gfx_update) gfx_present_if_due(vm);
+
+        if (!vm->running) break;
+        count += 1 + folded_nops;
+    }
+    vm->current_decoded = NULL;
+    return count;
+}
+
+uint64_t execute_switch_release(VM* vm) {
+    return execute_switch_impl(vm, false, false);
+}
+
+uint64_t execute_switch_trace(VM* vm) {
+    return execute_switch_impl(vm, true, false);
+}
+
+uint64_t execute_switch_profile(VM* vm) {
+    return execute_switch_impl(vm, false, true);
+}
+
+// Resets the guest's CPU state, or restores it from a loaded snapshot, and runs the program until it halts. Prints nothing itself, so it
+// is shared by the interactive run and the batch runner. Returns the executed instruction count.
+uint64_t vm_execute(VM* vm) {
+    vm->running = true;
+    vm->needs_gfx_update = false;
+    if (vm->resume_pending) {
+        vm->resume_pending = false;
+        snapshot_resume(vm);
+    }
+    else {
+        vm->program_counter = 0;
+        memset(vm->registers, 0, sizeof(vm->registers));
+        vm->registers[REG_SP] = vm->memory_size - 8;
+        vm->cursor_x = 0;
+        vm->cursor_y = 0;
+        vm->text_color = 7;
+    }
+
+    memset(vm->fused_pattern_counts, 0, sizeof(vm->fused_pattern_counts));
+    vm->flags_pending = false;
+    vm->flags_eager = false;
+
+    uint64_t instruction_count = 0;
+
+    // The tracing and profiling modes are fixed for the whole run, so pick the matching instantiation once.
+    // Tracing wins over profiling: the trace output would swamp any timing.
+    if ((vm->hotspot_counting || vm->stack_sampling) && !debug_mode) {
+        instruction_count = execute_switch_profile(vm);
+    }
+    else if (interpreter_core == CORE_THREADED) {
+        if (debug_mode) instruction_count = execute_threaded_trace(vm);
+        else if (vm->profiling) instruction_count = execute_threaded_profile(vm);
+        else instruction_count = execute_threaded_release(vm);
+    }
+    else {
+        if (debug_mode) instruction_count = execute_switch_trace(vm);
+        else if (vm->profiling) instruction_count = execute_switch_profile(vm);
+        else instruction_count = execute_switch_release(vm);
+    }
+    materialize_flags(vm);
+    if (vm->needs_gfx_update) gfx_update_screen(vm); // Last frame, even if the refresh interval has not passed
+    jit_flush(vm); // Compiled code belongs to this thread's JIT and must not outlive the run
+
+    vm->instruction_count = instruction_count;
+    return instruction_count;
+}
+
+// Profiler
+// Opt-in per-opcode profile of one interactive run. The profiling core counts every dispatch and publishes
+// the slot it is executing in profile_current; a sampler thread reads that slot every
+// PROFILE_SAMPLE_INTERVAL_US, so host time is attributed statistically and the core never reads a clock.
+
+#define PROFILE_SAMPLE_INTERVAL_US 1000
+#define PROFILE_DUMP_FILENAME "profile.json"
+
+bool profile_enabled = false;
+
+typedef struct {
+    VM* vm;
+    volatile bool stop;
+    double start_time;
+    double wall_seconds;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+    bool thread_started;
+} Profiler;
+
+static const char* profile_slot_name(int slot) {
+    if (slot == PROFILE_SLOT_COMPILED) return "[compiled code]";
+    if (slot < OP_INVALID) return opcode_info[slot].name;
+    if (slot >= FUSED_INC_CMP_VAL_JCC && slot < FUSED_END) return fused_pattern_names[FUSED_INDEX(slot)];
+    return "INVALID";
+}
+
+static void profiler_sample_loop(Profiler* profiler) {
+    while (!profiler->stop) {
+#ifdef _WIN32
+        Sleep(PROFILE_SAMPLE_INTERVAL_US / 1000 > 0 ? PROFILE_SAMPLE_INTERVAL_US / 1000 : 1);
+#else
+        usleep(PROFILE_SAMPLE_INTERVAL_US);
+#endif
+        if (profiler->stop) break; // The run ended while sleeping, the slot is stale
+        profiler->vm->profile_samples[profiler->vm->profile_current]++;
+    }
+}
+
+#ifdef _WIN32
+DWORD WINAPI profiler_thread(LPVOID param) {
+    profiler_sample_loop((Profiler*)param);
+    return 0;
+}
+#else
+void* profiler_thread(void* param) {
+    profiler_sample_loop((Profiler*)param);
+    return NULL;
+}
+#endif
+
+// Clears the counters and starts the sampler. Without a sampler thread the counts are still collected,
+// only the time columns stay empty.
+void profiler_start(Profiler* profiler, VM* vm) {
+    memset(profiler, 0, sizeof(*profiler));
+    profiler->vm = vm;
+    memset(vm->profile_counts, 0, sizeof(vm->profile_counts));
+    memset(vm->profile_samples, 0, sizeof(vm->profile_samples));
+    vm->profile_current = OP_NOP;
+    vm->profiling = true;
+#ifdef _WIN32
+    profiler->thread = CreateThread(NULL, 0, profiler_thread, profiler, 0, NULL);
+    profiler->thread_started = profiler->thread != NULL;
+#else
+    profiler->thread_started = pthread_create(&profiler->thread, NULL, profiler_thread, profiler) == 0;
+#endif
+    if (!profiler->thread_started) fprintf(stderr, "Warning: Could not start the profiler's sampler thread, timing is unavailable.\n");
+    profiler->start_time = wall_clock_seconds();
+}
+
+void profiler_stop(Profiler* profiler) {
+    profiler->stop = true;
+    profiler->wall_seconds = wall_clock_seconds() - profiler->start_time;
+    if (profiler->thread_started) {
+#ifdef _WIN32
+        WaitForSingleObject(profiler->thread, INFINITE);
+        CloseHandle(profiler->thread);
+#else
+        pthread_join(profiler->thread, NULL);
+#endif
+    }
+    profiler->vm->profiling = false;
+}
+
+static const VM* profile_sort_vm;
+
+static int profile_compare_slots(const void* a, const void* b) {
+    int slot_a = *(const int*)a, slot_b = *(const int*)b;
+    const VM* vm = profile_sort_vm;
+    if (vm->profile_samples[slot_a] != vm->profile_samples[slot_b]) return vm->profile_samples[slot_a] > vm->profile_samples[slot_b] ? -1 : 1;
+    if (vm->profile_counts[slot_a] != vm->profile_counts[slot_b]) return vm->profile_counts[slot_a] > vm->profile_counts[slot_b] ? -1 : 1;
+    return slot_a - slot_b;
+}
+
+// Prints the table sorted by time, then count, and writes the same rows to PROFILE_DUMP_FILENAME.
+// A slot's time is its share of the sampler ticks applied to the wall time of the run.
+void profiler_report(const Profiler* profiler) {
+    const VM* vm = profiler->vm;
+    int slots[PROFILE_SLOTS];
+    int slot_count = 0;
+    uint64_t total_count = 0, total_samples = 0;
+    for (int slot = 0; slot < PROFILE_SLOTS; slot++) {
+        total_count += vm->profile_counts[slot];
+        total_samples += vm->profile_samples[slot];
+        if (vm->profile_counts[slot] > 0 || vm->profile_samples[slot] > 0) slots[slot_count++] = slot;
+    }
+    profile_sort_vm = vm;
+    qsort(slots, slot_count, sizeof(slots[0]), profile_compare_slots);
+
+    FILE* dump = fopen(PROFILE_DUMP_FILENAME, "w");
+    if (dump == NULL) fprintf(stderr, "Error: Could not create profile dump '%s'.\n", PROFILE_DUMP_FILENAME);
+    else {
+        fprintf(dump, "{\n");
+        fprintf(dump, "  \"interpreter_core\": \"%s\",\n", interpreter_core == CORE_THREADED ? "threaded" : "switch");
+        fprintf(dump, "  \"jit\": %s,\n", jit_enabled ? "true" : "false");
+        fprintf(dump, "  \"wall_seconds\": %.9f,\n", profiler->wall_seconds);
+        fprintf(dump, "  \"sample_interval_us\": %d,\n", PROFILE_SAMPLE_INTERVAL_US);
+        fprintf(dump, "  \"total_samples\": %llu,\n", (unsigned long long)total_samples);
+        fprintf(dump, "  \"total_count\": %llu,\n", (unsigned long long)total_count);
+        fprintf(dump, "  \"opcodes\": [\n");
+    }
+
+    printf("\n--- Opcode Profile ---\n");
+    printf("%-24s %14s %8s %12s %8s %10s\n", "Opcode", "Count", "Count %", "Time ms", "Time %", "ns/exec");
+    for (int i = 0; i < slot_count; i++) {
+        int slot = slots[i];
+        uint64_t count = vm->profile_counts[slot];
+        uint64_t samples = vm->profile_samples[slot];
+        double seconds = total_samples > 0 ? profiler->wall_seconds * (double)samples / (double)total_samples : 0.0;
+        double count_percent = total_count > 0 ? 100.0 * (double)count / (double)total_count : 0.0;
+        double time_percent = total_samples > 0 ? 100.0 * (double)samples / (double)total_samples : 0.0;
+        double ns_per_exec = count > 0 ? seconds * 1e9 / (double)count : 0.0;
+        printf("%-24s %14llu %7.2f%% %12.3f %7.2f%% %10.2f\n", profile_slot_name(slot), (unsigned long long)count,
+            count_percent, seconds * 1000.0, time_percent, ns_per_exec);
+        if (dump != NULL) {
+            fprintf(dump, "    { \"name\": \"%s\", \"slot\": %d, \"count\": %llu, \"samples\": %llu, \"seconds\": %.9f, \"ns_per_exec\": %.3f }%s\n",
+                profile_slot_name(slot), slot, (unsigned long long)count, (unsigned long long)samples, seconds, ns_per_exec,
+                i + 1 < slot_count ? "," : "");
+        }
+    }
+    printf("%llu samples over %.3f seconds. Profile written to '%s'.\n", (unsigned long long)total_samples,
+        profiler->wall_seconds, PROFILE_DUMP_FILENAME);
+    if (dump != NULL) {
+        fprintf(dump, "  ]\n}\n");
+        fclose(dump);
+    }
+}
+
+// Hotspot Listing
+// Opt-in per-PC execution counts for one interactive run, joined with the assembler's listing so every
+// source line shows how often it ran. Counting happens in the switch core's profiling instantiation.
+
+#define HOTSPOT_TOP_LINES 10
+
+bool hotspot_enabled = false;
+
+typedef struct {
+    int line_number;
+    uint64_t count;
+    char source[64];
+} HotspotLine;
+
+void hotspot_reset(VM* vm) {
+    for (uint32_t i = 0; i < DECODE_PAGE_COUNT; i++) {
+        free(vm->hotspot_pages[i]);
+        vm->hotspot_pages[i] = NULL;
+    }
+}
+
+static uint64_t hotspot_lookup(const VM* vm, uint32_t pc) {
+    if (pc >= MEMORY_SIZE) return 0;
+    const uint64_t* page = vm->hotspot_pages[pc >> DECODE_PAGE_SHIFT];
+    return page != NULL ? page[pc & (DECODE_PAGE_SIZE - 1)] : 0;
+}
+
+// Keeps top[] sorted by count, hottest first
+static void hotspot_insert_top(HotspotLine* top, int* top_count, const HotspotLine* line) {
+    int position = *top_count;
+    while (position > 0 && top[position - 1].count < line->count) position--;
+    if (position >= HOTSPOT_TOP_LINES) return;
+    int last = (*top_count < HOTSPOT_TOP_LINES) ? (*top_count)++ : HOTSPOT_TOP_LINES - 1;
+    memmove(&top[position + 1], &top[position], (last - position) * sizeof(HotspotLine));
+    top[position] = *line;
+}
+
+// Copies rom_filename's .lst listing to <rom>.hot.lst with an execution count and share of all executed
+// instructions in front of every line that emitted code, then prints the hottest lines.
+// Rows look like "12       | 3A       | JL loop                        | 2E 14 00 00 00       | ".
+int hotspot_write_listing(const VM* vm, const char* rom_filename) {
+    char lst_filename[256], hot_filename[256];
+    snprintf(lst_filename, sizeof(lst_filename), "%s.lst", rom_filename);
+    snprintf(hot_filename, sizeof(hot_filename), "%s.hot.lst", rom_filename);
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < DECODE_PAGE_COUNT; i++) {
+        if (vm->hotspot_pages[i] == NULL) continue;
+        for (uint32_t j = 0; j < DECODE_PAGE_SIZE; j++) total += vm->hotspot_pages[i][j];
+    }
+
+    FILE* lst_file = fopen(lst_filename, "r");
+    if (lst_file == NULL) {
+        fprintf(stderr, "Error: Could not open listing file '%s' for the hotspot listing.\n", lst_filename);
+        return -1;
+    }
+    FILE* hot_file = fopen(hot_filename, "w");
+    if (hot_file == NULL) {
+        fprintf(stderr, "Error: Could not create hotspot listing '%s'.\n", hot_filename);
+        fclose(lst_file);
+        return -1;
+    }
+
+    HotspotLine top[HOTSPOT_TOP_LINES];
+    int top_count = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), lst_file) != NULL) {
+        if (strncmp(line, "Line No.", 8) == 0) {
+            fprintf(hot_file, "Executions   | %% Total  |%s", line);
+            continue;
+        }
+        if (strncmp(line, "---------|", 10) == 0) {
+            fprintf(hot_file, "-------------|----------|%s", line);
+            continue;
+        }
+        if (!isdigit((unsigned char)line[0])) {
+            if (strncmp(line, "Assembly Listing for:", 21) == 0 || line[0] == '\n') fputs(line, hot_file);
+            else fprintf(hot_file, "%-13s|%-10s|%s", "", "", line); // Continuation of a source line with a line break
+            continue;
+        }
+
+        // Fields: line number, address, source, binary code, comment. Only rows with binary code ran, not
+        // rows of instructions the peephole optimizer removed, which say "(removed)" instead.
+        char* fields[5] = { NULL };
+        int field_count = 0;
+        char row[4096];
+        strcpy(row, line);
+        for (char* cursor = row; cursor != NULL && field_count < 5; field_count++) {
+            fields[field_count] = cursor;
+            cursor = strchr(cursor, '|');
+            if (cursor != NULL) *cursor++ = '\0';
+        }
+        bool has_code = false;
+        if (field_count >= 4 && strstr(fields[3], "(removed)") == NULL) {
+            for (const char* c = fields[3]; *c != '\0'; c++) {
+                if (isxdigit((unsigned char)*c)) {
+                    has_code = true;
+                    break;
+                }
+            }
+        }
+        if (!has_code) {
+            fprintf(hot_file, "%-13s|%-10s|%s", "", "", line);
+            continue;
+        }
+
+        uint32_t address = (uint32_t)strtoul(fields[1], NULL, 16);
+        uint64_t count = hotspot_lookup(vm, address);
+        double percent = total > 0 ? 100.0 * (double)count / (double)total : 0.0;
+        fprintf(hot_file, "%-12llu | %7.2f%% |%s", (unsigned long long)count, percent, line);
+
+        if (count > 0) {
+            HotspotLine hot;
+            hot.line_number = atoi(fields[0]);
+            hot.count = count;
+            const char* source = fields[2];
+            while (*source == ' ') source++;
+            snprintf(hot.source, sizeof(hot.source), "%s", source);
+            for (int i = (int)strlen(hot.source) - 1; i >= 0 && hot.source[i] == ' '; i--) hot.source[i] = '\0';
+            hotspot_insert_top(top, &top_count, &hot);
+        }
+    }
+    fclose(lst_file);
+    fclose(hot_file);
+
+    printf("\n--- Hottest Source Lines ---\n");
+    printf("%-8s %14s %8s  %s\n", "Line", "Executions", "% Total", "Source");
+    for (int i = 0; i < top_count; i++) {
+        printf("%-8d %14llu %7.2f%%  %s\n", top[i].line_number, (unsigned long long)top[i].count,
+            total > 0 ? 100.0 * (double)top[i].count / (double)total : 0.0, top[i].source);
+    }
+    printf("Annotated listing written to '%s'.\n", hot_filename);
+    return 0;
+}
+
+// Call Stack Sampling
+// Opt-in sampling of the guest's subroutine stack for one interactive run. The switch core's profiling loop
+// keeps a shadow stack of callee entry addresses, updated on CALL and RET, and every N instructions adds
+// the whole stack to a table of distinct stacks. Afterwards the table is written as folded stacks
+// ("main;draw_frame;plot 1234"), the input format of flamegraph.pl and similar tools.
+
+#define STACK_SAMPLE_DEFAULT_INTERVAL 1000
+
+uint32_t call_stack_sample_interval = 0; // Instructions between samples, 0 = off
+
+typedef struct {
+    uint32_t address;
+    char name[sizeof(labels[0].name)];
+} StackSymbol;
+
+void stack_sampler_reset(VM* vm) {
+    for (uint32_t i = 0; i < vm->stack_sample_capacity; i++) free(vm->stack_samples[i].frames);
+    free(vm->stack_samples);
+    vm->stack_samples = NULL;
+    vm->stack_sample_capacity = 0;
+    vm->stack_sample_used = 0;
+    vm->stack_sample_total = 0;
+    vm->shadow_depth = 0;
+}
+
+// The program entry at address 0 is the outermost frame of every sample
+void stack_sampler_start(VM* vm, uint32_t interval) {
+    stack_sampler_reset(vm);
+    vm->stack_sample_interval = interval;
+    vm->stack_sample_countdown = interval;
+    shadow_push(vm, 0);
+    vm->stack_sampling = true;
+}
+
+static int stack_symbol_compare(const void* a, const void* b) {
+    uint32_t address_a = ((const StackSymbol*)a)->address, address_b = ((const StackSymbol*)b)->address;
+    return address_a < address_b ? -1 : (address_a > address_b ? 1 : 0);
+}
+
+// Labels come from the assembler's symbol table when the ROM was assembled in this session, otherwise
+// from the label rows of its .lst listing. Returns the symbol count, sorted by address.
+static int stack_symbols_load(const char* rom_filename, StackSymbol** out) {
+    StackSymbol* symbols = NULL;
+    int count = 0;
+    if (label_count > 0) {
+        symbols = (StackSymbol*)malloc(label_count * sizeof(StackSymbol));
+        if (symbols == NULL) return 0;
+        for (int i = 0; i < label_count; i++) {
+            symbols[count].address = labels[i].address;
+            strcpy(symbols[count].name, labels[i].name);
+            count++;
+        }
+    }
+    else {
+        char lst_filename[256];
+        snprintf(lst_filename, sizeof(lst_filename), "%s.lst", rom_filename);
+        FILE* lst_file = fopen(lst_filename, "r");
+        if (lst_file != NULL) {
+            int capacity = 0;
+            char line[4096];
+            while (fgets(line, sizeof(line), lst_file) != NULL) {
+                // Label rows: "5        | 14       | loop:" with the rest of the row on the next line
+                if (!isdigit((unsigned char)line[0])) continue;
+                char* address_field = strchr(line, '|');
+                char* source = address_field != NULL ? strchr(address_field + 1, '|') : NULL;
+                if (source == NULL) continue;
+                source++;
+                while (*source == ' ') source++;
+                size_t length = strcspn(source, ":| \r\n");
+                if (length == 0 || source[length] != ':' || length >= sizeof(symbols[0].name)) continue;
+                if (count == capacity) {
+                    capacity = capacity > 0 ? capacity * 2 : 64;
+                    StackSymbol* grown = (StackSymbol*)realloc(symbols, capacity * sizeof(StackSymbol));
+                    if (grown == NULL) break;
+                    symbols = grown;
+                }
+                symbols[count].address = (uint32_t)strtoul(address_field + 1, NULL, 16);
+                memcpy(symbols[count].name, source, length);
+                symbols[count].name[length] = '\0';
+                count++;
+            }
+            fclose(lst_file);
+        }
+    }
+    if (count > 0) qsort(symbols, count, sizeof(StackSymbol), stack_symbol_compare);
+    *out = symbols;
+    return count;
+}
+
+// "plot" for a labelled entry, "plot+0x1A" inside a label's code, "0x1A" before the first label
+static void stack_frame_name(const StackSymbol* symbols, int symbol_count, uint32_t address, char* out, size_t size) {
+    int low = 0, high = symbol_count - 1, found = -1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (symbols[mid].address <= address) {
+            found = mid;
+            low = mid + 1;
+        }
+        else high = mid - 1;
+    }
+    if (found < 0) snprintf(out, size, "0x%X", address);
+    else if (symbols[found].address == address) snprintf(out, size, "%s", symbols[found].name);
+    else snprintf(out, size, "%s+0x%X", symbols[found].name, address - symbols[found].address);
+}
+
+// Writes <rom>.folded, one line per distinct stack
+int stack_sampler_write(VM* vm, const char* rom_filename) {
+    char folded_filename[256];
+    snprintf(folded_filename, sizeof(folded_filename), "%s.folded", rom_filename);
+    FILE* folded_file = fopen(folded_filename, "w");
+    if (folded_file == NULL) {
+        fprintf(stderr, "Error: Could not create folded stack file '%s'.\n", folded_filename);
+        return -1;
+    }
+
+    StackSymbol* symbols = NULL;
+    int symbol_count = stack_symbols_load(rom_filename, &symbols);
+    char name[64];
+    for (uint32_t i = 0; i < vm->stack_sample_capacity; i++) {
+        const StackSample* sample = &vm->stack_samples[i];
+        if (sample->frames == NULL) continue;
+        for (uint32_t depth = 0; depth < sample->depth; depth++) {
+            stack_frame_name(symbols, symbol_count, sample->frames[depth], name, sizeof(name));
+            if (depth == 0 && strchr(name, '+') == NULL && strncmp(name, "0x", 2) == 0) strcpy(name, "main");
+            fprintf(folded_file, "%s%s", depth > 0 ? ";" : "", name);
+        }
+        fprintf(folded_file, " %llu\n", (unsigned long long)sample->count);
+    }
+    fclose(folded_file);
+    free(symbols);
+
+    printf("\n--- Call Stack Samples ---\n");
+    printf("%llu samples every %u instructions, %u distinct stacks written to '%s'.\n",
+        (unsigned long long)vm->stack_sample_total, vm->stack_sample_interval, vm->stack_sample_used, folded_filename);
+    printf("Render with: flamegraph.pl %s > flame.svg\n", folded_filename);
+    return 0;
+}
+
+// rom_filename is the ROM that was loaded; the hotspot listing and call stack names come from its .lst file.
+void run_vm(VM* vm, const char* rom_filename) {
+    if (headless_mode && !headless_open(vm, headless_frame_path, headless_audio_path)) {
+        headless_close(vm);
+        return;
+    }
+    sys_reset_text_color(vm);
+    sys_clear_screen(vm);
+    srand(time(NULL));
+    snprintf(vm->snapshot_path, sizeof(vm->snapshot_path), "%s.snap", rom_filename);
+
+    Profiler profiler;
+    bool profile = profile_enabled && !debug_mode;
+    if (profile) profiler_start(&profiler, vm);
+    bool hotspot = hotspot_enabled && !debug_mode;
+    if (hotspot) {
+        hotspot_reset(vm);
+        vm->hotspot_counting = true;
+    }
+    bool stack_sampling = call_stack_sample_interval > 0 && !debug_mode;
+    if (stack_sampling) stack_sampler_start(vm, call_stack_sample_interval);
+
+    clock_t start_time = clock();
+    uint64_t instruction_count = vm_execute(vm);
+    vm->snapshot_path[0] = '\0';
+    if (profile) profiler_stop(&profiler);
+    vm->hotspot_counting = false;
+    vm->stack_sampling = false;
+    sys_reset_text_color(vm);
+
+    clock_t end_time = clock();
+    double cpu_time_used = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
+
+    if (headless_mode) {
+        headless_close(vm);
+        printf("--- Console Output ---\n");
+        if (vm->console_length > 0) fwrite(vm->console_buffer, 1, vm->console_length, stdout);
+    }
+
+    printf("\n--- Execution Summary ---\n");
+    printf("Total Instructions Executed: %llu\n", instruction_count);
+    printf("Execution Time: %.6f seconds\n", cpu_time_used);
+    if (headless_mode) {
+        if (headless_frame_path[0] != '\0') printf("Frames Written: %u to '%s'\n", vm->frame_count, headless_frame_path);
+        if (headless_audio_path[0] != '\0') printf("Audio Written: %.3f seconds to '%s'\n", (double)vm->audio_sample_count / AUDIO_SAMPLE_RATE, headless_audio_path);
+    }
+
+    uint64_t fused_total = 0;
+    for (int i = 0; i < FUSED_PATTERN_COUNT; i++) fused_total += vm->fused_pattern_counts[i];
+    if (fused_total > 0) {
+        printf("\n--- Fused Instructions ---\n");
+        for (int i = 0; i < FUSED_PATTERN_COUNT; i++) {
+            if (vm->fused_pattern_counts[i] > 0) printf("%-24s %llu\n", fused_pattern_names[i], (unsigned long long)vm->fused_pattern_counts[i]);
+        }
+    }
+    if (profile) profiler_report(&profiler);
+    if (hotspot) hotspot_write_listing(vm, rom_filename);
+    if (stack_sampling) {
+        stack_sampler_write(vm, rom_filename);
+        stack_sampler_reset(vm);
+    }
+}
+
+// Assembler Functions
+
+bool is_register_str(const char* str) {
+    return register_from_string(str) != REG_INVALID;
+}
+
+bool is_memory_address_str(const char* str) {
+    return (str[0] == '[' && str[strlen(str) - 1] == ']');
+}
+
+int strcasecmp_portable(const char* s1, const char* s2) {
+    if (!s1 || !s2) {
+        if (s1 == s2) return 0; // Both NULL are equal
+        return (s1 == NULL) ? -1 : 1; // NULL is less than non-NULL
+    }
+
+    while (*s1 != '\0' && *s2 != '\0') {
+        int diff = tolower((unsigned char)*s1) - tolower((unsigned char)*s2);
+        if (diff != 0) {
+            return diff;
         }
         s1++;
         s2++;
     }
 
-    return tolower((unsigned char)*s1) - tolower((unsigned char)*s2);
+    return tolower((unsigned char)*s1) - tolower((unsigned char)*s2);
+}
+
+// Instruction Forms
+// Every mnemonic the assembler accepts, with the operand forms that select its opcodes. The forms of a
+// mnemonic are consecutive and tried in order; the first one whose operands all match wins, operands past
+// the form's count are ignored. A form has one operand per operand of its opcode in opcode_info, in the same
+// order, and 'r' exactly where the opcode takes a register (checked by mnemonic_index_build). Operand kinds:
+//   r  register                      m  memory operand, "[...]"
+//   l  defined label, string or buffer
+//   a  memory operand or label       i  anything but a register or a memory operand
+//   *  anything
+// Names with a '.' match their prefix ("math.", "sys.", ...) exactly and the rest in any case; the others
+// match in any case.
+
+typedef struct {
+    const char* mnemonic;
+    Opcode opcode;
+    const char* operands;
+} InstructionForm;
+
+static const InstructionForm instruction_forms[] = {
+    { "NOP", OP_NOP, "" },
+    { "MOV", OP_MOV_REG_REG, "rr" }, { "MOV", OP_MOV_REG_MEM, "rm" }, { "MOV", OP_LEA_REG_MEM, "rl" }, { "MOV", OP_MOV_REG_VAL, "r*" }, { "MOV", OP_MOV_MEM_REG, "mr" },
+    { "ADD", OP_ADD_REG_REG, "rr" }, { "ADD", OP_ADD_REG_VAL, "r*" },
+    { "SUB", OP_SUB_REG_REG, "rr" }, { "SUB", OP_SUB_REG_VAL, "r*" },
+    { "MUL", OP_MUL_REG_REG, "rr" }, { "MUL", OP_MUL_REG_VAL, "r*" },
+    { "DIV", OP_DIV_REG_REG, "rr" }, { "DIV", OP_DIV_REG_VAL, "r*" },
+    { "MOD", OP_MOD_REG_REG, "rr" }, { "MOD", OP_MOD_REG_VAL, "r*" },
+    { "AND", OP_AND_REG_REG, "rr" }, { "AND", OP_AND_REG_VAL, "r*" },
+    { "OR", OP_OR_REG_REG, "rr" }, { "OR", OP_OR_REG_VAL, "r*" },
+    { "XOR", OP_XOR_REG_REG, "rr" }, { "XOR", OP_XOR_REG_VAL, "r*" },
+    { "NOT", OP_NOT_REG, "r" },
+    { "NEG", OP_NEG_REG, "r" },
+    { "CMP", OP_CMP_REG_REG, "rr" }, { "CMP", OP_CMP_REG_VAL, "r*" },
+    { "TEST", OP_TEST_REG_REG, "rr" }, { "TEST", OP_TEST_REG_VAL, "r*" },
+    { "IMUL", OP_IMUL_REG_REG, "rr" },
+    { "IDIV", OP_IDIV_REG_REG, "rr" },
+    { "MOVZX", OP_MOVZX_REG_REG, "rr" }, { "MOVZX", OP_MOVZX_REG_MEM, "rm" },
+    { "MOVSX", OP_MOVSX_REG_REG, "rr" }, { "MOVSX", OP_MOVSX_REG_MEM, "rm" },
+    { "LEA", OP_LEA_REG_MEM, "ra" },
+    { "JMP", OP_JMP, "*" },
+    { "JNZ", OP_JMP_NZ, "*" }, { "JMP_NZ", OP_JMP_NZ, "*" },
+    { "JZ", OP_JMP_Z, "*" }, { "JMP_Z", OP_JMP_Z, "*" },
+    { "JS", OP_JMP_S, "*" }, { "JMP_S", OP_JMP_S, "*" },
+    { "JNS", OP_JMP_NS, "*" }, { "JMP_NS", OP_JMP_NS, "*" },
+    { "JC", OP_JMP_C, "*" }, { "JMP_C", OP_JMP_C, "*" },
+    { "JNC", OP_JMP_NC, "*" }, { "JMP_NC", OP_JMP_NC, "*" },
+    { "JO", OP_JMP_O, "*" }, { "JMP_O", OP_JMP_O, "*" },
+    { "JNO", OP_JMP_NO, "*" }, { "JMP_NO", OP_JMP_NO, "*" },
+    { "JGE", OP_JMP_GE, "*" }, { "JMP_GE", OP_JMP_GE, "*" },
+    { "JLE", OP_JMP_LE, "*" }, { "JMP_LE", OP_JMP_LE, "*" },
+    { "JG", OP_JMP_G, "*" }, { "JMP_G", OP_JMP_G, "*" },
+    { "JL", OP_JMP_L, "*" }, { "JMP_L", OP_JMP_L, "*" },
+    { "HLT", OP_HLT, "" },
+    { "INC", OP_INC_REG, "r" }, { "INC", OP_INC_MEM, "m" },
+    { "DEC", OP_DEC_REG, "r" }, { "DEC", OP_DEC_MEM, "m" },
+    { "SHL", OP_SHL_REG_REG, "rr" }, { "SHL", OP_SHL_REG_VAL, "r*" },
+    { "SHR", OP_SHR_REG_REG, "rr" }, { "SHR", OP_SHR_REG_VAL, "r*" },
+    { "SAR", OP_SAR_REG_REG, "rr" }, { "SAR", OP_SAR_REG_VAL, "r*" },
+    { "ROL", OP_ROL_REG_REG, "rr" }, { "ROL", OP_ROL_REG_VAL, "r*" },
+    { "ROR", OP_ROR_REG_REG, "rr" }, { "ROR", OP_ROR_REG_VAL, "r*" },
+    { "RND", OP_RND_REG, "r" },
+    { "PUSH", OP_PUSH_REG, "r" },
+    { "POP", OP_POP_REG, "r" },
+    { "CALL", OP_CALL_ADDR, "*" },
+    { "RET", OP_RET, "" },
+    { "XCHG", OP_XCHG_REG_REG, "rr" },
+    { "BSWAP", OP_BSWAP_REG, "r" },
+    { "SETZ", OP_SETZ_REG, "r" },
+    { "SETNZ", OP_SETNZ_REG, "r" },
+    { "PUSHA", OP_PUSHA, "" },
+    { "POPA", OP_POPA, "" },
+    { "PUSHFD", OP_PUSHFD, "" },
+    { "POPFD", OP_POPFD, "" },
+    { "MEM_TEST", OP_MEM_TEST, "" }, { "MEMTEST", OP_MEM_TEST, "" },
+
+    { "math.add", OP_MATH_ADD, "rr" },
+    { "math.sub", OP_MATH_SUB, "rr" },
+    { "math.mul", OP_MATH_MUL, "rr" },
+    { "math.div", OP_MATH_DIV, "rr" },
+    { "math.mod", OP_MATH_MOD, "rr" },
+    { "math.abs", OP_MATH_ABS, "r" },
+    { "math.sin", OP_MATH_SIN, "r" },
+    { "math.cos", OP_MATH_COS, "r" },
+    { "math.tan", OP_MATH_TAN, "r" },
+    { "math.asin", OP_MATH_ASIN, "r" },
+    { "math.acos", OP_MATH_ACOS, "r" },
+    { "math.atan", OP_MATH_ATAN, "r" },
+    { "math.pow", OP_MATH_POW, "rr" },
+    { "math.sqrt", OP_MATH_SQRT, "r" },
+    { "math.log", OP_MATH_LOG, "r" },
+    { "math.exp", OP_MATH_EXP, "r" },
+    { "math.floor", OP_MATH_FLOOR, "r" },
+    { "math.ceil", OP_MATH_CEIL, "r" },
+    { "math.round", OP_MATH_ROUND, "r" },
+    { "math.min", OP_MATH_MIN, "rr" },
+    { "math.max", OP_MATH_MAX, "rr" },
+    { "math.neg", OP_MATH_NEG, "r" },
+    { "math.atan2", OP_MATH_ATAN2, "rr" },
+    { "math.log10", OP_MATH_LOG10, "r" },
+    { "math.clamp", OP_MATH_CLAMP, "rrr" },
+    { "math.lerp", OP_MATH_LERP, "rrrr" },
+
+    { "str.len", OP_STR_LEN_REG_MEM, "ra" },
+    { "str.cpy", OP_STR_CPY_MEM_MEM, "aa" },
+    { "str.cat", OP_STR_CAT_MEM_MEM, "aa" },
+    { "str.cmp", OP_STR_CMP_REG_MEM_MEM, "raa" },
+    { "str.ncpy", OP_STR_NCPY_MEM_MEM_REG, "aar" },
+    { "str.ncat", OP_STR_NCAT_MEM_MEM_REG, "aar" },
+    { "str.toupper", OP_STR_TOUPPER_MEM, "a" },
+    { "str.tolower", OP_STR_TOLOWER_MEM, "a" },
+    { "str.chr", OP_STR_CHR_REG_MEM_VAL, "rai" },
+    { "str.str", OP_STR_STR_REG_MEM_MEM, "raa" },
+    { "str.atoi", OP_STR_ATOI_REG_MEM, "ra" },
+    { "str.itoa", OP_STR_ITOA_MEM_REG_REG, "arr" },
+    { "str.substr", OP_STR_SUBSTR_MEM_MEM_REG_REG, "aarr" },
+    { "str.fmt", OP_STR_FMT_MEM_MEM_REG_REG, "aarr" },
+
+    { "mem.cpy", OP_MEM_CPY_MEM_MEM_REG, "aar" },
+    { "mem.set", OP_MEM_SET_MEM_REG_VAL, "ari" }, { "mem.set", OP_MEM_SET_MEM_REG_REG, "arr" },
+    { "mem.clear", OP_MEM_FREE_MEM, "a" },
+
+    { "sys.print_char", OP_SYS_PRINT_CHAR, "r" },
+    { "sys.clear_screen", OP_SYS_CLEAR_SCREEN, "" },
+    { "sys.print_string", OP_SYS_PRINT_STRING, "r" },
+    { "sys.newline", OP_SYS_PRINT_NEWLINE, "" },
+    { "sys.set_cursor_pos", OP_SYS_SET_CURSOR_POS, "rr" },
+    { "sys.get_cursor_pos", OP_SYS_GET_CURSOR_POS, "rr" },
+    { "sys.set_text_color", OP_SYS_SET_TEXT_COLOR, "r" },
+    { "sys.reset_text_color", OP_SYS_RESET_TEXT_COLOR, "" },
+    { "sys.print_number_dec", OP_SYS_PRINT_NUMBER_DEC, "r" },
+    { "sys.print_number_hex", OP_SYS_PRINT_NUMBER_HEX, "r" },
+    { "sys.number_to_string", OP_SYS_NUMBER_TO_STRING, "rrr" },
+    { "sys.read_char", OP_SYS_READ_CHAR, "r" },
+    { "sys.read_string", OP_SYS_READ_STRING, "rr" },
+    { "sys.get_key_press", OP_SYS_GET_KEY_PRESS, "r" },
+    { "sys.cpu_ver", OP_SYS_GET_CPU_VER, "r" },
+    { "sys.wait", OP_SYS_WAIT, "r" },
+    { "sys.time", OP_SYS_TIME_REG, "r" },
+
+    { "disk.get_size", OP_DISK_GET_SIZE_REG, "r" },
+    { "disk.read_sector", OP_DISK_READ_SECTOR_MEM_REG_REG, "rra" },
+    { "disk.write_sector", OP_DISK_WRITE_SECTOR_MEM_REG_REG, "rra" },
+    { "disk.create_image", OP_DISK_CREATE_IMAGE, "" },
+    { "disk.get_volume_label", OP_DISK_GET_VOLUME_LABEL_MEM, "a" },
+    { "disk.set_volume_label", OP_DISK_SET_VOLUME_LABEL_MEM, "a" },
+    { "disk.format_disk", OP_DISK_FORMAT_DISK, "" },
+
+    { "vm.snapshot", OP_VM_SNAPSHOT, "" },
+
+    { "gfx.init", OP_GFX_INIT, "" },
+    { "gfx.close", OP_GFX_CLOSE, "" },
+    { "gfx.present", OP_GFX_PRESENT, "" },
+    { "gfx.pixel", OP_GFX_DRAW_PIXEL, "rrr" },
+    { "gfx.clear", OP_GFX_CLEAR, "r" },
+    { "gfx.get_screen_width", OP_GFX_GET_SCREEN_WIDTH_REG, "r" },
+    { "gfx.get_screen_height", OP_GFX_GET_SCREEN_HEIGHT_REG, "r" },
+    { "gfx.get_vram_size", OP_GFX_GET_VRAM_SIZE_REG, "r" },
+    { "gfx.get_gpu_ver", OP_GFX_GET_GPU_VER_REG, "r" },
+
+    { "audio.init", OP_AUDIO_INIT, "" },
+    { "audio.close", OP_AUDIO_CLOSE, "" },
+    { "audio.speaker_on", OP_AUDIO_SPEAKER_ON, "" },
+    { "audio.speaker_off", OP_AUDIO_SPEAKER_OFF, "" },
+    { "audio.set_pitch", OP_AUDIO_SET_PITCH_REG, "r" },
+    { "audio.get_ver", OP_AUDIO_GET_AUDIO_VER_REG, "r" },
+};
+#define INSTRUCTION_FORM_COUNT ((int)(sizeof(instruction_forms) / sizeof(instruction_forms[0])))
+
+// Mnemonic Lookup
+// A perfect hash from mnemonic to its run of forms, built from instruction_forms on first use (hash and
+// displace): the first hash picks a bucket, and each bucket has a seed for the second hash chosen so that
+// no two mnemonics share a slot. A lookup is two hashes over the name and one comparison.
+
+#define MNEMONIC_BUCKET_COUNT 64
+#define MNEMONIC_MAX_SLOTS 4096
+
+typedef struct {
+    int16_t first_form; // -1 for an empty slot
+    int16_t form_count;
+} MnemonicSlot;
+
+static MnemonicSlot* mnemonic_slots = NULL;
+static uint32_t mnemonic_slot_mask = 0;
+static uint32_t mnemonic_seeds[MNEMONIC_BUCKET_COUNT];
+
+// Case-insensitive FNV-1a, so "mov" and "MOV" hash alike
+static uint32_t mnemonic_hash(const char* name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (; *name; name++) {
+        hash ^= (uint8_t)tolower((unsigned char)*name);
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-Opcode opcode_from_string(const char* op_str, char* operand1, char* operand2, char* operand3, char* operand4) {
-    if (strcasecmp_portable(op_str, "NOP") == 0) return OP_NOP;
-    if (strcasecmp_portable(op_str, "MOV") == 0) {
-        if (operand1 && operand2) {
-            if (is_register_str(operand1)) {
-                if (is_register_str(operand2)) return OP_MOV_REG_REG;
-                else if (is_memory_address_str(operand2)) return OP_MOV_REG_MEM;
-                else if (get_label_address(operand2) != -1) return OP_LEA_REG_MEM;
-                else return OP_MOV_REG_VAL;
-            }
-            else if (is_memory_address_str(operand1) && is_register_str(operand2)) {
-                return OP_MOV_MEM_REG;
-            }
-        }
-    }
-    if (strcasecmp_portable(op_str, "ADD") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_ADD_REG_REG; else return OP_ADD_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "SUB") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_SUB_REG_REG; else return OP_SUB_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "MUL") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_MUL_REG_REG; else return OP_MUL_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "DIV") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_DIV_REG_REG; else return OP_DIV_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "MOD") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_MOD_REG_REG; else return OP_MOD_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "AND") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_AND_REG_REG; else return OP_AND_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "OR") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_OR_REG_REG; else return OP_OR_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "XOR") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_XOR_REG_REG; else return OP_XOR_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "NOT") == 0) { if (operand1 && is_register_str(operand1)) return OP_NOT_REG; }
-    if (strcasecmp_portable(op_str, "NEG") == 0) { if (operand1 && is_register_str(operand1)) return OP_NEG_REG; }
-    if (strcasecmp_portable(op_str, "CMP") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_CMP_REG_REG; else return OP_CMP_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "TEST") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_TEST_REG_REG; else return OP_TEST_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "IMUL") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_IMUL_REG_REG; }
-    if (strcasecmp_portable(op_str, "IDIV") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_IDIV_REG_REG; }
-    if (strcasecmp_portable(op_str, "MOVZX") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_MOVZX_REG_REG; else if (is_memory_address_str(operand2)) return OP_MOVZX_REG_MEM; } }
-    if (strcasecmp_portable(op_str, "MOVSX") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_MOVSX_REG_REG; else if (is_memory_address_str(operand2)) return OP_MOVSX_REG_MEM; } }
-    if (strcasecmp_portable(op_str, "LEA") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_memory_address_str(operand2) || get_label_address(operand2) != -1) return OP_LEA_REG_MEM; } }
-    if (strcasecmp_portable(op_str, "JMP") == 0) { if (operand1) return OP_JMP; }
-    if (strcasecmp_portable(op_str, "JNZ") == 0 || strcasecmp_portable(op_str, "JMP_NZ") == 0) { if (operand1) return OP_JMP_NZ; }
-    if (strcasecmp_portable(op_str, "JZ") == 0 || strcasecmp_portable(op_str, "JMP_Z") == 0) { if (operand1) return OP_JMP_Z; }
-    if (strcasecmp_portable(op_str, "JS") == 0 || strcasecmp_portable(op_str, "JMP_S") == 0) { if (operand1) return OP_JMP_S; }
-    if (strcasecmp_portable(op_str, "JNS") == 0 || strcasecmp_portable(op_str, "JMP_NS") == 0) { if (operand1) return OP_JMP_NS; }
-    if (strcasecmp_portable(op_str, "JC") == 0 || strcasecmp_portable(op_str, "JMP_C") == 0) { if (operand1) return OP_JMP_C; }
-    if (strcasecmp_portable(op_str, "JNC") == 0 || strcasecmp_portable(op_str, "JMP_NC") == 0) { if (operand1) return OP_JMP_NC; }
-    if (strcasecmp_portable(op_str, "JO") == 0 || strcasecmp_portable(op_str, "JMP_O") == 0) { if (operand1) return OP_JMP_O; }
-    if (strcasecmp_portable(op_str, "JNO") == 0 || strcasecmp_portable(op_str, "JMP_NO") == 0) { if (operand1) return OP_JMP_NO; }
-    if (strcasecmp_portable(op_str, "JGE") == 0 || strcasecmp_portable(op_str, "JMP_GE") == 0) { if (operand1) return OP_JMP_GE; }
-    if (strcasecmp_portable(op_str, "JLE") == 0 || strcasecmp_portable(op_str, "JMP_LE") == 0) { if (operand1) return OP_JMP_LE; }
-    if (strcasecmp_portable(op_str, "JG") == 0 || strcasecmp_portable(op_str, "JMP_G") == 0) { if (operand1) return OP_JMP_G; }
-    if (strcasecmp_portable(op_str, "JL") == 0 || strcasecmp_portable(op_str, "JMP_L") == 0) { if (operand1) return OP_JMP_L; }
-    if (strcasecmp_portable(op_str, "HLT") == 0) return OP_HLT;
-    if (strcasecmp_portable(op_str, "INC") == 0) { if (operand1 && is_register_str(operand1)) return OP_INC_REG; else if (is_memory_address_str(operand1)) return OP_INC_MEM; }
-    if (strcasecmp_portable(op_str, "DEC") == 0) { if (operand1 && is_register_str(operand1)) return OP_DEC_REG; else if (is_memory_address_str(operand1)) return OP_DEC_MEM; }
-    if (strcasecmp_portable(op_str, "SHL") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_SHL_REG_REG; else return OP_SHL_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "SHR") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_SHR_REG_REG; else return OP_SHR_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "SAR") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_SAR_REG_REG; else return OP_SAR_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "ROL") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_ROL_REG_REG; else return OP_ROL_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "ROR") == 0) { if (operand1 && operand2 && is_register_str(operand1)) { if (is_register_str(operand2)) return OP_ROR_REG_REG; else return OP_ROR_REG_VAL; } }
-    if (strcasecmp_portable(op_str, "RND") == 0) { if (operand1 && is_register_str(operand1)) return OP_RND_REG; }
-    if (strcasecmp_portable(op_str, "PUSH") == 0) { if (operand1 && is_register_str(operand1)) return OP_PUSH_REG; }
-    if (strcasecmp_portable(op_str, "POP") == 0) { if (operand1 && is_register_str(operand1)) return OP_POP_REG; }
-    if (strcasecmp_portable(op_str, "CALL") == 0) { if (operand1) return OP_CALL_ADDR; }
-    if (strcasecmp_portable(op_str, "RET") == 0) return OP_RET;
-    if (strcasecmp_portable(op_str, "XCHG") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_XCHG_REG_REG; }
-    if (strcasecmp_portable(op_str, "BSWAP") == 0) { if (operand1 && is_register_str(operand1)) return OP_BSWAP_REG; }
-    if (strcasecmp_portable(op_str, "SETZ") == 0) { if (operand1 && is_register_str(operand1)) return OP_SETZ_REG; }
-    if (strcasecmp_portable(op_str, "SETNZ") == 0) { if (operand1 && is_register_str(operand1)) return OP_SETNZ_REG; }
-    if (strcasecmp_portable(op_str, "PUSHA") == 0) return OP_PUSHA;
-    if (strcasecmp_portable(op_str, "POPA") == 0) return OP_POPA;
-    if (strcasecmp_portable(op_str, "PUSHFD") == 0) return OP_PUSHFD;
-    if (strcasecmp_portable(op_str, "POPFD") == 0) return OP_POPFD;
-    if (strcasecmp_portable(op_str, "MEM_TEST") == 0 || strcasecmp_portable(op_str, "MEMTEST") == 0) return OP_MEM_TEST;
-
-    if (strncmp(op_str, "math.", 5) == 0) {
-        char* math_func = op_str + 5;
-        if (strcasecmp_portable(math_func, "add") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_MATH_ADD; }
-        else if (strcasecmp_portable(math_func, "sub") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_MATH_SUB; }
-        else if (strcasecmp_portable(math_func, "mul") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_MATH_MUL; }
-        else if (strcasecmp_portable(math_func, "div") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_MATH_DIV; }
-        else if (strcasecmp_portable(math_func, "mod") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_MATH_MOD; }
-        else if (strcasecmp_portable(math_func, "abs") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_ABS; }
-        else if (strcasecmp_portable(math_func, "sin") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_SIN; }
-        else if (strcasecmp_portable(math_func, "cos") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_COS; }
-        else if (strcasecmp_portable(math_func, "tan") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_TAN; }
-        else if (strcasecmp_portable(math_func, "asin") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_ASIN; }
-        else if (strcasecmp_portable(math_func, "acos") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_ACOS; }
-        else if (strcasecmp_portable(math_func, "atan") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_ATAN; }
-        else if (strcasecmp_portable(math_func, "pow") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_MATH_POW; }
-        else if (strcasecmp_portable(math_func, "sqrt") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_SQRT; }
-        else if (strcasecmp_portable(math_func, "log") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_LOG; }
-        else if (strcasecmp_portable(math_func, "exp") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_EXP; }
-        else if (strcasecmp_portable(math_func, "floor") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_FLOOR; }
-        else if (strcasecmp_portable(math_func, "ceil") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_CEIL; }
-        else if (strcasecmp_portable(math_func, "round") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_ROUND; }
-        else if (strcasecmp_portable(math_func, "min") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_MATH_MIN; }
-        else if (strcasecmp_portable(math_func, "max") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_MATH_MAX; }
-        else if (strcasecmp_portable(math_func, "neg") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_NEG; }
-        else if (strcasecmp_portable(math_func, "atan2") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_MATH_ATAN2; }
-        else if (strcasecmp_portable(math_func, "log10") == 0) { if (operand1 && is_register_str(operand1)) return OP_MATH_LOG10; }
-        else if (strcasecmp_portable(math_func, "clamp") == 0) { if (operand1 && operand2 && operand3 && is_register_str(operand1) && is_register_str(operand2) && is_register_str(operand3)) return OP_MATH_CLAMP; }
-        else if (strcasecmp_portable(math_func, "lerp") == 0) { if (operand1 && operand2 && operand3 && operand4 && is_register_str(operand1) && is_register_str(operand2) && is_register_str(operand3) && is_register_str(operand4)) return OP_MATH_LERP; }
-    }
-    else if (strncmp(op_str, "str.", 4) == 0) {
-        char* str_func = op_str + 4;
-        if (strcasecmp_portable(str_func, "len") == 0) { if (operand1 && operand2 && is_register_str(operand1) && (is_memory_address_str(operand2) || get_label_address(operand2) != -1)) return OP_STR_LEN_REG_MEM; }
-        else if (strcasecmp_portable(str_func, "cpy") == 0) { if (operand1 && operand2 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1) && (is_memory_address_str(operand2) || get_label_address(operand2) != -1)) return OP_STR_CPY_MEM_MEM; }
-        else if (strcasecmp_portable(str_func, "cat") == 0) { if (operand1 && operand2 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1) && (is_memory_address_str(operand2) || get_label_address(operand2) != -1)) return OP_STR_CAT_MEM_MEM; }
-        else if (strcasecmp_portable(str_func, "cmp") == 0) { if (operand1 && operand2 && operand3 && is_register_str(operand1) && (is_memory_address_str(operand2) || get_label_address(operand2) != -1) && (is_memory_address_str(operand3) || get_label_address(operand3) != -1)) return OP_STR_CMP_REG_MEM_MEM; }
-        else if (strcasecmp_portable(str_func, "ncpy") == 0) { if (operand1 && operand2 && operand3 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1) && (is_memory_address_str(operand2) || get_label_address(operand2) != -1) && is_register_str(operand3)) return OP_STR_NCPY_MEM_MEM_REG; }
-        else if (strcasecmp_portable(str_func, "ncat") == 0) { if (operand1 && operand2 && operand3 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1) && (is_memory_address_str(operand2) || get_label_address(operand2) != -1) && is_register_str(operand3)) return OP_STR_NCAT_MEM_MEM_REG; }
-        else if (strcasecmp_portable(str_func, "toupper") == 0) { if (operand1 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1)) return OP_STR_TOUPPER_MEM; }
-        else if (strcasecmp_portable(str_func, "tolower") == 0) { if (operand1 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1)) return OP_STR_TOLOWER_MEM; }
-        else if (strcasecmp_portable(str_func, "chr") == 0) { if (operand1 && operand2 && operand3 && is_register_str(operand1) && (is_memory_address_str(operand2) || get_label_address(operand2) != -1) && !is_register_str(operand3) && !is_memory_address_str(operand3)) return OP_STR_CHR_REG_MEM_VAL; }
-        else if (strcasecmp_portable(str_func, "str") == 0) { if (operand1 && operand2 && operand3 && is_register_str(operand1) && (is_memory_address_str(operand2) || get_label_address(operand2) != -1) && (is_memory_address_str(operand3) || get_label_address(operand3) != -1)) return OP_STR_STR_REG_MEM_MEM; }
-        else if (strcasecmp_portable(str_func, "atoi") == 0) { if (operand1 && operand2 && is_register_str(operand1) && (is_memory_address_str(operand2) || get_label_address(operand2) != -1)) return OP_STR_ATOI_REG_MEM; }
-        else if (strcasecmp_portable(str_func, "itoa") == 0) { if (operand1 && operand2 && operand3 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1) && is_register_str(operand2) && is_register_str(operand3)) return OP_STR_ITOA_MEM_REG_REG; }
-        else if (strcasecmp_portable(str_func, "substr") == 0) { if (operand1 && operand2 && operand3 && operand4 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1) && (is_memory_address_str(operand2) || get_label_address(operand2) != -1) && is_register_str(operand3) && is_register_str(operand4)) return OP_STR_SUBSTR_MEM_MEM_REG_REG; }
-        else if (strcasecmp_portable(str_func, "fmt") == 0) { if (operand1 && operand2 && operand3 && operand4 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1) && (is_memory_address_str(operand2) || get_label_address(operand2) != -1) && is_register_str(operand3) && is_register_str(operand4)) return OP_STR_FMT_MEM_MEM_REG_REG; }
-    }
-    else if (strncmp(op_str, "mem.", 4) == 0) {
-        char* mem_func = op_str + 4;
-        if (strcasecmp_portable(mem_func, "cpy") == 0) { if (operand1 && operand2 && operand3 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1) && (is_memory_address_str(operand2) || get_label_address(operand2) != -1) && is_register_str(operand3)) return OP_MEM_CPY_MEM_MEM_REG; }
-        else if (strcasecmp_portable(mem_func, "set") == 0) {
-            if (operand1 && operand2 && operand3) {
-                if ((is_memory_address_str(operand1) || get_label_address(operand1) != -1) && is_register_str(operand2) && !is_register_str(operand3) && !is_memory_address_str(operand3)) return OP_MEM_SET_MEM_REG_VAL;
-                else if ((is_memory_address_str(operand1) || get_label_address(operand1) != -1) && is_register_str(operand2) && is_register_str(operand3)) return OP_MEM_SET_MEM_REG_REG;
-            }
-        }
-        else if (strcasecmp_portable(mem_func, "clear") == 0) { if (operand1 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1)) return OP_MEM_FREE_MEM; }
-    }
-    else if (strncmp(op_str, "sys.", 4) == 0) {
-        char* sys_func = op_str + 4;
-        if (strcasecmp_portable(sys_func, "print_char") == 0) { if (operand1 && (is_register_str(operand1) || !is_register_str(operand1) && !is_memory_address_str(operand1))) return OP_SYS_PRINT_CHAR; }
-        else if (strcasecmp_portable(sys_func, "clear_screen") == 0) return OP_SYS_CLEAR_SCREEN;
-        else if (strcasecmp_portable(sys_func, "print_string") == 0) { if (operand1 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1 || is_register_str(operand1))) return OP_SYS_PRINT_STRING; }
-        else if (strcasecmp_portable(sys_func, "newline") == 0) return OP_SYS_PRINT_NEWLINE;
-        else if (strcasecmp_portable(sys_func, "set_cursor_pos") == 0) { if (operand1 && operand2 && (is_register_str(operand1) || !is_register_str(operand1) && !is_memory_address_str(operand1)) && (is_register_str(operand2) || !is_register_str(operand2) && !is_memory_address_str(operand2))) return OP_SYS_SET_CURSOR_POS; }
-        else if (strcasecmp_portable(sys_func, "get_cursor_pos") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_SYS_GET_CURSOR_POS; }
-        else if (strcasecmp_portable(sys_func, "set_text_color") == 0) { if (operand1 && (is_register_str(operand1) || !is_register_str(operand1) && !is_memory_address_str(operand1))) return OP_SYS_SET_TEXT_COLOR; }
-        else if (strcasecmp_portable(sys_func, "reset_text_color") == 0) return OP_SYS_RESET_TEXT_COLOR;
-        else if (strcasecmp_portable(sys_func, "print_number_dec") == 0) { if (operand1 && is_register_str(operand1)) return OP_SYS_PRINT_NUMBER_DEC; }
-        else if (strcasecmp_portable(sys_func, "print_number_hex") == 0) { if (operand1 && is_register_str(operand1)) return OP_SYS_PRINT_NUMBER_HEX; }
-        else if (strcasecmp_portable(sys_func, "number_to_string") == 0) { if (operand1 && operand2 && operand3 && is_register_str(operand1) && is_register_str(operand2) && is_register_str(operand3)) return OP_SYS_NUMBER_TO_STRING; }
-        else if (strcasecmp_portable(sys_func, "read_char") == 0) { if (operand1 && is_register_str(operand1)) return OP_SYS_READ_CHAR; }
-        else if (strcasecmp_portable(sys_func, "read_string") == 0) { if (operand1 && operand2 && is_register_str(operand1) && is_register_str(operand2)) return OP_SYS_READ_STRING; }
-        else if (strcasecmp_portable(sys_func, "get_key_press") == 0) { if (operand1 && is_register_str(operand1)) return OP_SYS_GET_KEY_PRESS; }
-        else if (strcasecmp_portable(sys_func, "cpu_ver") == 0) { if (operand1 && is_register_str(operand1)) return OP_SYS_GET_CPU_VER; }
-        else if (strcasecmp_portable(sys_func, "wait") == 0) { if (operand1 && (is_register_str(operand1) || !is_register_str(operand1) && !is_memory_address_str(operand1))) return OP_SYS_WAIT; }
-        else if (strcasecmp_portable(sys_func, "time") == 0) { if (operand1 && is_register_str(operand1)) return OP_SYS_TIME_REG; }
-    }
-    else if (strncmp(op_str, "disk.", 5) == 0) {
-        char* disk_func = op_str + 5;
-        if (strcasecmp_portable(disk_func, "get_size") == 0) { if (operand1 && is_register_str(operand1)) return OP_DISK_GET_SIZE_REG; }
-        else if (strcasecmp_portable(disk_func, "read_sector") == 0) { if (operand1 && operand2 && operand3 && is_register_str(operand1) && is_register_str(operand2) && (is_memory_address_str(operand3) || get_label_address(operand3) != -1)) return OP_DISK_READ_SECTOR_MEM_REG_REG; }
-        else if (strcasecmp_portable(disk_func, "write_sector") == 0) { if (operand1 && operand2 && operand3 && is_register_str(operand1) && is_register_str(operand2) && (is_memory_address_str(operand3) || get_label_address(operand3) != -1)) return OP_DISK_WRITE_SECTOR_MEM_REG_REG; }
-        else if (strcasecmp_portable(disk_func, "create_image") == 0) return OP_DISK_CREATE_IMAGE;
-        else if (strcasecmp_portable(disk_func, "get_volume_label") == 0) { if (operand1 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1)) return OP_DISK_GET_VOLUME_LABEL_MEM; }
-        else if (strcasecmp_portable(disk_func, "set_volume_label") == 0) { if (operand1 && (is_memory_address_str(operand1) || get_label_address(operand1) != -1)) return OP_DISK_SET_VOLUME_LABEL_MEM; }
-        else if (strcasecmp_portable(disk_func, "format_disk") == 0) return OP_DISK_FORMAT_DISK;
-    }
-    else if (strncmp(op_str, "gfx.", 4) == 0) {
-        char* gfx_func = op_str + 4;
-        if (strcasecmp_portable(gfx_func, "init") == 0) return OP_GFX_INIT;
-        else if (strcasecmp_portable(gfx_func, "close") == 0) return OP_GFX_CLOSE;
-        else if (strcasecmp_portable(gfx_func, "pixel") == 0) {
-            if (operand1 && operand2 && operand3 && is_register_str(operand1) && is_register_str(operand2) && is_register_str(operand3)) return OP_GFX_DRAW_PIXEL;
-        }
-        else if (strcasecmp_portable(gfx_func, "clear") == 0) {
-            if (operand1 && is_register_str(operand1)) return OP_GFX_CLEAR;
-        }
-        else if (strcasecmp_portable(gfx_func, "get_screen_width") == 0) {
-            if (operand1 && is_register_str(operand1)) return OP_GFX_GET_SCREEN_WIDTH_REG;
-        }
-        else if (strcasecmp_portable(gfx_func, "get_screen_height") == 0) {
-            if (operand1 && is_register_str(operand1)) return OP_GFX_GET_SCREEN_HEIGHT_REG;
-        }
-        else if (strcasecmp_portable(gfx_func, "get_vram_size") == 0) {
-            if (operand1 && is_register_str(operand1)) return OP_GFX_GET_VRAM_SIZE_REG;
-        }
-        else if (strcasecmp_portable(gfx_func, "get_gpu_ver") == 0) {
-            if (operand1 && is_register_str(operand1)) return OP_GFX_GET_GPU_VER_REG;
-        }
-    }
-    else if (strncmp(op_str, "audio.", 6) == 0) { // <-- Insert this block
-        char* audio_func = op_str + 6;
-        if (strcasecmp_portable(audio_func, "init") == 0) return OP_AUDIO_INIT;
-        else if (strcasecmp_portable(audio_func, "close") == 0) return OP_AUDIO_CLOSE;
-        else if (strcasecmp_portable(audio_func, "speaker_on") == 0) return OP_AUDIO_SPEAKER_ON;
-        else if (strcasecmp_portable(audio_func, "speaker_off") == 0) return OP_AUDIO_SPEAKER_OFF;
-        else if (strcasecmp_portable(audio_func, "set_pitch") == 0) {
-            if (operand1 && is_register_str(operand1)) return OP_AUDIO_SET_PITCH_REG;
-        }
-        else if (strcasecmp_portable(audio_func, "get_ver") == 0) {
-            if (operand1 && is_register_str(operand1)) return OP_AUDIO_GET_AUDIO_VER_REG;
+static bool mnemonic_matches(const char* mnemonic, const char* op_str) {
+    const char* dot = strchr(mnemonic, '.');
+    if (dot == NULL) return strcasecmp_portable(mnemonic, op_str) == 0;
+    size_t prefix_length = dot - mnemonic + 1;
+    return strncmp(mnemonic, op_str, prefix_length) == 0 && strcasecmp_portable(mnemonic + prefix_length, op_str + prefix_length) == 0;
+}
+
+// Tries seeds for every bucket, largest bucket first, until all its mnemonics land in free slots
+static bool mnemonic_index_place(uint32_t slot_count) {
+    int firsts[INSTRUCTION_FORM_COUNT];
+    int bucket_of[INSTRUCTION_FORM_COUNT];
+    int mnemonic_count = 0;
+    for (int i = 0; i < INSTRUCTION_FORM_COUNT; i++) {
+        if (i > 0 && strcmp(instruction_forms[i].mnemonic, instruction_forms[i - 1].mnemonic) == 0) continue;
+        firsts[mnemonic_count] = i;
+        bucket_of[mnemonic_count] = mnemonic_hash(instruction_forms[i].mnemonic, 0) % MNEMONIC_BUCKET_COUNT;
+        mnemonic_count++;
+    }
+    for (uint32_t i = 0; i < slot_count; i++) mnemonic_slots[i].first_form = -1;
+
+    int bucket_size[MNEMONIC_BUCKET_COUNT] = { 0 };
+    for (int i = 0; i < mnemonic_count; i++) bucket_size[bucket_of[i]]++;
+    for (int size = mnemonic_count; size > 0; size--) {
+        for (int bucket = 0; bucket < MNEMONIC_BUCKET_COUNT; bucket++) {
+            if (bucket_size[bucket] != size) continue;
+            uint32_t slots[INSTRUCTION_FORM_COUNT];
+            uint32_t seed;
+            for (seed = 1; seed < 1u << 20; seed++) {
+                int placed = 0;
+                for (int i = 0; i < mnemonic_count; i++) {
+                    if (bucket_of[i] != bucket) continue;
+                    uint32_t slot = mnemonic_hash(instruction_forms[firsts[i]].mnemonic, seed) & (slot_count - 1);
+                    bool taken = mnemonic_slots[slot].first_form >= 0;
+                    for (int j = 0; j < placed && !taken; j++) taken = slots[j] == slot;
+                    if (taken) break;
+                    slots[placed++] = slot;
+                }
+                if (placed == size) break;
+            }
+            if (seed == 1u << 20) return false;
+            mnemonic_seeds[bucket] = seed;
+            int placed = 0;
+            for (int i = 0; i < mnemonic_count; i++) {
+                if (bucket_of[i] != bucket) continue;
+                int count = 1;
+                while (firsts[i] + count < INSTRUCTION_FORM_COUNT && strcmp(instruction_forms[firsts[i] + count].mnemonic, instruction_forms[firsts[i]].mnemonic) == 0) count++;
+                mnemonic_slots[slots[placed]].first_form = (int16_t)firsts[i];
+                mnemonic_slots[slots[placed]].form_count = (int16_t)count;
+                placed++;
+            }
+        }
+    }
+    return true;
+}
+
+// Finds rows of opcode_info and instruction_forms that disagree, which would assemble to bytes the
+// executor decodes differently.
+static bool instruction_forms_check(void) {
+    for (int i = 0; i < INSTRUCTION_FORM_COUNT; i++) {
+        const InstructionForm* form = &instruction_forms[i];
+        const OpcodeInfo* info = &opcode_info[form->opcode];
+        bool consistent = info->name != NULL && (int)strlen(form->operands) == info->operand_count;
+        for (int j = 0; j < info->operand_count && consistent; j++) consistent = (form->operands[j] == 'r') == (info->operands[j] == OPERAND_REG);
+        if (!consistent) {
+            fprintf(stderr, "Assembler Error: Form '%s %s' does not match the operands of its opcode.\n", form->mnemonic, form->operands);
+            return false;
+        }
+    }
+    for (int opcode = 0; opcode < OP_INVALID; opcode++) {
+        if (opcode_info[opcode].name == NULL) {
+            fprintf(stderr, "Assembler Error: Opcode %d has no row in opcode_info.\n", opcode);
+            return false;
         }
     }
+    return true;
+}
+
+static bool mnemonic_index_build(void) {
+    if (mnemonic_slots != NULL) return true;
+    if (!instruction_forms_check()) return false;
+    for (uint32_t slot_count = 256; slot_count <= MNEMONIC_MAX_SLOTS; slot_count *= 2) {
+        if (slot_count < 2 * INSTRUCTION_FORM_COUNT) continue;
+        mnemonic_slots = (MnemonicSlot*)malloc(slot_count * sizeof(MnemonicSlot));
+        if (mnemonic_slots == NULL) return false;
+        if (mnemonic_index_place(slot_count)) {
+            mnemonic_slot_mask = slot_count - 1;
+            return true;
+        }
+        free(mnemonic_slots);
+        mnemonic_slots = NULL;
+    }
+    return false;
+}
+
+// Returns the first form of op_str and stores how many forms it has, or NULL for an unknown mnemonic.
+static const InstructionForm* mnemonic_lookup(const char* op_str, int* form_count) {
+    if (op_str == NULL || !mnemonic_index_build()) return NULL;
+    uint32_t seed = mnemonic_seeds[mnemonic_hash(op_str, 0) % MNEMONIC_BUCKET_COUNT];
+    const MnemonicSlot* slot = &mnemonic_slots[mnemonic_hash(op_str, seed) & mnemonic_slot_mask];
+    if (slot->first_form < 0 || !mnemonic_matches(instruction_forms[slot->first_form].mnemonic, op_str)) return NULL;
+    *form_count = slot->form_count;
+    return &instruction_forms[slot->first_form];
+}
+
+static bool operand_matches(char kind, const char* operand) {
+    if (operand == NULL) return false;
+    switch (kind) {
+    case 'r': return is_register_str(operand);
+    case 'm': return is_memory_address_str(operand);
+    case 'l': return is_symbol_reference(operand);
+    case 'a': return is_memory_address_str(operand) || is_symbol_reference(operand);
+    case 'i': return !is_register_str(operand) && !is_memory_address_str(operand);
+    default: return true;
+    }
+}
 
+Opcode opcode_from_string(const char* op_str, char* operand1, char* operand2, char* operand3, char* operand4) {
+    int form_count;
+    const InstructionForm* form = mnemonic_lookup(op_str, &form_count);
+    if (form == NULL) return OP_INVALID;
+    const char* operands[4] = { operand1, operand2, operand3, operand4 };
+    for (int i = 0; i < form_count; i++, form++) {
+        bool matches = true;
+        for (int j = 0; form->operands[j] != '\0' && matches; j++) matches = operand_matches(form->operands[j], operands[j]);
+        if (matches) return form->opcode;
+    }
     return OP_INVALID;
 }
 
@@ -2601,35 +5285,155 @@ RegisterIndex register_from_string(const char* reg_str) {
     return REG_INVALID;
 }
 
+// Symbol Index
+// One open-addressing hash table over the names of labels, strings, buffers and macros, so a lookup costs
+// the same with 100 symbols as with 100000. The definition arrays stay the same; a slot holds the kind and
+// array index of the first definition of a name, which is what the scans over the arrays used to find.
+// Names are copied into an arena that is released with the table when the next assembly starts.
 
-const char* get_macro_value(const char* macro_name) {
-    for (int i = 0; i < macro_count; i++) {
-        if (strcmp(macros[i].name, macro_name) == 0) {
-            return macros[i].value_str;
-        }
-    }
-    return NULL;
+#define SYMBOL_INDEX_MIN_CAPACITY 1024 // Slots, a power of two. The table is kept at most half full.
+#define SYMBOL_ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef enum {
+    SYMBOL_LABEL,
+    SYMBOL_STRING,
+    SYMBOL_BUFFER,
+    SYMBOL_MACRO,
+    SYMBOL_EXPORT, // .GLOBAL, index is the line number
+    SYMBOL_EXTERN  // .EXTERN, index is the line number
+} SymbolKind;
+
+typedef struct {
+    const char* name; // In the arena, NULL for an empty slot
+    uint32_t hash;
+    uint32_t kind;    // SymbolKind
+    int index;        // Into labels, strings, buffers or macros
+} SymbolSlot;
+
+typedef struct SymbolArenaBlock {
+    struct SymbolArenaBlock* next;
+    size_t used;
+    char data[SYMBOL_ARENA_BLOCK_SIZE];
+} SymbolArenaBlock;
+
+SymbolSlot* symbol_slots = NULL;
+uint32_t symbol_capacity = 0;
+uint32_t symbol_count = 0;
+SymbolArenaBlock* symbol_arena = NULL;
+
+static uint32_t symbol_hash(const char* name) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (; *name; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-uint32_t get_label_address(const char* label_name) {
-    for (int i = 0; i < label_count; i++) {
-        if (strcmp(labels[i].name, label_name) == 0) {
-            return labels[i].address;
-        }
+void symbol_index_reset(void) {
+    free(symbol_slots);
+    symbol_slots = NULL;
+    symbol_capacity = 0;
+    symbol_count = 0;
+    while (symbol_arena != NULL) {
+        SymbolArenaBlock* next = symbol_arena->next;
+        free(symbol_arena);
+        symbol_arena = next;
     }
-    for (int i = 0; i < string_count; i++) {
-        if (strcmp(strings[i].name, label_name) == 0) {
-            return strings[i].address;
-        }
+}
+
+static const char* symbol_arena_copy(const char* name) {
+    size_t length = strlen(name) + 1; // Names are at most 31 characters, see LabelDefinition
+    if (symbol_arena == NULL || symbol_arena->used + length > SYMBOL_ARENA_BLOCK_SIZE) {
+        SymbolArenaBlock* block = (SymbolArenaBlock*)malloc(sizeof(SymbolArenaBlock));
+        if (block == NULL) return NULL;
+        block->next = symbol_arena;
+        block->used = 0;
+        symbol_arena = block;
+    }
+    char* copy = &symbol_arena->data[symbol_arena->used];
+    memcpy(copy, name, length);
+    symbol_arena->used += length;
+    return copy;
+}
+
+static bool symbol_index_grow(void) {
+    uint32_t capacity = (symbol_capacity == 0) ? SYMBOL_INDEX_MIN_CAPACITY : symbol_capacity * 2;
+    SymbolSlot* slots = (SymbolSlot*)calloc(capacity, sizeof(SymbolSlot));
+    if (slots == NULL) return false;
+    for (uint32_t i = 0; i < symbol_capacity; i++) {
+        if (symbol_slots[i].name == NULL) continue;
+        uint32_t j = symbol_slots[i].hash & (capacity - 1);
+        while (slots[j].name != NULL) j = (j + 1) & (capacity - 1);
+        slots[j] = symbol_slots[i];
+    }
+    free(symbol_slots);
+    symbol_slots = slots;
+    symbol_capacity = capacity;
+    return true;
+}
+
+// Records a definition. A name that is already defined as the same kind keeps its first definition.
+// Returns false if the index is out of memory.
+bool symbol_define(SymbolKind kind, const char* name, int index) {
+    if ((symbol_count + 1) * 2 > symbol_capacity && !symbol_index_grow()) return false;
+    uint32_t hash = symbol_hash(name);
+    uint32_t mask = symbol_capacity - 1;
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        SymbolSlot* slot = &symbol_slots[i];
+        if (slot->name == NULL) {
+            slot->name = symbol_arena_copy(name);
+            if (slot->name == NULL) return false;
+            slot->hash = hash;
+            slot->kind = kind;
+            slot->index = index;
+            symbol_count++;
+            return true;
+        }
+        if (slot->hash == hash && slot->kind == (uint32_t)kind && strcmp(slot->name, name) == 0) return true;
     }
-    for (int i = 0; i < buffer_count; i++) {
-        if (strcmp(buffers[i].name, label_name) == 0) {
-            return buffers[i].address;
-        }
+}
+
+static int symbol_find_hashed(SymbolKind kind, const char* name, uint32_t hash) {
+    if (symbol_count == 0) return -1;
+    uint32_t mask = symbol_capacity - 1;
+    for (uint32_t i = hash & mask; symbol_slots[i].name != NULL; i = (i + 1) & mask) {
+        const SymbolSlot* slot = &symbol_slots[i];
+        if (slot->hash == hash && slot->kind == (uint32_t)kind && strcmp(slot->name, name) == 0) return slot->index;
     }
     return -1;
 }
 
+// Returns the index of the first definition of name as kind, or -1.
+int symbol_find(SymbolKind kind, const char* name) {
+    if (name == NULL) return -1;
+    return symbol_find_hashed(kind, name, symbol_hash(name));
+}
+
+const char* get_macro_value(const char* macro_name) {
+    int index = symbol_find(SYMBOL_MACRO, macro_name);
+    return (index >= 0) ? macros[index].value_str : NULL;
+}
+
+// Labels shadow strings, which shadow buffers.
+uint32_t get_label_address(const char* label_name) {
+    if (label_name == NULL) return -1;
+    uint32_t hash = symbol_hash(label_name);
+    int index = symbol_find_hashed(SYMBOL_LABEL, label_name, hash);
+    if (index >= 0) return labels[index].address;
+    index = symbol_find_hashed(SYMBOL_STRING, label_name, hash);
+    if (index >= 0) return strings[index].address;
+    index = symbol_find_hashed(SYMBOL_BUFFER, label_name, hash);
+    if (index >= 0) return buffers[index].address;
+    return -1;
+}
+
+// Set by parse_value_double to a name that is not a symbol with an address yet, for the assembler to fix up.
+static char unresolved_symbol[256];
+// Set while assembling an object file or running the peephole optimizer: every symbol is then left to the
+// fixups, which record relocations and move with the code.
+static bool assembler_defer_symbols = false;
+
 double parse_value_double(const char* value_str) {
     if (!value_str) return 0.0;
 
@@ -2679,12 +5483,18 @@ double parse_value_double(const char* value_str) {
         return (double)strtol(value_str + 2, NULL, 2);
     }
     else if (isalpha(value_str[0]) || value_str[0] == '_') {
-        uint32_t label_addr = get_label_address(value_str);
+        uint32_t label_addr = assembler_defer_symbols ? (uint32_t)-1 : get_label_address(value_str);
         if (label_addr != -1) {
             return (double)label_addr;
         }
         else {
-            return strtod(value_str, NULL);
+            char* end;
+            double value = strtod(value_str, &end);
+            if (*end != '\0') {
+                strncpy(unresolved_symbol, value_str, sizeof(unresolved_symbol) - 1);
+                unresolved_symbol[sizeof(unresolved_symbol) - 1] = '\0';
+            }
+            return value;
         }
     }
     else {
@@ -2692,6 +5502,33 @@ double parse_value_double(const char* value_str) {
     }
 }
 
+// Whether operand names a label, string or buffer, including one that is only defined further down.
+bool is_symbol_reference(const char* operand) {
+    if (operand == NULL) return false;
+    if (get_label_address(operand) != -1 || symbol_find(SYMBOL_STRING, operand) >= 0 || symbol_find(SYMBOL_BUFFER, operand) >= 0) return true;
+    if (!(isalpha(operand[0]) || operand[0] == '_') || is_register_str(operand) || get_macro_value(operand) != NULL) return false;
+    unresolved_symbol[0] = '\0';
+    parse_value_double(operand);
+    bool unresolved = unresolved_symbol[0] != '\0';
+    unresolved_symbol[0] = '\0';
+    return unresolved;
+}
+
+// Whether an immediate is written as a whole number: decimal digits, 0x, 0b or a character literal,
+// directly or through a macro. Only those get a compact encoding, so "5.0" keeps the full double.
+bool is_integer_literal(const char* operand) {
+    if (operand == NULL) return false;
+    const char* macro_value = get_macro_value(operand);
+    if (macro_value != NULL) operand = macro_value;
+    if (operand[0] == '\'' || strncmp(operand, "0x", 2) == 0 || strncmp(operand, "0b", 2) == 0) return true;
+    if (operand[0] == '-' || operand[0] == '+') operand++;
+    if (*operand == '\0') return false;
+    for (; *operand != '\0'; operand++) {
+        if (!isdigit((unsigned char)*operand)) return false;
+    }
+    return true;
+}
+
 uint32_t parse_address(const char* addr_str) {
     char temp_addr_str[64];
     if (!addr_str) return 0;
@@ -2716,27 +5553,692 @@ typedef enum {
     PREPROCESSOR_STATE_IFDEF_FALSE
 } PreprocessorState;
 
-int assemble_program(const char* asm_filename, const char* rom_filename) {
-    FILE* asm_file = fopen(asm_filename, "r");
-    if (!asm_file) {
+// Assembler Source
+// The source is read through a read-only mapping of the file, so it is never copied through stdio and
+// lines can be of any length. Windows reads the file into memory instead.
+
+typedef struct {
+    const char* text;
+    size_t size;
+    bool mapped;
+} AssemblerSource;
+
+static bool assembler_source_open(const char* filename, AssemblerSource* source) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+    source->text = "";
+    source->size = 0;
+    source->mapped = false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    if (size <= 0) {
+        fclose(file);
+        return size == 0;
+    }
+#ifndef _WIN32
+    void* text = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (text != MAP_FAILED) {
+        fclose(file); // The mapping stays valid after the descriptor is closed
+        source->text = (const char*)text;
+        source->size = (size_t)size;
+        source->mapped = true;
+        return true;
+    }
+#endif
+    char* text_copy = (char*)malloc((size_t)size);
+    if (text_copy == NULL || fread(text_copy, 1, (size_t)size, file) != (size_t)size) {
+        free(text_copy);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+    source->text = text_copy;
+    source->size = (size_t)size;
+    return true;
+}
+
+static void assembler_source_close(AssemblerSource* source) {
+    if (source->size == 0) return;
+#ifndef _WIN32
+    if (source->mapped) {
+        munmap((void*)source->text, source->size);
+        return;
+    }
+#endif
+    free((void*)source->text);
+}
+
+// Assembly Listing
+// The rows are collected in memory and written when the pass is over: the rows of .STRING and .BUFFER
+// lines, and of instructions that use a symbol defined further down, hold addresses that are only known
+// then. Those fields are patched in place. The row format is the same as when the listing was printed
+// line by line.
+
+typedef enum {
+    LISTING_PATCH_NONE,         // Rows only: the address is final
+    LISTING_PATCH_DATA_ADDRESS, // value is an offset into the data section
+    LISTING_PATCH_CODE_ADDRESS, // value is a code address the peephole optimizer may move
+    LISTING_PATCH_BYTES,        // value is the address of an instruction whose bytes are rewritten
+    LISTING_PATCH_REMOVED       // The instruction was removed by the peephole optimizer
+} ListingPatchKind;
+
+typedef struct {
+    size_t offset;  // Of the field in the listing text
+    uint32_t value;
+    uint8_t length; // Of the instruction, for LISTING_PATCH_BYTES and LISTING_PATCH_REMOVED
+    uint8_t kind;   // ListingPatchKind
+} ListingPatch;
+
+typedef struct {
+    char* text;
+    size_t length;
+    size_t capacity;
+    ListingPatch* patches;
+    size_t patch_count;
+    size_t patch_capacity;
+    bool out_of_memory;
+} AssemblyListing;
+
+static char* listing_reserve(AssemblyListing* listing, size_t length) {
+    if (listing->length + length > listing->capacity) {
+        size_t capacity = listing->capacity ? listing->capacity : 64 * 1024;
+        while (capacity < listing->length + length) capacity *= 2;
+        char* text = (char*)realloc(listing->text, capacity);
+        if (text == NULL) {
+            listing->out_of_memory = true;
+            return NULL;
+        }
+        listing->text = text;
+        listing->capacity = capacity;
+    }
+    char* out = listing->text + listing->length;
+    listing->length += length;
+    return out;
+}
+
+// Appends text, padded with spaces to width like "%-*s"
+static void listing_append(AssemblyListing* listing, const char* text, size_t length, size_t width) {
+    char* out = listing_reserve(listing, length > width ? length : width);
+    if (out == NULL) return;
+    memcpy(out, text, length);
+    if (length < width) memset(out + length, ' ', width - length);
+}
+
+static void listing_add_patch(AssemblyListing* listing, size_t offset, ListingPatchKind kind, uint32_t value, uint8_t length) {
+    if (listing->patch_count == listing->patch_capacity) {
+        size_t capacity = listing->patch_capacity ? listing->patch_capacity * 2 : 256;
+        ListingPatch* patches = (ListingPatch*)realloc(listing->patches, capacity * sizeof(ListingPatch));
+        if (patches == NULL) {
+            listing->out_of_memory = true;
+            return;
+        }
+        listing->patches = patches;
+        listing->patch_capacity = capacity;
+    }
+    listing->patches[listing->patch_count].offset = offset;
+    listing->patches[listing->patch_count].value = value;
+    listing->patches[listing->patch_count].length = length;
+    listing->patches[listing->patch_count].kind = (uint8_t)kind;
+    listing->patch_count++;
+}
+
+static size_t listing_format_hex(char* out, uint32_t value) {
+    char digits[8];
+    size_t count = 0;
+    do {
+        digits[count++] = "0123456789ABCDEF"[value & 15];
+        value >>= 4;
+    } while (value != 0);
+    for (size_t i = 0; i < count; i++) out[i] = digits[count - 1 - i];
+    return count;
+}
+
+// One row, as "%-9d| %-8X | %-30s | %-20s | %s". An address that is not final is filled in later, as
+// address_patch says. Returns the offset of the binary code field.
+static size_t listing_row(AssemblyListing* listing, int line_number, uint32_t address, ListingPatchKind address_patch, const char* code, size_t code_length, const char* binary, size_t binary_length, const char* comment) {
+    char field[16];
+    size_t length = 0;
+    char digits[12];
+    size_t count = 0;
+    do {
+        digits[count++] = (char)('0' + line_number % 10);
+        line_number /= 10;
+    } while (line_number > 0);
+    while (count > 0) field[length++] = digits[--count];
+    listing_append(listing, field, length, 9);
+    listing_append(listing, "| ", 2, 2);
+    if (address_patch != LISTING_PATCH_NONE) {
+        listing_add_patch(listing, listing->length, address_patch, address, 0);
+        listing_append(listing, "", 0, 8);
+    }
+    else {
+        listing_append(listing, field, listing_format_hex(field, address), 8);
+    }
+    listing_append(listing, " | ", 3, 3);
+    listing_append(listing, code, code_length, 30);
+    listing_append(listing, " | ", 3, 3);
+    size_t binary_offset = listing->length;
+    listing_append(listing, binary, binary_length, 20);
+    listing_append(listing, " | ", 3, 3);
+    listing_append(listing, comment, strlen(comment), 0);
+    return binary_offset;
+}
+
+// Fills in the patched fields once the data section starts at data_start.
+static void listing_apply_patches(AssemblyListing* listing, const VM* vm, uint32_t data_start) {
+    for (size_t i = 0; i < listing->patch_count; i++) {
+        const ListingPatch* patch = &listing->patches[i];
+        char* out = listing->text + patch->offset;
+        if (patch->kind == LISTING_PATCH_DATA_ADDRESS) {
+            listing_format_hex(out, data_start + patch->value);
+            continue;
+        }
+        if (patch->kind == LISTING_PATCH_CODE_ADDRESS) {
+            listing_format_hex(out, patch->value);
+            continue;
+        }
+        if (patch->kind == LISTING_PATCH_REMOVED) {
+            memset(out, ' ', patch->length * 3);
+            memcpy(out, "(removed)", 9); // The field is at least 20 wide
+            continue;
+        }
+        for (uint32_t j = 0; j < patch->length; j++) {
+            uint8_t byte = vm->memory[patch->value + j];
+            out[j * 3] = "0123456789ABCDEF"[byte >> 4];
+            out[j * 3 + 1] = "0123456789ABCDEF"[byte & 15];
+        }
+    }
+}
+
+// Constant Pool Builder
+// Collects the pooled constants of one assembly or link, each distinct bit pattern once, so 0.5 written in
+// a hundred places is one entry. -0 and 0, and NaNs with different payloads, are different entries. The
+// entries are found through an open addressing table of indices.
+
+typedef struct {
+    double* values;            // In index order, as placed in the ROM
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* slots;           // Index + 1 of the value in each slot, 0 when free
+    uint32_t slot_count;       // A power of two, at least twice count
+} ConstantPool;
+
+static uint32_t constant_pool_hash(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xFF51AFD7ED558CCDULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// The index of value in the pool, adding it if it is new. Returns -1 when the pool is full or out of memory.
+static int constant_pool_add(ConstantPool* pool, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t mask = pool->slot_count - 1;
+    uint32_t slot = constant_pool_hash(bits) & mask;
+    for (; pool->slot_count > 0 && pool->slots[slot] != 0; slot = (slot + 1) & mask) {
+        uint64_t entry_bits;
+        memcpy(&entry_bits, &pool->values[pool->slots[slot] - 1], sizeof(entry_bits));
+        if (entry_bits == bits) return (int)(pool->slots[slot] - 1);
+    }
+    if (pool->count >= CONSTANT_POOL_MAX_ENTRIES) return -1;
+
+    if (pool->count == pool->capacity) {
+        uint32_t capacity = pool->capacity ? pool->capacity * 2 : 64;
+        double* values = (double*)realloc(pool->values, capacity * sizeof(double));
+        if (values == NULL) return -1;
+        pool->values = values;
+        pool->capacity = capacity;
+    }
+    if ((pool->count + 1) * 2 > pool->slot_count) {
+        uint32_t slot_count = pool->slot_count ? pool->slot_count * 2 : 128;
+        uint32_t* slots = (uint32_t*)calloc(slot_count, sizeof(uint32_t));
+        if (slots == NULL) return -1;
+        for (uint32_t i = 0; i < pool->count; i++) {
+            uint64_t entry_bits;
+            memcpy(&entry_bits, &pool->values[i], sizeof(entry_bits));
+            uint32_t rehashed = constant_pool_hash(entry_bits) & (slot_count - 1);
+            while (slots[rehashed] != 0) rehashed = (rehashed + 1) & (slot_count - 1);
+            slots[rehashed] = i + 1;
+        }
+        free(pool->slots);
+        pool->slots = slots;
+        pool->slot_count = slot_count;
+        mask = slot_count - 1;
+        slot = constant_pool_hash(bits) & mask;
+        while (pool->slots[slot] != 0) slot = (slot + 1) & mask;
+    }
+    pool->values[pool->count] = value;
+    pool->slots[slot] = ++pool->count;
+    return (int)(pool->count - 1);
+}
+
+static void constant_pool_free(ConstantPool* pool) {
+    free(pool->values);
+    free(pool->slots);
+    memset(pool, 0, sizeof(*pool));
+}
+
+// Writes the entries at address, and the trailer after them when trailer is set. Returns the address
+// after what was written.
+static uint32_t constant_pool_place(VM* vm, const ConstantPool* pool, uint32_t address, bool trailer) {
+    if (pool->count == 0) return address;
+    memcpy(&vm->memory[address], pool->values, pool->count * sizeof(double));
+    uint32_t end = address + pool->count * (uint32_t)sizeof(double);
+    if (!trailer) return end;
+    ConstantPoolTrailer pool_trailer;
+    pool_trailer.address = address;
+    pool_trailer.count = pool->count;
+    memcpy(pool_trailer.magic, CONSTANT_POOL_MAGIC, sizeof(pool_trailer.magic));
+    memcpy(&vm->memory[end], &pool_trailer, sizeof(pool_trailer));
+    return end + (uint32_t)sizeof(pool_trailer);
+}
+
+// Appends one listing row per entry, placed from address on
+static void constant_pool_list(FILE* file, const ConstantPool* pool, uint32_t address) {
+    for (uint32_t i = 0; i < pool->count; i++) {
+        const uint8_t* bytes = (const uint8_t*)&pool->values[i];
+        char value[40];
+        char binary[32];
+        snprintf(value, sizeof(value), "%.17g", pool->values[i]);
+        for (int b = 0; b < 8; b++) sprintf(&binary[b * 3], "%02X ", bytes[b]);
+        binary[23] = '\0';
+        fprintf(file, "%-9s| %-8X | %-30s | %-20s | ; Constant Pool entry %u\n", "-", address + i * 8, value, binary, i);
+    }
+}
+
+// Object Files
+// An object file holds one separately assembled module: its code as if loaded at address 0, followed by
+// its strings and buffers and its constant pool, the symbols it defines and a relocation for every operand
+// that holds an address or a pool index. .GLOBAL exports a label, string or buffer to the other modules of a project and .EXTERN
+// imports one from them. See Linker for how objects are combined.
+
+typedef struct {
+    ObjectHeader header;
+    uint8_t* contents;          // The whole file
+    const uint8_t* image;       // Code, then data
+    const uint8_t* pool;        // pool_count doubles, not necessarily aligned
+    const uint8_t* symbols;     // ObjectSymbol records, not necessarily aligned
+    const uint8_t* relocations; // ObjectRelocation records, not necessarily aligned
+    const char* names;
+} ObjectFile;
+
+// Writes the object under a temporary name and renames it into place, so a failed or concurrent build
+// never leaves a half-written object behind a valid cache key.
+static bool object_write(const char* filename, const ObjectHeader* header, const uint8_t* image, const ObjectSymbol* symbols, const ObjectRelocation* relocations, const char* names) {
+    char temp_path[272];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", filename);
+    FILE* file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not create object file '%s'.\n", temp_path);
+        return false;
+    }
+    uint32_t image_size = header->code_size + header->data_size + header->pool_count * (uint32_t)sizeof(double);
+    bool ok = fwrite(header, sizeof(*header), 1, file) == 1;
+    if (ok && image_size > 0) ok = fwrite(image, 1, image_size, file) == image_size;
+    if (ok && header->symbol_count > 0) ok = fwrite(symbols, sizeof(ObjectSymbol), header->symbol_count, file) == header->symbol_count;
+    if (ok && header->relocation_count > 0) ok = fwrite(relocations, sizeof(ObjectRelocation), header->relocation_count, file) == header->relocation_count;
+    if (ok && header->names_size > 0) ok = fwrite(names, 1, header->names_size, file) == header->names_size;
+    if (fclose(file) != 0) ok = false;
+    if (ok) {
+#ifdef _WIN32
+        remove(filename); // rename does not replace existing files on Windows
+#endif
+        ok = rename(temp_path, filename) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Could not write object file '%s'.\n", filename);
+        remove(temp_path);
+    }
+    return ok;
+}
+
+static ObjectSymbol object_symbol(const ObjectFile* object, uint32_t index) {
+    ObjectSymbol symbol;
+    memcpy(&symbol, object->symbols + index * sizeof(ObjectSymbol), sizeof(symbol));
+    return symbol;
+}
+
+static ObjectRelocation object_relocation(const ObjectFile* object, uint32_t index) {
+    ObjectRelocation relocation;
+    memcpy(&relocation, object->relocations + index * sizeof(ObjectRelocation), sizeof(relocation));
+    return relocation;
+}
+
+// Whether filename is an object file with the given cache key. Only the header is read.
+static bool object_is_current(const char* filename, uint64_t source_hash) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) return false;
+    ObjectHeader header;
+    bool current = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, OBJECT_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == OBJECT_VERSION && header.source_hash == source_hash;
+    fclose(file);
+    return current;
+}
+
+// Reads a whole object file and checks that every record stays inside it. Prints an error and returns
+// false if the file is missing or damaged.
+static bool object_read(const char* filename, ObjectFile* object) {
+    memset(object, 0, sizeof(*object));
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        perror("Error opening object file");
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    object->contents = size > 0 ? (uint8_t*)malloc((size_t)size) : NULL;
+    bool ok = object->contents != NULL && fread(object->contents, 1, (size_t)size, file) == (size_t)size;
+    fclose(file);
+
+    const ObjectHeader* header = &object->header;
+    if (ok && (size_t)size >= sizeof(ObjectHeader)) memcpy(&object->header, object->contents, sizeof(ObjectHeader));
+    ok = ok && (size_t)size >= sizeof(ObjectHeader) && memcmp(header->magic, OBJECT_MAGIC, sizeof(header->magic)) == 0 && header->version == OBJECT_VERSION &&
+        header->pool_count <= CONSTANT_POOL_MAX_ENTRIES && (uint64_t)sizeof(ObjectHeader) + header->code_size + header->data_size +
+        (uint64_t)header->pool_count * sizeof(double) + (uint64_t)header->symbol_count * sizeof(ObjectSymbol) +
+        (uint64_t)header->relocation_count * sizeof(ObjectRelocation) + header->names_size == (uint64_t)size;
+    if (!ok) {
+        fprintf(stderr, "Error: '%s' is not a valid object file.\n", filename);
+        free(object->contents);
+        object->contents = NULL;
+        return false;
+    }
+    object->image = object->contents + sizeof(ObjectHeader);
+    object->pool = object->image + header->code_size + header->data_size;
+    object->symbols = object->pool + header->pool_count * sizeof(double);
+    object->relocations = object->symbols + header->symbol_count * sizeof(ObjectSymbol);
+    object->names = (const char*)(object->relocations + header->relocation_count * sizeof(ObjectRelocation));
+
+    ok = header->names_size == 0 || object->names[header->names_size - 1] == '\0';
+    for (uint32_t i = 0; ok && i < header->symbol_count; i++) {
+        ObjectSymbol symbol = object_symbol(object, i);
+        uint32_t section_size = symbol.section == OBJECT_SECTION_CODE ? header->code_size : header->data_size;
+        ok = symbol.name < header->names_size && (symbol.section == OBJECT_SECTION_CODE || symbol.section == OBJECT_SECTION_DATA) &&
+            symbol.value <= section_size && symbol.size <= section_size - symbol.value &&
+            (symbol.kind == SYMBOL_LABEL || symbol.kind == SYMBOL_STRING || symbol.kind == SYMBOL_BUFFER);
+    }
+    for (uint32_t i = 0; ok && i < header->relocation_count; i++) {
+        ObjectRelocation relocation = object_relocation(object, i);
+        uint32_t operand_size = OPERAND_SIZE(relocation.kind);
+        bool pooled = relocation.section == OBJECT_SECTION_POOL;
+        ok = (pooled ? relocation.kind == OPERAND_K16 : relocation.kind == OPERAND_F64 || relocation.kind == OPERAND_U32) &&
+            relocation.offset <= header->code_size && operand_size <= header->code_size - relocation.offset &&
+            ((relocation.section == OBJECT_SECTION_CODE && relocation.target <= header->code_size) ||
+             (relocation.section == OBJECT_SECTION_DATA && relocation.target <= header->data_size) ||
+             (relocation.section == OBJECT_SECTION_EXTERN && relocation.target < header->names_size) ||
+             (pooled && relocation.target < header->pool_count));
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: '%s' has a damaged symbol or relocation table.\n", filename);
+        free(object->contents);
+        object->contents = NULL;
+    }
+    return ok;
+}
+
+// Single-Pass Assembler
+// Each line is assembled as soon as it is read. An operand naming a label, string or buffer that has no
+// address yet is emitted as zero and recorded as a fixup, and the fixups are patched when the source has
+// been read: labels defined further down are known then, and strings and buffers are placed after the
+// code in the order of their directives.
+
+typedef struct {
+    uint32_t address;  // Of the operand bytes
+    OperandKind kind;  // OPERAND_F64 or OPERAND_U32
+    int line_number;
+    size_t name;       // Offset of the symbol name in the fixup name buffer
+    uint8_t section;   // What the name resolved to, an OBJECT_SECTION_* value
+    uint32_t target;   // The address it resolved to
+} AssemblerFixup;
+
+typedef struct {
+    SymbolKind kind;   // SYMBOL_STRING or SYMBOL_BUFFER
+    int index;
+    uint32_t offset;   // From the start of the data section
+} AssemblerData;
+
+// Appends name to a buffer of NUL-terminated names and stores its offset. Returns false when out of memory.
+static bool assembler_names_add(char** names, size_t* length, size_t* capacity, const char* name, size_t* offset) {
+    size_t name_length = strlen(name) + 1;
+    if (*length + name_length > *capacity) {
+        size_t grown_capacity = *capacity ? *capacity : 4096;
+        while (grown_capacity < *length + name_length) grown_capacity *= 2;
+        char* grown = (char*)realloc(*names, grown_capacity);
+        if (grown == NULL) return false;
+        *names = grown;
+        *capacity = grown_capacity;
+    }
+    memcpy(*names + *length, name, name_length);
+    *offset = *length;
+    *length += name_length;
+    return true;
+}
+
+// Peephole Optimizer
+// An optional pass over the instructions of one assembly, run when the source has been read and before
+// the fixups are patched. It removes instructions that have no effect and retargets jumps to jumps, then
+// closes up the gaps. While it is on every label reference is kept as a fixup, so the labels, the operands
+// that hold their addresses and the listing all move with the code. Numeric code addresses do not move:
+// code that jumps through them or reads its own instructions must be assembled with the optimizer off.
+
+bool peephole_enabled = false;
+
+typedef enum {
+    PEEPHOLE_MOV_SELF,  // MOV Rx, Rx
+    PEEPHOLE_ADD_ZERO,  // SUB Rx, 0 or ADD Rx, -0 whose flags the next instruction overwrites
+    PEEPHOLE_JUMP_NEXT, // JMP or Jcc to the instruction that follows it anyway
+    PEEPHOLE_PUSH_POP,  // PUSH Rx directly followed by POP Rx, with no label in between
+    PEEPHOLE_RULE_COUNT
+} PeepholeRule;
+
+static const char* const peephole_rule_names[PEEPHOLE_RULE_COUNT] = { "MOV Rx, Rx", "SUB 0 or ADD -0", "Jump to next", "PUSH Rx; POP Rx" };
+
+#define PEEPHOLE_KEPT 0xFF
+#define PEEPHOLE_MAX_PASSES 16 // Each pass can enable more; real code settles after two or three
+
+typedef struct {
+    uint32_t address;     // As assembled
+    uint32_t new_address; // Once the removed instructions are closed up
+    uint32_t first_fixup; // Of the fixups in the instruction's operands
+    uint8_t fixup_count;
+    uint8_t length;
+    uint8_t opcode;
+    uint8_t removed_by;   // A PeepholeRule, or PEEPHOLE_KEPT
+} PeepholeInstruction;
+
+typedef struct {
+    int removed[PEEPHOLE_RULE_COUNT];
+    uint32_t bytes_removed;
+    int retargeted;       // Jumps and calls to a JMP that now go where the JMP goes
+} PeepholeReport;
+
+// Index of the first instruction at or after address, or count.
+static size_t peephole_find(const PeepholeInstruction* code, size_t count, uint32_t address) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (code[middle].address < address) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+static size_t peephole_next_kept(const PeepholeInstruction* code, size_t count, size_t index) {
+    while (index < count && code[index].removed_by != PEEPHOLE_KEPT) index++;
+    return index;
+}
+
+// Where an address of the assembled code ends up: at the first kept instruction at or after it.
+static uint32_t peephole_map_address(const PeepholeInstruction* code, size_t count, uint32_t address, uint32_t code_end) {
+    size_t index = peephole_next_kept(code, count, peephole_find(code, count, address));
+    return index < count ? code[index].new_address : code_end;
+}
+
+static bool peephole_is_jump(uint8_t opcode) {
+    switch (opcode) {
+    case OP_JMP: case OP_JMP_NZ: case OP_JMP_Z: case OP_JMP_S: case OP_JMP_NS: case OP_JMP_C: case OP_JMP_NC:
+    case OP_JMP_O: case OP_JMP_NO: case OP_JMP_GE: case OP_JMP_LE: case OP_JMP_G: case OP_JMP_L:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// The label a jump or call goes to, or -1 if it goes to an address, an import or a string.
+static int peephole_jump_label(const PeepholeInstruction* instruction, const AssemblerFixup* fixups, const char* names) {
+    if (instruction->fixup_count != 1) return -1;
+    const char* name = names + fixups[instruction->first_fixup].name;
+    const char* macro_value = get_macro_value(name);
+    return symbol_find(SYMBOL_LABEL, macro_value != NULL ? macro_value : name);
+}
+
+static bool peephole_is_flag_register(uint8_t reg) {
+    return reg >= REG_ZF && reg <= REG_OF;
+}
+
+// Whether the instruction overwrites every flag without reading one first.
+static bool peephole_writes_all_flags(const VM* vm, const PeepholeInstruction* instruction) {
+    const OpcodeInfo* info = &opcode_info[instruction->opcode];
+    if (info->flag_effects != FLAG_EFFECT_ALL) return false;
+    uint32_t offset = instruction->address + 1;
+    for (int i = 0; i < info->operand_count; i++) {
+        if (info->operands[i] == OPERAND_REG && peephole_is_flag_register(vm->memory[offset])) return false;
+        offset += OPERAND_SIZE(info->operands[i]);
+    }
+    return true;
+}
+
+// Whether a label of this assembly lies in (after, until]. labels[] is in address order.
+static bool peephole_label_between(uint32_t after, uint32_t until) {
+    int low = 0, high = label_count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (labels[middle].address <= after) low = middle + 1;
+        else high = middle;
+    }
+    return low < label_count && labels[low].address <= until;
+}
+
+// Applies the rules until nothing changes, closes up the code and moves the labels, the fixups and the
+// listing along. vm->program_counter is the end of the code before and after.
+static void peephole_optimize(VM* vm, PeepholeInstruction* code, size_t count, AssemblerFixup* fixups, const char* names, const ConstantPool* pool, AssemblyListing* listing, PeepholeReport* report) {
+    memset(report, 0, sizeof(*report));
+    bool changed = true;
+    for (int pass = 0; changed && pass < PEEPHOLE_MAX_PASSES; pass++) {
+        changed = false;
+        for (size_t i = 0; i < count; i++) {
+            PeepholeInstruction* instruction = &code[i];
+            if (instruction->removed_by != PEEPHOLE_KEPT) continue;
+            const uint8_t* bytes = &vm->memory[instruction->address];
+            size_t next = peephole_next_kept(code, count, i + 1);
+            int rule = -1;
+
+            if (instruction->opcode == OP_MOV_REG_REG && bytes[1] == bytes[2]) {
+                rule = PEEPHOLE_MOV_SELF;
+            }
+            else if ((opcode_widened(instruction->opcode) == OP_ADD_REG_VAL || opcode_widened(instruction->opcode) == OP_SUB_REG_VAL) && instruction->fixup_count == 0) {
+                double value = immediate_widen(bytes + 2, opcode_info[instruction->opcode].operands[1], pool->values, pool->count);
+                // x - 0 and x + -0 are x for every double; x + 0 turns -0 into +0
+                bool identity = value == 0.0 && (signbit(value) != 0) == (opcode_widened(instruction->opcode) == OP_ADD_REG_VAL);
+                if (identity && !peephole_is_flag_register(bytes[1]) && next < count && peephole_writes_all_flags(vm, &code[next])) rule = PEEPHOLE_ADD_ZERO;
+            }
+            else if (instruction->opcode == OP_PUSH_REG && next < count && code[next].opcode == OP_POP_REG) {
+                // Nothing may jump to the POP: it would pop a value the PUSH no longer pushed
+                if (bytes[1] == vm->memory[code[next].address + 1] && bytes[1] != REG_SP && !peephole_label_between(instruction->address, code[next].address)) {
+                    code[next].removed_by = PEEPHOLE_PUSH_POP;
+                    report->removed[PEEPHOLE_PUSH_POP]++;
+                    report->bytes_removed += code[next].length;
+                    rule = PEEPHOLE_PUSH_POP;
+                }
+            }
+            else if (peephole_is_jump(instruction->opcode) || instruction->opcode == OP_CALL_ADDR) {
+                int label = peephole_jump_label(instruction, fixups, names);
+                if (label < 0) continue;
+                size_t target = peephole_next_kept(code, count, peephole_find(code, count, labels[label].address));
+                if (target == next && instruction->opcode != OP_CALL_ADDR) {
+                    rule = PEEPHOLE_JUMP_NEXT;
+                }
+                else if (target < count && target != i && code[target].opcode == OP_JMP) {
+                    int target_label = peephole_jump_label(&code[target], fixups, names);
+                    if (target_label >= 0 && target_label != label) {
+                        fixups[instruction->first_fixup].name = fixups[code[target].first_fixup].name;
+                        report->retargeted++;
+                        changed = true;
+                    }
+                }
+            }
+
+            if (rule >= 0) {
+                instruction->removed_by = (uint8_t)rule;
+                report->removed[rule]++;
+                report->bytes_removed += instruction->length;
+                changed = true;
+            }
+        }
+    }
+
+    // Close up the code: kept instructions only move down, so one forward sweep does it
+    uint32_t old_end = vm->program_counter;
+    uint32_t address = count > 0 ? code[0].address : old_end;
+    for (size_t i = 0; i < count; i++) {
+        code[i].new_address = address;
+        if (code[i].removed_by != PEEPHOLE_KEPT) continue;
+        memmove(&vm->memory[address], &vm->memory[code[i].address], code[i].length);
+        address += code[i].length;
+    }
+    uint32_t code_end = address;
+    memset(&vm->memory[code_end], 0, old_end - code_end);
+    vm->program_counter = code_end;
+
+    for (int i = 0; i < label_count; i++) {
+        labels[i].address = peephole_map_address(code, count, labels[i].address, code_end);
+    }
+    for (size_t i = 0; i < count; i++) {
+        for (uint32_t j = code[i].first_fixup; j < code[i].first_fixup + code[i].fixup_count; j++) {
+            if (code[i].removed_by != PEEPHOLE_KEPT) fixups[j].kind = OPERAND_NONE;
+            else fixups[j].address = fixups[j].address - code[i].address + code[i].new_address;
+        }
+    }
+    for (size_t i = 0; i < listing->patch_count; i++) {
+        ListingPatch* patch = &listing->patches[i];
+        if (patch->kind == LISTING_PATCH_CODE_ADDRESS) {
+            patch->value = peephole_map_address(code, count, patch->value, code_end);
+        }
+        else if (patch->kind == LISTING_PATCH_BYTES) {
+            const PeepholeInstruction* instruction = &code[peephole_find(code, count, patch->value)];
+            if (instruction->removed_by != PEEPHOLE_KEPT) patch->kind = LISTING_PATCH_REMOVED;
+            else patch->value = instruction->new_address;
+        }
+    }
+}
+
+// Assembles asm_filename into a ROM, or into an object file for the linker when object is set. The
+// listing goes to output_filename with ".lst" appended either way.
+static int assemble_source(VM* vm, const char* asm_filename, const char* output_filename, bool object, uint64_t source_hash) {
+    AssemblerSource source;
+    if (!assembler_source_open(asm_filename, &source)) {
         perror("Error opening assembly file");
         return -1;
     }
 
-    FILE* rom_file = fopen(rom_filename, "wb");
-    if (!rom_file) {
-        perror("Error opening ROM file for writing");
-        fclose(asm_file);
-        return -1;
+    FILE* rom_file = NULL; // Object files are written when the module is complete, see object_write
+    if (!object) {
+        rom_file = fopen(output_filename, "wb");
+        if (!rom_file) {
+            perror("Error opening ROM file for writing");
+            assembler_source_close(&source);
+            return -1;
+        }
     }
     char lst_filename[256];
-    strcpy(lst_filename, rom_filename);
-    strcat(lst_filename, ".lst");
+    snprintf(lst_filename, sizeof(lst_filename), "%s.lst", output_filename);
     FILE* lst_file = fopen(lst_filename, "w");
     if (!lst_file) {
         perror("Error opening LST file for writing");
-        fclose(asm_file);
-        fclose(rom_file);
+        assembler_source_close(&source);
+        if (rom_file) fclose(rom_file);
         return -1;
     }
 
@@ -2745,29 +6247,71 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
     fprintf(lst_file, "---------|----------|--------------------------------|---------------------|---------\n");
 
 
-    memset(memory, 0, MEMORY_SIZE);
-    program_counter = 0;
+    guest_memory_discard(vm);
+    decode_cache_reset(vm);
+    vm->program_counter = 0;
     macro_count = 0;
     label_count = 0;
     string_count = 0;
     buffer_count = 0;
+    symbol_index_reset();
     data_section_start = 0;
     uint32_t rom_offset = 0;
+    bool optimize = peephole_enabled;
+    ListingPatchKind code_patch = optimize ? LISTING_PATCH_CODE_ADDRESS : LISTING_PATCH_NONE; // Code moves when optimizing
+    assembler_defer_symbols = object || optimize;
+
+    AssemblyListing listing = { 0 };
+    AssemblerFixup* fixups = NULL;
+    size_t fixup_count = 0, fixup_capacity = 0;
+    char* fixup_names = NULL;
+    size_t fixup_names_length = 0, fixup_names_capacity = 0;
+    AssemblerData* data_items = NULL;
+    size_t data_count = 0, data_capacity = 0;
+    uint32_t data_size = 0;
+    PeepholeInstruction* code = NULL; // Only recorded when optimizing
+    size_t code_count = 0, code_capacity = 0;
+    ConstantPool pool = { 0 };
+    char* line = NULL;
+    char* mnemonic_output = NULL;
+    size_t line_capacity = 0;
 
-    char line[256];
     int line_number = 1;
     PreprocessorState preprocessor_state[MAX_PREPROCESSOR_DEPTH];
     int preprocessor_depth = 0;
     preprocessor_state[0] = PREPROCESSOR_STATE_NORMAL;
+    uint32_t current_address = 0; // Shown on rows without code: the next instruction, or after the last data
+    ListingPatchKind current_patch = code_patch;
+    bool code_started = false;
+    bool failed = false;
+
+    const char* next_line = source.text;
+    const char* source_end = source.text + source.size;
+    while (next_line < source_end) {
+        const char* newline = (const char*)memchr(next_line, '\n', source_end - next_line);
+        const char* original_line = next_line;
+        size_t original_length = newline ? (size_t)(newline - next_line) + 1 : (size_t)(source_end - next_line);
+        next_line += original_length;
+        if (original_length + 1 > line_capacity) {
+            size_t capacity = line_capacity ? line_capacity : 256;
+            while (capacity < original_length + 1) capacity *= 2;
+            char* grown_line = (char*)realloc(line, capacity);
+            char* grown_output = grown_line ? (char*)realloc(mnemonic_output, capacity + 16) : NULL;
+            if (grown_line) line = grown_line;
+            if (grown_output) mnemonic_output = grown_output;
+            if (grown_line == NULL || grown_output == NULL) {
+                fprintf(stderr, "Error: Out of memory reading line %d.\n", line_number);
+                failed = true;
+                break;
+            }
+            line_capacity = capacity;
+        }
+        memcpy(line, original_line, original_length);
+        line[original_length] = '\0';
 
-    rewind(asm_file);
-    program_counter = 0;
-    while (fgets(line, sizeof(line), asm_file)) {
-        char original_line[256];
-        strcpy(original_line, line);
-        char* line_ptr = line;
-        char* token = strtok(line_ptr, " ,\t\n");
+        char* token = strtok(line, " ,\t\n");
         if (!token || token[0] == ';') {
+            listing_row(&listing, line_number, current_address, current_patch, original_line, original_length, "", 0, ";Comment or Empty Line\n");
             line_number++;
             continue;
         }
@@ -2789,6 +6333,7 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
                     preprocessor_state[preprocessor_depth] = (preprocessor_state[preprocessor_depth] == PREPROCESSOR_STATE_NORMAL) ? PREPROCESSOR_STATE_IFDEF_FALSE : PREPROCESSOR_STATE_NORMAL;
                 }
             }
+            listing_row(&listing, line_number, current_address, current_patch, original_line, original_length, "", 0, ";Preprocessor Directive\n");
             line_number++;
             continue;
         }
@@ -2796,30 +6341,32 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
         if (strcmp(token, "#offset") == 0) {
             char* offset_str = strtok(NULL, " ,\t\n");
             if (offset_str) {
-                rom_offset = parse_address(offset_str);
-                if (rom_offset > MEMORY_SIZE) {
+                uint32_t offset = parse_address(offset_str);
+                if (offset > vm->memory_size) {
                     fprintf(stderr, "Error: Offset too large on line %d.\n", line_number);
-                    fclose(asm_file);
-                    fclose(rom_file);
-                    fclose(lst_file);
-                    return -1;
+                    failed = true;
+                    break;
                 }
-                if (rom_offset % 1 != 0) {
-                    fprintf(stderr, "Error: Offset must be byte aligned on line %d.\n", line_number);
-                    fclose(asm_file);
-                    fclose(rom_file);
-                    fclose(lst_file);
-                    return -1;
+                if (code_started || data_count > 0) {
+                    fprintf(stderr, "Error: #offset must come before the first instruction or data on line %d.\n", line_number);
+                    failed = true;
+                    break;
                 }
-
+                if (object && offset != 0) {
+                    fprintf(stderr, "Error: Object files are placed by the linker, #offset must be 0 on line %d.\n", line_number);
+                    failed = true;
+                    break;
+                }
+                rom_offset = offset;
+                vm->program_counter = rom_offset;
+                current_address = rom_offset;
             }
             else {
                 fprintf(stderr, "Error: Missing offset value in #offset directive on line %d.\n", line_number);
-                fclose(asm_file);
-                fclose(rom_file);
-                fclose(lst_file);
-                return -1;
+                failed = true;
+                break;
             }
+            listing_row(&listing, line_number, current_address, current_patch, original_line, original_length, "", 0, ";Offset Directive\n");
             line_number++;
             continue;
         }
@@ -2829,17 +6376,13 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
 
             if (!string_name) {
                 fprintf(stderr, "Error: Missing string name in .STRING directive on line %d.\n", line_number);
-                fclose(asm_file);
-                fclose(rom_file);
-                fclose(lst_file);
-                return -1;
+                failed = true;
+                break;
             }
             if (!string_value_token) {
                 fprintf(stderr, "Error: Missing string value in .STRING directive on line %d.\n", line_number);
-                fclose(asm_file);
-                fclose(rom_file);
-                fclose(lst_file);
-                return -1;
+                failed = true;
+                break;
             }
 
             const char* macro_value = get_macro_value(string_value_token);
@@ -2851,48 +6394,64 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
                 string_value_with_quotes = string_value_token;
             }
 
-            if (string_count < MAX_STRINGS) {
-                strncpy(strings[string_count].name, string_name, sizeof(strings[string_count].name) - 1);
-                strings[string_count].name[sizeof(strings[string_count].name) - 1] = '\0';
-
-                char* start_quote = strchr(string_value_with_quotes, '\'');
-                char* end_quote = strrchr(string_value_with_quotes, '\'');
-                if (start_quote && end_quote && start_quote != end_quote) {
-                    size_t len = end_quote - start_quote - 1;
-                    if (len < sizeof(strings[string_count].value)) {
-                        strncpy(strings[string_count].value, start_quote + 1, len);
-                        strings[string_count].value[len] = '\0';
-                    }
-                    else {
-                        fprintf(stderr, "Error: String value too long on line %d.\n", line_number);
-                        fclose(asm_file);
-                        fclose(rom_file);
-                        fclose(lst_file);
-                        return -1;
-                    }
+            if (string_count >= MAX_STRINGS) {
+                fprintf(stderr, "Error: String limit reached on line %d.\n", line_number);
+                failed = true;
+                break;
+            }
+            StringDefinition* string = &strings[string_count];
+            strncpy(string->name, string_name, sizeof(string->name) - 1);
+            string->name[sizeof(string->name) - 1] = '\0';
+            string->address = (uint32_t)-1; // Placed after the code at the end
+            char* start_quote = strchr(string_value_with_quotes, '\'');
+            char* end_quote = strrchr(string_value_with_quotes, '\'');
+            if (start_quote && end_quote && start_quote != end_quote) {
+                size_t len = end_quote - start_quote - 1;
+                if (len < sizeof(string->value)) {
+                    strncpy(string->value, start_quote + 1, len);
+                    string->value[len] = '\0';
                 }
                 else {
-                    if (macro_value == NULL) {
-                        fprintf(stderr, "Error: Invalid string syntax on line %d. String must be enclosed in single quotes.\n", line_number);
-                        fclose(asm_file);
-                        fclose(rom_file);
-                        fclose(lst_file);
-                        return -1;
-                    }
-                    else {
-                        strncpy(strings[string_count].value, string_value_with_quotes, sizeof(strings[string_count].value) - 1);
-                        strings[string_count].value[sizeof(strings[string_count].value) - 1] = '\0';
-                    }
+                    fprintf(stderr, "Error: String value too long on line %d.\n", line_number);
+                    failed = true;
+                    break;
                 }
-                string_count++;
             }
             else {
-                fprintf(stderr, "Error: String limit reached on line %d.\n", line_number);
-                fclose(asm_file);
-                fclose(rom_file);
-                fclose(lst_file);
-                return -1;
+                if (macro_value == NULL) {
+                    fprintf(stderr, "Error: Invalid string syntax on line %d. String must be enclosed in single quotes.\n", line_number);
+                    failed = true;
+                    break;
+                }
+                else {
+                    strncpy(string->value, string_value_with_quotes, sizeof(string->value) - 1);
+                    string->value[sizeof(string->value) - 1] = '\0';
+                }
+            }
+            if (!symbol_define(SYMBOL_STRING, string->name, string_count)) {
+                fprintf(stderr, "Error: Out of memory for the symbol index on line %d.\n", line_number);
+                failed = true;
+                break;
             }
+            if (data_count == data_capacity) {
+                data_capacity = data_capacity ? data_capacity * 2 : 64;
+                AssemblerData* grown = (AssemblerData*)realloc(data_items, data_capacity * sizeof(AssemblerData));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Out of memory for the data section on line %d.\n", line_number);
+                    failed = true;
+                    break;
+                }
+                data_items = grown;
+            }
+            data_items[data_count].kind = SYMBOL_STRING;
+            data_items[data_count].index = string_count;
+            data_items[data_count].offset = data_size;
+            data_count++;
+            listing_row(&listing, line_number, data_size, LISTING_PATCH_DATA_ADDRESS, original_line, original_length, "", 0, "; String Definition\n");
+            data_size += (uint32_t)strlen(string->value) + 1;
+            string_count++;
+            current_address = data_size;
+            current_patch = LISTING_PATCH_DATA_ADDRESS;
             line_number++;
             continue;
         }
@@ -2902,42 +6461,82 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
 
             if (!buffer_name) {
                 fprintf(stderr, "Error: Missing buffer name in .BUFFER directive on line %d.\n", line_number);
-                fclose(asm_file);
-                fclose(rom_file);
-                fclose(lst_file);
-                return -1;
+                failed = true;
+                break;
             }
             if (!buffer_size_str) {
                 fprintf(stderr, "Error: Missing buffer size in .BUFFER directive on line %d.\n", line_number);
-                fclose(asm_file);
-                fclose(rom_file);
-                fclose(lst_file);
-                return -1;
+                failed = true;
+                break;
+            }
+
+            uint32_t buffer_size = parse_address(buffer_size_str);
+            if (buffer_size == 0 || buffer_size > vm->memory_size) {
+                fprintf(stderr, "Error: Invalid buffer size '%u' on line %d.\n", buffer_size, line_number);
+                failed = true;
+                break;
+            }
+
+            if (buffer_count >= MAX_BUFFERS) {
+                fprintf(stderr, "Error: Buffer limit reached on line %d.\n", line_number);
+                failed = true;
+                break;
+            }
+            strncpy(buffers[buffer_count].name, buffer_name, sizeof(buffers[buffer_count].name) - 1);
+            buffers[buffer_count].name[sizeof(buffers[buffer_count].name) - 1] = '\0';
+            buffers[buffer_count].size = buffer_size;
+            buffers[buffer_count].address = (uint32_t)-1;
+            if (!symbol_define(SYMBOL_BUFFER, buffers[buffer_count].name, buffer_count)) {
+                fprintf(stderr, "Error: Out of memory for the symbol index on line %d.\n", line_number);
+                failed = true;
+                break;
+            }
+            if (data_count == data_capacity) {
+                data_capacity = data_capacity ? data_capacity * 2 : 64;
+                AssemblerData* grown = (AssemblerData*)realloc(data_items, data_capacity * sizeof(AssemblerData));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Out of memory for the data section on line %d.\n", line_number);
+                    failed = true;
+                    break;
+                }
+                data_items = grown;
             }
-
-            uint32_t buffer_size = parse_address(buffer_size_str);
-            if (buffer_size == 0 || buffer_size > MEMORY_SIZE) {
-                fprintf(stderr, "Error: Invalid buffer size '%u' on line %d.\n", buffer_size, line_number);
-                fclose(asm_file);
-                fclose(rom_file);
-                fclose(lst_file);
-                return -1;
+            data_items[data_count].kind = SYMBOL_BUFFER;
+            data_items[data_count].index = buffer_count;
+            data_items[data_count].offset = data_size;
+            data_count++;
+            if (data_size > vm->memory_size || buffer_size > vm->memory_size - data_size) {
+                fprintf(stderr, "Error: Data does not fit in guest memory on line %d.\n", line_number);
+                failed = true;
+                break;
             }
-
-            if (buffer_count < MAX_BUFFERS) {
-                strncpy(buffers[buffer_count].name, buffer_name, sizeof(buffers[buffer_count].name) - 1);
-                buffers[buffer_count].name[sizeof(buffers[buffer_count].name) - 1] = '\0';
-                buffers[buffer_count].size = buffer_size;
-                buffer_count++;
-                program_counter += buffer_size;
+            listing_row(&listing, line_number, data_size, LISTING_PATCH_DATA_ADDRESS, original_line, original_length, "", 0, "; Buffer Definition\n");
+            data_size += buffer_size;
+            buffer_count++;
+            current_address = data_size;
+            current_patch = LISTING_PATCH_DATA_ADDRESS;
+            line_number++;
+            continue;
+        }
+        else if (strcmp(token, ".GLOBAL") == 0 || strcmp(token, ".EXTERN") == 0) {
+            SymbolKind kind = strcmp(token, ".GLOBAL") == 0 ? SYMBOL_EXPORT : SYMBOL_EXTERN;
+            char* symbol_name = strtok(NULL, " ,\t\n");
+            if (!symbol_name) {
+                fprintf(stderr, "Error: Missing symbol name in %s directive on line %d.\n", token, line_number);
+                failed = true;
+                break;
             }
-            else {
-                fprintf(stderr, "Error: Buffer limit reached on line %d.\n", line_number);
-                fclose(asm_file);
-                fclose(rom_file);
-                fclose(lst_file);
-                return -1;
+            for (; symbol_name != NULL && !failed; symbol_name = strtok(NULL, " ,\t\n")) {
+                char name[sizeof(labels[0].name)]; // Cut to the length of a label name, as definitions are
+                strncpy(name, symbol_name, sizeof(name) - 1);
+                name[sizeof(name) - 1] = '\0';
+                if (!symbol_define(kind, name, line_number)) {
+                    fprintf(stderr, "Error: Out of memory for the symbol index on line %d.\n", line_number);
+                    failed = true;
+                }
             }
+            if (failed) break;
+            listing_row(&listing, line_number, current_address, current_patch, original_line, original_length, "", 0, "; Symbol Declaration\n");
             line_number++;
             continue;
         }
@@ -2951,80 +6550,43 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
                         macros[macro_count].name[sizeof(macros[macro_count].name) - 1] = '\0';
                         strncpy(macros[macro_count].value_str, macro_value, sizeof(macros[macro_count].value_str) - 1);
                         macros[macro_count].value_str[sizeof(macros[macro_count].value_str) - 1] = '\0';
+                        if (!symbol_define(SYMBOL_MACRO, macros[macro_count].name, macro_count)) {
+                            fprintf(stderr, "Error: Out of memory for the symbol index on line %d.\n", line_number);
+                            failed = true;
+                            break;
+                        }
                         macro_count++;
                     }
                     else {
                         fprintf(stderr, "Error: Macro limit reached on line %d.\n", line_number);
-                        fclose(asm_file);
-                        fclose(rom_file);
-                        fclose(lst_file);
-                        return -1;
+                        failed = true;
+                        break;
                     }
                 }
                 else {
                     fprintf(stderr, "Error: Invalid #define syntax on line %d. Expected #define MACRO_NAME VALUE\n", line_number);
-                    fclose(asm_file);
-                    fclose(rom_file);
-                    fclose(lst_file);
-                    return -1;
-                }
-            }
-            else if (strcmp(token, "#ifdef") == 0) {
-                if (preprocessor_depth < MAX_PREPROCESSOR_DEPTH - 1) {
-                    char* macro_to_check = strtok(NULL, " ,\t\n");
-                    if (macro_to_check) {
-                        if (get_macro_value(macro_to_check) != NULL) {
-                            preprocessor_depth++;
-                            preprocessor_state[preprocessor_depth] = PREPROCESSOR_STATE_NORMAL;
-                        }
-                        else {
-                            preprocessor_depth++;
-                            preprocessor_state[preprocessor_depth] = PREPROCESSOR_STATE_IFDEF_FALSE;
-                        }
-                    }
-                    else {
-                        fprintf(stderr, "Error: Missing macro name in #ifdef directive on line %d.\n", line_number);
-                        fclose(asm_file);
-                        fclose(rom_file);
-                        fclose(lst_file);
-                        return -1;
-                    }
-                }
-                else {
-                    fprintf(stderr, "Error: Max preprocessor nesting depth reached on line %d.\n", line_number);
-                    fclose(asm_file);
-                    fclose(rom_file);
-                    fclose(lst_file);
-                    return -1;
+                    failed = true;
+                    break;
                 }
             }
-            else if (strcmp(token, "#ifndef") == 0) {
+            else if (strcmp(token, "#ifdef") == 0 || strcmp(token, "#ifndef") == 0) {
                 if (preprocessor_depth < MAX_PREPROCESSOR_DEPTH - 1) {
                     char* macro_to_check = strtok(NULL, " ,\t\n");
                     if (macro_to_check) {
-                        if (get_macro_value(macro_to_check) == NULL) {
-                            preprocessor_depth++;
-                            preprocessor_state[preprocessor_depth] = PREPROCESSOR_STATE_NORMAL;
-                        }
-                        else {
-                            preprocessor_depth++;
-                            preprocessor_state[preprocessor_depth] = PREPROCESSOR_STATE_IFDEF_FALSE;
-                        }
+                        bool defined = get_macro_value(macro_to_check) != NULL;
+                        preprocessor_depth++;
+                        preprocessor_state[preprocessor_depth] = (defined == (strcmp(token, "#ifdef") == 0)) ? PREPROCESSOR_STATE_NORMAL : PREPROCESSOR_STATE_IFDEF_FALSE;
                     }
                     else {
-                        fprintf(stderr, "Error: Missing macro name in #ifndef directive on line %d.\n", line_number);
-                        fclose(asm_file);
-                        fclose(rom_file);
-                        fclose(lst_file);
-                        return -1;
+                        fprintf(stderr, "Error: Missing macro name in %s directive on line %d.\n", token, line_number);
+                        failed = true;
+                        break;
                     }
                 }
                 else {
                     fprintf(stderr, "Error: Max preprocessor nesting depth reached on line %d.\n", line_number);
-                    fclose(asm_file);
-                    fclose(rom_file);
-                    fclose(lst_file);
-                    return -1;
+                    failed = true;
+                    break;
                 }
             }
             else if (strcmp(token, "#else") == 0) {
@@ -3033,10 +6595,8 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
                 }
                 else {
                     fprintf(stderr, "Error: #else directive without matching #ifdef or #ifndef on line %d.\n", line_number);
-                    fclose(asm_file);
-                    fclose(rom_file);
-                    fclose(lst_file);
-                    return -1;
+                    failed = true;
+                    break;
                 }
             }
             else if (strcmp(token, "#endif") == 0) {
@@ -3045,10 +6605,8 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
                 }
                 else {
                     fprintf(stderr, "Error: Unmatched #endif directive on line %d.\n", line_number);
-                    fclose(asm_file);
-                    fclose(rom_file);
-                    fclose(lst_file);
-                    return -1;
+                    failed = true;
+                    break;
                 }
             }
             else if (strcmp(token, "#error") == 0) {
@@ -3059,10 +6617,8 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
                 else {
                     fprintf(stderr, "Error on line %d: #error directive without message.\n", line_number);
                 }
-                fclose(asm_file);
-                fclose(rom_file);
-                fclose(lst_file);
-                return -1;
+                failed = true;
+                break;
             }
             else if (strcmp(token, "#warning") == 0) {
                 char* warning_message = strtok(NULL, "\n");
@@ -3075,11 +6631,10 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
             }
             else {
                 fprintf(stderr, "Error: Unknown preprocessor directive '%s' on line %d.\n", token, line_number);
-                fclose(asm_file);
-                fclose(rom_file);
-                fclose(lst_file);
-                return -1;
+                failed = true;
+                break;
             }
+            listing_row(&listing, line_number, current_address, current_patch, original_line, original_length, "", 0, ";Label or Preprocessor\n");
             line_number++;
             continue;
         }
@@ -3088,16 +6643,20 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
             if (label_count < MAX_LABELS) {
                 strncpy(labels[label_count].name, token, sizeof(labels[label_count].name) - 1);
                 labels[label_count].name[sizeof(labels[label_count].name) - 1] = '\0';
-                labels[label_count].address = program_counter;
+                labels[label_count].address = vm->program_counter;
+                if (!symbol_define(SYMBOL_LABEL, labels[label_count].name, label_count)) {
+                    fprintf(stderr, "Error: Out of memory for the symbol index on line %d.\n", line_number);
+                    failed = true;
+                    break;
+                }
                 label_count++;
             }
             else {
                 fprintf(stderr, "Error: Label limit reached on line %d.\n", line_number);
-                fclose(asm_file);
-                fclose(rom_file);
-                fclose(lst_file);
-                return -1;
+                failed = true;
+                break;
             }
+            listing_row(&listing, line_number, current_address, current_patch, original_line, original_length, "", 0, ";Label or Preprocessor\n");
             line_number++;
             continue;
         }
@@ -3110,886 +6669,1674 @@ int assemble_program(const char* asm_filename, const char* rom_filename) {
 
         if (opcode == OP_INVALID) {
             fprintf(stderr, "Error: Invalid opcode '%s' on line %d.\n", token, line_number);
-            fclose(asm_file);
-            fclose(rom_file);
-            fclose(lst_file);
-            return -1;
-        }
-
-        memory[program_counter++] = (uint8_t)opcode;
-
-        int instruction_bytes = 1;
-        switch (opcode) {
-        case OP_MOV_REG_VAL:
-        case OP_ADD_REG_VAL:
-        case OP_SUB_REG_VAL:
-        case OP_MUL_REG_VAL:
-        case OP_DIV_REG_VAL:
-        case OP_MOD_REG_VAL:
-        case OP_CMP_REG_VAL:
-        case OP_TEST_REG_VAL:
-        case OP_AND_REG_VAL:
-        case OP_OR_REG_VAL:
-        case OP_XOR_REG_VAL:
-            instruction_bytes += 9; break;
-        case OP_MOV_REG_REG:
-        case OP_ADD_REG_REG:
-        case OP_SUB_REG_REG:
-        case OP_MUL_REG_REG:
-        case OP_DIV_REG_REG:
-        case OP_MOD_REG_REG:
-        case OP_AND_REG_REG:
-        case OP_OR_REG_REG:
-        case OP_XOR_REG_REG:
-        case OP_CMP_REG_REG:
-        case OP_TEST_REG_REG:
-        case OP_IMUL_REG_REG:
-        case OP_IDIV_REG_REG:
-        case OP_MOVZX_REG_REG:
-        case OP_MOVSX_REG_REG:
-        case OP_XCHG_REG_REG:
-        case OP_SHL_REG_REG:
-        case OP_SHR_REG_REG:
-        case OP_SAR_REG_REG:
-        case OP_ROL_REG_REG:
-        case OP_ROR_REG_REG:
-        case OP_MATH_ADD:
-        case OP_MATH_SUB:
-        case OP_MATH_MUL:
-        case OP_MATH_DIV:
-        case OP_MATH_MOD:
-        case OP_MATH_POW:
-        case OP_MATH_MIN:
-        case OP_MATH_MAX:
-            instruction_bytes += 2; break;
-        case OP_MOV_REG_MEM:
-        case OP_MOV_MEM_REG:
-        case OP_LEA_REG_MEM:
-        case OP_MOVZX_REG_MEM:
-        case OP_MOVSX_REG_MEM:
-        case OP_STR_LEN_REG_MEM:
-        case OP_STR_ATOI_REG_MEM:
-        case OP_DISK_GET_VOLUME_LABEL_MEM:
-        case OP_DISK_SET_VOLUME_LABEL_MEM:
-        case OP_PUSHA:
-        case OP_POPA:
-        case OP_PUSHFD:
-        case OP_POPFD:
-            instruction_bytes += 5; break;
-        case OP_NOT_REG:
-        case OP_NEG_REG:
-        case OP_INC_REG:
-        case OP_DEC_REG:
-        case OP_RND_REG:
-        case OP_PUSH_REG:
-        case OP_POP_REG:
-        case OP_BSWAP_REG:
-        case OP_SETZ_REG:
-        case OP_SETNZ_REG:
-        case OP_SYS_PRINT_CHAR:
-        case OP_SYS_PRINT_STRING:
-        case OP_SYS_SET_TEXT_COLOR:
-        case OP_SYS_PRINT_NUMBER_DEC:
-        case OP_SYS_PRINT_NUMBER_HEX:
-        case OP_SYS_READ_CHAR:
-        case OP_SYS_GET_KEY_PRESS:
-        case OP_SYS_GET_CPU_VER:
-        case OP_SYS_WAIT:
-        case OP_SYS_TIME_REG:
-        case OP_MATH_ABS:
-        case OP_MATH_SIN:
-        case OP_MATH_COS:
-        case OP_MATH_TAN:
-        case OP_MATH_ASIN:
-        case OP_MATH_ACOS:
-        case OP_MATH_ATAN:
-        case OP_MATH_SQRT:
-        case OP_MATH_LOG:
-        case OP_MATH_EXP:
-        case OP_MATH_FLOOR:
-        case OP_MATH_CEIL:
-        case OP_MATH_ROUND:
-        case OP_MATH_NEG:
-        case OP_SHL_REG_VAL:
-        case OP_SHR_REG_VAL:
-        case OP_SAR_REG_VAL:
-        case OP_ROL_REG_VAL:
-        case OP_ROR_REG_VAL:
-        case OP_DISK_GET_SIZE_REG:
-            instruction_bytes += 5; break;
-        case OP_MATH_CLAMP:
-            instruction_bytes += 3; break;
-        case OP_MATH_LERP:
-            instruction_bytes += 4; break;
-        case OP_JMP:
-        case OP_JMP_NZ:
-        case OP_JMP_Z:
-        case OP_JMP_S:
-        case OP_JMP_NS:
-        case OP_JMP_C:
-        case OP_JMP_NC:
-        case OP_JMP_O:
-        case OP_JMP_NO:
-        case OP_JMP_GE:
-        case OP_JMP_LE:
-        case OP_JMP_G:
-        case OP_JMP_L:
-        case OP_CALL_ADDR:
-        case OP_DISK_CREATE_IMAGE:
-            instruction_bytes += 4; break;
-        case OP_INC_MEM:
-        case OP_DEC_MEM:
-        case OP_STR_CPY_MEM_MEM:
-        case OP_STR_CAT_MEM_MEM:
-            instruction_bytes += 8; break;
-        case OP_STR_CMP_REG_MEM_MEM:
-            instruction_bytes += 9; break;
-        case OP_STR_NCPY_MEM_MEM_REG:
-        case OP_STR_NCAT_MEM_MEM_REG:
-        case OP_DISK_READ_SECTOR_MEM_REG_REG:
-        case OP_DISK_WRITE_SECTOR_MEM_REG_REG:
-            instruction_bytes += 9; break;
-        case OP_MEM_CPY_MEM_MEM_REG:
-            instruction_bytes += 9; break;
-        case OP_STR_ITOA_MEM_REG_REG:
-        case OP_STR_FMT_MEM_MEM_REG_REG:
-            instruction_bytes += 9; break;
-        case OP_MEM_SET_MEM_REG_VAL:
-            instruction_bytes += 10; break;
-        case OP_MEM_SET_MEM_REG_REG:
-            instruction_bytes += 6; break;
-        case OP_MEM_FREE_MEM:
-            instruction_bytes += 5; break;
-        case OP_STR_TOUPPER_MEM:
-        case OP_STR_TOLOWER_MEM:
-            instruction_bytes += 5; break;
-        case OP_STR_CHR_REG_MEM_VAL:
-            instruction_bytes += 10; break;
-        case OP_STR_STR_REG_MEM_MEM:
-            instruction_bytes += 9; break;
-        case OP_SYS_SET_CURSOR_POS:
-        case OP_SYS_NUMBER_TO_STRING:
-        case OP_SYS_READ_STRING:
-        case OP_SYS_GET_CURSOR_POS:
-            instruction_bytes += 3; break;
-        case OP_MEM_TEST:
-            instruction_bytes = 1; break;
-        case OP_SYS_RESET_TEXT_COLOR:
-        case OP_SYS_PRINT_NEWLINE:
-        case OP_SYS_CLEAR_SCREEN:
-        case OP_NOP:
-        case OP_HLT:
-        case OP_RET:
-        case OP_DISK_FORMAT_DISK:
-            instruction_bytes = 1; break;
-        case OP_GFX_INIT:
-        case OP_GFX_CLOSE:
-            instruction_bytes = 1; 
-            break;
-        case OP_GFX_CLEAR:
-            instruction_bytes += 2; 
-            break;
-        case OP_GFX_GET_SCREEN_WIDTH_REG:  
-        case OP_GFX_GET_SCREEN_HEIGHT_REG:
-        case OP_GFX_GET_VRAM_SIZE_REG:
-        case OP_GFX_GET_GPU_VER_REG:
-            instruction_bytes += 2; 
+            failed = true;
             break;
-        case OP_GFX_DRAW_PIXEL:
-            instruction_bytes += 3;
-            break;
-        case OP_AUDIO_INIT:
-        case OP_AUDIO_CLOSE:
-        case OP_AUDIO_SPEAKER_ON:
-        case OP_AUDIO_SPEAKER_OFF:
-            instruction_bytes = 1;
-            break;
-        case OP_AUDIO_SET_PITCH_REG:
-        case OP_AUDIO_GET_AUDIO_VER_REG:
-            instruction_bytes += 2; 
+        }
+        int pool_index = -1;
+        if (opcode_info[opcode].operand_count == 2 && opcode_info[opcode].operands[1] == OPERAND_F64) {
+            // Whole numbers written as such get a compact form, constants with a fraction a pool entry
+            if (is_integer_literal(operand2_str)) opcode = opcode_compact_immediate(opcode, parse_value_double(operand2_str));
+            else {
+                unresolved_symbol[0] = '\0';
+                double value = parse_value_double(operand2_str);
+                if (unresolved_symbol[0] == '\0' && value != floor(value) && (pool_index = constant_pool_add(&pool, value)) >= 0) opcode = opcode_pooled(opcode);
+            }
+        }
+        const OpcodeInfo* info = &opcode_info[opcode];
+        if (info->length > vm->memory_size - vm->program_counter) {
+            fprintf(stderr, "Error: Program does not fit in guest memory on line %d.\n", line_number);
+            failed = true;
             break;
-
-        default:
-            fprintf(stderr, "Assembler Error (Pass 1): Unhandled opcode size calculation for '%s' on line %d.\n", token, line_number);
-            fclose(asm_file);
-            fclose(rom_file);
-            fclose(lst_file);
-            return -1;
         }
-        program_counter += instruction_bytes - 1;
 
+        uint32_t instruction_start_address = vm->program_counter;
+        vm->memory[vm->program_counter++] = (uint8_t)opcode;
+        code_started = true;
+
+        const char* operand_strs[MAX_DECODED_OPERANDS] = { operand1_str, operand2_str, operand3_str, operand4_str };
+        bool has_fixup = false;
+        for (int i = 0; i < info->operand_count && !failed; i++) {
+            unresolved_symbol[0] = '\0';
+            switch (info->operands[i]) {
+            case OPERAND_REG:
+                vm->memory[vm->program_counter] = (uint8_t)register_from_string(operand_strs[i]);
+                break;
+            case OPERAND_F64:
+                *(double*)&vm->memory[vm->program_counter] = parse_value_double(operand_strs[i]);
+                break;
+            case OPERAND_U32:
+                *(uint32_t*)&vm->memory[vm->program_counter] = parse_address(operand_strs[i]);
+                break;
+            case OPERAND_I8:
+                vm->memory[vm->program_counter] = (uint8_t)(int8_t)parse_value_double(operand_strs[i]);
+                break;
+            case OPERAND_I16:
+                *(int16_t*)&vm->memory[vm->program_counter] = (int16_t)parse_value_double(operand_strs[i]);
+                break;
+            case OPERAND_I32:
+                *(int32_t*)&vm->memory[vm->program_counter] = (int32_t)parse_value_double(operand_strs[i]);
+                break;
+            case OPERAND_K16:
+                *(uint16_t*)&vm->memory[vm->program_counter] = (uint16_t)pool_index;
+                break;
+            default:
+                break;
+            }
+            if (unresolved_symbol[0] != '\0' || (object && info->operands[i] == OPERAND_K16)) { // The linker renumbers pool entries
+                if (fixup_count == fixup_capacity) {
+                    size_t capacity = fixup_capacity ? fixup_capacity * 2 : 256;
+                    AssemblerFixup* grown = (AssemblerFixup*)realloc(fixups, capacity * sizeof(AssemblerFixup));
+                    if (grown == NULL) failed = true;
+                    else {
+                        fixups = grown;
+                        fixup_capacity = capacity;
+                    }
+                }
+                if (failed || !assembler_names_add(&fixup_names, &fixup_names_length, &fixup_names_capacity, unresolved_symbol, &fixups[fixup_count].name)) {
+                    fprintf(stderr, "Error: Out of memory for forward references on line %d.\n", line_number);
+                    failed = true;
+                    break;
+                }
+                fixups[fixup_count].address = vm->program_counter;
+                fixups[fixup_count].kind = info->operands[i];
+                fixups[fixup_count].line_number = line_number;
+                fixups[fixup_count].section = OBJECT_SECTION_POOL; // Symbols get theirs when they are resolved
+                fixups[fixup_count].target = (uint32_t)pool_index;
+                fixup_count++;
+                has_fixup = true;
+            }
+            vm->program_counter += OPERAND_SIZE(info->operands[i]);
+        }
+        if (failed) break;
+
+        char binary_output[DECODE_MAX_INSTRUCTION_LENGTH * 3 + 1];
+        for (uint32_t i = 0; i < info->length; i++) {
+            uint8_t byte = vm->memory[instruction_start_address + i];
+            binary_output[i * 3] = "0123456789ABCDEF"[byte >> 4];
+            binary_output[i * 3 + 1] = "0123456789ABCDEF"[byte & 15];
+            binary_output[i * 3 + 2] = ' ';
+        }
+
+        size_t mnemonic_length = strlen(token);
+        memcpy(mnemonic_output, token, mnemonic_length);
+        for (int i = 0; i < MAX_DECODED_OPERANDS && operand_strs[i]; i++) {
+            size_t operand_length = strlen(operand_strs[i]);
+            mnemonic_output[mnemonic_length++] = i == 0 ? ' ' : ',';
+            if (i > 0) mnemonic_output[mnemonic_length++] = ' ';
+            memcpy(mnemonic_output + mnemonic_length, operand_strs[i], operand_length);
+            mnemonic_length += operand_length;
+        }
+
+        size_t binary_offset = listing_row(&listing, line_number, instruction_start_address, code_patch, mnemonic_output, mnemonic_length, binary_output, info->length * 3, "\n");
+        if (has_fixup || optimize) listing_add_patch(&listing, binary_offset, LISTING_PATCH_BYTES, instruction_start_address, info->length);
+        if (optimize) {
+            if (code_count == code_capacity) {
+                size_t capacity = code_capacity ? code_capacity * 2 : 256;
+                PeepholeInstruction* grown = (PeepholeInstruction*)realloc(code, capacity * sizeof(PeepholeInstruction));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Out of memory for the peephole optimizer on line %d.\n", line_number);
+                    failed = true;
+                    break;
+                }
+                code = grown;
+                code_capacity = capacity;
+            }
+            PeepholeInstruction* instruction = &code[code_count++];
+            instruction->address = instruction_start_address;
+            instruction->new_address = instruction_start_address;
+            instruction->first_fixup = (uint32_t)fixup_count;
+            instruction->fixup_count = 0;
+            for (size_t i = fixup_count; i > 0 && fixups[i - 1].address > instruction_start_address; i--) {
+                instruction->first_fixup = (uint32_t)(i - 1);
+                instruction->fixup_count++;
+            }
+            instruction->length = info->length;
+            instruction->opcode = (uint8_t)opcode;
+            instruction->removed_by = PEEPHOLE_KEPT;
+        }
         line_number++;
+        current_address = vm->program_counter;
+        current_patch = code_patch;
     }
-    if (preprocessor_depth != 0) {
+    if (!failed && preprocessor_depth != 0) {
         fprintf(stderr, "Error: Unclosed #ifdef or #ifndef block.\n");
-        fclose(asm_file);
-        fclose(rom_file);
-        fclose(lst_file);
-        return -1;
+        failed = true;
     }
 
-    data_section_start = program_counter;
-
-    rewind(asm_file);
-    program_counter = rom_offset;
-    line_number = 1;
-    uint32_t data_pointer = data_section_start;
-    preprocessor_depth = 0;
-    preprocessor_state[0] = PREPROCESSOR_STATE_NORMAL;
+    if (!failed && optimize) {
+        PeepholeReport report;
+        peephole_optimize(vm, code, code_count, fixups, fixup_names, &pool, &listing, &report);
+        int removed = 0;
+        for (int i = 0; i < PEEPHOLE_RULE_COUNT; i++) removed += report.removed[i];
+        printf("Peephole optimizer: %d instructions (%u bytes) removed, %d jumps retargeted\n", removed, report.bytes_removed, report.retargeted);
+        for (int i = 0; i < PEEPHOLE_RULE_COUNT; i++) {
+            if (report.removed[i] > 0) printf("  %-18s %d removed\n", peephole_rule_names[i], report.removed[i]);
+        }
+    }
 
-    for (uint32_t i = 0; i < rom_offset; ++i) {
-        fputc(0x00, rom_file);
+    // Data goes after the code, in the order of the directives
+    data_section_start = vm->program_counter;
+    if (!failed && data_size > vm->memory_size - data_section_start) {
+        fprintf(stderr, "Error: Data does not fit in guest memory.\n");
+        failed = true;
     }
+    for (size_t i = 0; i < data_count && !failed; i++) {
+        uint32_t address = data_section_start + data_items[i].offset;
+        if (data_items[i].kind == SYMBOL_STRING) {
+            strings[data_items[i].index].address = address;
+            strcpy((char*)&vm->memory[address], strings[data_items[i].index].value);
+        }
+        else {
+            buffers[data_items[i].index].address = address;
+        }
+    }
+    // Then the constant pool, and in a ROM the trailer that points to it
+    uint32_t pool_start = data_section_start + data_size;
+    uint32_t image_end = pool_start;
+    if (!failed && pool.count > 0) {
+        uint64_t pool_size = (uint64_t)pool.count * sizeof(double) + (object ? 0 : sizeof(ConstantPoolTrailer));
+        if (pool_size > vm->memory_size - pool_start) {
+            fprintf(stderr, "Error: Constant pool does not fit in guest memory.\n");
+            failed = true;
+        }
+        else image_end = constant_pool_place(vm, &pool, pool_start, !object);
+    }
+    for (uint32_t i = 0; i < symbol_capacity && !failed; i++) {
+        const SymbolSlot* slot = &symbol_slots[i];
+        if (slot->name == NULL || slot->kind != SYMBOL_EXPORT) continue;
+        if (symbol_find(SYMBOL_LABEL, slot->name) < 0 && symbol_find(SYMBOL_STRING, slot->name) < 0 && symbol_find(SYMBOL_BUFFER, slot->name) < 0) {
+            fprintf(stderr, "Error: Exported symbol '%s' on line %d is not defined.\n", slot->name, slot->index);
+            failed = true;
+        }
+    }
+    for (size_t i = 0; i < fixup_count && !failed; i++) {
+        if (fixups[i].kind == OPERAND_K16) continue; // Resolved already, it only becomes a relocation
+        // The name is a label, string, buffer or import by now, or a macro defined further down
+        const char* name = fixup_names + fixups[i].name;
+        const char* target = get_macro_value(name) != NULL ? get_macro_value(name) : name;
+        int index;
+        double value = 0.0;
+        fixups[i].section = OBJECT_SECTION_NONE;
+        if (fixups[i].kind == OPERAND_NONE) continue; // Its instruction was removed by the peephole optimizer
+        if ((index = symbol_find(SYMBOL_LABEL, target)) >= 0) {
+            value = labels[index].address;
+            fixups[i].section = OBJECT_SECTION_CODE;
+        }
+        else if ((index = symbol_find(SYMBOL_STRING, target)) >= 0) {
+            value = strings[index].address;
+            fixups[i].section = OBJECT_SECTION_DATA;
+        }
+        else if ((index = symbol_find(SYMBOL_BUFFER, target)) >= 0) {
+            value = buffers[index].address;
+            fixups[i].section = OBJECT_SECTION_DATA;
+        }
+        else if (object && symbol_find(SYMBOL_EXTERN, target) >= 0) {
+            fixups[i].section = OBJECT_SECTION_EXTERN;
+            if (target != name && !assembler_names_add(&fixup_names, &fixup_names_length, &fixup_names_capacity, target, &fixups[i].name)) {
+                fprintf(stderr, "Error: Out of memory for forward references.\n");
+                failed = true;
+                break;
+            }
+        }
+        else {
+            unresolved_symbol[0] = '\0';
+            value = parse_value_double(name);
+            if (unresolved_symbol[0] != '\0') {
+                fprintf(stderr, "Error: Undefined symbol '%s' on line %d.\n", name, fixups[i].line_number);
+                failed = true;
+                break;
+            }
+        }
+        fixups[i].target = (uint32_t)value;
+        if (fixups[i].kind == OPERAND_F64) *(double*)&vm->memory[fixups[i].address] = value;
+        else *(uint32_t*)&vm->memory[fixups[i].address] = (uint32_t)value;
+    }
+    if (!failed && listing.out_of_memory) {
+        fprintf(stderr, "Error: Out of memory for the assembly listing.\n");
+        failed = true;
+    }
+
+    if (!failed && object) {
+        // Every symbol the module defines, then a relocation for every operand that holds an address
+        ObjectHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, OBJECT_MAGIC, sizeof(header.magic));
+        header.version = OBJECT_VERSION;
+        header.code_size = data_section_start;
+        header.data_size = data_size;
+        header.pool_count = pool.count;
+        header.source_hash = source_hash;
+        ObjectSymbol* symbols = (ObjectSymbol*)calloc((size_t)label_count + string_count + buffer_count + 1, sizeof(ObjectSymbol));
+        ObjectRelocation* relocations = (ObjectRelocation*)calloc(fixup_count + 1, sizeof(ObjectRelocation));
+        failed = symbols == NULL || relocations == NULL;
+        for (int i = 0; i < label_count + string_count + buffer_count && !failed; i++) {
+            ObjectSymbol* symbol = &symbols[header.symbol_count++];
+            const char* name;
+            if (i < label_count) {
+                name = labels[i].name;
+                symbol->value = labels[i].address;
+                symbol->section = OBJECT_SECTION_CODE;
+                symbol->kind = SYMBOL_LABEL;
+            }
+            else if (i < label_count + string_count) {
+                name = strings[i - label_count].name;
+                symbol->value = strings[i - label_count].address - data_section_start;
+                symbol->section = OBJECT_SECTION_DATA;
+                symbol->kind = SYMBOL_STRING;
+            }
+            else {
+                name = buffers[i - label_count - string_count].name;
+                symbol->value = buffers[i - label_count - string_count].address - data_section_start;
+                symbol->size = buffers[i - label_count - string_count].size;
+                symbol->section = OBJECT_SECTION_DATA;
+                symbol->kind = SYMBOL_BUFFER;
+            }
+            symbol->exported = symbol_find(SYMBOL_EXPORT, name) >= 0;
+            size_t name_offset;
+            failed = !assembler_names_add(&fixup_names, &fixup_names_length, &fixup_names_capacity, name, &name_offset);
+            symbol->name = (uint32_t)name_offset;
+        }
+        for (size_t i = 0; i < fixup_count && !failed; i++) {
+            if (fixups[i].section == OBJECT_SECTION_NONE) continue;
+            ObjectRelocation* relocation = &relocations[header.relocation_count++];
+            relocation->offset = fixups[i].address;
+            relocation->section = fixups[i].section;
+            relocation->kind = (uint8_t)fixups[i].kind;
+            if (fixups[i].section == OBJECT_SECTION_EXTERN) relocation->target = (uint32_t)fixups[i].name;
+            else if (fixups[i].section == OBJECT_SECTION_DATA) relocation->target = fixups[i].target - data_section_start;
+            else relocation->target = fixups[i].target;
+        }
+        header.names_size = (uint32_t)fixup_names_length;
+        if (failed) fprintf(stderr, "Error: Out of memory writing object file '%s'.\n", output_filename);
+        else failed = !object_write(output_filename, &header, vm->memory, symbols, relocations, fixup_names);
+        free(symbols);
+        free(relocations);
+    }
+    if (!failed) {
+        listing_apply_patches(&listing, vm, data_section_start);
+        if (listing.length > 0) fwrite(listing.text, 1, listing.length, lst_file);
+        constant_pool_list(lst_file, &pool, pool_start);
+        if (!object) {
+            for (uint32_t i = 0; i < rom_offset; ++i) {
+                fputc(0x00, rom_file);
+            }
+            fwrite(vm->memory + rom_offset, 1, image_end - rom_offset, rom_file);
+        }
+    }
+
+    assembler_defer_symbols = false;
+    free(listing.text);
+    free(listing.patches);
+    free(fixups);
+    free(fixup_names);
+    free(data_items);
+    free(code);
+    constant_pool_free(&pool);
+    free(line);
+    free(mnemonic_output);
+    assembler_source_close(&source);
+    if (rom_file) fclose(rom_file);
+    fclose(lst_file);
+    if (failed) return -1;
+    printf("Successfully assembled '%s' to '%s' and '%s'\n", asm_filename, output_filename, lst_filename);
+    return 0;
+}
 
-    uint32_t current_address = rom_offset;
+int assemble_program(VM* vm, const char* asm_filename, const char* rom_filename) {
+    return assemble_source(vm, asm_filename, rom_filename, false, 0);
+}
 
-    while (fgets(line, sizeof(line), asm_file)) {
-        char original_line[256];
-        strcpy(original_line, line);
+// Assembles one module of a project into obj_filename. source_hash is stored as its build cache key.
+int assemble_object(VM* vm, const char* asm_filename, const char* obj_filename, uint64_t source_hash) {
+    return assemble_source(vm, asm_filename, obj_filename, true, source_hash);
+}
 
-        char* line_ptr = line;
-        char* token = strtok(line_ptr, " ,\t\n");
-        if (!token || token[0] == ';') {
-            fprintf(lst_file, "%-9d| %-8X | %-30s | %-20s | %s", line_number, current_address, original_line, "", ";Comment or Empty Line\n");
-            line_number++;
-            continue;
-        }
+// Linker
+// Combines object files into a ROM. The code of the objects is laid out in the order they are given, so the
+// first one starts at address 0, and the data of all objects follows the code in the same order. Every
+// relocation then gets its final address. The constant pools of the objects are merged into one that
+// holds each constant once, placed after the data. Exported names must be unique across the objects, local ones
+// need not be. Afterwards the session's label, string and buffer tables hold the linked addresses, as
+// they would after assemble_program, for mem.clear and the call stack sampler. The listing written next
+// to the ROM is a link map with one row per symbol.
 
-        if (preprocessor_state[preprocessor_depth] == PREPROCESSOR_STATE_IFDEF_FALSE) {
-            if (strcmp(token, "#endif") == 0) {
-                if (preprocessor_depth > 0) {
-                    preprocessor_depth--;
+typedef struct {
+    uint32_t address;
+    int object;
+} LinkerExport;
+
+int link_objects(VM* vm, const char* const* object_filenames, int object_count, const char* rom_filename) {
+    ObjectFile* objects = (ObjectFile*)calloc(object_count, sizeof(ObjectFile));
+    uint32_t* code_bases = (uint32_t*)calloc(object_count, sizeof(uint32_t));
+    uint32_t* data_bases = (uint32_t*)calloc(object_count, sizeof(uint32_t));
+    LinkerExport* exports = NULL;
+    ConstantPool pool = { 0 };
+    bool failed = objects == NULL || code_bases == NULL || data_bases == NULL;
+    if (failed) fprintf(stderr, "Error: Out of memory linking '%s'.\n", rom_filename);
+
+    uint64_t code_size = 0, data_size = 0;
+    uint32_t symbol_total = 0;
+    for (int i = 0; i < object_count && !failed; i++) {
+        failed = !object_read(object_filenames[i], &objects[i]);
+        if (failed) break;
+        code_bases[i] = (uint32_t)code_size;
+        code_size += objects[i].header.code_size;
+        data_size += objects[i].header.data_size;
+        symbol_total += objects[i].header.symbol_count;
+    }
+    if (!failed && code_size + data_size > vm->memory_size) {
+        fprintf(stderr, "Error: The linked program does not fit in guest memory.\n");
+        failed = true;
+    }
+    uint32_t data_offset = 0;
+    for (int i = 0; i < object_count && !failed; i++) {
+        data_bases[i] = (uint32_t)code_size + data_offset;
+        data_offset += objects[i].header.data_size;
+    }
+
+    if (!failed) {
+        guest_memory_discard(vm);
+        decode_cache_reset(vm);
+        vm->program_counter = 0;
+        macro_count = 0;
+        label_count = 0;
+        string_count = 0;
+        buffer_count = 0;
+        symbol_index_reset();
+        data_section_start = (uint32_t)code_size;
+        exports = (LinkerExport*)malloc((symbol_total + 1) * sizeof(LinkerExport));
+        if (exports == NULL) {
+            fprintf(stderr, "Error: Out of memory linking '%s'.\n", rom_filename);
+            failed = true;
+        }
+    }
+    for (int i = 0; i < object_count && !failed; i++) {
+        const ObjectFile* object = &objects[i];
+        memcpy(&vm->memory[code_bases[i]], object->image, object->header.code_size);
+        memcpy(&vm->memory[data_bases[i]], object->image + object->header.code_size, object->header.data_size);
+    }
+
+    // Symbols, in object order. The first definition of a local name is the one the session tables find.
+    int export_count = 0;
+    bool tables_full = false;
+    for (int i = 0; i < object_count && !failed; i++) {
+        const ObjectFile* object = &objects[i];
+        for (uint32_t j = 0; j < object->header.symbol_count && !failed; j++) {
+            ObjectSymbol symbol = object_symbol(object, j);
+            const char* name = object->names + symbol.name;
+            uint32_t address = (symbol.section == OBJECT_SECTION_CODE ? code_bases[i] : data_bases[i]) + symbol.value;
+            if (symbol.exported) {
+                int index = symbol_find(SYMBOL_EXPORT, name);
+                if (index >= 0) {
+                    fprintf(stderr, "Error: Symbol '%s' is exported by both '%s' and '%s'.\n", name, object_filenames[exports[index].object], object_filenames[i]);
+                    failed = true;
+                    break;
+                }
+                exports[export_count].address = address;
+                exports[export_count].object = i;
+                if (!symbol_define(SYMBOL_EXPORT, name, export_count++)) {
+                    fprintf(stderr, "Error: Out of memory for the symbol index.\n");
+                    failed = true;
+                    break;
                 }
             }
-            else if (strcmp(token, "#ifdef") == 0 || strcmp(token, "#ifndef") == 0) {
-                if (preprocessor_depth < MAX_PREPROCESSOR_DEPTH - 1) {
-                    preprocessor_depth++;
-                    preprocessor_state[preprocessor_depth] = PREPROCESSOR_STATE_IFDEF_FALSE;
+            int index;
+            if (symbol.kind == SYMBOL_LABEL) {
+                if (label_count == MAX_LABELS) {
+                    tables_full = true;
+                    continue;
                 }
+                index = label_count++;
+                snprintf(labels[index].name, sizeof(labels[index].name), "%s", name);
+                labels[index].address = address;
             }
-            else if (strcmp(token, "#else") == 0) {
-                if (preprocessor_depth > 0) {
-                    preprocessor_state[preprocessor_depth] = (preprocessor_state[preprocessor_depth] == PREPROCESSOR_STATE_NORMAL) ? PREPROCESSOR_STATE_IFDEF_FALSE : PREPROCESSOR_STATE_NORMAL;
+            else if (symbol.kind == SYMBOL_STRING) {
+                if (string_count == MAX_STRINGS) {
+                    tables_full = true;
+                    continue;
                 }
+                index = string_count++;
+                snprintf(strings[index].name, sizeof(strings[index].name), "%s", name);
+                strings[index].address = address;
+                strncpy(strings[index].value, (const char*)&vm->memory[address], sizeof(strings[index].value) - 1);
+                strings[index].value[sizeof(strings[index].value) - 1] = '\0';
+            }
+            else {
+                if (buffer_count == MAX_BUFFERS) {
+                    tables_full = true;
+                    continue;
+                }
+                index = buffer_count++;
+                snprintf(buffers[index].name, sizeof(buffers[index].name), "%s", name);
+                buffers[index].address = address;
+                buffers[index].size = symbol.size;
+            }
+            if (!symbol_define((SymbolKind)symbol.kind, name, index)) {
+                fprintf(stderr, "Error: Out of memory for the symbol index.\n");
+                failed = true;
             }
-            fprintf(lst_file, "%-9d| %-8X | %-30s | %-20s | %s", line_number, current_address, original_line, "", ";Preprocessor Directive\n");
-            line_number++;
-            continue;
         }
+    }
 
-
-        if (strcmp(token, "#offset") == 0) {
-            fprintf(lst_file, "%-9d| %-8X | %-30s | %-20s | %s", line_number, current_address, original_line, "", ";Offset Directive\n");
-            line_number++;
-            continue;
-        }
-        if (strcmp(token, ".STRING") == 0) {
-            char* string_name = strtok(NULL, " ,\t\n");
-            char* string_value_token = strtok(NULL, "\n");
-            const char* macro_value = get_macro_value(string_value_token);
-            const char* string_value_with_quotes = macro_value != NULL ? macro_value : string_value_token;
-
-            for (int i = 0; i < string_count; i++) {
-                if (strcmp(strings[i].name, string_name) == 0) {
-                    strings[i].address = data_pointer;
-                    strcpy((char*)&memory[data_pointer], strings[i].value);
-                    data_pointer += strlen(strings[i].value) + 1;
-                    fprintf(lst_file, "%-9d| %-8X | %-30s | %-20s | %s", line_number, strings[i].address + rom_offset, original_line, "", "; String Definition\n");
+    if (!failed && tables_full) {
+        fprintf(stderr, "Warning: More than %d labels, strings or buffers; mem.clear and the call stack sampler only know the first %d of each.\n", MAX_LABELS, MAX_LABELS);
+    }
+    for (int i = 0; i < object_count && !failed; i++) {
+        const ObjectFile* object = &objects[i];
+        for (uint32_t j = 0; j < object->header.relocation_count; j++) {
+            ObjectRelocation relocation = object_relocation(object, j);
+            uint8_t* operand = &vm->memory[code_bases[i] + relocation.offset];
+            if (relocation.section == OBJECT_SECTION_POOL) {
+                double value;
+                memcpy(&value, object->pool + relocation.target * sizeof(double), sizeof(value));
+                int index = constant_pool_add(&pool, value);
+                if (index < 0) {
+                    fprintf(stderr, "Error: More than %d distinct constants in the constant pool, or out of memory.\n", CONSTANT_POOL_MAX_ENTRIES);
+                    failed = true;
                     break;
                 }
+                *(uint16_t*)operand = (uint16_t)index;
+                continue;
             }
-            line_number++;
-            current_address = data_pointer + rom_offset;
-            continue;
-        }
-        if (strcmp(token, ".BUFFER") == 0) {
-            char* buffer_name = strtok(NULL, " ,\t\n");
-
-            for (int i = 0; i < buffer_count; i++) {
-                if (strcmp(buffers[i].name, buffer_name) == 0) {
-                    buffers[i].address = data_pointer;
-                    data_pointer += buffers[i].size;
-                    fprintf(lst_file, "%-9d| %-8X | %-30s | %-20s | %s", line_number, buffers[i].address + rom_offset, original_line, "", "; Buffer Definition\n");
+            uint32_t address;
+            if (relocation.section == OBJECT_SECTION_CODE) address = code_bases[i] + relocation.target;
+            else if (relocation.section == OBJECT_SECTION_DATA) address = data_bases[i] + relocation.target;
+            else {
+                const char* name = object->names + relocation.target;
+                int index = symbol_find(SYMBOL_EXPORT, name);
+                if (index < 0) {
+                    fprintf(stderr, "Error: Undefined symbol '%s' imported by '%s'.\n", name, object_filenames[i]);
+                    failed = true;
                     break;
                 }
+                address = exports[index].address;
             }
-            line_number++;
-            current_address = data_pointer + rom_offset;
-            continue;
-        }
-        if (token[0] == '#' || (strchr(token, ':') != NULL && strlen(token) > 1)) {
-            fprintf(lst_file, "%-9d| %-8X | %-30s | %-20s | %s", line_number, current_address, original_line, "", ";Label or Preprocessor\n");
-            line_number++;
-            continue;
+            if (relocation.kind == OPERAND_F64) *(double*)operand = (double)address;
+            else *(uint32_t*)operand = address;
         }
+    }
 
-        char* reg1_str = strtok(NULL, " ,\t\n");
-        char* reg2_str = strtok(NULL, " ,\t\n");
-        char* reg3_str = strtok(NULL, " ,\t\n");
-        char* reg4_str = strtok(NULL, " ,\t\n");
-        Opcode opcode = opcode_from_string(token, reg1_str, reg2_str, reg3_str, reg4_str);
+    uint32_t pool_start = (uint32_t)(code_size + data_size);
+    uint32_t rom_size = pool_start;
+    if (!failed && pool.count > 0) {
+        if ((uint64_t)pool.count * sizeof(double) + sizeof(ConstantPoolTrailer) > vm->memory_size - pool_start) {
+            fprintf(stderr, "Error: The linked program does not fit in guest memory.\n");
+            failed = true;
+        }
+        else rom_size = constant_pool_place(vm, &pool, pool_start, true);
+    }
 
-        if (opcode == OP_INVALID) {
-            fprintf(stderr, "Error: Invalid opcode '%s' on line %d (Pass 2).\n", token, line_number);
-            fclose(asm_file);
-            fclose(rom_file);
+    char lst_filename[256];
+    snprintf(lst_filename, sizeof(lst_filename), "%s.lst", rom_filename);
+    if (!failed) {
+        FILE* rom_file = fopen(rom_filename, "wb");
+        if (!rom_file) {
+            perror("Error opening ROM file for writing");
+            failed = true;
+        }
+        else {
+            failed = fwrite(vm->memory, 1, rom_size, rom_file) != rom_size;
+            if (fclose(rom_file) != 0) failed = true;
+            if (failed) fprintf(stderr, "Error: Could not write ROM file '%s'.\n", rom_filename);
+        }
+    }
+    if (!failed) {
+        FILE* lst_file = fopen(lst_filename, "w");
+        if (!lst_file) {
+            perror("Error opening LST file for writing");
+            failed = true;
+        }
+        else {
+            fprintf(lst_file, "Link Map for: %s\n\n", rom_filename);
+            fprintf(lst_file, "Line No. | Address  | Assembly Code                  | Binary Code         | Comment\n");
+            fprintf(lst_file, "---------|----------|--------------------------------|---------------------|---------\n");
+            int row = 1;
+            for (int i = 0; i < object_count; i++) {
+                const ObjectFile* object = &objects[i];
+                for (uint32_t j = 0; j < object->header.symbol_count; j++) {
+                    ObjectSymbol symbol = object_symbol(object, j);
+                    char code[64];
+                    const char* name = object->names + symbol.name;
+                    if (symbol.kind == SYMBOL_LABEL) snprintf(code, sizeof(code), "%s:", name);
+                    else snprintf(code, sizeof(code), "%s %s", symbol.kind == SYMBOL_STRING ? ".STRING" : ".BUFFER", name);
+                    uint32_t address = (symbol.section == OBJECT_SECTION_CODE ? code_bases[i] : data_bases[i]) + symbol.value;
+                    fprintf(lst_file, "%-9d| %-8X | %-30s | %-20s | ; %s%s\n", row++, address, code, "", object_filenames[i], symbol.exported ? ", exported" : "");
+                }
+            }
+            constant_pool_list(lst_file, &pool, pool_start);
             fclose(lst_file);
-            return -1;
         }
+    }
 
-        uint32_t instruction_start_address = program_counter;
-        memory[program_counter++] = (uint8_t)opcode;
-        char binary_output[256] = "";
+    for (int i = 0; objects != NULL && i < object_count; i++) free(objects[i].contents);
+    free(objects);
+    free(code_bases);
+    free(data_bases);
+    free(exports);
+    constant_pool_free(&pool);
+    if (failed) return -1;
+    printf("Successfully linked %d objects into '%s' and '%s'\n", object_count, rom_filename, lst_filename);
+    return 0;
+}
 
-        char mnemonic_output[256] = "";
-        sprintf(mnemonic_output, "%s", token);
-        if (reg1_str) sprintf(mnemonic_output + strlen(mnemonic_output), " %s", reg1_str);
-        if (reg2_str) sprintf(mnemonic_output + strlen(mnemonic_output), ", %s", reg2_str);
-        if (reg3_str) sprintf(mnemonic_output + strlen(mnemonic_output), ", %s", reg3_str);
-        if (reg4_str) sprintf(mnemonic_output + strlen(mnemonic_output), ", %s", reg4_str);
+// Project Builds
+// A project file lists the modules of a program, one .asm file per line, relative to the project file.
+// Blank lines and lines starting with ';' are skipped, and the first module holds the entry point. Each
+// module is assembled into an object file next to its source, "game.asm" into "game.obj", and the objects
+// are linked into the ROM. The cache key stored in an object is a hash of the module's source, of the
+// assembler build and of the peephole optimizer setting, so a module is only assembled again when one of
+// them changed. Modules that need assembling are assembled in parallel, one child process each and at
+// most one per CPU: the assembler keeps its symbol tables in globals the runtime shares, so it cannot run
+// on threads. On Windows they are assembled one after the other.
 
-        switch (opcode) {
-        case OP_MOV_REG_VAL:
-        case OP_ADD_REG_VAL:
-        case OP_SUB_REG_VAL:
-        case OP_MUL_REG_VAL:
-        case OP_DIV_REG_VAL:
-        case OP_MOD_REG_VAL:
-        case OP_CMP_REG_VAL:
-        case OP_TEST_REG_VAL:
-        case OP_AND_REG_VAL:
-        case OP_OR_REG_VAL:
-        case OP_XOR_REG_VAL:
-        {
-            RegisterIndex reg = register_from_string(reg1_str);
-            double value = parse_value_double(reg2_str);
-            memory[program_counter++] = (uint8_t)reg;
-            *(double*)&memory[program_counter] = value;
-            program_counter += 8;
-
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
-            char val_hex[32] = "";
-            for (int i = 0; i < 8; ++i) { sprintf(val_hex + i * 3, "%02X ", memory[instruction_start_address + 2 + i]); }
-            strcat(binary_output, val_hex);
+typedef struct {
+    char source[256];
+    char object[256];
+    uint64_t source_hash;
+    bool stale;        // The object is missing or has another cache key
+} ProjectModule;
+
+// FNV-1a over the assembler build and the source text. Prints an error and returns false if the source
+// cannot be read.
+static bool project_source_hash(const char* asm_filename, uint64_t* hash) {
+    AssemblerSource source;
+    if (!assembler_source_open(asm_filename, &source)) {
+        fprintf(stderr, "Error: Could not read module '%s'.\n", asm_filename);
+        return false;
+    }
+    static const char build[] = __DATE__ " " __TIME__;
+    uint64_t value = 14695981039346656037ull;
+    for (size_t i = 0; i < sizeof(build); i++) {
+        value ^= (uint8_t)build[i];
+        value *= 1099511628211ull;
+    }
+    value ^= OBJECT_VERSION;
+    value *= 1099511628211ull;
+    value ^= peephole_enabled; // Optimized and unoptimized objects are not interchangeable
+    value *= 1099511628211ull;
+    for (size_t i = 0; i < source.size; i++) {
+        value ^= (uint8_t)source.text[i];
+        value *= 1099511628211ull;
+    }
+    assembler_source_close(&source);
+    *hash = value;
+    return true;
+}
+
+// Assembles every stale module. Returns false if any of them failed.
+static bool project_assemble(VM* vm, const ProjectModule* modules, int module_count, int stale_count) {
+    bool ok = true;
+#ifndef _WIN32
+    if (stale_count > 1) {
+        int max_children = host_cpu_count();
+        int running = 0;
+        fflush(stdout);
+        fflush(stderr);
+        for (int i = 0; i <= module_count; i++) {
+            while (running > 0 && (running >= max_children || i == module_count)) {
+                int status;
+                if (wait(&status) < 0) {
+                    running = 0;
+                    ok = false;
+                    break;
+                }
+                running--;
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+            }
+            if (i == module_count) break;
+            if (!modules[i].stale) continue;
+            pid_t child = fork();
+            if (child == 0) {
+                int result = assemble_object(vm, modules[i].source, modules[i].object, modules[i].source_hash);
+                fflush(stdout);
+                fflush(stderr);
+                _exit(result == 0 ? 0 : 1);
+            }
+            if (child > 0) running++;
+            else if (assemble_object(vm, modules[i].source, modules[i].object, modules[i].source_hash) != 0) ok = false; // No process available
+        }
+        return ok;
+    }
+#endif
+    for (int i = 0; i < module_count; i++) {
+        if (modules[i].stale && assemble_object(vm, modules[i].source, modules[i].object, modules[i].source_hash) != 0) ok = false;
+    }
+    return ok;
+}
 
+int build_project(VM* vm, const char* project_filename, const char* rom_filename) {
+    FILE* project_file = fopen(project_filename, "r");
+    if (!project_file) {
+        perror("Error opening project file");
+        return -1;
+    }
+    double start_time = wall_clock_seconds();
+    const char* separator = strrchr(project_filename, '/');
+#ifdef _WIN32
+    const char* backslash = strrchr(project_filename, '\\');
+    if (backslash != NULL && (separator == NULL || backslash > separator)) separator = backslash;
+#endif
+    int directory_length = separator != NULL ? (int)(separator - project_filename + 1) : 0;
+
+    ProjectModule* modules = NULL;
+    int module_count = 0, module_capacity = 0, stale_count = 0;
+    bool failed = false;
+    char line[512];
+    int line_number = 0;
+    while (!failed && fgets(line, sizeof(line), project_file) != NULL) {
+        line_number++;
+        char* path = line;
+        while (*path == ' ' || *path == '\t') path++;
+        size_t length = strcspn(path, "\r\n");
+        while (length > 0 && (path[length - 1] == ' ' || path[length - 1] == '\t')) length--;
+        path[length] = '\0';
+        if (length == 0 || path[0] == ';') continue;
+
+        if (module_count == module_capacity) {
+            module_capacity = module_capacity > 0 ? module_capacity * 2 : 16;
+            ProjectModule* grown = (ProjectModule*)realloc(modules, module_capacity * sizeof(ProjectModule));
+            if (grown == NULL) {
+                fprintf(stderr, "Error: Out of memory reading project '%s'.\n", project_filename);
+                failed = true;
+                break;
+            }
+            modules = grown;
+        }
+        ProjectModule* module = &modules[module_count];
+        bool absolute = path[0] == '/' || path[0] == '\\' || (isalpha((unsigned char)path[0]) && path[1] == ':');
+        int prefix = absolute ? 0 : directory_length;
+        const char* extension = strrchr(path, '.');
+        const char* path_separator = strrchr(path, '/');
+        if (extension == NULL || (path_separator != NULL && extension < path_separator)) extension = path + length;
+        int source_length = snprintf(module->source, sizeof(module->source), "%.*s%s", prefix, project_filename, path);
+        int object_length = snprintf(module->object, sizeof(module->object), "%.*s%.*s.obj", prefix, project_filename, (int)(extension - path), path);
+        if (source_length < 0 || (size_t)source_length >= sizeof(module->source) || object_length < 0 || (size_t)object_length >= sizeof(module->object)) {
+            fprintf(stderr, "Error: Module path too long on line %d of '%s'.\n", line_number, project_filename);
+            failed = true;
             break;
         }
-        case OP_MOV_REG_REG:
-        case OP_ADD_REG_REG:
-        case OP_SUB_REG_REG:
-        case OP_MUL_REG_REG:
-        case OP_DIV_REG_REG:
-        case OP_MOD_REG_REG:
-        case OP_AND_REG_REG:
-        case OP_OR_REG_REG:
-        case OP_XOR_REG_REG:
-        case OP_CMP_REG_REG:
-        case OP_TEST_REG_REG:
-        case OP_IMUL_REG_REG:
-        case OP_IDIV_REG_REG:
-        case OP_MOVZX_REG_REG:
-        case OP_MOVSX_REG_REG:
-        case OP_XCHG_REG_REG:
-        case OP_SHL_REG_REG:
-        case OP_SHR_REG_REG:
-        case OP_SAR_REG_REG:
-        case OP_ROL_REG_REG:
-        case OP_ROR_REG_REG:
-        case OP_MATH_ADD:
-        case OP_MATH_SUB:
-        case OP_MATH_MUL:
-        case OP_MATH_DIV:
-        case OP_MATH_MOD:
-        case OP_MATH_POW:
-        case OP_MATH_MIN:
-        case OP_MATH_MAX:
-        {
-            RegisterIndex reg1 = register_from_string(reg1_str);
-            RegisterIndex reg2 = register_from_string(reg2_str);
-            memory[program_counter++] = (uint8_t)reg1;
-            memory[program_counter++] = (uint8_t)reg2;
+        if (!project_source_hash(module->source, &module->source_hash)) {
+            failed = true;
+            break;
+        }
+        module->stale = !object_is_current(module->object, module->source_hash);
+        if (module->stale) stale_count++;
+        module_count++;
+    }
+    fclose(project_file);
+    if (!failed && module_count == 0) {
+        fprintf(stderr, "Error: Project '%s' lists no modules.\n", project_filename);
+        failed = true;
+    }
+
+    if (!failed && stale_count > 0) failed = !project_assemble(vm, modules, module_count, stale_count);
+    if (!failed) {
+        const char** object_filenames = (const char**)malloc(module_count * sizeof(const char*));
+        if (object_filenames == NULL) {
+            fprintf(stderr, "Error: Out of memory linking '%s'.\n", rom_filename);
+            failed = true;
+        }
+        else {
+            for (int i = 0; i < module_count; i++) object_filenames[i] = modules[i].object;
+            failed = link_objects(vm, object_filenames, module_count, rom_filename) != 0;
+            free(object_filenames);
+        }
+    }
+    if (!failed) {
+        printf("Built '%s' from %d modules (%d assembled, %d cached) in %.3f seconds\n", rom_filename, module_count, stale_count,
+            module_count - stale_count, wall_clock_seconds() - start_time);
+    }
+    free(modules);
+    return failed ? -1 : 0;
+}
+
+// Virtual Machine Lifetime
+
+// memory_size must be accepted by memory_size_valid
+VM* vm_create(uint32_t memory_size) {
+    VM* vm = (VM*)calloc(1, sizeof(VM));
+    if (vm == NULL) return NULL;
+    vm->memory = guest_pages_map(memory_size);
+    vm->code_map = guest_pages_map(memory_size >> CODE_MAP_SHIFT);
+    if (vm->memory == NULL || vm->code_map == NULL) {
+        guest_pages_unmap(vm->memory, memory_size);
+        guest_pages_unmap(vm->code_map, memory_size >> CODE_MAP_SHIFT);
+        free(vm);
+        return NULL;
+    }
+    vm->memory_size = memory_size;
+    vm->running = true;
+    vm->text_color = 7;
+    vm->current_pitch = 440.0;
+    return vm;
+}
+
+void vm_destroy(VM* vm) {
+    if (vm == NULL) return;
+    gfx_close(vm);
+    sys_audio_close(vm);
+    decode_cache_reset(vm);
+    hotspot_reset(vm);
+    stack_sampler_reset(vm);
+    free(vm->console_buffer);
+    free(vm->constant_pool);
+    guest_pages_unmap(vm->memory, vm->memory_size);
+    guest_pages_unmap(vm->code_map, vm->memory_size >> CODE_MAP_SHIFT);
+    free(vm);
+}
+
+static void dirty_clear(VM* vm) {
+    for (uint32_t i = 0; i < vm->dirty_count; i++) vm->dirty_pages[vm->dirty_list[i]] = 0;
+    vm->dirty_count = 0;
+}
+
+// Clears guest memory and everything derived from it before a new program is loaded.
+void vm_clear_memory(VM* vm) {
+    guest_memory_discard(vm);
+    vm->resume_pending = false;
+    decode_cache_reset(vm);
+    dirty_clear(vm);
+    vm->image = NULL;
+    vm->image_size = 0;
+    vm->constant_pool_count = 0;
+    vm->constant_pool_address = 0;
+}
+
+// Replaces guest memory with an empty one of a new size. The loaded program is gone afterwards.
+// Returns false and keeps the old memory if the new one cannot be mapped.
+bool vm_set_memory_size(VM* vm, uint32_t memory_size) {
+    uint8_t* memory = guest_pages_map(memory_size);
+    uint8_t* code_map = guest_pages_map(memory_size >> CODE_MAP_SHIFT);
+    if (memory == NULL || code_map == NULL) {
+        guest_pages_unmap(memory, memory_size);
+        guest_pages_unmap(code_map, memory_size >> CODE_MAP_SHIFT);
+        return false;
+    }
+    gfx_close(vm); // gfx_pixels points into the old memory
+    decode_cache_reset(vm);
+    guest_pages_unmap(vm->memory, vm->memory_size);
+    guest_pages_unmap(vm->code_map, vm->memory_size >> CODE_MAP_SHIFT);
+    vm->memory = memory;
+    vm->code_map = code_map;
+    vm->memory_size = memory_size;
+    vm->memory_file_backed = false;
+    vm->resume_pending = false;
+    dirty_clear(vm);
+    vm->image = NULL;
+    vm->image_size = 0;
+    vm->constant_pool_count = 0;
+    vm->constant_pool_address = 0;
+    return true;
+}
+
+// Fast Reset
+// Every store path goes through decode_cache_invalidate, which records the 4KB pages it writes. Running the
+// same program again then only has to put those pages back: the cost follows what the last run touched,
+// not the size of guest memory, and decodes of code that was not written stay cached between runs.
+
+// Loads a program from an image in host memory. The image must stay valid while vm_reset_image may use it.
+// Returns false and loads nothing if the image does not fit in the VM's guest memory.
+bool vm_load_image(VM* vm, const uint8_t* image, size_t image_size) {
+    if (image_size > vm->memory_size) return false;
+    vm_clear_memory(vm);
+    memcpy(vm->memory, image, image_size);
+    vm->image = image;
+    vm->image_size = image_size;
+    vm_constant_pool_load(vm, image_size);
+    return true;
+}
+
+// Puts guest memory back to the state vm_load_image left it in. Returns false if no image is loaded.
+bool vm_reset_image(VM* vm) {
+    if (vm->image == NULL) return false;
+    vm->resume_pending = false;
+    for (uint32_t i = 0; i < vm->dirty_count; i++) {
+        uint32_t offset = (uint32_t)vm->dirty_list[i] << DIRTY_PAGE_SHIFT;
+        size_t from_image = 0;
+        if (offset < vm->image_size) from_image = (vm->image_size - offset < GUEST_PAGE_SIZE) ? vm->image_size - offset : GUEST_PAGE_SIZE;
+        memcpy(&vm->memory[offset], vm->image + offset, from_image);
+        memset(&vm->memory[offset + from_image], 0, GUEST_PAGE_SIZE - from_image);
+        decode_cache_invalidate(vm, offset, GUEST_PAGE_SIZE);
+    }
+    dirty_clear(vm);
+    return true;
+}
+
+int load_rom(VM* vm, const char* rom_filename) {
+    FILE* rom_file = fopen(rom_filename, "rb");
+    if (!rom_file) {
+        perror("Error opening ROM file for reading");
+        return -1;
+    }
+
+    vm_clear_memory(vm);
+    fseek(rom_file, 0, SEEK_END);
+    long rom_size = ftell(rom_file);
+    rewind(rom_file);
+
+    if (rom_size > vm->memory_size) {
+        fprintf(stderr, "Error: ROM file is too large to load into memory.\n");
+        fclose(rom_file);
+        return -1;
+    }
+
+    size_t bytes_read = fread(vm->memory, 1, rom_size, rom_file);
+    fclose(rom_file);
+    vm_constant_pool_load(vm, bytes_read);
+    printf("Loaded %zu bytes from '%s'\n", bytes_read, rom_filename);
+    return 0;
+}
 
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg1_hex[8]; sprintf(reg1_hex, "%02X ", reg1); strcat(binary_output, reg1_hex);
-            char reg2_hex[8]; sprintf(reg2_hex, "%02X ", reg2); strcat(binary_output, reg2_hex);
+// Reads a ROM into a new buffer so it can be copied into many runs. Returns NULL if it cannot be loaded
+// or is larger than memory_size.
+uint8_t* read_rom_image(const char* rom_filename, size_t* image_size, uint32_t memory_size) {
+    FILE* rom_file = fopen(rom_filename, "rb");
+    if (!rom_file) {
+        perror("Error opening ROM file for reading");
+        return NULL;
+    }
+    fseek(rom_file, 0, SEEK_END);
+    long rom_size = ftell(rom_file);
+    rewind(rom_file);
+    if (rom_size < 0 || rom_size > memory_size) {
+        fprintf(stderr, "Error: ROM file is too large to load into memory.\n");
+        fclose(rom_file);
+        return NULL;
+    }
+    uint8_t* image = (uint8_t*)malloc(rom_size > 0 ? rom_size : 1);
+    if (image == NULL) {
+        fprintf(stderr, "Error: Out of memory reading '%s'.\n", rom_filename);
+        fclose(rom_file);
+        return NULL;
+    }
+    *image_size = fread(image, 1, rom_size, rom_file);
+    fclose(rom_file);
+    return image;
+}
 
+// Disassembler
+// A linear sweep driven by opcode_info: the opcode byte gives the operand layout and the length, and the
+// first form of the opcode's mnemonic gives the operand syntax, so every line assembles back to the same
+// bytes. Strings and buffers after the code are decoded too; bytes that are no instruction are shown as DB.
+// The constant pool is shown as comments, and pooled operands as their values, which assemble back into
+// the same pool.
+
+// Writes one instruction as source text and returns its length. Returns 0 if the bytes at code are no
+// instruction; text then shows the first byte as DB. Pool indices are looked up in pool.
+int disassemble_instruction(const uint8_t* code, uint32_t available, const double* pool, uint32_t pool_count, char* text, size_t text_size) {
+    Opcode opcode = available > 0 ? (Opcode)code[0] : OP_INVALID;
+    const OpcodeInfo* info = opcode < OP_INVALID ? &opcode_info[opcode] : NULL;
+    if (info == NULL || info->length > available) {
+        snprintf(text, text_size, "DB 0x%02X", available > 0 ? code[0] : 0);
+        return 0;
+    }
+    const InstructionForm* form = instruction_forms;
+    while (form < instruction_forms + INSTRUCTION_FORM_COUNT && (form->opcode != opcode || strcmp(form->mnemonic, info->mnemonic) != 0)) form++;
+
+    char line[160];
+    int used = snprintf(line, sizeof(line), "%s", info->mnemonic);
+    uint32_t offset = 1;
+    for (int i = 0; i < info->operand_count; i++) {
+        const char* separator = i == 0 ? " " : ", ";
+        switch (info->operands[i]) {
+        case OPERAND_REG:
+            if (code[offset] >= NUM_TOTAL_REGISTERS) {
+                snprintf(text, text_size, "DB 0x%02X", code[0]);
+                return 0;
+            }
+            used += snprintf(line + used, sizeof(line) - used, "%s%s", separator, register_string((RegisterIndex)code[offset]));
+            offset += 1;
             break;
-        }
-        case OP_LEA_REG_MEM:
-        case OP_MOV_REG_MEM:
-        case OP_MOVZX_REG_MEM:
-        case OP_MOVSX_REG_MEM:
-        case OP_STR_LEN_REG_MEM:
-        case OP_STR_ATOI_REG_MEM:
-        case OP_INC_MEM:
-        case OP_DEC_MEM:
-        case OP_MEM_FREE_MEM:
-        case OP_STR_TOUPPER_MEM:
-        case OP_STR_TOLOWER_MEM:
-        case OP_PUSHA:
-        case OP_POPA:
-        case OP_PUSHFD:
-        case OP_POPFD:
-        case OP_DISK_GET_VOLUME_LABEL_MEM:
-        case OP_DISK_SET_VOLUME_LABEL_MEM:
-        {
-            RegisterIndex reg = REG_INVALID;
-            if (opcode != OP_INC_MEM && opcode != OP_DEC_MEM && opcode != OP_MEM_FREE_MEM && opcode != OP_STR_TOUPPER_MEM && opcode != OP_STR_TOLOWER_MEM && opcode != OP_PUSHA && opcode != OP_POPA && opcode != OP_PUSHFD && opcode != OP_POPFD && opcode != OP_DISK_GET_VOLUME_LABEL_MEM && opcode != OP_DISK_SET_VOLUME_LABEL_MEM)
-                reg = register_from_string(reg1_str);
-            uint32_t address = parse_address((opcode == OP_INC_MEM || opcode == OP_DEC_MEM || opcode == OP_MEM_FREE_MEM || opcode == OP_STR_TOUPPER_MEM || opcode == OP_STR_TOLOWER_MEM || opcode == OP_PUSHA || opcode == OP_POPA || opcode == OP_PUSHFD || opcode == OP_POPFD || opcode == OP_DISK_GET_VOLUME_LABEL_MEM || opcode == OP_DISK_SET_VOLUME_LABEL_MEM) ? reg1_str : reg2_str);
-            if (reg != REG_INVALID) memory[program_counter++] = (uint8_t)reg;
-            *(uint32_t*)&memory[program_counter] = address;
-            program_counter += 4;
-
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            if (reg != REG_INVALID) { char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex); }
-            char addr_hex[16] = "";
-            for (int i = 0; i < 4; ++i) { sprintf(addr_hex + i * 3, "%02X ", memory[instruction_start_address + (reg != REG_INVALID ? 2 : 1) + i]); }
-            strcat(binary_output, addr_hex);
+        case OPERAND_F64: {
+            double value;
+            memcpy(&value, code + offset, sizeof(value));
+            // A whole number that fits an int32 is shown as "5.0", or it would assemble to a compact form
+            bool integral = value == floor(value) && value >= INT32_MIN && value <= INT32_MAX;
+            used += snprintf(line + used, sizeof(line) - used, integral ? "%s%.1f" : "%s%.17g", separator, value);
+            offset += 8;
             break;
         }
-        case OP_MOV_MEM_REG: {
-            char* addr_str = reg1_str;
-            RegisterIndex reg = register_from_string(reg2_str);
-            uint32_t address = parse_address(addr_str);
-            *(uint32_t*)&memory[program_counter] = address;
-            program_counter += 4;
-            memory[program_counter++] = (uint8_t)reg;
-
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char addr_hex[16] = "";
-            for (int i = 0; i < 4; ++i) { sprintf(addr_hex + i * 3, "%02X ", memory[instruction_start_address + 1 + i]); }
-            strcat(binary_output, addr_hex);
-            char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
+        case OPERAND_I8:
+        case OPERAND_I16:
+        case OPERAND_I32:
+            used += snprintf(line + used, sizeof(line) - used, "%s%d", separator, (int)immediate_widen(code + offset, info->operands[i], NULL, 0));
+            offset += OPERAND_SIZE(info->operands[i]);
+            break;
+        case OPERAND_K16: {
+            uint16_t index;
+            memcpy(&index, code + offset, sizeof(index));
+            if (index >= pool_count) {
+                snprintf(text, text_size, "DB 0x%02X", code[0]);
+                return 0;
+            }
+            used += snprintf(line + used, sizeof(line) - used, "%s%.17g", separator, pool[index]);
+            offset += 2;
             break;
         }
-        case OP_POP_REG: {
-            RegisterIndex reg = register_from_string(reg1_str);
-            memory[program_counter++] = (uint8_t)opcode;
-            memory[program_counter++] = (uint8_t)reg;
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
+        case OPERAND_U32: {
+            uint32_t value;
+            memcpy(&value, code + offset, sizeof(value));
+            bool memory = form < instruction_forms + INSTRUCTION_FORM_COUNT && (form->operands[i] == 'm' || form->operands[i] == 'a');
+            used += snprintf(line + used, sizeof(line) - used, memory ? "%s[%u]" : "%s%u", separator, value);
+            offset += 4;
             break;
         }
-        case OP_NOT_REG:
-        case OP_NEG_REG:
-        case OP_INC_REG:
-        case OP_DEC_REG:
-        case OP_RND_REG:
-        case OP_PUSH_REG:
-        case OP_BSWAP_REG:
-        case OP_SETZ_REG:
-        case OP_SETNZ_REG:
-        case OP_SYS_PRINT_CHAR:
-        case OP_SYS_PRINT_STRING:
-        case OP_SYS_SET_TEXT_COLOR:
-        case OP_SYS_PRINT_NUMBER_DEC:
-        case OP_SYS_PRINT_NUMBER_HEX:
-        case OP_SYS_READ_CHAR:
-        case OP_SYS_GET_KEY_PRESS:
-        case OP_SYS_GET_CPU_VER:
-        case OP_SYS_WAIT:
-        case OP_SYS_TIME_REG:
-        case OP_MATH_ABS:
-        case OP_MATH_SIN:
-        case OP_MATH_COS:
-        case OP_MATH_TAN:
-        case OP_MATH_ASIN:
-        case OP_MATH_ACOS:
-        case OP_MATH_ATAN:
-        case OP_MATH_SQRT:
-        case OP_MATH_LOG:
-        case OP_MATH_EXP:
-        case OP_MATH_FLOOR:
-        case OP_MATH_CEIL:
-        case OP_MATH_ROUND:
-        case OP_MATH_NEG:
-        case OP_SHL_REG_VAL:
-        case OP_SHR_REG_VAL:
-        case OP_SAR_REG_VAL:
-        case OP_ROL_REG_VAL:
-        case OP_ROR_REG_VAL:
-        case OP_DISK_GET_SIZE_REG:
-        {
-            RegisterIndex reg = register_from_string(reg1_str);
-            uint32_t value = parse_value_double(reg2_str);
-            memory[program_counter++] = (uint8_t)reg;
-            *(uint32_t*)&memory[program_counter] = value;
-            program_counter += 4;
-
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
-            char val_hex[16] = "";
-            for (int i = 0; i < 4; ++i) { sprintf(val_hex + i * 3, "%02X ", memory[instruction_start_address + 2 + i]); }
-            strcat(binary_output, val_hex);
+        default:
             break;
         }
-        case OP_MATH_CLAMP: {
-            RegisterIndex reg_dest = register_from_string(reg1_str);
-            RegisterIndex reg_val = register_from_string(reg1_str);
-            RegisterIndex reg_min = register_from_string(reg2_str);
-            RegisterIndex reg_max = register_from_string(reg3_str);
+    }
+    snprintf(text, text_size, "%s", line);
+    return info->length;
+}
 
-            memory[program_counter++] = (uint8_t)reg_dest;
-            memory[program_counter++] = (uint8_t)reg_min;
-            memory[program_counter++] = (uint8_t)reg_max;
+// Writes rom_filename.dis with the address, bytes, source text and flag effects of each instruction.
+int disassemble_rom(const char* rom_filename) {
+    size_t image_size;
+    uint8_t* image = read_rom_image(rom_filename, &image_size, MEMORY_SIZE);
+    if (image == NULL) return -1;
+    char dis_filename[256];
+    snprintf(dis_filename, sizeof(dis_filename), "%s.dis", rom_filename);
+    FILE* dis_file = fopen(dis_filename, "w");
+    if (!dis_file) {
+        perror("Error opening disassembly file for writing");
+        free(image);
+        return -1;
+    }
 
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg_dest_hex[8]; sprintf(reg_dest_hex, "%02X ", reg_dest); strcat(binary_output, reg_dest_hex);
-            char reg_min_hex[8]; sprintf(reg_min_hex, "%02X ", reg_min); strcat(binary_output, reg_min_hex);
-            char reg_max_hex[8]; sprintf(reg_max_hex, "%02X ", reg_max); strcat(binary_output, reg_max_hex);
-            break;
-        }
-        case OP_MATH_LERP: {
-            RegisterIndex reg_dest = register_from_string(reg1_str);
-            RegisterIndex reg_start = register_from_string(reg2_str);
-            RegisterIndex reg_end = register_from_string(reg3_str);
-            RegisterIndex reg_step = register_from_string(reg4_str);
-
-            memory[program_counter++] = (uint8_t)reg_dest;
-            memory[program_counter++] = (uint8_t)reg_start;
-            memory[program_counter++] = (uint8_t)reg_end;
-            memory[program_counter++] = (uint8_t)reg_step;
-
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg_dest_hex[8]; sprintf(reg_dest_hex, "%02X ", reg_dest); strcat(binary_output, reg_dest_hex);
-            char reg_start_hex[8]; sprintf(reg_start_hex, "%02X ", reg_start); strcat(binary_output, reg_start_hex);
-            char reg_end_hex[8]; sprintf(reg_end_hex, "%02X ", reg_end); strcat(binary_output, reg_end_hex);
-            char reg_step_hex[8]; sprintf(reg_step_hex, "%02X ", reg_step); strcat(binary_output, reg_step_hex);
-            break;
+    fprintf(dis_file, "Disassembly of: %s\n\n", rom_filename);
+    fprintf(dis_file, "Address  | Binary Code                       | Assembly Code\n");
+    fprintf(dis_file, "---------|-----------------------------------|--------------\n");
+
+    // The pool and its trailer end the ROM, see Constant Pool
+    ConstantPoolTrailer trailer;
+    double* pool = NULL;
+    uint32_t pool_count = 0;
+    size_t sweep_end = image_size;
+    if (image_size >= sizeof(trailer)) {
+        memcpy(&trailer, image + image_size - sizeof(trailer), sizeof(trailer));
+        size_t pool_end = image_size - sizeof(trailer);
+        if (memcmp(trailer.magic, CONSTANT_POOL_MAGIC, sizeof(trailer.magic)) == 0 && trailer.address <= pool_end &&
+            (uint64_t)trailer.count * sizeof(double) <= pool_end - trailer.address) {
+            pool = (double*)malloc((trailer.count > 0 ? trailer.count : 1) * sizeof(double));
+            if (pool != NULL) {
+                memcpy(pool, image + trailer.address, trailer.count * sizeof(double));
+                pool_count = trailer.count;
+                sweep_end = trailer.address;
+            }
         }
-        case OP_JMP:
-        case OP_JMP_NZ:
-        case OP_JMP_Z:
-        case OP_JMP_S:
-        case OP_JMP_NS:
-        case OP_JMP_C:
-        case OP_JMP_NC:
-        case OP_JMP_O:
-        case OP_JMP_NO:
-        case OP_JMP_GE:
-        case OP_JMP_LE:
-        case OP_JMP_G:
-        case OP_JMP_L:
-        case OP_CALL_ADDR:
-        case OP_DISK_CREATE_IMAGE: {
-            uint32_t address = parse_address(reg1_str);
-            *(uint32_t*)&memory[program_counter] = address;
-            program_counter += 4;
-
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char addr_hex[16] = "";
-            for (int i = 0; i < 4; ++i) { sprintf(addr_hex + i * 3, "%02X ", memory[instruction_start_address + 1 + i]); }
-            strcat(binary_output, addr_hex);
-            break;
+    }
+
+    uint32_t instruction_count = 0;
+    for (uint32_t address = 0; address < sweep_end;) {
+        char text[160];
+        int length = disassemble_instruction(image + address, (uint32_t)(sweep_end - address), pool, pool_count, text, sizeof(text));
+        uint8_t flag_effects = length > 0 ? opcode_info[image[address]].flag_effects : 0;
+        if (length == 0) length = 1;
+        char binary[DECODE_MAX_INSTRUCTION_LENGTH * 3 + 1] = "";
+        for (int i = 0; i < length; i++) sprintf(binary + i * 3, "%02X ", image[address + i]);
+        fprintf(dis_file, "%08X | %-33s | %s", address, binary, text);
+        if (flag_effects) {
+            fprintf(dis_file, "  ; flags %s%s%s%s", flag_effects & FLAG_EFFECT_ZF ? "Z" : "", flag_effects & FLAG_EFFECT_SF ? "S" : "",
+                flag_effects & FLAG_EFFECT_CF ? "C" : "", flag_effects & FLAG_EFFECT_OF ? "O" : "");
         }
-        case OP_STR_CPY_MEM_MEM:
-        case OP_STR_CAT_MEM_MEM: {
-            uint32_t dest_addr = parse_address(reg1_str);
-            uint32_t src_addr = parse_address(reg2_str);
-            *(uint32_t*)&memory[program_counter] = dest_addr;
-            program_counter += 4;
-            *(uint32_t*)&memory[program_counter] = src_addr;
-            program_counter += 4;
-
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char addr1_hex[16] = "";
-            for (int i = 0; i < 4; ++i) { sprintf(addr1_hex + i * 3, "%02X ", memory[instruction_start_address + 1 + i]); }
-            strcat(binary_output, addr1_hex);
-            char addr2_hex[16] = "";
-            for (int i = 0; i < 4; ++i) { sprintf(addr2_hex + i * 3, "%02X ", memory[instruction_start_address + 5 + i]); }
-            strcat(binary_output, addr2_hex);
-            break;
+        fputc('\n', dis_file);
+        address += length;
+        instruction_count++;
+    }
+    if (pool != NULL) {
+        for (uint32_t i = 0; i < pool_count; i++) {
+            char binary[8 * 3 + 1] = "";
+            for (int b = 0; b < 8; b++) sprintf(binary + b * 3, "%02X ", image[trailer.address + i * 8 + b]);
+            fprintf(dis_file, "%08X | %-33s | ; Constant Pool entry %u: %.17g\n", trailer.address + i * 8, binary, i, pool[i]);
         }
-        case OP_MEM_SET_MEM_REG_REG: {
-            uint32_t dest_addr = decode_address();
-            RegisterIndex reg1 = decode_register();
-            RegisterIndex reg2 = decode_register();
-            *(uint32_t*)&memory[program_counter] = dest_addr;
-            program_counter += 4;
-            memory[program_counter++] = (uint8_t)reg1;
-            memory[program_counter++] = (uint8_t)reg2;
-
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char addr_hex[16] = "";
-            for (int i = 0; i < 4; ++i) { sprintf(addr_hex + i * 3, "%02X ", memory[instruction_start_address + 1 + i]); }
-            strcat(binary_output, addr_hex);
-            char reg1_hex[8]; sprintf(reg1_hex, "%02X ", reg1); strcat(binary_output, reg1_hex);
-            char reg2_hex[8]; sprintf(reg2_hex, "%02X ", reg2); strcat(binary_output, reg2_hex);
+        fprintf(dis_file, "%08X | %-33s | ; Constant Pool trailer: %u entries at 0x%X\n", trailer.address + pool_count * 8, "", pool_count, trailer.address);
+    }
+    fclose(dis_file);
+    free(pool);
+    free(image);
+    printf("Disassembled %u instructions from '%s' to '%s'\n", instruction_count, rom_filename, dis_filename);
+    return 0;
+}
 
-            break;
-        }
-        case OP_SYS_READ_STRING: {
-            RegisterIndex reg1 = register_from_string(reg1_str);
-            RegisterIndex reg2 = register_from_string(reg2_str);
-            memory[program_counter++] = (uint8_t)reg1;
-            memory[program_counter++] = (uint8_t)reg2;
+// Snapshots
+// vm.snapshot saves a warmed-up guest: CPU registers, PC, flags, console and device state and every
+// non-zero page of memory. Resuming maps those pages straight from the file as private copy-on-write
+// pages, so a restart costs a few system calls instead of replaying the program's initialization. The
+// guest tells the two apart by R0: SNAPSHOT_WRITTEN after saving, SNAPSHOT_RESUMED after a resume.
 
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg1_hex[8]; sprintf(reg1_hex, "%02X ", reg1); strcat(binary_output, reg1_hex);
-            char reg2_hex[8]; sprintf(reg2_hex, "%02X ", reg2); strcat(binary_output, reg2_hex);
-            break;
-        }
-        case OP_STR_CMP_REG_MEM_MEM: {
-            RegisterIndex reg = register_from_string(reg1_str);
-            uint32_t addr1 = parse_address(reg2_str);
-            uint32_t addr2 = parse_address(reg3_str);
+static uint32_t snapshot_data_offset(uint32_t page_count) {
+    uint32_t table_end = (uint32_t)sizeof(SnapshotHeader) + page_count * (uint32_t)sizeof(uint32_t);
+    return (table_end + GUEST_PAGE_SIZE - 1) / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE;
+}
 
-            memory[program_counter++] = (uint8_t)reg;
-            *(uint32_t*)&memory[program_counter] = addr1;
-            program_counter += 4;
-            *(uint32_t*)&memory[program_counter] = addr2;
-            program_counter += 4;
+// Writes vm->snapshot_path. The file is written under a temporary name and renamed into place, so a
+// guest that was itself resumed from that file keeps its mapped pages intact.
+bool snapshot_write(VM* vm) {
+    if (vm->snapshot_path[0] == '\0') return false; // Batch and benchmark runs have nowhere to save
+    materialize_flags(vm);
 
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
-            char addr1_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(addr1_hex + i * 3, "%02X ", memory[instruction_start_address + 2 + i]); } strcat(binary_output, addr1_hex);
-            char addr2_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(addr2_hex + i * 3, "%02X ", memory[instruction_start_address + 6 + i]); } strcat(binary_output, addr2_hex);
+    uint32_t total_pages = vm->memory_size / GUEST_PAGE_SIZE;
+    uint32_t* page_numbers = (uint32_t*)malloc(total_pages * sizeof(uint32_t));
+    if (page_numbers == NULL) {
+        fprintf(stderr, "Error: Out of memory writing snapshot.\n");
+        return false;
+    }
+    uint32_t page_count = 0;
+    for (uint32_t page = 0; page < total_pages; page++) {
+        if (guest_page_bits(&vm->memory[page * GUEST_PAGE_SIZE]) != 0) page_numbers[page_count++] = page;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.page_size = GUEST_PAGE_SIZE;
+    header.memory_size = vm->memory_size;
+    header.page_count = page_count;
+    header.program_counter = vm->program_counter;
+    header.cursor_x = vm->cursor_x;
+    header.cursor_y = vm->cursor_y;
+    header.text_color = vm->text_color;
+    header.gfx_initialized = vm->gfx_initialized;
+    header.audio_initialized = vm->audio_initialized;
+    header.speaker_enabled = vm->speaker_enabled;
+    header.current_pitch = vm->current_pitch;
+    memcpy(header.registers, vm->registers, sizeof(header.registers));
+    header.registers[REG_R0] = SNAPSHOT_RESUMED;
+    header.constant_pool_address = vm->constant_pool_address;
+    header.constant_pool_count = vm->constant_pool_count;
+    snprintf(header.rom_filename, sizeof(header.rom_filename), "%s", vm->snapshot_path);
+    char* extension = strrchr(header.rom_filename, '.');
+    if (extension != NULL && strcmp(extension, ".snap") == 0) *extension = '\0';
+
+    char temp_path[272];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", vm->snapshot_path);
+    FILE* file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not create snapshot file '%s'.\n", temp_path);
+        free(page_numbers);
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (ok && page_count > 0) ok = fwrite(page_numbers, sizeof(uint32_t), page_count, file) == page_count;
+    static const uint8_t padding[GUEST_PAGE_SIZE];
+    uint32_t padding_size = snapshot_data_offset(page_count) - (uint32_t)sizeof(header) - page_count * (uint32_t)sizeof(uint32_t);
+    if (ok && padding_size > 0) ok = fwrite(padding, 1, padding_size, file) == padding_size;
+    for (uint32_t i = 0; ok && i < page_count; i++) {
+        ok = fwrite(&vm->memory[page_numbers[i] * GUEST_PAGE_SIZE], GUEST_PAGE_SIZE, 1, file) == 1;
+    }
+    free(page_numbers);
+    if (fclose(file) != 0) ok = false;
+    if (ok) {
+#ifdef _WIN32
+        remove(vm->snapshot_path); // rename does not replace existing files on Windows
+#endif
+        ok = rename(temp_path, vm->snapshot_path) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Could not write snapshot file '%s'.\n", vm->snapshot_path);
+        remove(temp_path);
+    }
+    return ok;
+}
 
-            break;
+// Loads a snapshot into the VM's memory and keeps its CPU state for the next vm_execute, which continues
+// where vm.snapshot left off. The memory size follows the snapshot. rom_filename receives the ROM the
+// snapshot came from. Returns 0 on success.
+int snapshot_load(VM* vm, const char* snapshot_filename, char* rom_filename, size_t rom_filename_size) {
+    FILE* file = fopen(snapshot_filename, "rb");
+    if (file == NULL) {
+        perror("Error opening snapshot file for reading");
+        return -1;
+    }
+    // A truncated file must be rejected here: touching a mapped page past its end raises SIGBUS
+    uint64_t file_size = 0;
+#ifndef _WIN32
+    struct stat file_info;
+    if (fstat(fileno(file), &file_info) == 0) file_size = (uint64_t)file_info.st_size;
+#else
+    if (_fseeki64(file, 0, SEEK_END) == 0) file_size = (uint64_t)_ftelli64(file);
+    rewind(file);
+#endif
+    SnapshotHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_VERSION || header.page_size != GUEST_PAGE_SIZE || !memory_size_valid(header.memory_size) ||
+        header.page_count > header.memory_size / GUEST_PAGE_SIZE ||
+        file_size < snapshot_data_offset(header.page_count) + (uint64_t)header.page_count * GUEST_PAGE_SIZE) {
+        fprintf(stderr, "Error: '%s' is not a valid snapshot file.\n", snapshot_filename);
+        fclose(file);
+        return -1;
+    }
+    uint32_t* page_numbers = (uint32_t*)malloc((header.page_count > 0 ? header.page_count : 1) * sizeof(uint32_t));
+    if (page_numbers == NULL || fread(page_numbers, sizeof(uint32_t), header.page_count, file) != header.page_count) {
+        fprintf(stderr, "Error: Could not read the page table of '%s'.\n", snapshot_filename);
+        free(page_numbers);
+        fclose(file);
+        return -1;
+    }
+    for (uint32_t i = 0; i < header.page_count; i++) {
+        if (page_numbers[i] >= header.memory_size / GUEST_PAGE_SIZE || (i > 0 && page_numbers[i] <= page_numbers[i - 1])) {
+            fprintf(stderr, "Error: '%s' has a damaged page table.\n", snapshot_filename);
+            free(page_numbers);
+            fclose(file);
+            return -1;
         }
-        case OP_STR_NCPY_MEM_MEM_REG: {
-            uint32_t dest_addr = parse_address(reg1_str);
-            uint32_t src_addr = parse_address(reg2_str);
-            RegisterIndex reg = register_from_string(reg3_str);
-
-            *(uint32_t*)&memory[program_counter] = dest_addr;
-            program_counter += 4;
-            *(uint32_t*)&memory[program_counter] = src_addr;
-            program_counter += 4;
-            memory[program_counter++] = (uint8_t)reg;
+    }
 
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char addr1_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(addr1_hex + i * 3, "%02X ", memory[instruction_start_address + 1 + i]); } strcat(binary_output, addr1_hex);
-            char addr2_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(addr2_hex + i * 3, "%02X ", memory[instruction_start_address + 5 + i]); } strcat(binary_output, addr2_hex);
-            char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
+    if (header.memory_size != vm->memory_size) {
+        if (!vm_set_memory_size(vm, header.memory_size)) {
+            fprintf(stderr, "Error: Could not allocate %u KB of guest memory for the snapshot.\n", header.memory_size / 1024);
+            free(page_numbers);
+            fclose(file);
+            return -1;
+        }
+        printf("Guest memory set to %u KB to match the snapshot.\n", header.memory_size / 1024);
+    }
+    vm_clear_memory(vm);
 
-            break;
+    uint32_t data_offset = snapshot_data_offset(header.page_count);
+    bool ok = true;
+#ifndef _WIN32
+    bool map_pages = sysconf(_SC_PAGESIZE) == GUEST_PAGE_SIZE;
+#else
+    bool map_pages = false;
+#endif
+    // Runs of consecutive pages are consecutive in the file too, so each run is one mapping or one read
+    for (uint32_t first = 0; ok && first < header.page_count; ) {
+        uint32_t run = 1;
+        while (first + run < header.page_count && page_numbers[first + run] == page_numbers[first] + run) run++;
+        uint8_t* target = &vm->memory[page_numbers[first] * GUEST_PAGE_SIZE];
+        size_t length = (size_t)run * GUEST_PAGE_SIZE;
+        long offset = (long)data_offset + (long)first * GUEST_PAGE_SIZE;
+#ifndef _WIN32
+        if (map_pages) {
+            vm->memory_file_backed = true;
+            ok = mmap(target, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(file), offset) != MAP_FAILED;
+        }
+        else
+#endif
+        {
+            ok = fseek(file, offset, SEEK_SET) == 0 && fread(target, 1, length, file) == length;
         }
-        case OP_STR_NCAT_MEM_MEM_REG: {
-            uint32_t dest_addr = parse_address(reg1_str);
-            uint32_t src_addr = parse_address(reg2_str);
-            RegisterIndex reg = register_from_string(reg3_str);
+        first += run;
+    }
+    free(page_numbers);
+    fclose(file); // Mapped pages stay valid after the descriptor is closed
+    if (!ok) {
+        fprintf(stderr, "Error: Could not load the pages of '%s'.\n", snapshot_filename);
+        vm_clear_memory(vm);
+        return -1;
+    }
 
-            *(uint32_t*)&memory[program_counter] = dest_addr;
-            program_counter += 4;
-            *(uint32_t*)&memory[program_counter] = src_addr;
-            program_counter += 4;
-            memory[program_counter++] = (uint8_t)reg;
+    if (!vm_constant_pool_attach(vm, header.constant_pool_address, header.constant_pool_count)) {
+        fprintf(stderr, "Error: '%s' has a damaged constant pool.\n", snapshot_filename);
+        vm_clear_memory(vm);
+        return -1;
+    }
+    vm->resume = header;
+    vm->resume_pending = true;
+    snprintf(rom_filename, rom_filename_size, "%s", header.rom_filename);
+    printf("Resumed %u pages (%u KB) from '%s'\n", header.page_count, header.page_count * GUEST_PAGE_SIZE / 1024, snapshot_filename);
+    return 0;
+}
 
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char addr1_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(addr1_hex + i * 3, "%02X ", memory[instruction_start_address + 1 + i]); } strcat(binary_output, addr1_hex);
-            char addr2_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(addr2_hex + i * 3, "%02X ", memory[instruction_start_address + 5 + i]); } strcat(binary_output, addr2_hex);
-            char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
+// Called by vm_execute in place of the CPU reset when a snapshot is pending. Devices are opened again
+// the way the program had them; gfx_init clears VRAM, so the restored frame is put back afterwards.
+void snapshot_resume(VM* vm) {
+    const SnapshotHeader* header = &vm->resume;
+    vm->program_counter = header->program_counter;
+    memcpy(vm->registers, header->registers, sizeof(vm->registers));
+    sys_set_text_color(vm, header->text_color);
+    sys_set_cursor_pos(vm, header->cursor_x, header->cursor_y);
 
-            break;
+    if (header->gfx_initialized && !vm->gfx_initialized) {
+        uint8_t* frame = (uint8_t*)malloc(VRAM_SIZE);
+        if (frame != NULL) memcpy(frame, &vm->memory[VRAM_START_ADDRESS(vm)], VRAM_SIZE);
+        if (!gfx_init(vm)) printf("GFX Error: Could not reopen the display for the snapshot.\n");
+        if (frame != NULL) {
+            memcpy(&vm->memory[VRAM_START_ADDRESS(vm)], frame, VRAM_SIZE);
+            free(frame);
         }
-        case OP_MEM_CPY_MEM_MEM_REG: {
-            uint32_t dest_addr = parse_address(reg1_str);
-            uint32_t src_addr = parse_address(reg2_str);
-            RegisterIndex reg = register_from_string(reg3_str);
+        vm->needs_gfx_update = true;
+    }
+    if (header->audio_initialized && !vm->audio_initialized) {
+        if (!sys_audio_init(vm)) printf("AUDIO Error: Could not reopen audio for the snapshot.\n");
+    }
+    if (vm->audio_initialized) {
+        sys_audio_set_pitch(vm, header->current_pitch);
+        if (header->speaker_enabled) sys_audio_speaker_on(vm);
+    }
+}
 
-            *(uint32_t*)&memory[program_counter] = dest_addr;
-            program_counter += 4;
-            *(uint32_t*)&memory[program_counter] = src_addr;
-            program_counter += 4;
-            memory[program_counter++] = (uint8_t)reg;
+// Batch Runner
+//
+// Runs one ROM as many independent instances on a pool of worker threads. Every worker owns a single VM
+// and reloads it for each instance it picks up, so memory use follows the thread count, not the batch size.
+// Instances always run headless. Each one's console output is printed as a block when it finishes, and
+// the headless frame and audio files get the instance number appended to their names.
 
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char addr1_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(addr1_hex + i * 3, "%02X ", memory[instruction_start_address + 1 + i]); } strcat(binary_output, addr1_hex);
-            char addr2_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(addr2_hex + i * 3, "%02X ", memory[instruction_start_address + 5 + i]); } strcat(binary_output, addr2_hex);
-            char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
+#define BATCH_MAX_THREADS 256
 
-            break;
-        }
-        case OP_STR_CHR_REG_MEM_VAL: {
-            RegisterIndex reg = register_from_string(reg1_str);
-            uint32_t address = parse_address(reg2_str);
-            uint32_t value = parse_address(reg3_str);
+typedef struct {
+    uint8_t* image;               // The ROM, read once and copied into each instance
+    size_t image_size;
+    int instance_count;
+    int next_instance;            // Next instance to hand out, guarded by lock
+    uint64_t* instruction_counts; // Per instance
+    double* seconds;              // Per instance wall time, negative if the instance never ran
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+} BatchJob;
+
+int host_cpu_count() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
 
-            memory[program_counter++] = (uint8_t)reg;
-            *(uint32_t*)&memory[program_counter] = address;
-            program_counter += 4;
-            *(uint32_t*)&memory[program_counter] = value;
-            program_counter += 4;
+static int batch_take_instance(BatchJob* job) {
+    int instance;
+#ifdef _WIN32
+    EnterCriticalSection(&job->lock);
+#else
+    pthread_mutex_lock(&job->lock);
+#endif
+    instance = (job->next_instance < job->instance_count) ? job->next_instance++ : -1;
+#ifdef _WIN32
+    LeaveCriticalSection(&job->lock);
+#else
+    pthread_mutex_unlock(&job->lock);
+#endif
+    return instance;
+}
 
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
-            char addr_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(addr_hex + i * 3, "%02X ", memory[instruction_start_address + 2 + i]); } strcat(binary_output, addr_hex);
-            char val_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(val_hex + i * 3, "%02X ", memory[instruction_start_address + 6 + i]); } strcat(binary_output, val_hex);
+// "frames.ppm" becomes "frames_3.ppm" for instance 3. Empty paths stay empty.
+static void batch_output_path(char* out, size_t size, const char* path, int instance) {
+    if (path[0] == '\0') {
+        out[0] = '\0';
+        return;
+    }
+    const char* extension = strrchr(path, '.');
+    const char* separator = strrchr(path, '/');
+    if (extension == NULL || (separator != NULL && extension < separator)) extension = path + strlen(path);
+    snprintf(out, size, "%.*s_%d%s", (int)(extension - path), path, instance, extension);
+}
 
-            break;
+static void batch_worker_run(BatchJob* job) {
+    VM* vm = vm_create(guest_memory_size);
+    if (vm == NULL) {
+        fprintf(stderr, "Batch Error: Could not allocate a VM for a worker thread.\n");
+        return;
+    }
+    int instance;
+    char frame_path[300], audio_path[300];
+    while ((instance = batch_take_instance(job)) >= 0) {
+        batch_output_path(frame_path, sizeof(frame_path), headless_frame_path, instance);
+        batch_output_path(audio_path, sizeof(audio_path), headless_audio_path, instance);
+        if (!headless_open(vm, frame_path, audio_path)) {
+            headless_close(vm);
+            continue;
+        }
+        if (!vm_reset_image(vm) && !vm_load_image(vm, job->image, job->image_size)) {
+            fprintf(stderr, "Batch Error: The ROM does not fit in the guest memory of instance %d.\n", instance);
+            headless_close(vm);
+            continue;
+        }
+        double start_time = wall_clock_seconds();
+        job->instruction_counts[instance] = vm_execute(vm);
+        job->seconds[instance] = wall_clock_seconds() - start_time;
+        headless_close(vm);
+
+        if (vm->console_length > 0) {
+#ifdef _WIN32
+            EnterCriticalSection(&job->lock);
+#else
+            pthread_mutex_lock(&job->lock);
+#endif
+            printf("\n--- Instance %d Output ---\n", instance);
+            fwrite(vm->console_buffer, 1, vm->console_length, stdout);
+            fflush(stdout);
+#ifdef _WIN32
+            LeaveCriticalSection(&job->lock);
+#else
+            pthread_mutex_unlock(&job->lock);
+#endif
         }
-        case OP_STR_STR_REG_MEM_MEM: {
-            RegisterIndex reg = register_from_string(reg1_str);
-            uint32_t addr1 = parse_address(reg2_str);
-            uint32_t addr2 = parse_address(reg3_str);
+    }
+    jit_release(vm);
+    vm_destroy(vm);
+}
+
+#ifdef _WIN32
+DWORD WINAPI batch_worker(LPVOID param) {
+    batch_worker_run((BatchJob*)param);
+    return 0;
+}
+#else
+void* batch_worker(void* param) {
+    batch_worker_run((BatchJob*)param);
+    return NULL;
+}
+#endif
 
-            memory[program_counter++] = (uint8_t)reg;
-            *(uint32_t*)&memory[program_counter] = addr1;
-            program_counter += 4;
-            *(uint32_t*)&memory[program_counter] = addr2;
-            program_counter += 4;
+// Runs instance_count copies of the ROM on thread_count workers (0 = one per CPU) and prints a summary.
+int run_batch(const char* rom_filename, int instance_count, int thread_count) {
+    BatchJob job;
+    memset(&job, 0, sizeof(job));
+    job.image = read_rom_image(rom_filename, &job.image_size, guest_memory_size);
+    if (job.image == NULL) return -1;
+    job.instruction_counts = (uint64_t*)calloc(instance_count, sizeof(uint64_t));
+    job.seconds = (double*)malloc(instance_count * sizeof(double));
+    if (job.instruction_counts == NULL || job.seconds == NULL) {
+        fprintf(stderr, "Batch Error: Out of memory.\n");
+        free(job.image);
+        free(job.instruction_counts);
+        free(job.seconds);
+        return -1;
+    }
+    job.instance_count = instance_count;
+    for (int i = 0; i < instance_count; i++) job.seconds[i] = -1.0;
 
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
-            char addr1_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(addr1_hex + i * 3, "%02X ", memory[instruction_start_address + 2 + i]); } strcat(binary_output, addr1_hex);
-            char addr2_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(addr2_hex + i * 3, "%02X ", memory[instruction_start_address + 6 + i]); } strcat(binary_output, addr2_hex);
+    if (thread_count <= 0) thread_count = host_cpu_count();
+    if (thread_count > instance_count) thread_count = instance_count;
+    if (thread_count > BATCH_MAX_THREADS) thread_count = BATCH_MAX_THREADS;
+    printf("Running %d instances of '%s' on %d threads...\n", instance_count, rom_filename, thread_count);
+    srand(time(NULL));
 
-            break;
-        }
-        case OP_STR_ITOA_MEM_REG_REG:
-        case OP_STR_FMT_MEM_MEM_REG_REG:
-        case OP_STR_SUBSTR_MEM_MEM_REG_REG:
-        case OP_MEM_SET_MEM_REG_VAL:
-        case OP_SYS_SET_CURSOR_POS:
-        case OP_SYS_GET_CURSOR_POS:
-        case OP_SYS_NUMBER_TO_STRING:
-        case OP_DISK_READ_SECTOR_MEM_REG_REG:
-        case OP_DISK_WRITE_SECTOR_MEM_REG_REG:
-        {
-            RegisterIndex reg1, reg2, reg3 = REG_INVALID, reg4 = REG_INVALID;
-            uint32_t address = decode_address();
-            reg1 = decode_register();
-            reg2 = decode_register();
-            if (opcode == OP_STR_SUBSTR_MEM_MEM_REG_REG || opcode == OP_STR_FMT_MEM_MEM_REG_REG || opcode == OP_MATH_LERP || opcode == OP_DISK_READ_SECTOR_MEM_REG_REG || opcode == OP_DISK_WRITE_SECTOR_MEM_REG_REG) reg3 = decode_register();
-            if (opcode == OP_STR_FMT_MEM_MEM_REG_REG || opcode == OP_MATH_LERP) reg4 = decode_register();
+    double start_time = wall_clock_seconds();
+#ifdef _WIN32
+    HANDLE threads[BATCH_MAX_THREADS];
+    InitializeCriticalSection(&job.lock);
+#else
+    pthread_t threads[BATCH_MAX_THREADS];
+    pthread_mutex_init(&job.lock, NULL);
+#endif
+    int started = 0;
+    for (int i = 0; i < thread_count; i++) {
+#ifdef _WIN32
+        threads[started] = CreateThread(NULL, 0, batch_worker, &job, 0, NULL);
+        if (threads[started] != NULL) started++;
+#else
+        if (pthread_create(&threads[started], NULL, batch_worker, &job) == 0) started++;
+#endif
+    }
+    if (started == 0) batch_worker_run(&job); // No threads available, run the whole batch here
+#ifdef _WIN32
+    for (int i = 0; i < started; i++) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    DeleteCriticalSection(&job.lock);
+#else
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+#endif
+    double wall_time = wall_clock_seconds() - start_time;
+
+    int completed = 0;
+    uint64_t total_instructions = 0;
+    double fastest = 0.0, slowest = 0.0;
+    for (int i = 0; i < instance_count; i++) {
+        if (job.seconds[i] < 0.0) continue;
+        if (completed == 0 || job.seconds[i] < fastest) fastest = job.seconds[i];
+        if (completed == 0 || job.seconds[i] > slowest) slowest = job.seconds[i];
+        total_instructions += job.instruction_counts[i];
+        completed++;
+    }
+
+    printf("\n--- Batch Summary ---\n");
+    printf("Instances Completed: %d of %d\n", completed, instance_count);
+    printf("Worker Threads: %d\n", started > 0 ? started : 1);
+    printf("Total Instructions Executed: %llu\n", (unsigned long long)total_instructions);
+    printf("Wall Time: %.6f seconds\n", wall_time);
+    if (completed > 0) {
+        printf("Instance Time: %.6f to %.6f seconds\n", fastest, slowest);
+        if (wall_time > 0.0) printf("Throughput: %.2f MIPS\n", (double)total_instructions / wall_time / 1e6);
+    }
+
+    free(job.image);
+    free(job.instruction_counts);
+    free(job.seconds);
+    return completed == instance_count ? 0 : -1;
+}
 
+// Benchmark Suite
+//
+// Assembles the microbenchmarks in bench/ and runs each one headlessly: one untimed warm-up run, then a
+// fixed number of timed repetitions. Wall time, instructions per second and the variance across the
+// repetitions are reported as JSON. The interpreter core, predecode and JIT settings apply as usual.
 
-            program_counter = instruction_start_address + 1;
-            *(uint32_t*)&memory[program_counter] = address; program_counter += 4;
-            memory[program_counter++] = (uint8_t)reg1;
-            memory[program_counter++] = (uint8_t)reg2;
-            if (reg3 != REG_INVALID) memory[program_counter++] = (uint8_t)reg3;
-            if (reg4 != REG_INVALID) memory[program_counter++] = (uint8_t)reg4;
+#define BENCH_DIRECTORY "bench/"
+#define BENCH_DEFAULT_REPETITIONS 10
 
+const char* benchmark_names[] = { "alu", "call", "stack", "string", "memory", "gfxfill", "disk" };
+#define BENCHMARK_COUNT ((int)(sizeof(benchmark_names) / sizeof(benchmark_names[0])))
 
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char addr_hex[16] = ""; for (int i = 0; i < 4; ++i) { sprintf(addr_hex + i * 3, "%02X ", memory[instruction_start_address + 1 + i]); } strcat(binary_output, addr_hex);
-            char reg1_hex[8]; sprintf(reg1_hex, "%02X ", reg1); strcat(binary_output, reg1_hex);
-            char reg2_hex[8]; sprintf(reg2_hex, "%02X ", reg2); strcat(binary_output, reg2_hex);
-            if (reg3 != REG_INVALID) { char reg3_hex[8]; sprintf(reg3_hex, "%02X ", reg3); strcat(binary_output, reg3_hex); }
-            if (reg4 != REG_INVALID) { char reg4_hex[8]; sprintf(reg4_hex, "%02X ", reg4); strcat(binary_output, reg4_hex); }
+typedef struct {
+    const char* name;
+    const char* error;       // NULL if the benchmark ran
+    uint64_t instructions;   // Per repetition
+    double mean_seconds;
+    double min_seconds;
+    double max_seconds;
+    double variance_seconds; // Sample variance over the repetitions
+} BenchmarkResult;
+
+// The assembler benchmark times assemble_program on a generated source of about 100000 lines. Each group of
+// code defines a label and a macro and refers to a string, a buffer and the next group's label and macro.
+#define ASM_BENCH_NAME "assembler"
+#define ASM_BENCH_GROUPS 10000
+#define ASM_BENCH_LINES (ASM_BENCH_GROUPS * 10 + 2) // 8 lines of code, a string and a buffer per group, a comment and HLT
+
+static void benchmark_statistics(BenchmarkResult* result, const double* seconds, int repetitions) {
+    double sum = 0.0;
+    result->min_seconds = result->max_seconds = seconds[0];
+    for (int i = 0; i < repetitions; i++) {
+        sum += seconds[i];
+        if (seconds[i] < result->min_seconds) result->min_seconds = seconds[i];
+        if (seconds[i] > result->max_seconds) result->max_seconds = seconds[i];
+    }
+    result->mean_seconds = sum / repetitions;
+    double squares = 0.0;
+    for (int i = 0; i < repetitions; i++) {
+        double delta = seconds[i] - result->mean_seconds;
+        squares += delta * delta;
+    }
+    result->variance_seconds = repetitions > 1 ? squares / (repetitions - 1) : 0.0;
+}
 
-            break;
-        }
-        case OP_MEM_TEST: {
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            break; 
-        }
-        case OP_SYS_RESET_TEXT_COLOR:
-        case OP_SYS_PRINT_NEWLINE:
-        case OP_SYS_CLEAR_SCREEN:
-        case OP_RET:
-        case OP_NOP:
-        case OP_HLT:
-        case OP_DISK_FORMAT_DISK:
-        {
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            break;
-        }
-        case OP_GFX_INIT:
-        case OP_GFX_CLOSE:
-        case OP_GFX_CLEAR:
-        {
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            RegisterIndex reg = REG_INVALID;
-            if (opcode == OP_GFX_CLEAR) {
-                reg = register_from_string(reg1_str);
-                memory[program_counter++] = (uint8_t)reg;
-                char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
-            }
-            break;
-        }
-        case OP_GFX_GET_SCREEN_WIDTH_REG:
-        case OP_GFX_GET_SCREEN_HEIGHT_REG:
-        case OP_GFX_GET_VRAM_SIZE_REG:
-        case OP_GFX_GET_GPU_VER_REG:
-        {
-            RegisterIndex reg = register_from_string(reg1_str);
-            memory[program_counter++] = (uint8_t)reg;
+static void benchmark_run(VM* vm, BenchmarkResult* result, int repetitions) {
+    char asm_filename[256], rom_filename[256];
+    snprintf(asm_filename, sizeof(asm_filename), "%s%s.asm", BENCH_DIRECTORY, result->name);
+    snprintf(rom_filename, sizeof(rom_filename), "%s%s.rom", BENCH_DIRECTORY, result->name);
+    if (assemble_program(vm, asm_filename, rom_filename) != 0) {
+        result->error = "assembly failed";
+        return;
+    }
+    size_t image_size;
+    uint8_t* image = read_rom_image(rom_filename, &image_size, vm->memory_size);
+    if (image == NULL) {
+        result->error = "could not read ROM";
+        return;
+    }
+    double* seconds = (double*)malloc(repetitions * sizeof(double));
+    if (seconds == NULL) {
+        free(image);
+        result->error = "out of memory";
+        return;
+    }
 
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
-            break;
-        }
-        case OP_GFX_DRAW_PIXEL:
-        {
-            RegisterIndex reg1 = register_from_string(reg1_str); // X
-            RegisterIndex reg2 = register_from_string(reg2_str); // Y
-            RegisterIndex reg3 = register_from_string(reg3_str); // Color
-
-            memory[program_counter++] = (uint8_t)reg1;
-            memory[program_counter++] = (uint8_t)reg2;
-            memory[program_counter++] = (uint8_t)reg3;
-
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg1_hex[8]; sprintf(reg1_hex, "%02X ", reg1); strcat(binary_output, reg1_hex);
-            char reg2_hex[8]; sprintf(reg2_hex, "%02X ", reg2); strcat(binary_output, reg2_hex);
-            char reg3_hex[8]; sprintf(reg3_hex, "%02X ", reg3); strcat(binary_output, reg3_hex);
-            break;
-        }
-        case OP_AUDIO_INIT:
-        case OP_AUDIO_CLOSE:
-        case OP_AUDIO_SPEAKER_ON:
-        case OP_AUDIO_SPEAKER_OFF:
-        {
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
+    for (int run = -1; run < repetitions; run++) { // Run -1 is the warm-up
+        if (!headless_open(vm, "", "")) {
+            headless_close(vm);
+            result->error = "headless setup failed";
             break;
         }
-        case OP_AUDIO_SET_PITCH_REG:
-        case OP_AUDIO_GET_AUDIO_VER_REG: {
-            RegisterIndex reg = register_from_string(reg1_str);
-            memory[program_counter++] = (uint8_t)reg;
-
-            char opcode_hex[8]; sprintf(opcode_hex, "%02X ", opcode); strcat(binary_output, opcode_hex);
-            char reg_hex[8]; sprintf(reg_hex, "%02X ", reg); strcat(binary_output, reg_hex);
+        if (run == -1 && !vm_load_image(vm, image, image_size)) {
+            headless_close(vm);
+            result->error = "ROM does not fit in guest memory";
             break;
         }
-        default:
-            fprintf(stderr, "Assembler Error: Unhandled opcode in assembler switch on line %d (Pass 2).\n", line_number);
-            fclose(asm_file);
-            fclose(rom_file);
-            fclose(lst_file);
-            return -1;
+        if (run >= 0) vm_reset_image(vm);
+        double start_time = wall_clock_seconds();
+        uint64_t instructions = vm_execute(vm);
+        double elapsed = wall_clock_seconds() - start_time;
+        headless_close(vm);
+        if (run >= 0) {
+            seconds[run] = elapsed;
+            result->instructions = instructions;
         }
-        fprintf(lst_file, "%-9d| %-8X | %-30s | %-20s | %s", line_number, instruction_start_address + rom_offset, mnemonic_output, binary_output, "\n");
-        line_number++;
-        current_address = program_counter + rom_offset;
     }
 
-    fwrite(memory + rom_offset, 1, data_pointer - rom_offset, rom_file);
+    if (result->error == NULL) benchmark_statistics(result, seconds, repetitions);
+    free(seconds);
+    vm->image = NULL; // Freed below, the program stays loaded
+    vm->image_size = 0;
+    free(image);
+}
 
-    fclose(asm_file);
-    fclose(rom_file);
-    fclose(lst_file);
-    printf("Successfully assembled '%s' to '%s' and '%s'\n", asm_filename, rom_filename, lst_filename);
-    return 0;
+static bool benchmark_write_assembler_source(const char* asm_filename) {
+    FILE* out = fopen(asm_filename, "w");
+    if (out == NULL) return false;
+    fprintf(out, "; Generated by the benchmark suite, %d lines\n", ASM_BENCH_LINES);
+    for (int i = 0; i < ASM_BENCH_GROUPS; i++) {
+        int next = (i + 1) % ASM_BENCH_GROUPS;
+        fprintf(out, "#define STEP_%05d %d\n", i, i % 100);
+        fprintf(out, "group_%05d:\n", i);
+        fprintf(out, "    MOV R1, STEP_%05d\n", i);
+        fprintf(out, "    ADD R1, R2\n");
+        fprintf(out, "    MOV [buffer_%05d], R1\n", i);
+        fprintf(out, "    MOV R3, text_%05d\n", i);
+        fprintf(out, "    CMP R1, STEP_%05d\n", next);
+        fprintf(out, "    JZ group_%05d\n", next);
+    }
+    fprintf(out, "    HLT\n");
+    for (int i = 0; i < ASM_BENCH_GROUPS; i++) fprintf(out, ".STRING text_%05d 'group %d'\n", i, i);
+    for (int i = 0; i < ASM_BENCH_GROUPS; i++) fprintf(out, ".BUFFER buffer_%05d 8\n", i);
+    bool ok = ferror(out) == 0;
+    return fclose(out) == 0 && ok;
 }
 
-int load_rom(const char* rom_filename) {
-    FILE* rom_file = fopen(rom_filename, "rb");
-    if (!rom_file) {
-        perror("Error opening ROM file for reading");
-        return -1;
+// Times the assembler on a generated source. result->instructions holds the number of source lines.
+static void benchmark_assembler(VM* vm, BenchmarkResult* result, int repetitions) {
+    char asm_filename[256], rom_filename[256];
+    snprintf(asm_filename, sizeof(asm_filename), "%s%s.asm", BENCH_DIRECTORY, ASM_BENCH_NAME);
+    snprintf(rom_filename, sizeof(rom_filename), "%s%s.rom", BENCH_DIRECTORY, ASM_BENCH_NAME);
+    if (!benchmark_write_assembler_source(asm_filename)) {
+        result->error = "could not write the source";
+        return;
     }
+    double* seconds = (double*)malloc(repetitions * sizeof(double));
+    if (seconds == NULL) {
+        result->error = "out of memory";
+        return;
+    }
+    for (int run = 0; run < repetitions; run++) {
+        double start_time = wall_clock_seconds();
+        int status = assemble_program(vm, asm_filename, rom_filename);
+        seconds[run] = wall_clock_seconds() - start_time;
+        if (status != 0) {
+            result->error = "assembly failed";
+            break;
+        }
+    }
+    if (result->error == NULL) {
+        result->instructions = ASM_BENCH_LINES;
+        benchmark_statistics(result, seconds, repetitions);
+    }
+    free(seconds);
+}
 
-    memset(memory, 0, MEMORY_SIZE);
-    fseek(rom_file, 0, SEEK_END);
-    long rom_size = ftell(rom_file);
-    rewind(rom_file);
-
-    if (rom_size > MEMORY_SIZE) {
-        fprintf(stderr, "Error: ROM file is too large to load into memory.\n");
-        fclose(rom_file);
-        return -1;
+static void benchmark_write_json(FILE* out, const BenchmarkResult* results, const BenchmarkResult* assembler, int repetitions) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"cpu_version\": %d,\n", CPU_VER);
+    fprintf(out, "  \"repetitions\": %d,\n", repetitions);
+    fprintf(out, "  \"interpreter_core\": \"%s\",\n", interpreter_core == CORE_THREADED ? "threaded" : "switch");
+    fprintf(out, "  \"predecode\": %s,\n", predecode_enabled ? "true" : "false");
+    fprintf(out, "  \"jit\": %s,\n", jit_enabled ? "true" : "false");
+    fprintf(out, "  \"benchmarks\": [\n");
+    for (int i = 0; i < BENCHMARK_COUNT; i++) {
+        const BenchmarkResult* result = &results[i];
+        fprintf(out, "    { \"name\": \"%s\", ", result->name);
+        if (result->error != NULL) {
+            fprintf(out, "\"error\": \"%s\" }", result->error);
+        }
+        else {
+            double per_second = result->mean_seconds > 0.0 ? (double)result->instructions / result->mean_seconds : 0.0;
+            fprintf(out, "\"instructions\": %llu, \"mean_seconds\": %.9f, \"min_seconds\": %.9f, \"max_seconds\": %.9f, "
+                "\"variance_seconds\": %.6e, \"stddev_seconds\": %.9f, \"instructions_per_second\": %.0f }",
+                (unsigned long long)result->instructions, result->mean_seconds, result->min_seconds, result->max_seconds,
+                result->variance_seconds, sqrt(result->variance_seconds), per_second);
+        }
+        fprintf(out, i + 1 < BENCHMARK_COUNT ? ",\n" : "\n");
     }
+    fprintf(out, "  ],\n");
+    if (assembler->error != NULL) {
+        fprintf(out, "  \"assembler\": { \"error\": \"%s\" }\n}\n", assembler->error);
+    }
+    else {
+        double per_second = assembler->mean_seconds > 0.0 ? (double)assembler->instructions / assembler->mean_seconds : 0.0;
+        fprintf(out, "  \"assembler\": { \"lines\": %llu, \"mean_seconds\": %.9f, \"min_seconds\": %.9f, \"max_seconds\": %.9f, "
+            "\"stddev_seconds\": %.9f, \"lines_per_second\": %.0f }\n}\n",
+            (unsigned long long)assembler->instructions, assembler->mean_seconds, assembler->min_seconds, assembler->max_seconds,
+            sqrt(assembler->variance_seconds), per_second);
+    }
+}
 
-    size_t bytes_read = fread(memory, 1, rom_size, rom_file);
-    fclose(rom_file);
-    printf("Loaded %zu bytes from '%s'\n", bytes_read, rom_filename);
-    return 0;
+// Runs the whole suite and prints the JSON report. json_filename, if not NULL, gets a copy of it.
+// Returns 0 if every benchmark ran.
+int run_benchmarks(VM* vm, int repetitions, const char* json_filename) {
+    if (repetitions < 1) repetitions = BENCH_DEFAULT_REPETITIONS;
+    bool saved_debug_mode = debug_mode;
+    debug_mode = false; // Tracing would dominate the timings
+
+    uint32_t disk_size;
+    if (disk_get_size(vm, &disk_size) != DISK_OK) create_disk_image(vm); // For the disk benchmark
+
+    BenchmarkResult results[BENCHMARK_COUNT];
+    memset(results, 0, sizeof(results));
+    int failures = 0;
+    for (int i = 0; i < BENCHMARK_COUNT; i++) {
+        results[i].name = benchmark_names[i];
+        printf("Benchmark '%s': %d repetitions...\n", results[i].name, repetitions);
+        benchmark_run(vm, &results[i], repetitions);
+        if (results[i].error != NULL) {
+            fprintf(stderr, "Benchmark '%s' failed: %s\n", results[i].name, results[i].error);
+            failures++;
+        }
+    }
+    BenchmarkResult assembler;
+    memset(&assembler, 0, sizeof(assembler));
+    assembler.name = ASM_BENCH_NAME;
+    printf("Benchmark '%s': %d lines, %d repetitions...\n", assembler.name, ASM_BENCH_LINES, repetitions);
+    benchmark_assembler(vm, &assembler, repetitions);
+    if (assembler.error != NULL) {
+        fprintf(stderr, "Benchmark '%s' failed: %s\n", assembler.name, assembler.error);
+        failures++;
+    }
+    debug_mode = saved_debug_mode;
+
+    printf("\n--- Benchmark Results ---\n");
+    benchmark_write_json(stdout, results, &assembler, repetitions);
+    if (json_filename != NULL) {
+        FILE* json_file = fopen(json_filename, "w");
+        if (json_file == NULL) {
+            perror("Error opening benchmark results file");
+            return -1;
+        }
+        benchmark_write_json(json_file, results, &assembler, repetitions);
+        fclose(json_file);
+        printf("Results written to '%s'\n", json_filename);
+    }
+    return failures == 0 ? 0 : -1;
 }
 
 bool debug_mode = false;
@@ -4004,20 +8351,51 @@ int main(int argc, char* argv[]) {
     mkdir("img", 0777);
 #endif
 
+    VM* vm = vm_create(guest_memory_size);
+    if (vm == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for the virtual machine.\n");
+        return 1;
+    }
+
+    // Non-interactive benchmark run: --bench [repetitions] [results.json]
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        int repetitions = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_REPETITIONS;
+        int result = run_benchmarks(vm, repetitions, argc > 3 ? argv[3] : NULL);
+        vm_destroy(vm);
+        return result == 0 ? 0 : 1;
+    }
+
     while (1) {
         printf("\nChoose action:\n");
         printf("1. Assemble .asm to .rom and .lst\n");
         printf("2. Run .rom\n");
         printf("3. Exit\n");
         printf("4. Toggle Debug Mode (%s)\n", debug_mode ? "ON" : "OFF");
-        printf("Enter choice (1-4: ");
+        printf("5. Toggle Predecode Cache (%s)\n", predecode_enabled ? "ON" : "OFF");
+        printf("6. Toggle Interpreter Core (%s)\n", interpreter_core == CORE_THREADED ? "THREADED" : "SWITCH");
+        printf("7. Toggle JIT (%s)\n", jit_enabled ? "ON" : "OFF");
+        if (gfx_refresh_hz > 0) printf("8. Set GFX Refresh Rate (%d Hz)\n", gfx_refresh_hz);
+        else printf("8. Set GFX Refresh Rate (manual, gfx.present only)\n");
+        printf("9. Run .rom batch on worker threads\n");
+        printf("0. Toggle Headless Mode (%s)\n", headless_mode ? "ON" : "OFF");
+        printf("B. Run benchmark suite\n");
+        printf("P. Toggle Opcode Profiler (%s)\n", profile_enabled ? "ON" : "OFF");
+        printf("H. Toggle Source Hotspot Listing (%s)\n", hotspot_enabled ? "ON" : "OFF");
+        if (call_stack_sample_interval > 0) printf("S. Set Call Stack Sampling (every %u instructions)\n", call_stack_sample_interval);
+        else printf("S. Set Call Stack Sampling (OFF)\n");
+        printf("M. Set Guest Memory Size (%u KB)\n", guest_memory_size / 1024);
+        printf("R. Resume from snapshot\n");
+        printf("D. Disassemble .rom\n");
+        printf("L. Build project (.prj) to .rom through cached object files\n");
+        printf("O. Toggle Peephole Optimizer (%s)\n", peephole_enabled ? "ON" : "OFF");
+        printf("Enter choice (0-9, B, P, H, S, M, R, D, L, O): ");
         scanf(" %c", &choice);
 
         switch (choice) {
         case '1':
             printf("Enter assembly filename (.asm): ");
             scanf("%255s", filename);
-            if (assemble_program(filename, "output.rom") == 0) {
+            if (assemble_program(vm, filename, "output.rom") == 0) {
                 printf("Assembly successful. ROM file 'output.rom' and listing file 'output.rom.lst' created.\n");
             }
             else {
@@ -4025,9 +8403,9 @@ int main(int argc, char* argv[]) {
             }
             break;
         case '2':
-            if (load_rom("output.rom") == 0) {
+            if (load_rom(vm, "output.rom") == 0) {
                 printf("Running 'output.rom'...\n");
-                run_vm();
+                run_vm(vm, "output.rom");
                 printf("\n\nVM execution finished.\n");
             }
             else {
@@ -4036,13 +8414,171 @@ int main(int argc, char* argv[]) {
             break;
         case '3':
             printf("Exiting.\n");
+            vm_destroy(vm);
             return 0;
         case '4':
             debug_mode = !debug_mode;
             printf("Debug Mode is now %s\n", debug_mode ? "ON" : "OFF");
             break;
+        case '5':
+            predecode_enabled = !predecode_enabled;
+            printf("Predecode Cache is now %s\n", predecode_enabled ? "ON" : "OFF");
+            break;
+        case '6':
+            interpreter_core = (interpreter_core == CORE_THREADED) ? CORE_SWITCH : CORE_THREADED;
+            printf("Interpreter Core is now %s\n", interpreter_core == CORE_THREADED ? "THREADED" : "SWITCH");
+            break;
+        case '7':
+#ifdef VM_JIT_AVAILABLE
+            jit_enabled = !jit_enabled;
+            printf("JIT is now %s\n", jit_enabled ? "ON" : "OFF");
+#else
+            printf("JIT is not available on this platform.\n");
+#endif
+            break;
+        case '8': {
+            int hz;
+            printf("Enter refresh rate in Hz (0 = present only on gfx.present): ");
+            if (scanf("%d", &hz) == 1 && hz >= 0 && hz <= 1000) {
+                gfx_refresh_hz = hz;
+                if (hz > 0) printf("GFX refresh rate is now %d Hz\n", hz);
+                else printf("GFX now presents only on gfx.present\n");
+            }
+            else {
+                printf("Invalid refresh rate. Please enter 0-1000.\n");
+            }
+            break;
+        }
+        case '9': {
+            int instances, threads;
+            printf("Enter ROM filename (.rom): ");
+            scanf("%255s", filename);
+            printf("Enter number of instances: ");
+            if (scanf("%d", &instances) != 1 || instances < 1) {
+                printf("Invalid instance count.\n");
+                break;
+            }
+            printf("Enter number of worker threads (0 = one per CPU): ");
+            if (scanf("%d", &threads) != 1 || threads < 0) {
+                printf("Invalid thread count.\n");
+                break;
+            }
+            if (run_batch(filename, instances, threads) != 0) {
+                fprintf(stderr, "Batch run did not complete every instance.\n");
+            }
+            break;
+        }
+        case '0':
+            headless_mode = !headless_mode;
+            printf("Headless Mode is now %s\n", headless_mode ? "ON" : "OFF");
+            if (headless_mode) {
+                printf("Enter frame dump file (.ppm for PPM frames, any other name for raw ARGB8888, - for none): ");
+                scanf("%255s", headless_frame_path);
+                if (strcmp(headless_frame_path, "-") == 0) headless_frame_path[0] = '\0';
+                printf("Enter audio output file (.wav, - to discard audio): ");
+                scanf("%255s", headless_audio_path);
+                if (strcmp(headless_audio_path, "-") == 0) headless_audio_path[0] = '\0';
+            }
+            break;
+        case 'B':
+        case 'b': {
+            int repetitions;
+            printf("Enter number of repetitions per benchmark: ");
+            if (scanf("%d", &repetitions) != 1 || repetitions < 1) {
+                printf("Invalid repetition count.\n");
+                break;
+            }
+            printf("Enter JSON results filename (- for none): ");
+            scanf("%255s", filename);
+            if (run_benchmarks(vm, repetitions, strcmp(filename, "-") == 0 ? NULL : filename) != 0) {
+                fprintf(stderr, "Some benchmarks did not run.\n");
+            }
+            break;
+        }
+        case 'P':
+        case 'p':
+            profile_enabled = !profile_enabled;
+            printf("Opcode Profiler is now %s\n", profile_enabled ? "ON" : "OFF");
+            if (profile_enabled && debug_mode) printf("Note: the profiler is ignored while Debug Mode is ON.\n");
+            break;
+        case 'H':
+        case 'h':
+            hotspot_enabled = !hotspot_enabled;
+            printf("Source Hotspot Listing is now %s\n", hotspot_enabled ? "ON" : "OFF");
+            if (hotspot_enabled && debug_mode) printf("Note: hotspot counting is ignored while Debug Mode is ON.\n");
+            break;
+        case 'S':
+        case 's': {
+            long interval;
+            printf("Enter instructions between call stack samples (0 = off, default %d): ", STACK_SAMPLE_DEFAULT_INTERVAL);
+            if (scanf("%ld", &interval) == 1 && interval >= 0 && interval <= UINT32_MAX) {
+                call_stack_sample_interval = (uint32_t)interval;
+                if (interval > 0) printf("Call stack sampling is now every %u instructions\n", call_stack_sample_interval);
+                else printf("Call stack sampling is now OFF\n");
+                if (interval > 0 && debug_mode) printf("Note: call stack sampling is ignored while Debug Mode is ON.\n");
+            }
+            else {
+                printf("Invalid sample interval.\n");
+            }
+            break;
+        }
+        case 'M':
+        case 'm': {
+            unsigned int kilobytes;
+            printf("Enter guest memory size in KB (%u-%u, a multiple of %u): ", MEMORY_MIN_SIZE / 1024, MEMORY_SIZE / 1024, MEMORY_SIZE_ALIGNMENT / 1024);
+            if (scanf("%u", &kilobytes) != 1 || kilobytes > MEMORY_SIZE / 1024 || !memory_size_valid(kilobytes * 1024)) {
+                printf("Invalid memory size.\n");
+                break;
+            }
+            if (!vm_set_memory_size(vm, kilobytes * 1024)) {
+                fprintf(stderr, "Error: Could not allocate %u KB of guest memory.\n", kilobytes);
+                break;
+            }
+            guest_memory_size = kilobytes * 1024;
+            printf("Guest memory is now %u KB. Assemble or load the ROM again before running it.\n", kilobytes);
+            break;
+        }
+        case 'R':
+        case 'r': {
+            char rom_filename[256];
+            printf("Enter snapshot filename (.snap): ");
+            scanf("%255s", filename);
+            if (snapshot_load(vm, filename, rom_filename, sizeof(rom_filename)) == 0) {
+                printf("Resuming '%s'...\n", rom_filename);
+                run_vm(vm, rom_filename);
+                printf("\n\nVM execution finished.\n");
+            }
+            else {
+                fprintf(stderr, "Failed to load snapshot.\n");
+            }
+            break;
+        }
+        case 'D':
+        case 'd':
+            printf("Enter ROM filename (.rom): ");
+            scanf("%255s", filename);
+            if (disassemble_rom(filename) != 0) {
+                fprintf(stderr, "Disassembly failed.\n");
+            }
+            break;
+        case 'L':
+        case 'l':
+            printf("Enter project filename (.prj): ");
+            scanf("%255s", filename);
+            if (build_project(vm, filename, "output.rom") == 0) {
+                printf("Build successful. ROM file 'output.rom' and link map 'output.rom.lst' created.\n");
+            }
+            else {
+                fprintf(stderr, "Build failed.\n");
+            }
+            break;
+        case 'O':
+        case 'o':
+            peephole_enabled = !peephole_enabled;
+            printf("Peephole Optimizer is now %s\n", peephole_enabled ? "ON" : "OFF");
+            break;
         default:
-            printf("Invalid choice. Please enter 1, 2, 3 or 4.\n");
+            printf("Invalid choice. Please enter 0-9, B, P, H, S, M, R, D, L or O.\n");
         }
     }
 